@@ -95,6 +95,10 @@ AML_MP_DVR_SRC := \
 AML_MP_DEMUX_SRC := \
 	demux/AmlDemuxBase.cpp \
 	demux/AmlHwDemux.cpp \
+	demux/AmlDvrInjector.cpp \
+	demux/AmlDmxDevice.cpp \
+	demux/AmlDmxEmulator.cpp \
+	demux/AmlTsPidStatistics.cpp \
 	demux/AmlSwDemux.cpp \
 	demux/AmlESQueue.cpp \
 	demux/AmlTsParser.cpp
@@ -130,7 +134,11 @@ AML_MP_UTILS_SRC := \
 	utils/json/lib_json/json_reader.cpp \
 	utils/json/lib_json/json_value.cpp \
 	utils/json/lib_json/json_writer.cpp \
-	utils/AmlMpCodecCapability.cpp
+	utils/AmlMpCodecCapability.cpp \
+	utils/AmlMpTsScanner.cpp \
+	utils/AmlMpCrc32.cpp \
+	utils/AmlMpSectionCache.cpp \
+	utils/AmlMpBufferPool.cpp
 
 AML_MP_SRCS := \
 	$(AML_MP_PLAYER_SRC) \
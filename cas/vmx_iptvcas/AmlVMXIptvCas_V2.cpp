@@ -14,6 +14,7 @@
 #include <dlfcn.h>
 #include <cutils/properties.h>
 #include <utils/Amlsysfsutils.h>
+#include <utils/AmlMpTsScanner.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -109,52 +110,45 @@ int AmlVMXIptvCas_V2::checkEcmProcess(uint8_t* pBuffer, uint32_t vEcmPid, uint32
 {
   int ret = 0;
   uint32_t pid = 0;
-  unsigned int rem = *nSize;
+  size_t size = *nSize;
+  size_t offset = 0;
 
-  uint8_t * psync = pBuffer;
-  uint8_t * current = NULL;
+  AmlMpTsPidSet ecmPids;
+  ecmPids.add(vEcmPid);
+  ecmPids.add(aEcmPid);
 
-  while (rem >= TS_PACKET_SIZE)
+  for (;;)
   {
-      if (*psync != 0x47)
-      {
-          ++psync;
-          --rem;
-          continue;
-      }
-      if ((*(psync) == 0x47) && ((rem == TS_PACKET_SIZE) || (*(psync+TS_PACKET_SIZE) == 0x47)))
+      offset += tsFindPidPacket(pBuffer + offset, size - offset, ecmPids, TS_PACKET_SIZE);
+      if (offset + TS_PACKET_SIZE > size)
+          break;
+
+      uint8_t * psync = pBuffer + offset;
+      pid = (( psync[1] << 8 | psync[2]) & 0x1FFF);
+      if (memcmp(mEcmTsPacket + 4,psync + 4,TS_PACKET_SIZE- 4))
       {
-          current = psync;
-          pid = (( current[1] << 8 | current[2]) & 0x1FFF);
-          if (pid == vEcmPid || pid == aEcmPid)
+          memcpy(mEcmTsPacket, psync, TS_PACKET_SIZE);
+          std::string ecmDataStr;
+          char hex[3];
+          for (int i = 0; i < 64; i++) {
+              snprintf(hex, sizeof(hex), "%02X", mEcmTsPacket[i]);
+              ecmDataStr.append(hex);
+              ecmDataStr.append(" ");
+            }
+          MLOGI("checkEcmProcess, ecmDataStr.c_str()=%s", ecmDataStr.c_str());
+          if (pIptvCas)
           {
-              if (memcmp(mEcmTsPacket + 4,psync + 4,TS_PACKET_SIZE- 4))
-              {
-                  memcpy(mEcmTsPacket, psync, TS_PACKET_SIZE);
-                  std::string ecmDataStr;
-                  char hex[3];
-                  for (int i = 0; i < 64; i++) {
-                      snprintf(hex, sizeof(hex), "%02X", mEcmTsPacket[i]);
-                      ecmDataStr.append(hex);
-                      ecmDataStr.append(" ");
-                    }
-                  MLOGI("checkEcmProcess, ecmDataStr.c_str()=%s", ecmDataStr.c_str());
-                  if (pIptvCas)
-                  {
-                      if (pid == (uint32_t)mIptvCasParam.ecmPid[1])
-                         ret = pIptvCas->processEcm(0, 1, mIptvCasParam.ecmPid[1], mIptvCasParam.ecmPid[0], mEcmTsPacket, TS_PACKET_SIZE);
-                      else
-                         ret = pIptvCas->processEcm(0, 0, mIptvCasParam.ecmPid[1], mIptvCasParam.ecmPid[0], mEcmTsPacket, TS_PACKET_SIZE);
-                  }
-              }
-              if (mFirstEcm != 1) {
-                  MLOGI("first_SetECM find\n");
-                  mFirstEcm = 1;
-              }
+              if (pid == (uint32_t)mIptvCasParam.ecmPid[1])
+                 ret = pIptvCas->processEcm(0, 1, mIptvCasParam.ecmPid[1], mIptvCasParam.ecmPid[0], mEcmTsPacket, TS_PACKET_SIZE);
+              else
+                 ret = pIptvCas->processEcm(0, 0, mIptvCasParam.ecmPid[1], mIptvCasParam.ecmPid[0], mEcmTsPacket, TS_PACKET_SIZE);
           }
       }
-      psync += TS_PACKET_SIZE;
-      rem -= TS_PACKET_SIZE;
+      if (mFirstEcm != 1) {
+          MLOGI("first_SetECM find\n");
+          mFirstEcm = 1;
+      }
+      offset += TS_PACKET_SIZE;
   }
 
   return ret;
@@ -17,8 +17,15 @@
 #endif
 #include <utils/AmlMpHandle.h>
 #include <utils/AmlMpBuffer.h>
+#include <utils/AmlMpEventLooper.h>
+#include <utils/AmlMpEventHandlerReflector.h>
+#include <utils/AmlMpMessage.h>
+#include <utils/AmlMpSectionCache.h>
 #include <sstream>
 #include <set>
+#include <algorithm>
+#include <thread>
+#include <inttypes.h>
 
 static const char* mName = LOG_TAG;
 
@@ -28,9 +35,15 @@ namespace aml_mp {
 struct AmlDemuxBase::Filter : public AmlMpHandle
 {
     Filter(Aml_MP_Demux_FilterCb cb, void* userData, int id);
+    Filter(Aml_MP_Demux_FilterLeaseCb cb, void* userData, int id);
+    Filter(Aml_MP_Demux_FilterBatchCb cb, void* userData, size_t maxCount, int maxLatencyMs, int id);
     ~Filter();
 
+    void setBatchLooper(const sptr<AmlMpEventLooper>& looper);
+    void onMessageReceived(const sptr<AmlMpMessage>& msg);
+
     void notifyListener(int pid, const sptr<AmlMpBuffer>& data, int version);
+    // also takes the channel's AML_MP_DEMUX_DELIVER_ON_CHANGE
     void setOwner(const sptr<AmlDemuxBase::Channel>& channel);
     bool hasOwner() const;
     int id() const {
@@ -42,12 +55,48 @@ struct AmlDemuxBase::Filter : public AmlMpHandle
     }
 
 private:
-    Aml_MP_Demux_FilterCb mCb;
+    Aml_MP_Demux_FilterCb mCb = nullptr;
+    Aml_MP_Demux_FilterLeaseCb mLeaseCb = nullptr;
+    Aml_MP_Demux_FilterBatchCb mBatchCb = nullptr;
     void* pUserData;
     const int mId;
     int mVersion;
     wptr<AmlDemuxBase::Channel> mChannel;
 
+    // The sections this filter got, only touched by the delivering thread.
+    // setOwner() bumps the generation instead of clearing the cache itself,
+    // the cache is cleared before the next delivery.
+    std::atomic_bool mDeliverOnChange{false};
+    std::atomic<int> mSectionCacheGeneration{0};
+    int mSectionCacheSeen = 0;
+    AmlMpSectionCache mSectionCache;
+
+    enum {
+        kWhatFlushBatch = 'flsh',
+    };
+
+    struct PendingRecord {
+        sptr<AmlMpBuffer> data;
+        int version;
+        int64_t timeUs;
+    };
+
+    void queueRecord(int pid, const sptr<AmlMpBuffer>& data, int version);
+    void flushBatch(int32_t generation);
+
+    size_t mMaxBatchCount = 0;
+    int64_t mMaxBatchLatencyUs = 0;
+    sptr<AmlMpEventLooper> mBatchLooper;
+    sptr<AmlMpEventHandlerReflector<Filter>> mBatchHandler;
+
+    // mFlushLock keeps the batches in order if the timer and the demux
+    // thread flush at the same time, mBatchLock guards the pending records
+    std::mutex mFlushLock;
+    std::mutex mBatchLock;
+    std::vector<PendingRecord> mPendingRecords;
+    int mBatchPid = AML_MP_INVALID_PID;
+    int32_t mBatchGeneration = 0;
+
 private:
     Filter(const Filter&);
     Filter& operator= (const Filter&);
@@ -55,21 +104,26 @@ private:
 
 struct AmlDemuxBase::Channel : public AmlMpHandle
 {
-    Channel(int pid);
+    Channel(int pid, bool deliverOnChange);
     ~Channel();
     bool attachFilter(const sptr<Filter>& filter);
     bool detachFilter(const sptr<Filter>& filter);
     bool hasFilter() const;
-    void onData(int pid, const sptr<AmlMpBuffer>& data, int version);
+    std::vector<sptr<Filter>> filters() const;
     int pid() const {
         return mPid;
     }
 
     bool enabled() const;
     void setEnable(bool enable);
+    bool deliverOnChange() const {
+        return mDeliverOnChange;
+    }
 
 private:
     const int mPid = AML_MP_INVALID_PID;
+    // fixed by the params of the first createChannel() on the pid
+    const bool mDeliverOnChange = false;
 
     std::atomic_bool mEnabled {true};
 
@@ -91,14 +145,44 @@ AmlDemuxBase::Filter::Filter(Aml_MP_Demux_FilterCb cb, void* userData, int id)
     MLOG("ctor filter:%d", mId);
 }
 
+AmlDemuxBase::Filter::Filter(Aml_MP_Demux_FilterLeaseCb cb, void* userData, int id)
+: mLeaseCb(cb)
+, pUserData(userData)
+, mId(id)
+, mVersion(-1)
+{
+    MLOG("ctor lease filter:%d", mId);
+}
+
+AmlDemuxBase::Filter::Filter(Aml_MP_Demux_FilterBatchCb cb, void* userData, size_t maxCount, int maxLatencyMs, int id)
+: mBatchCb(cb)
+, pUserData(userData)
+, mId(id)
+, mVersion(-1)
+, mMaxBatchCount(std::max(maxCount, (size_t)1))
+, mMaxBatchLatencyUs(std::max(maxLatencyMs, 0) * 1000LL)
+{
+    MLOG("ctor batch filter:%d, max count:%zu, max latency:%d ms", mId, mMaxBatchCount, maxLatencyMs);
+    mPendingRecords.reserve(mMaxBatchCount);
+}
+
 AmlDemuxBase::Filter::~Filter()
 {
+    if (mBatchLooper != nullptr) {
+        mBatchLooper->unregisterHandler(mBatchHandler->id());
+    }
+
+    if (mSectionCache.hits() + mSectionCache.misses() > 0) {
+        MLOGI("filter:%d repeated sections dropped:%" PRIu64 ", delivered:%" PRIu64, mId,
+                mSectionCache.hits(), mSectionCache.misses());
+    }
+
     MLOG("dtor filter:%d", mId);
 }
 
 void AmlDemuxBase::Filter::notifyListener(int pid, const sptr<AmlMpBuffer>& data, int version)
 {
-    if (mCb == nullptr) {
+    if (mCb == nullptr && mLeaseCb == nullptr && mBatchCb == nullptr) {
         MLOGW("user cb is NULL!");
         return;
     }
@@ -112,12 +196,113 @@ void AmlDemuxBase::Filter::notifyListener(int pid, const sptr<AmlMpBuffer>& data
         MLOGI("notify filter:%d, version:%d", mId, mVersion);
     }
 
-    mCb(pid, data->size(), data->base(), pUserData);
+    if (mDeliverOnChange.load(std::memory_order_relaxed)) {
+        int generation = mSectionCacheGeneration.load(std::memory_order_acquire);
+        if (generation != mSectionCacheSeen) {
+            mSectionCache.clear();
+            mSectionCacheSeen = generation;
+        }
+
+        if (mSectionCache.isRepeated(data->data(), data->size())) {
+            return;
+        }
+        mSectionCache.update(data->data(), data->size());
+    }
+
+    if (mBatchCb != nullptr) {
+        queueRecord(pid, data, version);
+    } else if (mLeaseCb != nullptr) {
+        mLeaseCb(pid, data, pUserData);
+    } else {
+        mCb(pid, data->size(), data->data(), pUserData);
+    }
+}
+
+void AmlDemuxBase::Filter::setBatchLooper(const sptr<AmlMpEventLooper>& looper)
+{
+    mBatchLooper = looper;
+    mBatchHandler = new AmlMpEventHandlerReflector<Filter>(this);
+    mBatchLooper->registerHandler(mBatchHandler);
+}
+
+// The buffers are kept until the batch is delivered, the demux doesn't
+// reuse a buffer which is still referenced.
+void AmlDemuxBase::Filter::queueRecord(int pid, const sptr<AmlMpBuffer>& data, int version)
+{
+    bool full = false;
+    int32_t generation;
+
+    {
+        std::lock_guard<std::mutex> _l(mBatchLock);
+        mBatchPid = pid;
+        mPendingRecords.push_back({data, version, AmlMpEventLooper::GetNowUs()});
+        generation = mBatchGeneration;
+        if (mPendingRecords.size() >= mMaxBatchCount) {
+            full = true;
+        } else if (mPendingRecords.size() == 1 && mBatchHandler != nullptr) {
+            sptr<AmlMpMessage> msg = new AmlMpMessage(kWhatFlushBatch, mBatchHandler);
+            msg->setInt32("generation", generation);
+            msg->post(mMaxBatchLatencyUs);
+        }
+    }
+
+    if (full) {
+        flushBatch(generation);
+    }
+}
+
+void AmlDemuxBase::Filter::flushBatch(int32_t generation)
+{
+    std::lock_guard<std::mutex> _f(mFlushLock);
+    std::vector<PendingRecord> pending;
+    int pid;
+
+    {
+        std::lock_guard<std::mutex> _l(mBatchLock);
+        if (generation != mBatchGeneration || mPendingRecords.empty()) {
+            // delivered already
+            return;
+        }
+
+        pending.reserve(mMaxBatchCount);
+        pending.swap(mPendingRecords);
+        pid = mBatchPid;
+        ++mBatchGeneration;
+    }
+
+    std::vector<Aml_MP_DemuxRecord> records;
+    records.reserve(pending.size());
+    for (const PendingRecord& r : pending) {
+        records.push_back({r.data->data(), r.data->size(), r.version, r.timeUs});
+    }
+
+    mBatchCb(pid, records.data(), records.size(), pUserData);
+}
+
+void AmlDemuxBase::Filter::onMessageReceived(const sptr<AmlMpMessage>& msg)
+{
+    switch (msg->what()) {
+    case kWhatFlushBatch:
+    {
+        int32_t generation;
+        if (msg->findInt32("generation", &generation)) {
+            flushBatch(generation);
+        }
+        break;
+    }
+
+    default:
+        break;
+    }
 }
 
 void AmlDemuxBase::Filter::setOwner(const sptr<AmlDemuxBase::Channel>& channel)
 {
     mChannel = channel;
+
+    // a filter attached again must get the current sections
+    mDeliverOnChange.store(channel != nullptr && channel->deliverOnChange(), std::memory_order_relaxed);
+    mSectionCacheGeneration.fetch_add(1, std::memory_order_release);
 }
 
 bool AmlDemuxBase::Filter::hasOwner() const
@@ -126,8 +311,9 @@ bool AmlDemuxBase::Filter::hasOwner() const
 }
 
 ////////////////////////////////////////////////////////////////////////////////
-AmlDemuxBase::Channel::Channel(int pid)
+AmlDemuxBase::Channel::Channel(int pid, bool deliverOnChange)
 : mPid(pid)
+, mDeliverOnChange(deliverOnChange)
 {
     MLOG("ctor channel, pid:%d", mPid);
 }
@@ -171,22 +357,10 @@ bool AmlDemuxBase::Channel::hasFilter() const
     return !mFilters.empty();
 }
 
-void AmlDemuxBase::Channel::onData(int pid, const sptr<AmlMpBuffer>& data, int version)
+std::vector<sptr<AmlDemuxBase::Filter>> AmlDemuxBase::Channel::filters() const
 {
-    std::set<sptr<Filter>> filters;
-
-    {
-        std::lock_guard<std::mutex> _l(mLock);
-        if (!enabled() || mFilters.empty()) {
-            return;
-        }
-
-        filters = mFilters;
-    }
-
-    for (auto& f : filters) {
-        f->notifyListener(pid, data, version);
-    }
+    std::lock_guard<std::mutex> _l(mLock);
+    return std::vector<sptr<Filter>>(mFilters.begin(), mFilters.end());
 }
 
 bool AmlDemuxBase::Channel::enabled() const
@@ -199,6 +373,28 @@ void AmlDemuxBase::Channel::setEnable(bool enable)
     mEnabled.store(enable, std::memory_order_relaxed);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// What notifyData() needs of the channels and their filters, never modified
+// once published. The sptrs keep the objects alive as long as a reader can
+// see them, so the data path doesn't touch any reference count.
+struct AmlDemuxBase::Snapshot
+{
+    struct Entry {
+        int pid;
+        sptr<Channel> channel;
+        std::vector<sptr<Filter>> filters;
+    };
+
+    const Entry* find(int pid) const {
+        auto it = std::lower_bound(entries.begin(), entries.end(), pid, [](const Entry& e, int pid) {
+            return e.pid < pid;
+        });
+        return it != entries.end() && it->pid == pid ? &*it : nullptr;
+    }
+
+    std::vector<Entry> entries;     // sorted by pid
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 sptr<AmlDemuxBase> AmlDemuxBase::create(Aml_MP_DemuxType demuxType)
 {
@@ -230,7 +426,14 @@ AmlDemuxBase::AmlDemuxBase()
 
 AmlDemuxBase::~AmlDemuxBase()
 {
+    if (mBatchLooper != nullptr) {
+        mBatchLooper->stop();
+    }
 
+    delete mSnapshot.load();
+    for (const Snapshot* snapshot : mRetiredSnapshots) {
+        delete snapshot;
+    }
 }
 
 AmlDemuxBase::CHANNEL AmlDemuxBase::createChannel(int pid, const Aml_MP_DemuxFilterParams* params)
@@ -256,11 +459,16 @@ AmlDemuxBase::CHANNEL AmlDemuxBase::createChannel(int pid, const Aml_MP_DemuxFil
             return nullptr;
         }
 
-        channel = new Channel(pid);
+        // repeated sections are dropped per filter, each one gets the
+        // current sections when it is attached
+        bool deliverOnChange = params != nullptr && params->type == AML_MP_DEMUX_FILTER_PSI &&
+                (params->flags & AML_MP_DEMUX_DELIVER_ON_CHANGE);
+        channel = new Channel(pid, deliverOnChange);
         auto ret = mChannels.emplace(pid, channel);
         if (ret.second) {
             //MLOGI("create channel success!");
         }
+        publishSnapshot_l();
     }
 
     channel->incStrong(this);
@@ -286,10 +494,13 @@ int AmlDemuxBase::destroyChannel(CHANNEL _channel)
 
     removeDemuxFilter(pid);
 
-    std::lock_guard<std::mutex> _l(mLock);
-    auto it = mChannels.find(pid);
-    if (it != mChannels.end()) {
-        mChannels.erase(it);
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        auto it = mChannels.find(pid);
+        if (it != mChannels.end()) {
+            mChannels.erase(it);
+        }
+        publishSnapshot_l();
     }
 
     channel->decStrong(this);
@@ -327,6 +538,34 @@ AmlDemuxBase::FILTER AmlDemuxBase::createFilter(Aml_MP_Demux_FilterCb cb, void*
     return aml_handle_cast(filter);
 }
 
+AmlDemuxBase::FILTER AmlDemuxBase::createFilter(Aml_MP_Demux_FilterLeaseCb cb, void* userData)
+{
+    sptr<Filter> filter(new Filter(cb, userData, mFilterId++));
+
+    filter->incStrong(this);
+    return aml_handle_cast(filter);
+}
+
+AmlDemuxBase::FILTER AmlDemuxBase::createFilter(Aml_MP_Demux_FilterBatchCb cb, void* userData, size_t maxCount, int maxLatencyMs)
+{
+    sptr<Filter> filter(new Filter(cb, userData, maxCount, maxLatencyMs, mFilterId++));
+
+    sptr<AmlMpEventLooper> looper;
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        if (mBatchLooper == nullptr) {
+            mBatchLooper = new AmlMpEventLooper;
+            mBatchLooper->setName("demuxBatch");
+            mBatchLooper->start();
+        }
+        looper = mBatchLooper;
+    }
+    filter->setBatchLooper(looper);
+
+    filter->incStrong(this);
+    return aml_handle_cast(filter);
+}
+
 int AmlDemuxBase::destroyFilter(FILTER _filter)
 {
     sptr<Filter> filter = aml_handle_cast<Filter>(_filter);
@@ -339,6 +578,9 @@ int AmlDemuxBase::destroyFilter(FILTER _filter)
         sptr<Channel> channel = filter->getOwner().promote();
         if (channel != nullptr) {
             channel->detachFilter(filter);
+
+            std::lock_guard<std::mutex> _l(mLock);
+            publishSnapshot_l();
         }
     }
 
@@ -357,6 +599,8 @@ int AmlDemuxBase::attachFilter(FILTER _filter, CHANNEL _channel)
 
     channel->attachFilter(filter);
 
+    std::lock_guard<std::mutex> _l(mLock);
+    publishSnapshot_l();
     return 0;
 }
 
@@ -376,26 +620,120 @@ int AmlDemuxBase::detachFilter(FILTER _filter, CHANNEL _channel)
 
     channel->detachFilter(filter);
 
+    std::lock_guard<std::mutex> _l(mLock);
+    publishSnapshot_l();
     return 0;
 }
 
+// Called by the parser threads for every buffer: it reads the current
+// snapshot without a lock, the only shared writes are to the reader's slot.
 void AmlDemuxBase::notifyData(int pid, const sptr<AmlMpBuffer>& data, int version)
 {
-    sptr<Channel> channel;
+    ReaderSlot* slot = acquireReaderSlot();
+
+    // a writer that replaced the snapshot before the slot was set may have
+    // missed it, so it is only used once it is still current afterwards
+    const Snapshot* snapshot;
+    do {
+        snapshot = mSnapshot.load();
+        slot->snapshot.store(snapshot);
+    } while (mSnapshot.load() != snapshot);
+
+    const Snapshot::Entry* entry = snapshot ? snapshot->find(pid) : nullptr;
+    if (entry != nullptr && entry->channel->enabled()) {
+        for (const sptr<Filter>& f : entry->filters) {
+            f->notifyListener(pid, data, version);
+        }
+    }
+
+    slot->snapshot.store(nullptr);
+    slot->busy.store(false, std::memory_order_release);
+
+    if (mHasRetiredSnapshots.load()) {
+        reclaimSnapshots(false);
+    }
+}
+
+AmlDemuxBase::ReaderSlot* AmlDemuxBase::acquireReaderSlot()
+{
+    // each thread starts from a slot of its own, mostly finding it free
+    size_t hash = std::hash<std::thread::id>()(std::this_thread::get_id());
+    size_t start = (uint64_t)hash * 0x9E3779B97F4A7C15ULL >> 32;
+
+    for (size_t i = 0;; ++i) {
+        ReaderSlot* slot = &mReaderSlots[(start + i) % kReaderSlots];
+        if (!slot->busy.load(std::memory_order_relaxed) && !slot->busy.exchange(true, std::memory_order_acquire)) {
+            return slot;
+        }
+
+        if (i % kReaderSlots == kReaderSlots - 1) {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void AmlDemuxBase::publishSnapshot_l()
+{
+    Snapshot* snapshot = new Snapshot;
+    snapshot->entries.reserve(mChannels.size());
+    for (auto& p : mChannels) {
+        snapshot->entries.push_back({p.first, p.second, p.second->filters()});
+    }
+
+    const Snapshot* old = mSnapshot.exchange(snapshot);
+    if (old != nullptr) {
+        std::lock_guard<std::mutex> _l(mRetiredLock);
+        mRetiredSnapshots.push_back(old);
+        mHasRetiredSnapshots.store(true);
+    }
+
+    reclaimSnapshots(true);
+}
+
+// A retired snapshot can still be in use by a reader which loaded it before
+// it was replaced, but such a reader holds it in its slot. Any reader that
+// sets its slot later loads a newer snapshot, so a retired one that no slot
+// holds is free to go. At most one retired snapshot per busy slot outlives
+// this, whatever the other readers are doing.
+// This doesn't wait for the readers: a filter callback may well attach or
+// detach filters, the readers free what is left when they leave.
+void AmlDemuxBase::reclaimSnapshots(bool wait)
+{
+    std::vector<const Snapshot*> unused;
 
     {
-        std::unique_lock<std::mutex> _l(mLock);
-        auto it = mChannels.find(pid);
-        if (it != mChannels.end()) {
-            channel = it->second;
+        std::unique_lock<std::mutex> _l(mRetiredLock, std::defer_lock);
+        if (wait) {
+            _l.lock();
+        } else if (!_l.try_lock()) {
+            return;
+        }
+
+        const Snapshot* held[kReaderSlots];
+        for (size_t i = 0; i < kReaderSlots; ++i) {
+            held[i] = mReaderSlots[i].snapshot.load();
         }
+
+        auto isHeld = [&](const Snapshot* snapshot) {
+            return std::find(std::begin(held), std::end(held), snapshot) != std::end(held);
+        };
+        auto it = std::stable_partition(mRetiredSnapshots.begin(), mRetiredSnapshots.end(), isHeld);
+        unused.assign(it, mRetiredSnapshots.end());
+        mRetiredSnapshots.erase(it, mRetiredSnapshots.end());
+        mHasRetiredSnapshots.store(!mRetiredSnapshots.empty());
     }
 
-    if (channel) {
-        channel->onData(pid, data, version);
+    for (const Snapshot* snapshot : unused) {
+        delete snapshot;
     }
 }
 
+size_t AmlDemuxBase::retiredSnapshotCount()
+{
+    std::lock_guard<std::mutex> _l(mRetiredLock);
+    return mRetiredSnapshots.size();
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 AmlDemuxBase::ITsParser::ITsParser(const std::function<FilterCallback>& cb)
 : mFilterCallback(cb)
@@ -13,13 +13,38 @@
 #include <Aml_MP/Common.h>
 #include <utils/AmlMpRefBase.h>
 #include <mutex>
+#include <atomic>
 #include <map>
+#include <vector>
 
 namespace aml_mp {
 struct AmlMpBuffer;
+struct AmlMpEventLooper;
 
 ///////////////////////////////////////////////////////////////////////////////
 typedef int (*Aml_MP_Demux_FilterCb)(int pid, size_t size, const uint8_t* data, void* userData);
+/*
+ * same as Aml_MP_Demux_FilterCb, but data may be kept after the callback returns:
+ * the demux doesn't write to the buffer again as long as a reference is held.
+ * It is shared by all the filters of the channel, so it must not be modified,
+ * its range included.
+ */
+typedef int (*Aml_MP_Demux_FilterLeaseCb)(int pid, const sptr<AmlMpBuffer>& data, void* userData);
+
+typedef struct {
+    const uint8_t* data;        /*valid until the batch callback returns*/
+    size_t size;
+    int version;                /*as passed to the demux listener, -1 if not a versioned section*/
+    int64_t timeUs;             /*AmlMpEventLooper::GetNowUs() when the demux delivered it*/
+} Aml_MP_DemuxRecord;
+
+/*
+ * gets the sections or frames of a filter in batches of up to maxCount
+ * records, in order. A batch is delivered on the demux thread once it is
+ * full, or maxLatencyMs after its first record on the demux batch thread.
+ * Records still pending when the filter is destroyed are dropped.
+ */
+typedef int (*Aml_MP_Demux_FilterBatchCb)(int pid, const Aml_MP_DemuxRecord* records, size_t count, void* userData);
 
 typedef enum {
     AML_MP_DEMUX_TYPE_HARDWARE,
@@ -32,6 +57,7 @@ typedef enum {
     AML_MP_DEMUX_FILTER_VIDEO,
     AML_MP_DEMUX_FILTER_AUDIO,
     AML_MP_DEMUX_FILTER_PCR,
+    AML_MP_DEMUX_FILTER_METADATA,   /*ID3 or KLV timed metadata PES, codecType is AML_MP_CODEC_UNKNOWN*/
 } Aml_MP_DemuxFilterType;
 
 typedef struct {
@@ -49,8 +75,85 @@ typedef struct {
 /*set raw mode, it will send the struct dmx_sec_es_data, not es data*/
 #define DMX_OUTPUT_RAW_MODE  (1 << 17)
 #define DMX_OUTPUT_SECTION_MODE (1<<18)
+
+/*bit 24~31 are handled by aml_mp, they are not passed to the driver*/
+#define AML_MP_DEMUX_PRIVATE_FLAGS_MASK (0xFFu << 24)
+/*drop the sections which are identical to the last delivered ones*/
+#define AML_MP_DEMUX_DELIVER_ON_CHANGE  (1 << 24)
+/*output of the software demux audio and video filters, one frame per callback*/
+#define AML_MP_DEMUX_ES_FORMAT_MASK             (0x7 << 25)
+#define AML_MP_DEMUX_ES_FORMAT_PES              (0 << 25)   /*in a PES packet with the original stream_id, PTS and DTS*/
+#define AML_MP_DEMUX_ES_FORMAT_RAW              (1 << 25)   /*Annex-B video, ADTS AAC, audio sync frames*/
+#define AML_MP_DEMUX_ES_FORMAT_LENGTH_PREFIXED  (2 << 25)   /*H.264/H.265 NAL units with 4 byte sizes, raw for other codecs*/
+#define AML_MP_DEMUX_ES_FORMAT_LATM             (3 << 25)   /*AAC as LOAS/LATM, raw for other codecs*/
+/*software demux H.264/H.265 filters drop the frames before the first key frame or recovery point*/
+#define AML_MP_DEMUX_START_ON_KEY_FRAME (1 << 28)
+
+    /*
+     * section filter, same as dmx_sct_filter_params.filter: filter[0] is
+     * compared with table_id, filter[i] (i > 0) with section byte i + 2.
+     * mask selects the bits to compare, a mode bit of 0 requires them to be
+     * equal, 1 requires at least one of them to differ. All 0 masks pass
+     * every section.
+     */
+#define AML_MP_DEMUX_FILTER_SIZE 16
+    uint8_t filter[AML_MP_DEMUX_FILTER_SIZE];
+    uint8_t mask[AML_MP_DEMUX_FILTER_SIZE];
+    uint8_t mode[AML_MP_DEMUX_FILTER_SIZE];
 } Aml_MP_DemuxFilterParams;
 
+typedef enum {
+    AML_MP_DEMUX_FEED_POLICY_BLOCK,         // feedTs waits until a queue slot is free
+    AML_MP_DEMUX_FEED_POLICY_FAIL,          // feedTs returns -EAGAIN if the queue is full
+    AML_MP_DEMUX_FEED_POLICY_DROP_OLDEST,   // the oldest pending buffer is discarded
+} Aml_MP_DemuxFeedPolicy;
+
+/*
+ * called when the demux no longer references a buffer passed to feedTs.
+ * result is 0 if the buffer has been parsed, -ECANCELED if it was dropped or flushed.
+ */
+typedef void (*Aml_MP_Demux_FeedDoneCb)(const uint8_t* buffer, size_t size, int result, void* userData);
+
+typedef struct {
+    size_t maxPendingBuffers;           // 0 means feedTs is synchronous, which is the default
+    Aml_MP_DemuxFeedPolicy policy;
+    Aml_MP_Demux_FeedDoneCb doneCb;     // if null, feedTs copies the data before it returns
+    void* userData;
+} Aml_MP_DemuxFeedParams;
+
+typedef struct {
+    size_t queuedBytes;                 // fed, not written to the dvr device yet
+    size_t queuedBuffers;               // secure buffers not written yet
+    size_t capacity;                    // bytes of clear TS the queue holds
+    uint64_t feeds;                     // feedTs calls
+    uint64_t writes;                    // writes to the dvr device, a write carries several feeds
+    uint64_t bytesWritten;
+    uint64_t stalls;                    // times the dvr device was full
+    uint64_t bytesDropped;              // by flush or stop
+} Aml_MP_DemuxInjectStatistics;
+
+typedef struct {
+    uint64_t bytesReferenced;           // PES bytes framed straight from the fed buffers
+    uint64_t bytesCopied;               // PES bytes copied because a PES outlived its buffer
+    uint64_t auPoolHits;                // access units allocated from recycled buffers
+    uint64_t auPoolMisses;              // access units that needed a new allocation
+    uint64_t auPoolCachedBytes;         // free access unit memory kept for reuse
+    uint64_t auPoolHighWaterBytes;      // most access unit memory held at once
+} Aml_MP_DemuxStreamStatistics;
+
+#define AML_MP_DEMUX_CONFIG_DATA_SIZE 4096
+typedef struct {
+    int width;
+    int height;
+    int profile;                        // profile_idc
+    int level;                          // level_idc
+    uint32_t generation;                // incremented when a parameter set changes
+    int keyFrameFound;                  // a key frame or recovery point has been output
+    uint32_t framesBeforeKeyFrame;      // frames before it, dropped with AML_MP_DEMUX_START_ON_KEY_FRAME
+    size_t configDataSize;
+    uint8_t configData[AML_MP_DEMUX_CONFIG_DATA_SIZE];  // the VPS, SPS and PPS NAL units in Annex-B
+} Aml_MP_DemuxVideoConfig;
+
 class AmlDemuxBase : public AmlMpRefBase
 {
 public:
@@ -69,15 +172,45 @@ public:
         (void)buffer;
         return size;
     }
+    virtual int setFeedParams(const Aml_MP_DemuxFeedParams* params) {
+        (void)params;
+        return -1;
+    }
+    // the queue between feedTs and a hw demux
+    virtual int getInjectStatistics(Aml_MP_DemuxInjectStatistics* stats) {
+        (void)stats;
+        return -1;
+    }
+    virtual int getStreamStatistics(int pid, Aml_MP_DemuxStreamStatistics* stats) {
+        (void)pid;
+        (void)stats;
+        return -1;
+    }
+    virtual int getPidStatistics(int pid, Aml_MP_DemuxPidStat* stat) {
+        (void)pid;
+        (void)stat;
+        return -1;
+    }
+    // the parameter sets of an H.264/H.265 filter, to configure the decoder
+    // before the first frame arrives
+    virtual int getVideoConfig(int pid, Aml_MP_DemuxVideoConfig* config) {
+        (void)pid;
+        (void)config;
+        return -1;
+    }
 
     CHANNEL createChannel(int pid, const Aml_MP_DemuxFilterParams* params);
     int destroyChannel(CHANNEL channel);
     int openChannel(CHANNEL channel);
     int closeChannel(CHANNEL channel);
     FILTER createFilter(Aml_MP_Demux_FilterCb cb, void* userData);
+    FILTER createFilter(Aml_MP_Demux_FilterLeaseCb cb, void* userData);
+    FILTER createFilter(Aml_MP_Demux_FilterBatchCb cb, void* userData, size_t maxCount, int maxLatencyMs);
     int destroyFilter(FILTER filter);
     int attachFilter(FILTER filter, CHANNEL channel);
     int detachFilter(FILTER filter, CHANNEL channel);
+    // replaced channel snapshots a reader still holds, for diagnostics
+    size_t retiredSnapshotCount();
 
     struct ITsParser : virtual public AmlMpRefBase {
         using FilterCallback = void(int pid, const sptr<AmlMpBuffer>& data, int version);
@@ -113,6 +246,34 @@ protected:
     std::map<int, sptr<Channel>> mChannels;
 
 private:
+    struct Snapshot;
+
+    // A reader announces the snapshot it uses in a slot of its own, each on
+    // its own cache line so the workers don't write to a shared one.
+    struct ReaderSlot {
+        std::atomic_bool busy{false};
+        std::atomic<const Snapshot*> snapshot{nullptr};
+        char padding[64 - sizeof(std::atomic_bool) - sizeof(std::atomic<const Snapshot*>)];
+    };
+    // more concurrent readers than this wait for a free slot
+    static const size_t kReaderSlots = 16;
+
+    ReaderSlot* acquireReaderSlot();
+    // rebuilds the snapshot read by notifyData() from mChannels
+    void publishSnapshot_l();
+    // frees the retired snapshots no slot holds, a reader doesn't wait for
+    // the lock but leaves them to the next one
+    void reclaimSnapshots(bool wait);
+
+    std::atomic<const Snapshot*> mSnapshot{nullptr};
+    ReaderSlot mReaderSlots[kReaderSlots];
+    std::atomic_bool mHasRetiredSnapshots{false};
+    std::mutex mRetiredLock;
+    std::vector<const Snapshot*> mRetiredSnapshots;
+
+    // flushes the batch filters on time, started with the first one
+    sptr<AmlMpEventLooper> mBatchLooper;
+
     AmlDemuxBase(const AmlDemuxBase&) = delete;
     AmlDemuxBase& operator= (const AmlDemuxBase&) = delete;
 };
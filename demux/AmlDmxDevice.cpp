@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#include <utils/AmlMpConfig.h>
+#include "AmlDmxDevice.h"
+#include "AmlDmxEmulator.h"
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace aml_mp {
+
+class AmlKernelDmxDevice : public AmlDmxDevice
+{
+public:
+    int open(const char* path, int flags) override {
+        return ::open(path, flags);
+    }
+
+    int ioctl(int fd, unsigned long request, void* arg) override {
+        return ::ioctl(fd, request, arg);
+    }
+
+    ssize_t read(int fd, void* buffer, size_t size) override {
+        return ::read(fd, buffer, size);
+    }
+
+    int close(int fd) override {
+        return ::close(fd);
+    }
+};
+
+AmlDmxDevice* AmlDmxDevice::instance()
+{
+    static AmlKernelDmxDevice kernelDevice;
+
+    if (AmlMpConfig::instance().mHwDemuxEmulator) {
+        return AmlDmxEmulator::instance();
+    }
+
+    return &kernelDevice;
+}
+
+}
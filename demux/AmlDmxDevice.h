@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#ifndef _AML_DMX_DEVICE_H_
+#define _AML_DMX_DEVICE_H_
+
+#include <sys/types.h>
+
+namespace aml_mp {
+
+// The syscalls AmlHwDemux makes on /dev/dvb0.demuxN and /dev/dvb0.dvrN.
+// Returns and errno are those of the syscalls; the fds can be polled and the
+// dvr fd written to directly.
+class AmlDmxDevice
+{
+public:
+    // the kernel devices, or AmlDmxEmulator if vendor.amlmp.hwdemux-emulator is set
+    static AmlDmxDevice* instance();
+
+    virtual ~AmlDmxDevice() = default;
+    virtual int open(const char* path, int flags) = 0;
+    virtual int ioctl(int fd, unsigned long request, void* arg = nullptr) = 0;
+    virtual ssize_t read(int fd, void* buffer, size_t size) = 0;
+    virtual int close(int fd) = 0;
+
+protected:
+    AmlDmxDevice() = default;
+
+private:
+    AmlDmxDevice(const AmlDmxDevice&) = delete;
+    AmlDmxDevice& operator= (const AmlDmxDevice&) = delete;
+};
+
+}
+
+#endif
@@ -0,0 +1,796 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#define LOG_TAG "AmlDmxEmulator"
+#include <utils/AmlMpLog.h>
+#include <utils/AmlMpBuffer.h>
+#include <utils/AmlMpUtils.h>
+#include <utils/AmlMpTsScanner.h>
+#include "AmlDmxEmulator.h"
+#include "AmlSwDemux.h"
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <vector>
+
+#define CONFIG_AMLOGIC_DVB_COMPAT // use for write_ts to demux
+extern "C" {
+#include <dmx.h>
+}
+
+static const char* mName = LOG_TAG;
+
+namespace aml_mp {
+static const size_t kDvrReadSize = 64 * 1024;
+// what a dvr write can queue before it blocks, the pipe's default is 64KB
+static const int kDvrPipeSize = 1024 * 1024;
+
+struct AmlDmxEmulator::Demux {
+    explicit Demux(int id);
+    ~Demux();
+
+    // the dvr thread, one write of the dvr at a time
+    void feed(const uint8_t* data, size_t size);
+
+    // called by the filters with lock held
+    void start_l(Filter* filter);
+    void stop_l(Filter* filter);
+
+    const int id;
+    // the parser, and the settings of the filters while they run
+    std::mutex lock;
+
+private:
+    void feedPacket_l(const uint8_t* packet);
+    void onSection_l(int pid, const sptr<AmlMpBuffer>& section);
+
+    sptr<AmlDemuxBase::ITsParser> mParser;
+    std::map<int, std::vector<Filter*>> mStartedFilters;
+    uint8_t mRemainder[kTsPacketSize];
+    size_t mRemainderSize = 0;
+
+    Demux(const Demux&) = delete;
+    Demux& operator= (const Demux&) = delete;
+};
+
+struct AmlDmxEmulator::Filter {
+    enum Type {
+        TYPE_NONE,
+        TYPE_SECTION,
+        TYPE_PES,
+    };
+
+    Filter(const std::shared_ptr<Demux>& demux, int fd, bool nonBlocking);
+    ~Filter();
+
+    // the ioctls, return 0 or -errno
+    int setBufferSize(size_t size);
+    int setSectionFilter(const struct dmx_sct_filter_params* params);
+    int setPesFilter(const struct dmx_pes_filter_params* params);
+    int start();
+    int stop();
+
+    ssize_t read(void* buffer, size_t size);
+
+    // the dvr thread, with the demux lock held
+    bool match(const uint8_t* section, size_t size) const;
+    void write(const uint8_t* data, size_t size, bool isSection);
+
+    const std::shared_ptr<Demux> demux;
+    const int fd;
+    const bool nonBlocking;
+
+    // changed with the demux lock held
+    Type type = TYPE_NONE;
+    int pid = -1;
+    bool oneshot = false;
+    bool started = false;
+    bool done = false;          // a oneshot filter got its section
+    bool pusiSeen = false;      // PES payloads are passed from a unit start on
+
+private:
+    int start_l();
+    int stop_l();
+    void flush_l();
+    void updateReadable_l();
+
+    uint8_t mFilter[DMX_FILTER_SIZE];
+    uint8_t mPositiveMask[DMX_FILTER_SIZE];
+    uint8_t mNegativeMask[DMX_FILTER_SIZE];
+    size_t mFilterLength = 0;
+    bool mHasNegativeMask = false;
+
+    // the buffer, shared by the dvr thread and the reader
+    std::mutex mLock;
+    std::condition_variable mCond;
+    size_t mBufferSize = kDefaultBufferSize;
+    std::vector<uint8_t> mBuffer;
+    size_t mIn = 0;
+    size_t mOut = 0;
+    std::deque<size_t> mSections;   // what is left to read of each buffered section
+    int mError = 0;
+    bool mReadable = false;
+
+    Filter(const Filter&) = delete;
+    Filter& operator= (const Filter&) = delete;
+};
+
+struct AmlDmxEmulator::Dvr {
+    Dvr(const std::shared_ptr<Demux>& demux, int readFd, int writeFd, int wakeFd);
+    ~Dvr();
+
+    const std::shared_ptr<Demux> demux;
+    const int readFd;
+    const int writeFd;          // handed out as the dvr fd
+
+private:
+    void threadLoop();
+
+    const int mWakeFd;
+    std::thread mThread;
+
+    Dvr(const Dvr&) = delete;
+    Dvr& operator= (const Dvr&) = delete;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+AmlDmxEmulator::Demux::Demux(int id)
+: id(id)
+{
+    mParser = AmlSwDemux::createStandaloneParser([this](int pid, const sptr<AmlMpBuffer>& data, int version) {
+        AML_MP_UNUSED(version);
+        onSection_l(pid, data);
+    });
+}
+
+AmlDmxEmulator::Demux::~Demux()
+{
+    MLOGI("demux%d released", id);
+}
+
+void AmlDmxEmulator::Demux::feed(const uint8_t* data, size_t size)
+{
+    std::lock_guard<std::mutex> _l(lock);
+
+    if (mRemainderSize > 0) {
+        size_t len = std::min(size, kTsPacketSize - mRemainderSize);
+        memcpy(mRemainder + mRemainderSize, data, len);
+        mRemainderSize += len;
+        data += len;
+        size -= len;
+        if (mRemainderSize < kTsPacketSize) {
+            return;
+        }
+
+        feedPacket_l(mRemainder);
+        mRemainderSize = 0;
+    }
+
+    while (size >= kTsPacketSize) {
+        if (data[0] != 0x47) {
+            size_t offset = tsFindSyncLock(data, size);
+            data += offset;
+            size -= offset;
+            continue;
+        }
+
+        feedPacket_l(data);
+        data += kTsPacketSize;
+        size -= kTsPacketSize;
+    }
+
+    memcpy(mRemainder, data, size);
+    mRemainderSize = size;
+}
+
+void AmlDmxEmulator::Demux::feedPacket_l(const uint8_t* packet)
+{
+    if (packet[0] != 0x47) {
+        return;
+    }
+
+    int pid = (packet[1] & 0x1F) << 8 | packet[2];
+    auto it = mStartedFilters.find(pid);
+    if (it == mStartedFilters.end()) {
+        return;
+    }
+
+    bool hasSectionFilter = false;
+    bool hasPesFilter = false;
+    for (Filter* filter : it->second) {
+        hasSectionFilter |= filter->type == Filter::TYPE_SECTION;
+        hasPesFilter |= filter->type == Filter::TYPE_PES;
+    }
+
+    if (hasSectionFilter) {
+        // calls onSection_l() for the sections the packet completes
+        mParser->feedTs(packet, kTsPacketSize);
+    }
+
+    if (!hasPesFilter || (packet[1] & 0x80)) {
+        return;
+    }
+
+    int adaptationFieldControl = packet[3] >> 4 & 0x03;
+    if (!(adaptationFieldControl & 0x01)) {
+        return;
+    }
+
+    size_t offset = 4;
+    if (adaptationFieldControl & 0x02) {
+        offset += 1 + packet[4];
+    }
+    if (offset >= kTsPacketSize) {
+        return;
+    }
+
+    bool payloadUnitStart = packet[1] & 0x40;
+    for (Filter* filter : it->second) {
+        if (filter->type != Filter::TYPE_PES) {
+            continue;
+        }
+
+        filter->pusiSeen |= payloadUnitStart;
+        if (filter->pusiSeen) {
+            filter->write(packet + offset, kTsPacketSize - offset, false);
+        }
+    }
+}
+
+void AmlDmxEmulator::Demux::onSection_l(int pid, const sptr<AmlMpBuffer>& section)
+{
+    auto it = mStartedFilters.find(pid);
+    if (it == mStartedFilters.end()) {
+        return;
+    }
+
+    for (Filter* filter : it->second) {
+        if (filter->type != Filter::TYPE_SECTION || filter->done ||
+                !filter->match(section->data(), section->size())) {
+            continue;
+        }
+
+        filter->write(section->data(), section->size(), true);
+        if (filter->oneshot) {
+            filter->done = true;
+        }
+    }
+}
+
+void AmlDmxEmulator::Demux::start_l(Filter* filter)
+{
+    std::vector<Filter*>& filters = mStartedFilters[filter->pid];
+
+    if (filter->type == Filter::TYPE_SECTION &&
+            std::none_of(filters.begin(), filters.end(), [](Filter* f) { return f->type == Filter::TYPE_SECTION; })) {
+        // every filter of the pid matches the sections on its own
+        Aml_MP_DemuxFilterParams params{};
+        params.type = AML_MP_DEMUX_FILTER_PSI;
+        mParser->addDemuxFilter(filter->pid, &params);
+    }
+
+    filters.push_back(filter);
+}
+
+void AmlDmxEmulator::Demux::stop_l(Filter* filter)
+{
+    auto it = mStartedFilters.find(filter->pid);
+    if (it == mStartedFilters.end()) {
+        return;
+    }
+
+    std::vector<Filter*>& filters = it->second;
+    filters.erase(std::remove(filters.begin(), filters.end(), filter), filters.end());
+
+    if (filter->type == Filter::TYPE_SECTION &&
+            std::none_of(filters.begin(), filters.end(), [](Filter* f) { return f->type == Filter::TYPE_SECTION; })) {
+        mParser->removeDemuxFilter(filter->pid);
+    }
+
+    if (filters.empty()) {
+        mStartedFilters.erase(it);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+AmlDmxEmulator::Filter::Filter(const std::shared_ptr<Demux>& demux, int fd, bool nonBlocking)
+: demux(demux)
+, fd(fd)
+, nonBlocking(nonBlocking)
+{
+    memset(mFilter, 0, sizeof(mFilter));
+    memset(mPositiveMask, 0, sizeof(mPositiveMask));
+    memset(mNegativeMask, 0, sizeof(mNegativeMask));
+}
+
+AmlDmxEmulator::Filter::~Filter()
+{
+    ::close(fd);
+}
+
+int AmlDmxEmulator::Filter::setBufferSize(size_t size)
+{
+    std::lock_guard<std::mutex> _l(demux->lock);
+    if (started) {
+        return -EBUSY;
+    }
+
+    std::lock_guard<std::mutex> _l2(mLock);
+    mBufferSize = size;
+    // allocated by the next start
+    mBuffer.clear();
+
+    return 0;
+}
+
+int AmlDmxEmulator::Filter::setSectionFilter(const struct dmx_sct_filter_params* params)
+{
+    std::lock_guard<std::mutex> _l(demux->lock);
+    stop_l();
+
+    type = TYPE_SECTION;
+    pid = params->pid;
+    oneshot = params->flags & DMX_ONESHOT;
+
+    // as dmxdev, a mode bit set means the bit of the section must differ
+    mFilterLength = 0;
+    mHasNegativeMask = false;
+    for (size_t i = 0; i < DMX_FILTER_SIZE; ++i) {
+        mFilter[i] = params->filter.filter[i];
+        mPositiveMask[i] = params->filter.mask[i] & ~params->filter.mode[i];
+        mNegativeMask[i] = params->filter.mask[i] & params->filter.mode[i];
+
+        if (params->filter.mask[i]) {
+            mFilterLength = i + 1;
+        }
+        if (mNegativeMask[i]) {
+            mHasNegativeMask = true;
+        }
+    }
+
+    return params->flags & DMX_IMMEDIATE_START ? start_l() : 0;
+}
+
+int AmlDmxEmulator::Filter::setPesFilter(const struct dmx_pes_filter_params* params)
+{
+    if (params->pid > 0x1FFF) {
+        return -EINVAL;
+    }
+
+    if (params->output != DMX_OUT_TAP) {
+        MLOGE("pid:%d, only DMX_OUT_TAP is emulated, output:%d", params->pid, params->output);
+        return -EINVAL;
+    }
+
+    std::lock_guard<std::mutex> _l(demux->lock);
+    stop_l();
+
+    type = TYPE_PES;
+    pid = params->pid;
+    oneshot = false;
+
+    return params->flags & DMX_IMMEDIATE_START ? start_l() : 0;
+}
+
+int AmlDmxEmulator::Filter::start()
+{
+    std::lock_guard<std::mutex> _l(demux->lock);
+    return start_l();
+}
+
+int AmlDmxEmulator::Filter::stop()
+{
+    std::lock_guard<std::mutex> _l(demux->lock);
+    return stop_l();
+}
+
+int AmlDmxEmulator::Filter::start_l()
+{
+    if (type == TYPE_NONE) {
+        return -EINVAL;
+    }
+
+    stop_l();
+
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        if (mBuffer.size() != mBufferSize) {
+            mBuffer.assign(mBufferSize, 0);
+        }
+        flush_l();
+    }
+
+    done = false;
+    pusiSeen = false;
+    demux->start_l(this);
+    started = true;
+
+    return 0;
+}
+
+int AmlDmxEmulator::Filter::stop_l()
+{
+    if (!started) {
+        return 0;
+    }
+
+    demux->stop_l(this);
+    started = false;
+
+    std::lock_guard<std::mutex> _l(mLock);
+    flush_l();
+
+    return 0;
+}
+
+void AmlDmxEmulator::Filter::flush_l()
+{
+    mIn = mOut = 0;
+    mSections.clear();
+    mError = 0;
+    updateReadable_l();
+}
+
+bool AmlDmxEmulator::Filter::match(const uint8_t* section, size_t size) const
+{
+    bool differs = false;
+
+    // filter[0] is the table_id, filter[1..] start after the section_length
+    for (size_t i = 0; i < mFilterLength; ++i) {
+        size_t pos = i == 0 ? 0 : i + 2;
+        if (pos >= size) {
+            return false;
+        }
+
+        uint8_t diff = section[pos] ^ mFilter[i];
+        if (diff & mPositiveMask[i]) {
+            return false;
+        }
+        if (diff & mNegativeMask[i]) {
+            differs = true;
+        }
+    }
+
+    return !mHasNegativeMask || differs;
+}
+
+void AmlDmxEmulator::Filter::write(const uint8_t* data, size_t size, bool isSection)
+{
+    std::lock_guard<std::mutex> _l(mLock);
+
+    // as dmxdev, nothing more is buffered until the reader has seen the error
+    if (mError != 0) {
+        return;
+    }
+
+    if (size > mBuffer.size() - (mIn - mOut)) {
+        MLOGV("pid:%d overflow, %zu bytes buffered, dropped %zu", pid, mIn - mOut, size);
+        mError = -EOVERFLOW;
+        updateReadable_l();
+        mCond.notify_all();
+        return;
+    }
+
+    size_t pos = mIn % mBuffer.size();
+    size_t first = std::min(size, mBuffer.size() - pos);
+    memcpy(&mBuffer[pos], data, first);
+    memcpy(&mBuffer[0], data + first, size - first);
+    mIn += size;
+
+    if (isSection) {
+        mSections.push_back(size);
+    }
+
+    updateReadable_l();
+    mCond.notify_all();
+}
+
+ssize_t AmlDmxEmulator::Filter::read(void* buffer, size_t size)
+{
+    std::unique_lock<std::mutex> l(mLock);
+    while (mError == 0 && mIn == mOut) {
+        if (nonBlocking) {
+            errno = EAGAIN;
+            return -1;
+        }
+        mCond.wait(l);
+    }
+
+    if (mError != 0) {
+        int err = mError;
+        flush_l();
+        errno = -err;
+        return -1;
+    }
+
+    size_t len = std::min(size, mIn - mOut);
+    if (!mSections.empty()) {
+        len = std::min(len, mSections.front());
+        mSections.front() -= len;
+        if (mSections.front() == 0) {
+            mSections.pop_front();
+        }
+    }
+
+    size_t pos = mOut % mBuffer.size();
+    size_t first = std::min(len, mBuffer.size() - pos);
+    memcpy(buffer, &mBuffer[pos], first);
+    memcpy((uint8_t*)buffer + first, &mBuffer[0], len - first);
+    mOut += len;
+
+    updateReadable_l();
+
+    return len;
+}
+
+void AmlDmxEmulator::Filter::updateReadable_l()
+{
+    bool readable = mError != 0 || mIn != mOut;
+    if (readable == mReadable) {
+        return;
+    }
+
+    uint64_t value = 1;
+    ssize_t ret = readable ? ::write(fd, &value, sizeof(value)) : ::read(fd, &value, sizeof(value));
+    if (ret != sizeof(value)) {
+        MLOGE("pid:%d, update eventfd failed, %s", pid, strerror(errno));
+    }
+    mReadable = readable;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+AmlDmxEmulator::Dvr::Dvr(const std::shared_ptr<Demux>& demux, int readFd, int writeFd, int wakeFd)
+: demux(demux)
+, readFd(readFd)
+, writeFd(writeFd)
+, mWakeFd(wakeFd)
+{
+    mThread = std::thread([this] {
+        threadLoop();
+    });
+}
+
+AmlDmxEmulator::Dvr::~Dvr()
+{
+    uint64_t value = 1;
+    if (::write(mWakeFd, &value, sizeof(value)) != sizeof(value)) {
+        MLOGE("wake dvr thread failed, %s", strerror(errno));
+    }
+    mThread.join();
+
+    ::close(readFd);
+    ::close(writeFd);
+    ::close(mWakeFd);
+}
+
+void AmlDmxEmulator::Dvr::threadLoop()
+{
+    MLOGI("dvr%d thread start", demux->id);
+
+    std::vector<uint8_t> buffer(kDvrReadSize);
+    for (;;) {
+        struct pollfd fds[2] = {{readFd, POLLIN, 0}, {mWakeFd, POLLIN, 0}};
+        int ret = ::poll(fds, 2, -1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            MLOGE("poll failed, %s", strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents) {
+            break;
+        }
+
+        ssize_t len = ::read(readFd, buffer.data(), buffer.size());
+        if (len > 0) {
+            demux->feed(buffer.data(), len);
+        } else if (len < 0 && errno != EINTR && errno != EAGAIN) {
+            MLOGE("read dvr failed, %s", strerror(errno));
+            break;
+        }
+    }
+
+    MLOGI("dvr%d thread exited!", demux->id);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+AmlDmxEmulator* AmlDmxEmulator::instance()
+{
+    static AmlDmxEmulator emulator;
+    return &emulator;
+}
+
+std::shared_ptr<AmlDmxEmulator::Demux> AmlDmxEmulator::getDemux_l(int id)
+{
+    std::shared_ptr<Demux> demux = mDemuxes[id].lock();
+    if (demux == nullptr) {
+        demux = std::make_shared<Demux>(id);
+        mDemuxes[id] = demux;
+    }
+
+    return demux;
+}
+
+std::shared_ptr<AmlDmxEmulator::Filter> AmlDmxEmulator::getFilter(int fd)
+{
+    std::lock_guard<std::mutex> _l(mLock);
+    auto it = mFilters.find(fd);
+    return it != mFilters.end() ? it->second : nullptr;
+}
+
+int AmlDmxEmulator::open(const char* path, int flags)
+{
+    int id = -1;
+    std::lock_guard<std::mutex> _l(mLock);
+
+    if (sscanf(path, "/dev/dvb0.demux%d", &id) == 1) {
+        int fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0) {
+            return -1;
+        }
+
+        mFilters.emplace(fd, std::make_shared<Filter>(getDemux_l(id), fd, flags & O_NONBLOCK));
+        return fd;
+    }
+
+    if (sscanf(path, "/dev/dvb0.dvr%d", &id) != 1) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    if ((flags & O_ACCMODE) != O_WRONLY) {
+        MLOGE("%s, only the dvr input is emulated", path);
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (const auto& p : mDvrs) {
+        if (p.second->demux->id == id) {
+            errno = EBUSY;
+            return -1;
+        }
+    }
+
+    int fds[2];
+    if (::pipe2(fds, O_CLOEXEC) < 0) {
+        return -1;
+    }
+
+    int wakeFd = ::eventfd(0, EFD_CLOEXEC);
+    if (wakeFd < 0) {
+        ::close(fds[0]);
+        ::close(fds[1]);
+        return -1;
+    }
+
+    if (fcntl(fds[1], F_SETPIPE_SZ, kDvrPipeSize) < 0) {
+        MLOGW("set dvr pipe size failed, %s", strerror(errno));
+    }
+    if (flags & O_NONBLOCK) {
+        fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    }
+
+    MLOGI("open %s, fd:%d", path, fds[1]);
+    mDvrs.emplace(fds[1], std::unique_ptr<Dvr>(new Dvr(getDemux_l(id), fds[0], fds[1], wakeFd)));
+
+    return fds[1];
+}
+
+int AmlDmxEmulator::ioctl(int fd, unsigned long request, void* arg)
+{
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        if (mDvrs.find(fd) != mDvrs.end()) {
+            if (request == DMX_SET_INPUT) {
+                // there is no frontend, the input is always local
+                if ((long)arg != INPUT_LOCAL_SEC) {
+                    return 0;
+                }
+                // fail dvr_open() of a secure buffer rather than feed it as clear TS
+                errno = EINVAL;
+                return -1;
+            }
+            errno = ENOTTY;
+            return -1;
+        }
+    }
+
+    std::shared_ptr<Filter> filter = getFilter(fd);
+    if (filter == nullptr) {
+        errno = EBADF;
+        return -1;
+    }
+
+    int ret;
+    switch (request) {
+    case DMX_SET_BUFFER_SIZE:
+        ret = filter->setBufferSize((size_t)(long)arg);
+        break;
+
+    case DMX_SET_FILTER:
+        ret = filter->setSectionFilter((const struct dmx_sct_filter_params*)arg);
+        break;
+
+    case DMX_SET_PES_FILTER:
+        ret = filter->setPesFilter((const struct dmx_pes_filter_params*)arg);
+        break;
+
+    case DMX_START:
+        ret = filter->start();
+        break;
+
+    case DMX_STOP:
+        ret = filter->stop();
+        break;
+
+    default:
+        ret = -ENOTTY;
+        break;
+    }
+
+    if (ret < 0) {
+        errno = -ret;
+        return -1;
+    }
+
+    return 0;
+}
+
+ssize_t AmlDmxEmulator::read(int fd, void* buffer, size_t size)
+{
+    std::shared_ptr<Filter> filter = getFilter(fd);
+    if (filter == nullptr) {
+        errno = EBADF;
+        return -1;
+    }
+
+    return filter->read(buffer, size);
+}
+
+int AmlDmxEmulator::close(int fd)
+{
+    std::shared_ptr<Filter> filter;
+    std::unique_ptr<Dvr> dvr;
+
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        auto it = mFilters.find(fd);
+        if (it != mFilters.end()) {
+            filter = std::move(it->second);
+            mFilters.erase(it);
+        } else {
+            auto dvrIt = mDvrs.find(fd);
+            if (dvrIt == mDvrs.end()) {
+                errno = EBADF;
+                return -1;
+            }
+            dvr = std::move(dvrIt->second);
+            mDvrs.erase(dvrIt);
+        }
+    }
+
+    if (filter != nullptr) {
+        filter->stop();
+    }
+
+    return 0;
+}
+
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#ifndef _AML_DMX_EMULATOR_H_
+#define _AML_DMX_EMULATOR_H_
+
+#include "AmlDmxDevice.h"
+#include <map>
+#include <memory>
+#include <mutex>
+
+namespace aml_mp {
+
+// The dvb demux devices in user space, so AmlHwDemux runs without a box.
+//
+// The dvr fd is the write end of a pipe, a thread per dvr reads the other
+// end into the demux. Sections are assembled by the sw TS parser, bad CRCs
+// are always dropped as with DMX_CHECK_CRC. PES filters get the TS payloads
+// of their pid, as DMX_OUT_TAP does.
+//
+// Filter fds are eventfds, readable while data or an error is waiting, and
+// behave like dmxdev's:
+//  - the buffer is kDefaultBufferSize until DMX_SET_BUFFER_SIZE, which fails
+//    with EBUSY while the filter runs
+//  - a section or PES chunk that doesn't fit is dropped, the next read fails
+//    with EOVERFLOW and empties the buffer
+//  - a read returns at most one section, a short read leaves the rest of it
+//    for the next read
+// The secure dvr input isn't emulated, DMX_SET_INPUT of INPUT_LOCAL_SEC fails
+// with EINVAL.
+class AmlDmxEmulator : public AmlDmxDevice
+{
+public:
+    static const size_t kDefaultBufferSize = 8192;
+
+    static AmlDmxEmulator* instance();
+
+    int open(const char* path, int flags) override;
+    int ioctl(int fd, unsigned long request, void* arg = nullptr) override;
+    ssize_t read(int fd, void* buffer, size_t size) override;
+    int close(int fd) override;
+
+private:
+    struct Demux;
+    struct Filter;
+    struct Dvr;
+
+    AmlDmxEmulator() = default;
+    std::shared_ptr<Demux> getDemux_l(int id);
+    std::shared_ptr<Filter> getFilter(int fd);
+
+    std::mutex mLock;
+    std::map<int, std::weak_ptr<Demux>> mDemuxes;
+    std::map<int, std::shared_ptr<Filter>> mFilters;
+    std::map<int, std::unique_ptr<Dvr>> mDvrs;
+};
+
+}
+
+#endif
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#define LOG_TAG "AmlDvrInjector"
+#include <utils/AmlMpLog.h>
+#include "AmlDvrInjector.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+#include <algorithm>
+
+#define CONFIG_AMLOGIC_DVB_COMPAT // use for write_ts to demux
+extern "C" {
+#include <dmx.h>
+}
+
+static const char* mName = LOG_TAG;
+
+namespace aml_mp {
+static const size_t kDefaultMaxSecureBuffers = 64;
+// how often a write waiting for the device checks for flush() and stop()
+static const int kPollTimeoutMs = 20;
+
+AmlDvrInjector::AmlDvrInjector(int fd, bool isSecureBuffer, size_t capacity, size_t targetWriteSize, int maxDelayMs)
+: mFd(fd)
+, mIsSecureBuffer(isSecureBuffer)
+, mCapacity(isSecureBuffer ? 0 : capacity)
+, mTargetWriteSize(std::min(targetWriteSize, capacity))
+, mMaxDelay(maxDelayMs)
+, mRing(mCapacity)
+{
+    int flags = fcntl(mFd, F_GETFL);
+    if (flags < 0 || fcntl(mFd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        MLOGE("set O_NONBLOCK failed, %s", strerror(errno));
+    }
+
+    mFeedParams.policy = AML_MP_DEMUX_FEED_POLICY_BLOCK;
+    mFeedParams.maxPendingBuffers = kDefaultMaxSecureBuffers;
+    mStats.capacity = mCapacity;
+}
+
+AmlDvrInjector::~AmlDvrInjector()
+{
+    stop();
+}
+
+int AmlDvrInjector::start()
+{
+    std::lock_guard<std::mutex> _l(mLock);
+    if (mThread.joinable()) {
+        return 0;
+    }
+
+    mStopping = false;
+    mThread = std::thread([this] {
+        threadLoop();
+    });
+
+    return 0;
+}
+
+void AmlDvrInjector::stop()
+{
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        mStopping = true;
+        mCond.notify_all();
+        mSpaceCond.notify_all();
+    }
+
+    if (!mThread.joinable()) {
+        flush();
+        return;
+    }
+    mThread.join();
+
+    flush();
+
+    MLOGI("feeds:%" PRIu64 ", writes:%" PRIu64 ", stalls:%" PRIu64 ", dropped:%" PRIu64 " bytes",
+            mStats.feeds, mStats.writes, mStats.stalls, mStats.bytesDropped);
+}
+
+void AmlDvrInjector::flush()
+{
+    std::deque<SecureBuffer> dropped;
+    Aml_MP_DemuxFeedParams feedParams;
+
+    {
+        std::unique_lock<std::mutex> l(mLock);
+        ++mGeneration;
+        mSpaceCond.wait(l, [this] { return !mWriting; });
+
+        mStats.bytesDropped += mIn - mOut;
+        mOut = mIn;
+
+        for (const SecureBuffer& b : mSecureBuffers) {
+            mStats.bytesDropped += b.size;
+        }
+        dropped.swap(mSecureBuffers);
+        mWrittenSeq = mQueuedSeq;
+        feedParams = mFeedParams;
+        mSpaceCond.notify_all();
+    }
+
+    if (feedParams.doneCb != nullptr) {
+        for (const SecureBuffer& b : dropped) {
+            feedParams.doneCb(b.data, b.size, -ECANCELED, feedParams.userData);
+        }
+    }
+}
+
+int AmlDvrInjector::setFeedParams(const Aml_MP_DemuxFeedParams* params)
+{
+    std::lock_guard<std::mutex> _l(mLock);
+    mFeedParams = *params;
+    if (mFeedParams.maxPendingBuffers == 0) {
+        mFeedParams.maxPendingBuffers = kDefaultMaxSecureBuffers;
+    }
+
+    return 0;
+}
+
+void AmlDvrInjector::getStatistics(Aml_MP_DemuxInjectStatistics* stats) const
+{
+    std::lock_guard<std::mutex> _l(mLock);
+    *stats = mStats;
+    stats->queuedBytes = mIn - mOut;
+    for (const SecureBuffer& b : mSecureBuffers) {
+        stats->queuedBytes += b.size;
+    }
+    stats->queuedBuffers = mSecureBuffers.size();
+}
+
+int AmlDvrInjector::queue(const uint8_t* buffer, size_t size)
+{
+    if (size == 0) {
+        return 0;
+    }
+
+    return mIsSecureBuffer ? queueSecure(buffer, size) : queueClear(buffer, size);
+}
+
+int AmlDvrInjector::queueClear(const uint8_t* buffer, size_t size)
+{
+    Aml_MP_DemuxFeedParams feedParams;
+    size_t offset = 0;
+
+    while (offset < size) {
+        size_t in;
+        size_t space;
+        {
+            std::unique_lock<std::mutex> l(mLock);
+            while ((space = mCapacity - (mIn - mOut)) == 0 && !mStopping) {
+                if (mFeedParams.policy == AML_MP_DEMUX_FEED_POLICY_FAIL) {
+                    return offset > 0 ? (int)offset : -EAGAIN;
+                }
+                mSpaceCond.wait(l);
+            }
+
+            if (mStopping) {
+                return -1;
+            }
+            in = mIn;
+            feedParams = mFeedParams;
+        }
+
+        // the writer only reads [mOut, mIn), the free space is ours until mIn moves
+        size_t len = std::min(size - offset, space);
+        size_t pos = in % mCapacity;
+        size_t first = std::min(len, mCapacity - pos);
+        memcpy(&mRing[pos], buffer + offset, first);
+        memcpy(&mRing[0], buffer + offset + first, len - first);
+        offset += len;
+
+        std::lock_guard<std::mutex> _l(mLock);
+        size_t queued = mIn - mOut;
+        if (queued == 0) {
+            mFirstQueuedTime = std::chrono::steady_clock::now();
+        }
+        mIn += len;
+
+        // the writer sleeps until the first byte's deadline or the target size
+        if (queued == 0 || (queued < mTargetWriteSize && queued + len >= mTargetWriteSize)) {
+            mCond.notify_one();
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        ++mStats.feeds;
+    }
+
+    if (feedParams.doneCb != nullptr) {
+        feedParams.doneCb(buffer, size, 0, feedParams.userData);
+    }
+
+    return size;
+}
+
+int AmlDvrInjector::queueSecure(const uint8_t* buffer, size_t size)
+{
+    std::unique_lock<std::mutex> l(mLock);
+    while (mSecureBuffers.size() >= mFeedParams.maxPendingBuffers && !mStopping) {
+        if (mFeedParams.policy == AML_MP_DEMUX_FEED_POLICY_FAIL) {
+            return -EAGAIN;
+        }
+        mSpaceCond.wait(l);
+    }
+
+    if (mStopping) {
+        return -1;
+    }
+
+    uint64_t seq = ++mQueuedSeq;
+    mSecureBuffers.push_back({buffer, size, seq});
+    ++mStats.feeds;
+    mCond.notify_one();
+
+    if (mFeedParams.doneCb == nullptr) {
+        mSpaceCond.wait(l, [&] { return mWrittenSeq >= seq || mStopping; });
+    }
+
+    return size;
+}
+
+void AmlDvrInjector::threadLoop()
+{
+    MLOGI("injector thread start, fd:%d, secure:%d", mFd, mIsSecureBuffer);
+
+    std::unique_lock<std::mutex> l(mLock);
+    while (!mStopping) {
+        if (mIsSecureBuffer) {
+            if (mSecureBuffers.empty()) {
+                mCond.wait(l);
+            } else {
+                writeSecure_l(l);
+            }
+            continue;
+        }
+
+        size_t queued = mIn - mOut;
+        if (queued == 0) {
+            mCond.wait(l);
+            continue;
+        }
+
+        if (queued < mTargetWriteSize) {
+            auto deadline = mFirstQueuedTime + mMaxDelay;
+            if (std::chrono::steady_clock::now() < deadline) {
+                mCond.wait_until(l, deadline);
+                continue;
+            }
+        }
+
+        writeClear_l(l);
+    }
+
+    MLOGI("injector thread exited!");
+}
+
+void AmlDvrInjector::writeClear_l(std::unique_lock<std::mutex>& l)
+{
+    // one write per turn of the ring, the part after the wrap goes out right after
+    size_t pos = mOut % mCapacity;
+    size_t len = std::min({mIn - mOut, mTargetWriteSize, mCapacity - pos});
+    uint32_t generation = mGeneration;
+
+    mWriting = true;
+    l.unlock();
+    size_t written = writeFully(&mRing[pos], len, generation);
+    l.lock();
+    mWriting = false;
+
+    if (generation == mGeneration) {
+        if (written < len && !mStopping) {
+            // the device failed, don't retry the same bytes forever
+            mStats.bytesDropped += len - written;
+            written = len;
+        }
+        mOut += written;
+    }
+    ++mStats.writes;
+    mStats.bytesWritten += written;
+    mSpaceCond.notify_all();
+}
+
+void AmlDvrInjector::writeSecure_l(std::unique_lock<std::mutex>& l)
+{
+    // adjacent buffers of the secure ring go out as one descriptor
+    const uint8_t* start = mSecureBuffers.front().data;
+    const uint8_t* end = start;
+    size_t count = 0;
+    for (const SecureBuffer& b : mSecureBuffers) {
+        if (b.data != end) {
+            break;
+        }
+        end += b.size;
+        ++count;
+    }
+
+    struct dmx_sec_ts_data ts_sec_data;
+    ts_sec_data.buf_start = (uint32_t)(long)start;
+    ts_sec_data.buf_end = (uint32_t)(long)end;
+    uint32_t generation = mGeneration;
+
+    mWriting = true;
+    l.unlock();
+    size_t written = writeFully(&ts_sec_data, sizeof(ts_sec_data), generation);
+    l.lock();
+    mWriting = false;
+
+    std::vector<SecureBuffer> done;
+    if (generation == mGeneration) {
+        done.assign(mSecureBuffers.begin(), mSecureBuffers.begin() + count);
+        mSecureBuffers.erase(mSecureBuffers.begin(), mSecureBuffers.begin() + count);
+        mWrittenSeq = done.back().seq;
+    }
+    ++mStats.writes;
+    if (written == sizeof(ts_sec_data)) {
+        mStats.bytesWritten += end - start;
+    }
+    Aml_MP_DemuxFeedParams feedParams = mFeedParams;
+    mSpaceCond.notify_all();
+
+    if (feedParams.doneCb != nullptr && !done.empty()) {
+        l.unlock();
+        for (const SecureBuffer& b : done) {
+            feedParams.doneCb(b.data, b.size, written == sizeof(ts_sec_data) ? 0 : -ECANCELED, feedParams.userData);
+        }
+        l.lock();
+    }
+}
+
+size_t AmlDvrInjector::writeFully(const void* data, size_t size, uint32_t generation)
+{
+    size_t offset = 0;
+
+    while (offset < size) {
+        ssize_t ret = ::write(mFd, (const uint8_t*)data + offset, size - offset);
+        if (ret >= 0) {
+            offset += ret;
+            continue;
+        }
+
+        if (errno == EINTR) {
+            continue;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            MLOGE("Write DVR data failed: %s", strerror(errno));
+            break;
+        }
+
+        {
+            std::lock_guard<std::mutex> _l(mLock);
+            ++mStats.stalls;
+            if (mStopping || generation != mGeneration) {
+                break;
+            }
+        }
+
+        struct pollfd pfd = {mFd, POLLOUT, 0};
+        ::poll(&pfd, 1, kPollTimeoutMs);
+    }
+
+    return offset;
+}
+
+}
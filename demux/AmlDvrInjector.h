@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#ifndef _AML_DVR_INJECTOR_H_
+#define _AML_DVR_INJECTOR_H_
+
+#include "AmlDemuxBase.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <chrono>
+
+namespace aml_mp {
+
+// Writes the TS fed to a hw demux into its dvr device, on a thread of its own.
+//
+// Clear TS is copied into a ring. The thread writes what has queued up once
+// it reaches targetWriteSize, or maxDelayMs after it started queueing, so
+// small datagrams don't cost a syscall each.
+//
+// Secure buffers can't be copied, their dmx_sec_ts_data descriptors are
+// queued instead and adjacent buffers are merged into one. Without a done
+// callback, a secure feed still waits until it has been written, because the
+// caller may reuse its buffer as soon as queue() returns.
+//
+// The fd is switched to O_NONBLOCK, a full device is waited for with poll().
+class AmlDvrInjector
+{
+public:
+    static const size_t kDefaultCapacity = 2 * 1024 * 1024;
+    static const size_t kDefaultTargetWriteSize = 188 * 256;
+    static const int kDefaultMaxDelayMs = 10;
+
+    AmlDvrInjector(int fd, bool isSecureBuffer, size_t capacity = kDefaultCapacity,
+            size_t targetWriteSize = kDefaultTargetWriteSize, int maxDelayMs = kDefaultMaxDelayMs);
+    ~AmlDvrInjector();
+
+    int start();
+    // drops what is still queued
+    void stop();
+    void flush();
+
+    // only one thread feeds at a time. Returns size, or -EAGAIN if the queue
+    // is full and the policy is AML_MP_DEMUX_FEED_POLICY_FAIL
+    int queue(const uint8_t* buffer, size_t size);
+
+    // doneCb and policy apply to both paths, maxPendingBuffers only bounds
+    // the secure buffers. Clear TS is always copied, doneCb is called before
+    // queue() returns.
+    int setFeedParams(const Aml_MP_DemuxFeedParams* params);
+
+    void getStatistics(Aml_MP_DemuxInjectStatistics* stats) const;
+
+private:
+    struct SecureBuffer {
+        const uint8_t* data;
+        size_t size;
+        uint64_t seq;
+    };
+
+    void threadLoop();
+    int queueClear(const uint8_t* buffer, size_t size);
+    int queueSecure(const uint8_t* buffer, size_t size);
+    void writeClear_l(std::unique_lock<std::mutex>& l);
+    void writeSecure_l(std::unique_lock<std::mutex>& l);
+    size_t writeFully(const void* data, size_t size, uint32_t generation);
+
+    const int mFd;
+    const bool mIsSecureBuffer;
+    const size_t mCapacity;
+    const size_t mTargetWriteSize;
+    const std::chrono::milliseconds mMaxDelay;
+
+    std::thread mThread;
+
+    mutable std::mutex mLock;
+    std::condition_variable mCond;          // wakes the writer
+    std::condition_variable mSpaceCond;     // wakes the feeder and flush()
+    bool mStopping = false;
+    bool mWriting = false;
+    uint32_t mGeneration = 0;               // incremented by flush(), aborts the write in progress
+    Aml_MP_DemuxFeedParams mFeedParams{};
+
+    // clear TS, mIn is only moved by the feeding thread, mOut by the writer and flush()
+    std::vector<uint8_t> mRing;
+    size_t mIn = 0;
+    size_t mOut = 0;
+    std::chrono::steady_clock::time_point mFirstQueuedTime;
+
+    std::deque<SecureBuffer> mSecureBuffers;
+    uint64_t mQueuedSeq = 0;
+    uint64_t mWrittenSeq = 0;
+
+    Aml_MP_DemuxInjectStatistics mStats{};
+
+private:
+    AmlDvrInjector(const AmlDvrInjector&) = delete;
+    AmlDvrInjector& operator= (const AmlDvrInjector&) = delete;
+};
+
+}
+
+#endif
@@ -13,13 +13,16 @@
 #include <utils/AmlMpBuffer.h>
 #include <utils/AmlMpBitReader.h>
 #include <utils/AmlMpUtils.h>
+#include <utils/AmlMpTsScanner.h>
 #include <vector>
+#include <algorithm>
 #include "AmlESQueue.h"
 
 static const char* mName = LOG_TAG;
 
 namespace aml_mp {
-static const int kPesHeaderSize = 14;
+// the largest header makePESHeader() writes, PTS and DTS
+static const int kPesHeaderSize = 19;
 
 
 static bool IsSeeminglyValidADTSHeader(
@@ -260,9 +263,145 @@ static unsigned parseEAC3SyncFrame(
     return payloadSize;
 }
 
+// Parse the AC-4 sync frame header and the start of the TOC, return the size
+// of the whole sync frame including the header and the CRC, 0 if it isn't one.
+// ETSI TS 103 190-2 Annex C, ETSI TS 103 190-1 4.2.1
+static unsigned parseAC4SyncFrame(const uint8_t *ptr, size_t size) {
+    AmlMpBitReader bits(ptr, size);
+    if (bits.numBitsLeft() < 32) {
+        return 0;
+    }
+
+    unsigned syncWord = bits.getBits(16);
+    if (syncWord != 0xAC40 && syncWord != 0xAC41) {
+        return 0;
+    }
+
+    unsigned headerSize = 4;
+    unsigned frameSize = bits.getBits(16);
+    if (frameSize == 0xFFFF) {
+        if (bits.numBitsLeft() < 24) {
+            return 0;
+        }
+        frameSize = bits.getBits(24);
+        headerSize += 3;
+    }
+
+    if (frameSize == 0) {
+        MLOGW("Incorrect frame_size in AC4 header");
+        return 0;
+    }
+
+    // bitstream_version, sequence_counter, b_wait_frames, wait_frames,
+    // br_code, fs_index, frame_rate_index and some variable_bits
+    if (bits.numBitsLeft() < 2 + 2 + 3 + 10 + 1 + 3 + 2 + 1 + 4) {
+        return 0;
+    }
+
+    unsigned bitstreamVersion = bits.getBits(2);
+    if (bitstreamVersion == 3) {
+        unsigned value = 0;
+        while (true) {
+            value += bits.getBits(2);
+            if (!bits.getBits(1)) {
+                break;
+            }
+            value = (value + 1) << 2;
+        }
+        bitstreamVersion += value;
+    }
+    if (bitstreamVersion > 2) {
+        MLOGW("Unsupported AC4 bitstream_version %u", bitstreamVersion);
+        return 0;
+    }
+
+    bits.skipBits(10);  // sequence_counter
+    if (bits.getBits(1)) {  // b_wait_frames
+        if (bits.getBits(3) > 0) {  // wait_frames
+            bits.skipBits(2);  // br_code
+        }
+    }
+
+    bits.skipBits(1);  // fs_index
+    unsigned frameRateIndex = bits.getBits(4);
+    if (frameRateIndex > 13) {
+        MLOGW("Incorrect frame_rate_index in AC4 TOC");
+        return 0;
+    }
+
+    return headerSize + frameSize + (syncWord == 0xAC41 ? 2 : 0);
+}
+
+// Parse the LPCM header at the start of a PES payload, return its size, 0 if
+// the payload doesn't start with one.
+//
+// Blu-ray (HDMV) LPCM, 4 bytes:
+//   audio_data_payload_size 16, channel_assignment 4, sampling_frequency 4,
+//   bits_per_sample 2, start_flag 1, reserved 5
+// DVD LPCM, 7 bytes:
+//   sub_stream_id 8 (0xA0-0xA7), number_of_frame_headers 8,
+//   first_access_unit_pointer 16, emphasis/mute/reserved/frame_number 8,
+//   quantization_word_length 2, sampling_frequency 2, reserved 1,
+//   number_of_audio_channels_minus1 3, dynamic_range_control 8
+static size_t parseLPCMHeader(const uint8_t *ptr, size_t size, ElementaryStreamQueue::PcmFormat *format) {
+    static const int bdChannelCountTable[] = {0, 1, 0, 2, 3, 3, 4, 4, 5, 6, 7, 8, 0, 0, 0, 0};
+    static const int bdBitsPerSampleTable[] = {0, 16, 20, 24};
+
+    if (size < 4) {
+        return 0;
+    }
+
+    // the payload size tells a Blu-ray header apart
+    size_t payloadSize = ptr[0] << 8 | ptr[1];
+    if (payloadSize == size - 4) {
+        int channels = bdChannelCountTable[ptr[2] >> 4];
+        int bitsPerSample = bdBitsPerSampleTable[ptr[3] >> 6];
+        int sampleRate = 0;
+        switch (ptr[2] & 0x0F) {
+        case 1: sampleRate = 48000; break;
+        case 4: sampleRate = 96000; break;
+        case 5: sampleRate = 192000; break;
+        default: break;
+        }
+
+        if (channels == 0 || bitsPerSample == 0 || sampleRate == 0) {
+            MLOGW("Incorrect Blu-ray LPCM header %02x %02x", ptr[2], ptr[3]);
+            return 0;
+        }
+
+        // an odd channel count is padded to even, 20 bit samples take 3 bytes
+        size_t sampleSize = ((channels + 1) & ~1) * (bitsPerSample == 16 ? 2 : 3);
+        if (payloadSize % sampleSize != 0) {
+            MLOGW("Blu-ray LPCM payload size %zu is not whole samples", payloadSize);
+            return 0;
+        }
+
+        format->sampleRate = sampleRate;
+        format->channels = channels;
+        format->bitsPerSample = bitsPerSample;
+        return 4;
+    }
+
+    if ((ptr[0] & 0xF8) == 0xA0 && size >= 7) {
+        unsigned quantization = ptr[5] >> 6;
+        if (quantization == 3) {
+            MLOGW("Incorrect DVD LPCM quantization_word_length");
+            return 0;
+        }
+
+        format->sampleRate = (ptr[5] >> 4 & 0x03) == 0 ? 48000 : 96000;
+        format->channels = (ptr[5] & 0x07) + 1;
+        format->bitsPerSample = 16 + 4 * quantization;
+        return 7;
+    }
+
+    return 0;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 ElementaryStreamQueue::ElementaryStreamQueue(Mode mode)
 : mMode(mode)
+, mPool(new AmlMpBufferPool("AU"))
 {
 
 }
@@ -277,177 +416,253 @@ void ElementaryStreamQueue::clear()
     mAUIndex = 0;
 }
 
-int ElementaryStreamQueue::appendData(const void* data, size_t size, int64_t pts, int32_t payloadOffset)
+ssize_t ElementaryStreamQueue::findSyncOffset(const uint8_t* ptr, size_t size) const
 {
-    if (mBuffer == nullptr || mBuffer->size() == 0) {
-        switch (mMode) {
-        case H264:
-        case H265:
-        case MPEG_VIDEO:
-        {
-            uint8_t *ptr = (uint8_t *)data;
-            ssize_t startOffset = -1;
-            for (size_t i = 0; i+2 < size; ++i) {
-                if (!memcmp("\x00\x00\x01", &ptr[i], 3)) {
-                    startOffset = i;
-                    break;
-                }
-            }
-
-            if (startOffset < 0) {
-                return -1;
-            }
+    ssize_t startOffset = -1;
 
-            data = &ptr[startOffset];
-            size -= startOffset;
+    switch (mMode) {
+    case H264:
+    case H265:
+    case MPEG_VIDEO:
+    case MPEG4_VIDEO:
+    {
+        size_t i = esFindStartCode(ptr, size);
+        if (i < size) {
+            startOffset = i;
         }
         break;
+    }
 
-        case MPEG4_VIDEO:
-        {
-            uint8_t* ptr = (uint8_t*)data;
-            ssize_t startOffset = -1;
-            for (size_t i = 0; i+2 < size; ++i) {
-                if (!memcmp("\x00\x00\x01", &ptr[i], 3)) {
-                    startOffset = i;
-                    break;
-                }
-            }
+    case AAC:
+    {
+        size_t frameLength;
 
-            if (startOffset < 0) {
-                return -1;
+        for (size_t i = 0; i < size; ++i) {
+            i += esFindSyncWord(&ptr[i], size - i, 0xFF, 0xF0, 0xF0);
+            if (IsSeeminglyValidADTSHeader(&ptr[i], size -i, &frameLength)) {
+                startOffset = i;
+                break;
             }
+        }
 
-            data = &ptr[startOffset];
-            size -= startOffset;
-
+        if (startOffset < 0) {
             break;
         }
 
-        case AAC:
-        {
-            uint8_t* ptr = (uint8_t*)data;
-            ssize_t startOffset = -1;
-            size_t frameLength;
+        if (startOffset > 0) {
+            ALOGI("found something resembling an AAC syncword at "
+                "offset %zd", startOffset);
+        }
 
-            for (size_t i = 0; i < size; ++i) {
-                if (IsSeeminglyValidADTSHeader(&ptr[i], size -i, &frameLength)) {
-                    startOffset = i;
-                    break;
-                }
-            }
+        if (frameLength != size - startOffset) {
+            MLOGV( "First ADTS AAC frame length is %zd bytes, "
+                "while the buffer size is %zd bytes, startOffset:%zd.",
+                frameLength, size - startOffset, startOffset);
+        }
+        break;
+    }
 
-            if (startOffset < 0) {
-                return -1;
+    case AC3:
+    case EAC3:
+    {
+        for (size_t i = 0; i < size; ++i) {
+            i += esFindSyncWord(&ptr[i], size - i, 0x0B, 0x77);
+            if (i >= size) {
+                break;
             }
 
-            if (startOffset > 0) {
-                ALOGI("found something resembling an AAC syncword at "
-                    "offset %zd", startOffset);
+            unsigned payloadSize = 0;
+            if (mMode == AC3) {
+                payloadSize = parseAC3SyncFrame(&ptr[i], size - i);
+            } else if (mMode == EAC3) {
+                payloadSize = parseEAC3SyncFrame(&ptr[i], size - i);
             }
 
-            if (frameLength != size - startOffset) {
-                MLOGV( "First ADTS AAC frame length is %zd bytes, "
-                    "while the buffer size is %zd bytes, startOffset:%zd.",
-                    frameLength, size - startOffset, startOffset);
+            if (payloadSize > 0) {
+                startOffset = i;
+                break;
             }
-
-            data = &ptr[startOffset];
-            size -= startOffset;
-
-            break;
         }
 
-        case AC3:
-        case EAC3:
-        {
-            uint8_t *ptr = (uint8_t *)data;
-            ssize_t startOffset = -1;
-            for (size_t i = 0; i < size; ++i) {
-                unsigned payloadSize = 0;
-                if (mMode == AC3) {
-                    payloadSize = parseAC3SyncFrame(&ptr[i], size - i);
-                } else if (mMode == EAC3) {
-                    payloadSize = parseEAC3SyncFrame(&ptr[i], size - i);
-                }
+        if (startOffset > 0) {
+            ALOGI("found something resembling an (E)AC3 syncword at "
+                "offset %zd",
+                startOffset);
+        }
+        break;
+    }
 
-                if (payloadSize > 0) {
-                    startOffset = i;
-                    break;
-                }
+    case MPEG_AUDIO:
+    {
+        for (size_t i = 0; i < size; ++i) {
+            i += esFindSyncWord(&ptr[i], size - i, 0xFF, 0xE0, 0xE0);
+            if (IsSeeminglyValidMPEGAudioHeader(&ptr[i], size - i)) {
+                startOffset = i;
+                break;
             }
+        }
+        break;
+    }
 
-            if (startOffset < 0) {
-                return -1;
+    case AC4:
+    {
+        for (size_t i = 0; i < size; ++i) {
+            i += esFindSyncWord(&ptr[i], size - i, 0xAC, 0x40, 0xFE);
+            if (parseAC4SyncFrame(&ptr[i], size - i) > 0) {
+                startOffset = i;
+                break;
             }
+        }
 
-            if (startOffset > 0) {
-                ALOGI("found something resembling an (E)AC3 syncword at "
-                    "offset %zd",
-                    startOffset);
-            }
+        if (startOffset > 0) {
+            MLOGI("found something resembling an AC4 syncword at offset %zd", startOffset);
+        }
+        break;
+    }
 
-            data = &ptr[startOffset];
-            size -= startOffset;
+    case PCM_AUDIO:
+    case METADATA:
+        // framed by the PES packets, each payload starts with a header
+        startOffset = 0;
+        break;
 
-            break;
-        }
+    default:
+        break;
+    }
 
-        case MPEG_AUDIO:
-        {
-            uint8_t* ptr = (uint8_t*) data;
-            ssize_t startOffset = -1;
-            for (size_t i = 0; i < size; ++i) {
-                if (IsSeeminglyValidMPEGAudioHeader(&ptr[i], size - i)) {
-                    startOffset = i;
-                    break;
-                }
-            }
+    return startOffset;
+}
 
-            if (startOffset < 0) {
-                return -1;
-            }
+int ElementaryStreamQueue::appendData(const void* data, size_t size, int64_t pts, int32_t payloadOffset)
+{
+    struct iovec iov;
+    iov.iov_base = const_cast<void*>(data);
+    iov.iov_len = size;
 
-            data = &ptr[startOffset];
-            size -= startOffset;
+    return appendData(&iov, 1, pts, payloadOffset);
+}
 
-            break;
-        }
+int ElementaryStreamQueue::appendData(const struct iovec* iov, int iovcnt, int64_t pts, int32_t payloadOffset)
+{
+    PesInfo pesInfo;
+    pesInfo.pts = pts;
+    pesInfo.payloadOffset = payloadOffset;
 
-        default:
-            return -1;
-        }
+    return appendData(iov, iovcnt, pesInfo);
+}
+
+int ElementaryStreamQueue::appendData(const struct iovec* iov, int iovcnt, const PesInfo& pesInfo)
+{
+    size_t size = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        size += iov[i].iov_len;
     }
 
-    size_t neededSize = (mBuffer == NULL ? 0 : mBuffer->size()) + size;
-    if (mBuffer == NULL || neededSize > mBuffer->capacity()) {
-        neededSize = (neededSize + 65535) & ~65535;
+    bool needSync = mBuffer == nullptr || mBuffer->size() == 0;
+    if (needSync && size == 0) {
+        return -1;
+    }
 
-        MLOGI("resizing buffer to size %zu", neededSize);
+    if (mBuffer != nullptr && mBuffer->size() == 0) {
+        // nothing left to read, rewind for free
+        mBuffer->setRange(0, 0);
+    }
 
-        sptr<AmlMpBuffer> buffer = new AmlMpBuffer(neededSize);
-        if (mBuffer != NULL) {
-            memcpy(buffer->data(), mBuffer->data(), mBuffer->size());
-            buffer->setRange(0, mBuffer->size());
-        } else {
-            buffer->setRange(0, 0);
+    if (mBuffer == nullptr || mBuffer->offset() + mBuffer->size() + size > mBuffer->capacity()) {
+        reserve(size);
+    }
+
+    // this is the only copy of the payload, the segments are gathered here
+    uint8_t* dst = mBuffer->data() + mBuffer->size();
+    size_t copied = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        memcpy(dst + copied, iov[i].iov_base, iov[i].iov_len);
+        copied += iov[i].iov_len;
+    }
+
+    if (needSync) {
+        // an access unit can only start on a sync word, skip what's before it.
+        ssize_t startOffset = findSyncOffset(dst, size);
+        if (startOffset < 0) {
+            return -1;
         }
 
-        mBuffer = buffer;
+        size -= startOffset;
+        mBuffer->setRange(dst - mBuffer->base() + startOffset, size);
+    } else {
+        mBuffer->setRange(mBuffer->offset(), mBuffer->size() + size);
     }
 
-    memcpy(mBuffer->data() + mBuffer->size(), data, size);
-    mBuffer->setRange(0, mBuffer->size() + size);
+    if (mRangeInfos.full()) {
+        if (mMode != PCM_AUDIO && mMode != METADATA) {
+            MLOGW("too many PES queued, merged into the last one");
+            mRangeInfos.back().mLength += size;
+            return 0;
+        }
+
+        // their access units are whole PES, a merged range would be one
+        // access unit with two headers. Drop the oldest PES instead.
+        size_t dropped = mRangeInfos.front().mLength;
+        MLOGW("too many PES queued, dropped the oldest one of %zu bytes", dropped);
+        (void)fetchTimestamp(dropped);
+        consume(dropped);
+    }
 
     RangeInfo info;
     info.mLength = size;
-    info.mPts = pts;
-    info.mPesOffset = payloadOffset;
+    info.mPts = pesInfo.pts;
+    info.mDts = pesInfo.dts;
+    info.mPesOffset = pesInfo.payloadOffset;
+    info.mStreamId = pesInfo.streamId;
+    info.mDataAlignment = pesInfo.dataAlignment;
     mRangeInfos.push_back(info);
 
     return 0;
 }
 
+void ElementaryStreamQueue::reserve(size_t size)
+{
+    size_t queued = mBuffer == nullptr ? 0 : mBuffer->size();
+    size_t neededSize = queued + size;
+
+    if (mBuffer != nullptr && neededSize <= mBuffer->capacity() / 2) {
+        // wrap the unread bytes around to the front. At least half of the
+        // buffer is freed each time, so this costs less than a byte per byte
+        // appended, instead of a memmove of the whole tail per access unit.
+        memmove(mBuffer->base(), mBuffer->data(), queued);
+        mBuffer->setRange(0, queued);
+        mBytesMoved += queued;
+        return;
+    }
+
+    neededSize = (neededSize * 2 + 65535) & ~65535;
+
+    MLOGI("resizing buffer to size %zu", neededSize);
+
+    sptr<AmlMpBuffer> buffer = new AmlMpBuffer(neededSize);
+    if (mBuffer != nullptr) {
+        memcpy(buffer->data(), mBuffer->data(), queued);
+        mBytesMoved += queued;
+    }
+    buffer->setRange(0, queued);
+
+    mBuffer = buffer;
+}
+
+void ElementaryStreamQueue::consume(size_t size)
+{
+    if (size >= mBuffer->size()) {
+        mBuffer->setRange(0, 0);
+    } else {
+        mBuffer->setRange(mBuffer->offset() + size, mBuffer->size() - size);
+    }
+}
+
+size_t ElementaryStreamQueue::size() const
+{
+    return mBuffer == nullptr ? 0 : mBuffer->size();
+}
+
 sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnit()
 {
     if (mBuffer == nullptr) {
@@ -477,6 +692,15 @@ sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnit()
     case MPEG_AUDIO:
         return dequeueAccessUnitMPEGAudio();
 
+    case AC4:
+        return dequeueAccessUnitAC4();
+
+    case PCM_AUDIO:
+        return dequeueAccessUnitPCMAudio();
+
+    case METADATA:
+        return dequeueAccessUnitMetadata();
+
     default:
         return nullptr;
     }
@@ -502,17 +726,11 @@ int getNextNALUnit(
         return -EAGAIN;
     }
 
-    size_t offset = 0;
-
     // A valid startcode consists of at least two 0x00 bytes followed by 0x01.
-    for (; offset + 2 < size; ++offset) {
-        if (data[offset + 2] == 0x01 && data[offset] == 0x00
-                && data[offset + 1] == 0x00) {
-            break;
-        }
-    }
+    size_t offset = esFindStartCode(data, size);
     if (offset + 2 >= size) {
-        *_data = &data[offset];
+        // none, keep the last 2 bytes which may begin one
+        *_data = &data[size - 2];
         *_size = 2;
         return -EAGAIN;
     }
@@ -520,25 +738,14 @@ int getNextNALUnit(
 
     size_t startOffset = offset;
 
-    for (;;) {
-        while (offset < size && data[offset] != 0x01) {
-            ++offset;
-        }
-
-        if (offset == size) {
-            if (startCodeFollows) {
-                offset = size + 2;
-                break;
-            }
-
+    // offset is the 0x01 of the next startcode
+    offset += esFindStartCode(&data[offset], size - offset) + 2;
+    if (offset >= size) {
+        if (!startCodeFollows) {
             return -EAGAIN;
         }
 
-        if (data[offset - 1] == 0x00 && data[offset - 2] == 0x00) {
-            break;
-        }
-
-        ++offset;
+        offset = size + 2;
     }
 
     size_t endOffset = offset - 2;
@@ -585,6 +792,330 @@ unsigned parseUE(AmlMpBitReader *br) {
     return x + (1u << numZeroes) - 1;
 }
 
+// parseUE() for data that may be cut short, fallback once the bits run out
+static unsigned parseUEWithFallback(AmlMpBitReader *br, unsigned fallback) {
+    unsigned numZeroes = 0;
+    while (br->getBitsWithFallback(1, 1) == 0) {
+        if (++numZeroes > 31) {
+            return fallback;
+        }
+    }
+
+    uint32_t x;
+    if (!br->getBitsGraceful(numZeroes, &x)) {
+        return fallback;
+    }
+
+    return x + (1u << numZeroes) - 1;
+}
+
+// the NAL unit without its emulation prevention bytes, cut at dstSize
+static size_t unescapeRbsp(const uint8_t *src, size_t size, uint8_t *dst, size_t dstSize) {
+    size_t n = 0;
+    unsigned zeroes = 0;
+    for (size_t i = 0; i < size && n < dstSize; ++i) {
+        if (zeroes >= 2 && src[i] == 0x03) {
+            zeroes = 0;
+            continue;
+        }
+
+        zeroes = src[i] == 0 ? zeroes + 1 : 0;
+        dst[n++] = src[i];
+    }
+
+    return n;
+}
+
+// ITU-T H.264 7.3.2.1.1, the SPS up to the frame cropping
+static bool parseAVCSps(const uint8_t *rbsp, size_t size, ElementaryStreamQueue::VideoConfig *config) {
+    AmlMpBitReader br(rbsp, size);
+    unsigned profile = br.getBitsWithFallback(8, 0);
+    br.skipBits(8);  // constraint_set flags
+    unsigned level = br.getBitsWithFallback(8, 0);
+    parseUEWithFallback(&br, 0);  // seq_parameter_set_id
+
+    unsigned chromaFormatIdc = 1;
+    if (profile == 100 || profile == 110 || profile == 122 || profile == 244
+            || profile == 44 || profile == 83 || profile == 86 || profile == 118
+            || profile == 128 || profile == 138 || profile == 139 || profile == 134
+            || profile == 135) {
+        chromaFormatIdc = parseUEWithFallback(&br, 0);
+        if (chromaFormatIdc == 3) {
+            br.skipBits(1);  // separate_colour_plane_flag
+        }
+        parseUEWithFallback(&br, 0);  // bit_depth_luma_minus8
+        parseUEWithFallback(&br, 0);  // bit_depth_chroma_minus8
+        br.skipBits(1);  // qpprime_y_zero_transform_bypass_flag
+        if (br.getBitsWithFallback(1, 0)) {  // seq_scaling_matrix_present_flag
+            for (unsigned i = 0; i < (chromaFormatIdc != 3 ? 8u : 12u); ++i) {
+                if (!br.getBitsWithFallback(1, 0)) {
+                    continue;
+                }
+
+                // scaling_list()
+                unsigned lastScale = 8, nextScale = 8;
+                for (unsigned j = 0; j < (i < 6 ? 16u : 64u) && !br.overRead(); ++j) {
+                    if (nextScale != 0) {
+                        unsigned delta = parseUEWithFallback(&br, 0);
+                        int deltaScale = (delta & 1) ? (delta + 1) / 2 : -(int)(delta / 2);
+                        nextScale = (lastScale + deltaScale + 256) % 256;
+                    }
+                    lastScale = nextScale == 0 ? lastScale : nextScale;
+                }
+            }
+        }
+    }
+
+    parseUEWithFallback(&br, 0);  // log2_max_frame_num_minus4
+    unsigned picOrderCntType = parseUEWithFallback(&br, 0);
+    if (picOrderCntType == 0) {
+        parseUEWithFallback(&br, 0);  // log2_max_pic_order_cnt_lsb_minus4
+    } else if (picOrderCntType == 1) {
+        br.skipBits(1);  // delta_pic_order_always_zero_flag
+        parseUEWithFallback(&br, 0);  // offset_for_non_ref_pic
+        parseUEWithFallback(&br, 0);  // offset_for_top_to_bottom_field
+        unsigned numRefFramesInPicOrderCntCycle = parseUEWithFallback(&br, 0);
+        for (unsigned i = 0; i < numRefFramesInPicOrderCntCycle && !br.overRead(); ++i) {
+            parseUEWithFallback(&br, 0);  // offset_for_ref_frame
+        }
+    }
+
+    parseUEWithFallback(&br, 0);  // max_num_ref_frames
+    br.skipBits(1);  // gaps_in_frame_num_value_allowed_flag
+    unsigned picWidthInMbs = parseUEWithFallback(&br, 0) + 1;
+    unsigned picHeightInMapUnits = parseUEWithFallback(&br, 0) + 1;
+    unsigned frameMbsOnly = br.getBitsWithFallback(1, 1);
+    if (!frameMbsOnly) {
+        br.skipBits(1);  // mb_adaptive_frame_field_flag
+    }
+    br.skipBits(1);  // direct_8x8_inference_flag
+
+    unsigned cropLeft = 0, cropRight = 0, cropTop = 0, cropBottom = 0;
+    if (br.getBitsWithFallback(1, 0)) {
+        cropLeft = parseUEWithFallback(&br, 0);
+        cropRight = parseUEWithFallback(&br, 0);
+        cropTop = parseUEWithFallback(&br, 0);
+        cropBottom = parseUEWithFallback(&br, 0);
+    }
+
+    if (br.overRead()) {
+        return false;
+    }
+
+    unsigned cropUnitX = (chromaFormatIdc == 1 || chromaFormatIdc == 2) ? 2 : 1;
+    unsigned cropUnitY = (chromaFormatIdc == 1 ? 2 : 1) * (2 - frameMbsOnly);
+    int width = picWidthInMbs * 16 - (cropLeft + cropRight) * cropUnitX;
+    int height = (2 - frameMbsOnly) * picHeightInMapUnits * 16 - (cropTop + cropBottom) * cropUnitY;
+    if (width <= 0 || height <= 0) {
+        return false;
+    }
+
+    config->width = width;
+    config->height = height;
+    config->profile = profile;
+    config->level = level;
+    return true;
+}
+
+// ITU-T H.265 7.3.2.2, the SPS up to the conformance window
+static bool parseHEVCSps(const uint8_t *rbsp, size_t size, ElementaryStreamQueue::VideoConfig *config) {
+    AmlMpBitReader br(rbsp, size);
+    br.skipBits(4);  // sps_video_parameter_set_id
+    unsigned maxSubLayersMinus1 = br.getBitsWithFallback(3, 0);
+    br.skipBits(1);  // sps_temporal_id_nesting_flag
+
+    // profile_tier_level()
+    br.skipBits(2 + 1);  // general_profile_space, general_tier_flag
+    unsigned profile = br.getBitsWithFallback(5, 0);
+    br.skipBits(32 + 48);  // compatibility and constraint flags
+    unsigned level = br.getBitsWithFallback(8, 0);
+
+    bool subLayerProfilePresent[8] = {}, subLayerLevelPresent[8] = {};
+    for (unsigned i = 0; i < maxSubLayersMinus1; ++i) {
+        subLayerProfilePresent[i] = br.getBitsWithFallback(1, 0);
+        subLayerLevelPresent[i] = br.getBitsWithFallback(1, 0);
+    }
+    if (maxSubLayersMinus1 > 0) {
+        br.skipBits(2 * (8 - maxSubLayersMinus1));  // reserved_zero_2bits
+    }
+    for (unsigned i = 0; i < maxSubLayersMinus1; ++i) {
+        if (subLayerProfilePresent[i]) {
+            br.skipBits(88);
+        }
+        if (subLayerLevelPresent[i]) {
+            br.skipBits(8);
+        }
+    }
+
+    parseUEWithFallback(&br, 0);  // sps_seq_parameter_set_id
+    unsigned chromaFormatIdc = parseUEWithFallback(&br, 0);
+    if (chromaFormatIdc == 3) {
+        br.skipBits(1);  // separate_colour_plane_flag
+    }
+    int width = parseUEWithFallback(&br, 0);
+    int height = parseUEWithFallback(&br, 0);
+    if (br.getBitsWithFallback(1, 0)) {  // conformance_window_flag
+        unsigned subWidthC = (chromaFormatIdc == 1 || chromaFormatIdc == 2) ? 2 : 1;
+        unsigned subHeightC = chromaFormatIdc == 1 ? 2 : 1;
+        unsigned left = parseUEWithFallback(&br, 0);
+        unsigned right = parseUEWithFallback(&br, 0);
+        unsigned top = parseUEWithFallback(&br, 0);
+        unsigned bottom = parseUEWithFallback(&br, 0);
+        width -= subWidthC * (left + right);
+        height -= subHeightC * (top + bottom);
+    }
+
+    if (br.overRead() || width <= 0 || height <= 0) {
+        return false;
+    }
+
+    config->width = width;
+    config->height = height;
+    config->profile = profile;
+    config->level = level;
+    return true;
+}
+
+// true if the SEI messages (after the NAL unit header) include a recovery
+// point, payloadType 6 in both H.264 and H.265
+static bool hasRecoveryPointSei(const uint8_t *data, size_t size) {
+    uint8_t rbsp[256];
+    size = unescapeRbsp(data, size, rbsp, sizeof(rbsp));
+
+    size_t offset = 0;
+    while (offset < size && rbsp[offset] != 0x80) {  // rbsp_trailing_bits
+        unsigned payloadType = 0;
+        while (offset < size && rbsp[offset] == 0xFF) {
+            payloadType += 255;
+            ++offset;
+        }
+        if (offset >= size) {
+            break;
+        }
+        payloadType += rbsp[offset++];
+
+        size_t payloadSize = 0;
+        while (offset < size && rbsp[offset] == 0xFF) {
+            payloadSize += 255;
+            ++offset;
+        }
+        if (offset >= size) {
+            break;
+        }
+        payloadSize += rbsp[offset++];
+
+        if (payloadType == 6) {
+            return true;
+        }
+        offset += payloadSize;
+    }
+
+    return false;
+}
+
+int32_t ElementaryStreamQueue::inspectNalUnit(const uint8_t* nal, size_t nalSize)
+{
+    size_t headerSize = mMode == H264 ? 1 : 2;
+    if (nalSize <= headerSize) {
+        return 0;
+    }
+
+    bool isSps = false;
+    bool isPps = false;
+    unsigned nalType;
+    if (mMode == H264) {
+        nalType = nal[0] & 0x1f;
+        switch (nalType) {
+        case 5:
+            return AU_FLAG_KEY_FRAME;
+        case 6:
+            return hasRecoveryPointSei(nal + headerSize, nalSize - headerSize) ? AU_FLAG_RECOVERY_POINT : 0;
+        case 7:
+            isSps = true;
+            break;
+        case 8:
+            isPps = true;
+            break;
+        default:
+            return 0;
+        }
+    } else {
+        nalType = (nal[0] >> 1) & 0x3f;
+        if (nalType >= 16 && nalType <= 23) {
+            return AU_FLAG_KEY_FRAME;
+        }
+
+        switch (nalType) {
+        case 32:
+            break;
+        case 33:
+            isSps = true;
+            break;
+        case 34:
+            isPps = true;
+            break;
+        case 39:
+            return hasRecoveryPointSei(nal + headerSize, nalSize - headerSize) ? AU_FLAG_RECOVERY_POINT : 0;
+        default:
+            return 0;
+        }
+    }
+
+    // a stream can switch between several PPS, each one is kept
+    uint32_t key = nalType << 16;
+    if (isPps) {
+        AmlMpBitReader br(nal + headerSize, nalSize - headerSize);
+        key |= parseUEWithFallback(&br, 0) & 0xFFFF;
+    }
+
+    sptr<AmlMpBuffer>& parameterSet = mParameterSets[key];
+    if (parameterSet != nullptr && parameterSet->size() == nalSize
+            && !memcmp(parameterSet->data(), nal, nalSize)) {
+        return 0;
+    }
+
+    parameterSet = AmlMpBuffer::CreateAsCopy(nal, nalSize);
+    ++mVideoConfig.generation;
+
+    if (isSps) {
+        uint8_t rbsp[1024];
+        size_t rbspSize = unescapeRbsp(nal + headerSize, nalSize - headerSize, rbsp, sizeof(rbsp));
+        bool parsed = mMode == H264 ? parseAVCSps(rbsp, rbspSize, &mVideoConfig) : parseHEVCSps(rbsp, rbspSize, &mVideoConfig);
+        if (parsed) {
+            MLOGI("%s SPS: %dx%d, profile %d, level %d", mMode == H264 ? "H264" : "H265",
+                    mVideoConfig.width, mVideoConfig.height, mVideoConfig.profile, mVideoConfig.level);
+        } else {
+            MLOGW("failed to parse SPS of %zu bytes", nalSize);
+        }
+    }
+
+    return AU_FLAG_CONFIG_CHANGED;
+}
+
+bool ElementaryStreamQueue::getVideoConfig(VideoConfig* config) const
+{
+    if (mVideoConfig.width <= 0) {
+        return false;
+    }
+
+    *config = mVideoConfig;
+
+    size_t size = 0;
+    for (const auto& p : mParameterSets) {
+        size += 4 + p.second->size();
+    }
+
+    config->configData = new AmlMpBuffer(size);
+    uint8_t* dst = config->configData->data();
+    for (const auto& p : mParameterSets) {
+        memcpy(dst, "\x00\x00\x00\x01", 4);
+        memcpy(dst + 4, p.second->data(), p.second->size());
+        dst += 4 + p.second->size();
+    }
+
+    return true;
+}
+
 sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitH264()
 {
     const uint8_t* data = mBuffer->data();
@@ -628,30 +1159,29 @@ sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitH264()
 
         if (flush) {
             size_t auSize = 4 * nals.size() + totalSize;
-            sptr<AmlMpBuffer> accessUnit = new AmlMpBuffer(auSize + kPesHeaderSize);
+            sptr<AmlMpBuffer> accessUnit = mPool->acquire(auSize + kPesHeaderSize);
 
             size_t dstOffset = kPesHeaderSize;
+            int32_t flags = 0;
             for (size_t i = 0; i < nals.size(); ++i) {
                 const NALPosition &pos = nals.at(i);
-                unsigned nalType = mBuffer->data()[pos.nalOffset] & 0x1f;
+                flags |= inspectNalUnit(mBuffer->data() + pos.nalOffset, pos.nalSize);
 
-                memcpy(accessUnit->data() + dstOffset, "\x00\x00\x00\x01", 4);
+                writeNalPrefix(accessUnit->data() + dstOffset, pos.nalSize);
                 memcpy(accessUnit->data() + dstOffset + 4, mBuffer->data() + pos.nalOffset, pos.nalSize);
                 dstOffset += pos.nalSize + 4;
             }
 
             const NALPosition &pos = nals.at(nals.size() - 1);
             size_t nextScan = pos.nalOffset + pos.nalSize;
-            memmove(mBuffer->data(),
-                    mBuffer->data() + nextScan,
-                    mBuffer->size() - nextScan);
-            mBuffer->setRange(0, mBuffer->size() - nextScan);
+            consume(nextScan);
 
             int64_t pts = fetchTimestamp(nextScan);
             if (pts < 0) {
                 return nullptr;
             }
-            makePESHeader(accessUnit->data(), accessUnit->capacity(), auSize, pts);
+            finishAccessUnit(accessUnit, auSize, pts);
+            accessUnit->setInt32Data(flags);
 
             MLOGV("dequeueAccessUnitH264[%d]: AU %p(%zu) dstOffset:%zu, nals:%zu, totalSize:%zu,auSize:%zu, PTS:%.3fs",
                     mAUIndex, accessUnit->data(), accessUnit->size(),
@@ -716,29 +1246,29 @@ sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitH265()
 
         if (flush) {
             size_t auSize = 4 * nals.size() + totalSize;
-            sptr<AmlMpBuffer> accessUnit = new AmlMpBuffer(auSize + kPesHeaderSize);
+            sptr<AmlMpBuffer> accessUnit = mPool->acquire(auSize + kPesHeaderSize);
 
             size_t dstOffset = kPesHeaderSize;
+            int32_t flags = 0;
             for (size_t i = 0; i < nals.size(); ++i) {
                 const NALPosition &pos = nals.at(i);
+                flags |= inspectNalUnit(mBuffer->data() + pos.nalOffset, pos.nalSize);
 
-                memcpy(accessUnit->data() + dstOffset, "\x00\x00\x00\x01", 4);
+                writeNalPrefix(accessUnit->data() + dstOffset, pos.nalSize);
                 memcpy(accessUnit->data() + dstOffset + 4, mBuffer->data() + pos.nalOffset, pos.nalSize);
                 dstOffset += pos.nalSize + 4;
             }
 
             const NALPosition &pos = nals.at(nals.size() - 1);
             size_t nextScan = pos.nalOffset + pos.nalSize;
-            memmove(mBuffer->data(),
-                    mBuffer->data() + nextScan,
-                    mBuffer->size() - nextScan);
-            mBuffer->setRange(0, mBuffer->size() - nextScan);
+            consume(nextScan);
 
             int64_t pts = fetchTimestamp(nextScan);
             if (pts < 0) {
                 return nullptr;
             }
-            makePESHeader(accessUnit->data(), accessUnit->capacity(), auSize, pts);
+            finishAccessUnit(accessUnit, auSize, pts);
+            accessUnit->setInt32Data(flags);
 
             MLOGV("dequeueAccessUnitH265[%d]: AU %p(%zu) dstOffset:%zu, nals:%zu, totalSize:%zu,auSize:%zu, PTS:%.3fs",
                     mAUIndex, accessUnit->data(), accessUnit->size(),
@@ -765,6 +1295,99 @@ sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitH265()
     return nullptr;
 }
 
+// LOAS sync and length, the AudioMuxElement up to PayloadLengthInfo, alignment
+static const size_t kMaxLoasHeaderSize = 3 + 6 + 1;
+
+struct BitWriter {
+    explicit BitWriter(uint8_t* data)
+    : mData(data)
+    {
+    }
+
+    void putBits(uint32_t value, size_t n) {
+        while (n > 0) {
+            --n;
+            size_t byte = mBitPos >> 3;
+            unsigned shift = 7 - (mBitPos & 7);
+            if (shift == 7) {
+                mData[byte] = 0;
+            }
+            mData[byte] |= ((value >> n) & 1) << shift;
+            ++mBitPos;
+        }
+    }
+
+    void putBytes(const uint8_t* src, size_t n) {
+        uint8_t* p = mData + (mBitPos >> 3);
+        unsigned rem = mBitPos & 7;
+        if (rem == 0) {
+            memcpy(p, src, n);
+        } else {
+            for (size_t i = 0; i < n; ++i) {
+                p[i] |= src[i] >> rem;
+                p[i + 1] = src[i] << (8 - rem);
+            }
+        }
+        mBitPos += n * 8;
+    }
+
+    size_t size() const {
+        return (mBitPos + 7) >> 3;
+    }
+
+private:
+    uint8_t* mData;
+    size_t mBitPos = 0;
+};
+
+// Rewraps one ADTS frame as an AudioSyncStream frame carrying its
+// StreamMuxConfig (ISO/IEC 14496-3 1.7), so a decoder can start on any of
+// them. Returns the bytes written to dst.
+static size_t writeLoasFrame(uint8_t* dst, const uint8_t* adts, size_t headerSize, size_t frameLength)
+{
+    unsigned audioObjectType = (adts[2] >> 6) + 1;
+    unsigned samplingFrequencyIndex = (adts[2] >> 2) & 0x0F;
+    unsigned channelConfiguration = (adts[2] & 0x01) << 2 | adts[3] >> 6;
+    const uint8_t* payload = adts + headerSize;
+    size_t payloadSize = frameLength - headerSize;
+
+    BitWriter bits(dst + 3);
+    bits.putBits(0, 1);                         // useSameStreamMux
+    bits.putBits(0, 1);                         // audioMuxVersion
+    bits.putBits(1, 1);                         // allStreamsSameTimeFraming
+    bits.putBits(0, 6);                         // numSubFrames
+    bits.putBits(0, 4);                         // numProgram
+    bits.putBits(0, 3);                         // numLayer
+    bits.putBits(audioObjectType, 5);
+    bits.putBits(samplingFrequencyIndex, 4);
+    bits.putBits(channelConfiguration, 4);
+    bits.putBits(0, 3);                         // GASpecificConfig, 1024 samples, no core coder, no extension
+    bits.putBits(0, 3);                         // frameLengthType
+    bits.putBits(0xFF, 8);                      // latmBufferFullness
+    bits.putBits(0, 1);                         // otherDataPresent
+    bits.putBits(0, 1);                         // crcCheckPresent
+
+    for (size_t n = payloadSize; ; n -= 255) {  // PayloadLengthInfo
+        bits.putBits(std::min(n, (size_t)255), 8);
+        if (n < 255) {
+            break;
+        }
+    }
+    bits.putBytes(payload, payloadSize);
+
+    size_t audioMuxLengthBytes = bits.size();
+    if (audioMuxLengthBytes > 0x1FFF) {
+        MLOGW("AAC frame too large for LOAS: %zu", frameLength);
+        return 0;
+    }
+
+    dst[0] = 0x56;
+    dst[1] = 0xE0 | audioMuxLengthBytes >> 8;
+    dst[2] = audioMuxLengthBytes & 0xFF;
+
+    return 3 + audioMuxLengthBytes;
+}
+
 sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitAAC()
 {
     if (mBuffer->size() == 0) {
@@ -775,7 +1398,7 @@ sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitAAC()
         return nullptr;
     }
 
-    const RangeInfo &info = *mRangeInfos.begin();
+    const RangeInfo info = mRangeInfos.front();
     if (info.mLength == 0 || mBuffer->size() < info.mLength) {
         return nullptr;
     }
@@ -802,7 +1425,11 @@ sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitAAC()
         AmlMpBitReader bits(mBuffer->data() + offset, mBuffer->size() - offset);
         if (bits.getBits(12) != 0xfffu) {
             //MLOGE("Wrong adts_fixed_header");
-            ++offset;
+            // skip to the next candidate, the checks above apply from
+            // info.mLength or the last 6 bytes on.
+            size_t end = std::min(info.mLength, mBuffer->size() - 6);
+            size_t next = esFindSyncWord(mBuffer->data() + offset + 1, end - offset, 0xFF, 0xF0, 0xF0);
+            offset = next < end - offset ? offset + 1 + next : end;
             continue;
         }
 
@@ -842,9 +1469,25 @@ sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitAAC()
 
     int64_t pts = fetchTimestamp(offset);
 
-    sptr<AmlMpBuffer> accessUnit = new AmlMpBuffer(offset + kPesHeaderSize);
-    size_t pesHeaderSize = makePESHeader(accessUnit->data(), accessUnit->capacity(), offset, pts);
-    memcpy(accessUnit->data() + pesHeaderSize, mBuffer->data(), offset);
+    sptr<AmlMpBuffer> accessUnit;
+    if (mOutputFormat == OUTPUT_LATM) {
+        size_t capacity = kPesHeaderSize;
+        for (const ADTSPosition& frame : frames) {
+            capacity += kMaxLoasHeaderSize + (frame.length - frame.headerSize) / 255 + 1 + frame.length;
+        }
+
+        accessUnit = mPool->acquire(capacity);
+        size_t size = 0;
+        for (const ADTSPosition& frame : frames) {
+            size += writeLoasFrame(accessUnit->data() + kPesHeaderSize + size,
+                    mBuffer->data() + frame.offset, frame.headerSize, frame.length);
+        }
+        finishAccessUnit(accessUnit, size, pts);
+    } else {
+        accessUnit = mPool->acquire(offset + kPesHeaderSize);
+        memcpy(accessUnit->data() + kPesHeaderSize, mBuffer->data(), offset);
+        finishAccessUnit(accessUnit, offset, pts);
+    }
 
     MLOGV("dequeueAccessUnit_AAC[%d]: AU:%p(%zu) offset:%zu, info.mLength %zu, frames:%zu, PTS:%.3fs",
                         mAUIndex, accessUnit->data(), accessUnit->size(),
@@ -855,9 +1498,7 @@ sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitAAC()
 
     mAUIndex++;
 
-    memmove(mBuffer->data(), mBuffer->data() + offset,
-            mBuffer->size() - offset);
-    mBuffer->setRange(0, mBuffer->size() - offset);
+    consume(offset);
 
     return accessUnit;
 }
@@ -875,6 +1516,11 @@ sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitEAC3()
             return NULL;
         }
 
+        syncStartPos += esFindSyncWord(mBuffer->data() + syncStartPos, mBuffer->size() - syncStartPos, 0x0B, 0x77);
+        if (syncStartPos + 2 >= mBuffer->size()) {
+            return NULL;
+        }
+
         uint8_t *ptr = mBuffer->data() + syncStartPos;
         size_t size = mBuffer->size() - syncStartPos;
         if (mMode == AC3) {
@@ -905,17 +1551,220 @@ sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitEAC3()
 
     mAUIndex++;
 
-    sptr<AmlMpBuffer> accessUnit = new AmlMpBuffer(syncStartPos + payloadSize + kPesHeaderSize);
+    sptr<AmlMpBuffer> accessUnit = mPool->acquire(syncStartPos + payloadSize + kPesHeaderSize);
     memcpy(accessUnit->data() + kPesHeaderSize, mBuffer->data(), syncStartPos + payloadSize);
 
-    makePESHeader(accessUnit->data(), accessUnit->capacity(), syncStartPos + payloadSize, pts);
+    finishAccessUnit(accessUnit, syncStartPos + payloadSize, pts);
+
+    consume(syncStartPos + payloadSize);
+
+    return accessUnit;
+}
 
-    memmove(
-            mBuffer->data(),
-            mBuffer->data() + syncStartPos + payloadSize,
-            mBuffer->size() - syncStartPos - payloadSize);
+// enough for the sync frame header and the part of the TOC that's checked,
+// a parse failure before that could be a frame not completely queued yet.
+static const size_t kAC4MinHeaderSize = 16;
 
-    mBuffer->setRange(0, mBuffer->size() - syncStartPos - payloadSize);
+sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitAC4()
+{
+    size_t syncStartPos = 0;
+    size_t frameSize = 0;
+
+    while (true) {
+        if (syncStartPos + kAC4MinHeaderSize > mBuffer->size()) {
+            return nullptr;
+        }
+
+        syncStartPos += esFindSyncWord(mBuffer->data() + syncStartPos, mBuffer->size() - syncStartPos, 0xAC, 0x40, 0xFE);
+        if (syncStartPos + kAC4MinHeaderSize > mBuffer->size()) {
+            return nullptr;
+        }
+
+        frameSize = parseAC4SyncFrame(mBuffer->data() + syncStartPos, mBuffer->size() - syncStartPos);
+        if (frameSize > 0) {
+            break;
+        }
+
+        ++syncStartPos;
+    }
+
+    if (mBuffer->size() < syncStartPos + frameSize) {
+        MLOGV("Not enough buffer size for AC4");
+        return nullptr;
+    }
+
+    if (syncStartPos > 0) {
+        MLOGW("dropped %zu bytes before the AC4 sync frame", syncStartPos);
+        (void)fetchTimestamp(syncStartPos);
+        consume(syncStartPos);
+    }
+
+    int64_t pts = fetchTimestamp(frameSize);
+    if (pts < 0ll) {
+        MLOGE("negative pts");
+        return nullptr;
+    }
+
+    mAUIndex++;
+
+    sptr<AmlMpBuffer> accessUnit = mPool->acquire(frameSize + kPesHeaderSize);
+    memcpy(accessUnit->data() + kPesHeaderSize, mBuffer->data(), frameSize);
+    finishAccessUnit(accessUnit, frameSize, pts);
+
+    consume(frameSize);
+
+    return accessUnit;
+}
+
+sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitPCMAudio()
+{
+    // one access unit per PES, the header is repeated in each of them
+    while (!mRangeInfos.empty()) {
+        const RangeInfo info = mRangeInfos.front();
+        if (mBuffer->size() < info.mLength) {
+            return nullptr;
+        }
+
+        const uint8_t* data = mBuffer->data();
+        PcmFormat format;
+        size_t headerSize = parseLPCMHeader(data, info.mLength, &format);
+        if (headerSize == 0) {
+            MLOGW("no LPCM header, dropped %zu bytes", info.mLength);
+            (void)fetchTimestamp(info.mLength);
+            consume(info.mLength);
+            continue;
+        }
+
+        if (format.sampleRate != mPcmFormat.sampleRate
+                || format.channels != mPcmFormat.channels
+                || format.bitsPerSample != mPcmFormat.bitsPerSample) {
+            MLOGI("LPCM %d Hz, %d channels, %d bits", format.sampleRate, format.channels, format.bitsPerSample);
+            mPcmFormat = format;
+        }
+
+        // PES output keeps the header for the decoder, raw output is the
+        // big endian samples only
+        size_t offset = mOutputFormat == OUTPUT_PES ? 0 : headerSize;
+        size_t frameLength = info.mLength - offset;
+
+        int64_t pts = fetchTimestamp(info.mLength);
+        sptr<AmlMpBuffer> accessUnit = mPool->acquire(frameLength + kPesHeaderSize);
+        memcpy(accessUnit->data() + kPesHeaderSize, data + offset, frameLength);
+        finishAccessUnit(accessUnit, frameLength, pts);
+
+        mAUIndex++;
+        consume(info.mLength);
+
+        return accessUnit;
+    }
+
+    return nullptr;
+}
+
+// ID3v2 tag: "ID3", version 16, flags 8, syncsafe size 32, then the size of
+// the frames, and a footer of 10 bytes if flags has bit 4 set.
+static size_t getID3TagSize(const uint8_t *ptr, size_t size) {
+    if (size < 10 || memcmp(ptr, "ID3", 3) != 0 || ptr[3] == 0xFF || ptr[4] == 0xFF
+            || ((ptr[6] | ptr[7] | ptr[8] | ptr[9]) & 0x80)) {
+        return 0;
+    }
+
+    size_t tagSize = 10 + (ptr[6] << 21 | ptr[7] << 14 | ptr[8] << 7 | ptr[9]);
+    if (ptr[5] & 0x10) {
+        tagSize += 10;
+    }
+
+    return tagSize <= size ? tagSize : 0;
+}
+
+// SMPTE 336M KLV packet: 16 byte universal label key, BER length, value.
+static size_t getKLVPacketSize(const uint8_t *ptr, size_t size) {
+    if (size < 17 || memcmp(ptr, "\x06\x0E\x2B\x34", 4) != 0) {
+        return 0;
+    }
+
+    size_t offset = 16;
+    size_t length = ptr[offset++];
+    if (length & 0x80) {
+        size_t lengthBytes = length & 0x7F;
+        if (lengthBytes == 0 || lengthBytes > 4 || offset + lengthBytes > size) {
+            return 0;
+        }
+
+        length = 0;
+        while (lengthBytes-- > 0) {
+            length = length << 8 | ptr[offset++];
+        }
+    }
+
+    return offset + length <= size ? offset + length : 0;
+}
+
+sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitMetadata()
+{
+    // one access unit per PES
+    if (mRangeInfos.empty()) {
+        return nullptr;
+    }
+
+    const RangeInfo info = mRangeInfos.front();
+    if (mBuffer->size() < info.mLength) {
+        return nullptr;
+    }
+
+    int64_t pts = fetchTimestamp(info.mLength);
+
+    // in a metadata stream (stream_id 0xFC) the access units are wrapped in
+    // cells, ISO/IEC 13818-1 2.12.4: metadata_service_id 8,
+    // sequence_number 8, cell_fragment_indication 2, decoder_config_flag 1,
+    // random_access_indicator 1, reserved 4, AU_cell_data_length 16
+    sptr<AmlMpBuffer> accessUnit = mPool->acquire(info.mLength + kPesHeaderSize);
+    uint8_t* dst = accessUnit->data() + kPesHeaderSize;
+    const uint8_t* data = mBuffer->data();
+    size_t size = 0;
+    if (info.mStreamId == 0xFC) {
+        size_t offset = 0;
+        while (offset + 5 <= info.mLength) {
+            size_t cellSize = data[offset + 3] << 8 | data[offset + 4];
+            offset += 5;
+            if (offset + cellSize > info.mLength) {
+                MLOGW("metadata AU cell of %zu bytes is truncated", cellSize);
+                cellSize = info.mLength - offset;
+            }
+            memcpy(dst + size, data + offset, cellSize);
+            size += cellSize;
+            offset += cellSize;
+        }
+    } else {
+        memcpy(dst, data, info.mLength);
+        size = info.mLength;
+    }
+    consume(info.mLength);
+
+    // ID3 tags and KLV packets are cut to their declared sizes, anything
+    // else is passed as is
+    size_t offset = 0;
+    while (offset < size) {
+        size_t unitSize = getID3TagSize(dst + offset, size - offset);
+        if (unitSize == 0) {
+            unitSize = getKLVPacketSize(dst + offset, size - offset);
+        }
+        if (unitSize == 0) {
+            break;
+        }
+        offset += unitSize;
+    }
+    if (offset > 0 && offset < size) {
+        MLOGV("dropped %zu bytes after the metadata", size - offset);
+        size = offset;
+    }
+
+    if (size == 0) {
+        return nullptr;
+    }
+
+    finishAccessUnit(accessUnit, size, pts);
+    mAUIndex++;
 
     return accessUnit;
 }
@@ -1106,12 +1955,11 @@ sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitMPEGAudio()
     }
 
     unsigned layer = 4 - ((header >> 17) & 3);
-    sptr<AmlMpBuffer> accessUnit = new AmlMpBuffer(frameSize + kPesHeaderSize);
-    size_t pesHeaderSize = makePESHeader(accessUnit->data(), accessUnit->capacity(), frameSize, pts);
-    memcpy(accessUnit->data() + pesHeaderSize, data, frameSize);
+    sptr<AmlMpBuffer> accessUnit = mPool->acquire(frameSize + kPesHeaderSize);
+    memcpy(accessUnit->data() + kPesHeaderSize, data, frameSize);
+    finishAccessUnit(accessUnit, frameSize, pts);
 
-    memmove(mBuffer->data(), mBuffer->data() + frameSize, mBuffer->size() - frameSize);
-    mBuffer->setRange(0, mBuffer->size() - frameSize);
+    consume(frameSize);
 
     return accessUnit;
 }
@@ -1133,9 +1981,9 @@ sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitMPEGVideo()
 
     size_t offset = 0;
     while (offset + 3 < size) {
-        if (memcmp(&data[offset], "\x00\x00\x01", 3)) {
-            ++offset;
-            continue;
+        offset += esFindStartCode(&data[offset], size - offset);
+        if (offset + 3 >= size) {
+            break;
         }
 
         pprevStartCode = prevStartCode;
@@ -1143,11 +1991,11 @@ sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitMPEGVideo()
         currentStartCode = data[offset + 3];
 
         if (currentStartCode == 0xb3 && mFormat == nullptr) {
-            memmove(mBuffer->data(), mBuffer->data() + offset, size - offset);
+            consume(offset);
+            data = mBuffer->data();
             size -= offset;
             (void)fetchTimestamp(offset);
             offset = 0;
-            mBuffer->setRange(0, size);
         }
 
         if ((prevStartCode == 0xb3 && currentStartCode != 0xb5)
@@ -1192,16 +2040,15 @@ sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitMPEGVideo()
             if (!sawPictureStart) {
                 sawPictureStart = true;
             } else {
-                sptr<AmlMpBuffer> accessUnit = new AmlMpBuffer(offset + kPesHeaderSize);
+                sptr<AmlMpBuffer> accessUnit = mPool->acquire(offset + kPesHeaderSize);
                 int64_t pts = fetchTimestamp(offset);
                 if (pts < 0LL) {
                     MLOGE("Negative pts");
                     return NULL;
                 }
 
-                makePESHeader(accessUnit->data(), accessUnit->capacity(), offset, pts);
-
                 memcpy(accessUnit->data() + kPesHeaderSize, data, offset);
+                finishAccessUnit(accessUnit, offset, pts);
 
                 MLOGV("dequeueAccessUnitMPEGVideo[%d]: AU %p(%zu) offset:%zu, PTS:%.3fs",
                     mAUIndex, accessUnit->data(), accessUnit->size(),
@@ -1209,11 +2056,7 @@ sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitMPEGVideo()
 
                 ++mAUIndex;
 
-                memmove(mBuffer->data(),
-                        mBuffer->data() + offset,
-                        mBuffer->size() - offset);
-
-                mBuffer->setRange(0, mBuffer->size() - offset);
+                consume(offset);
 
                 offset = 0;
 
@@ -1247,13 +2090,9 @@ static ssize_t getNextChunkSize(
         return -EAGAIN;
     }
 
-    size_t offset = 4;
-    while (offset + 2 < size) {
-        if (!memcmp(&data[offset], kStartCode, 3)) {
-            return offset;
-        }
-
-        ++offset;
+    size_t offset = 4 + esFindStartCode(&data[4], size - 4);
+    if (offset < size) {
+        return offset;
     }
 
     return -EAGAIN;
@@ -1447,19 +2286,17 @@ sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitMPEG4Video()
 
                     offset += chunkSize;
 
-                    sptr<AmlMpBuffer> accessUnit = new AmlMpBuffer(offset + kPesHeaderSize);
+                    sptr<AmlMpBuffer> accessUnit = mPool->acquire(offset + kPesHeaderSize);
                     memcpy(accessUnit->data() + kPesHeaderSize, data, offset);
 
-                    memmove(data, &data[offset], size - offset);
-                    size -= offset;
-                    mBuffer->setRange(0, size);
+                    consume(offset);
 
                     int64_t pts = fetchTimestamp(offset);
                     if (pts < 0LL) {
                         MLOGE("Negative pts");
                         return NULL;
                     }
-                    makePESHeader(accessUnit->data(), accessUnit->capacity(), offset, pts);
+                    finishAccessUnit(accessUnit, offset, pts);
 
                     offset = 0;
 
@@ -1488,10 +2325,10 @@ sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitMPEG4Video()
 
         if (discard) {
             (void)fetchTimestamp(offset);
-            memmove(data, &data[offset], size - offset);
+            consume(offset);
+            data = mBuffer->data();
             size -= offset;
             offset = 0;
-            mBuffer->setRange(0, size);
         } else {
             offset += chunkSize;
         }
@@ -1502,42 +2339,43 @@ sptr<AmlMpBuffer> ElementaryStreamQueue::dequeueAccessUnitMPEG4Video()
 
 int64_t ElementaryStreamQueue::fetchTimestamp(
         size_t size, int32_t *pesOffset) {
-    int64_t pts = -1;
-    bool first = true;
-
-    while (size > 0) {
-        if (mRangeInfos.empty()) {
-            return pts;
-        }
+    mAUInfo = RangeInfo{-1, -1, 0, 0, 0, false};
+    if (mRangeInfos.empty() || size == 0) {
+        return -1;
+    }
 
-        RangeInfo *info = &*mRangeInfos.begin();
+    mAUInfo = mRangeInfos.front();
+    if (pesOffset != NULL) {
+        *pesOffset = mAUInfo.mPesOffset;
+    }
 
-        if (first) {
-            pts = info->mPts;
-            if (pesOffset != NULL) {
-                *pesOffset = info->mPesOffset;
-            }
-            first = false;
+    // drop the ranges the access unit covers completely in one go, and
+    // cut the one it ends in.
+    size_t consumed = 0;
+    while (consumed < mRangeInfos.count()) {
+        RangeInfo& info = mRangeInfos.at(consumed);
+        if (info.mLength > size) {
+            info.mLength -= size;
+            break;
         }
 
-        if (info->mLength > size) {
-            info->mLength -= size;
-            size = 0;
-        } else {
-            size -= info->mLength;
-
-            mRangeInfos.erase(mRangeInfos.begin());
-            info = NULL;
+        size -= info.mLength;
+        ++consumed;
+        if (size == 0) {
+            break;
         }
-
     }
+    mRangeInfos.pop_front(consumed);
 
-    return pts;
+    return mAUInfo.mPts;
 }
 
 size_t ElementaryStreamQueue::makePESHeader(uint8_t* data, size_t size, size_t frameLength, int64_t pts)
 {
-    if (size < 14) {
+    bool hasPts = pts >= 0;
+    bool hasDts = hasPts && mAUInfo.mDts >= 0 && mAUInfo.mDts != pts;
+    size_t headerDataLength = hasDts ? 10 : hasPts ? 5 : 0;
+    if (size < 9 + headerDataLength) {
         return 0;
     }
 
@@ -1548,10 +2386,10 @@ size_t ElementaryStreamQueue::makePESHeader(uint8_t* data, size_t size, size_t f
     p[2] = 0x01;
     p += 3;
 
-    p[0] = 0xE0;
+    p[0] = mAUInfo.mStreamId != 0 ? mAUInfo.mStreamId : 0xE0;
     ++p;
 
-    int pes_packet_length = 8 + frameLength;
+    size_t pes_packet_length = 3 + headerDataLength + frameLength;
     if (pes_packet_length <= 65535) {
         p[0] = pes_packet_length >> 8;
         p[1] = pes_packet_length & 0xff;
@@ -1561,19 +2399,78 @@ size_t ElementaryStreamQueue::makePESHeader(uint8_t* data, size_t size, size_t f
     }
     p += 2;
 
-    p[0] = 0x80;
-    p[1] = 0x80;
-    p[2] = 5; //PTS size
+    p[0] = 0x80 | (mAUInfo.mDataAlignment ? 0x04 : 0);
+    p[1] = hasDts ? 0xC0 : hasPts ? 0x80 : 0x00;
+    p[2] = headerDataLength;
     p += 3;
 
-    p[0] = 0x20 | (pts>>29&0x0e) | 0x01;
-    p[1] = pts>>22 & 0xff;
-    p[2] = (pts>>14 & 0xfe) | 0x01;
-    p[3] = pts>>7 & 0xff;
-    p[4] = (pts<<1 & 0xfe) | 0x01;
-    p += 5;
+    auto putTimestamp = [&p](unsigned prefix, int64_t ts) {
+        p[0] = prefix << 4 | (ts>>29&0x0e) | 0x01;
+        p[1] = ts>>22 & 0xff;
+        p[2] = (ts>>14 & 0xfe) | 0x01;
+        p[3] = ts>>7 & 0xff;
+        p[4] = (ts<<1 & 0xfe) | 0x01;
+        p += 5;
+    };
+
+    if (hasPts) {
+        putTimestamp(hasDts ? 0x3 : 0x2, pts);
+    }
+    if (hasDts) {
+        putTimestamp(0x1, mAUInfo.mDts);
+    }
 
     return p - data;
 }
 
+void ElementaryStreamQueue::finishAccessUnit(const sptr<AmlMpBuffer>& accessUnit, size_t frameLength, int64_t pts)
+{
+    // the framers leave room for the largest header before the payload,
+    // the range is moved to where the actual one starts.
+    size_t headerSize = 0;
+    if (mOutputFormat == OUTPUT_PES) {
+        uint8_t header[kPesHeaderSize];
+        headerSize = makePESHeader(header, sizeof(header), frameLength, pts);
+        memcpy(accessUnit->base() + kPesHeaderSize - headerSize, header, headerSize);
+    }
+
+    accessUnit->setRange(kPesHeaderSize - headerSize, headerSize + frameLength);
+}
+
+size_t ElementaryStreamQueue::writeNalPrefix(uint8_t* data, size_t nalSize) const
+{
+    if (mOutputFormat == OUTPUT_LENGTH_PREFIXED) {
+        data[0] = nalSize >> 24;
+        data[1] = nalSize >> 16;
+        data[2] = nalSize >> 8;
+        data[3] = nalSize;
+    } else {
+        memcpy(data, "\x00\x00\x00\x01", 4);
+    }
+
+    return 4;
+}
+
+void ElementaryStreamQueue::setOutputFormat(OutputFormat format)
+{
+    switch (format) {
+    case OUTPUT_LENGTH_PREFIXED:
+        if (mMode != H264 && mMode != H265) {
+            format = OUTPUT_RAW;
+        }
+        break;
+
+    case OUTPUT_LATM:
+        if (mMode != AAC) {
+            format = OUTPUT_RAW;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    mOutputFormat = format;
+}
+
 }
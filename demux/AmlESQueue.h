@@ -8,7 +8,9 @@
  */
 
 #include <utils/AmlMpRefBase.h>
-#include <list>
+#include <utils/AmlMpBufferPool.h>
+#include <map>
+#include <sys/uio.h>
 
 namespace aml_mp {
 struct AmlMpBuffer;
@@ -30,25 +32,163 @@ struct ElementaryStreamQueue : public AmlMpRefBase
         METADATA,
     };
 
+    enum OutputFormat {
+        OUTPUT_PES,                 // one PES packet per access unit
+        OUTPUT_RAW,                 // Annex-B video, ADTS AAC, audio sync frames, LPCM samples
+        OUTPUT_LENGTH_PREFIXED,     // H.264/H.265 NAL units with 4 byte sizes, as in avcC/hvcC samples
+        OUTPUT_LATM,                // AAC in LOAS/LATM AudioMuxElements
+    };
+
+    // what the PES header carried besides the payload
+    struct PesInfo {
+        int64_t pts = -1;
+        int64_t dts = -1;           // -1 if the PES has no DTS
+        uint8_t streamId = 0;       // 0 if unknown, 0xE0 is used then
+        bool dataAlignment = false;
+        int32_t payloadOffset = 0;
+    };
+
+    // parsed from the LPCM headers
+    struct PcmFormat {
+        int sampleRate = 0;
+        int channels = 0;
+        int bitsPerSample = 0;
+    };
+
+    // flags of the H.264/H.265 access units, in their int32Data()
+    enum AccessUnitFlag {
+        AU_FLAG_KEY_FRAME       = 1 << 0,   // IDR, or IRAP picture for H.265
+        AU_FLAG_RECOVERY_POINT  = 1 << 1,   // recovery point SEI, decoding can start here too
+        AU_FLAG_CONFIG_CHANGED  = 1 << 2,   // carries a parameter set not seen before
+    };
+
+    // what the cached parameter sets of an H.264/H.265 stream say
+    struct VideoConfig {
+        int width = 0;
+        int height = 0;
+        int profile = 0;                // profile_idc
+        int level = 0;                  // level_idc
+        uint32_t generation = 0;        // incremented when a parameter set changes
+        sptr<AmlMpBuffer> configData;   // the VPS, SPS and PPS NAL units in Annex-B
+    };
+
     explicit ElementaryStreamQueue(Mode mode);
     int appendData(const void* data, size_t size, int64_t pts, int32_t payloadOffset);
+    // appends one PES payload scattered over several buffers
+    int appendData(const struct iovec* iov, int iovcnt, int64_t pts, int32_t payloadOffset);
+    int appendData(const struct iovec* iov, int iovcnt, const PesInfo& info);
+    // formats not applying to the mode fall back to OUTPUT_RAW
+    void setOutputFormat(OutputFormat format);
     void clear();
     sptr<AmlMpBuffer> dequeueAccessUnit();
 
+    // bytes queued and not dequeued yet
+    size_t size() const;
+
+    // bytes moved inside the queue by compaction and growth so far
+    uint64_t bytesMoved() const {
+        return mBytesMoved;
+    }
+
+    // the format of the last LPCM access unit, false if there was none
+    bool getPcmFormat(PcmFormat* format) const {
+        *format = mPcmFormat;
+        return mPcmFormat.sampleRate != 0;
+    }
+
+    // false until an SPS has been parsed
+    bool getVideoConfig(VideoConfig* config) const;
+
+    // the access units come from the queue's pool, and go back to it
+    // when released
+    void getPoolStats(AmlMpBufferPool::Stats* stats) const {
+        mPool->getStats(stats);
+    }
+
 private:
     struct RangeInfo {
         int64_t mPts;
+        int64_t mDts;
         size_t mLength;
         int32_t mPesOffset;
+        uint8_t mStreamId;
+        bool mDataAlignment;
+    };
+
+    // The PES ranges of the queued data, oldest first. Appending and
+    // consuming don't allocate; when it's full, appendData() merges the
+    // new range into the last one and that PES's timestamp is lost, or
+    // drops the oldest PES for PCM_AUDIO and METADATA.
+    class RangeInfoRing {
+    public:
+        static const size_t kCapacity = 256;
+
+        bool empty() const {
+            return mCount == 0;
+        }
+
+        bool full() const {
+            return mCount == kCapacity;
+        }
+
+        size_t count() const {
+            return mCount;
+        }
+
+        RangeInfo& front() {
+            return mEntries[mHead];
+        }
+
+        RangeInfo& back() {
+            return mEntries[(mHead + mCount - 1) % kCapacity];
+        }
+
+        RangeInfo& at(size_t index) {
+            return mEntries[(mHead + index) % kCapacity];
+        }
+
+        void push_back(const RangeInfo& info) {
+            mEntries[(mHead + mCount) % kCapacity] = info;
+            ++mCount;
+        }
+
+        // drops the oldest count ranges
+        void pop_front(size_t count) {
+            mHead = (mHead + count) % kCapacity;
+            mCount -= count;
+        }
+
+        void clear() {
+            mHead = 0;
+            mCount = 0;
+        }
+
+    private:
+        RangeInfo mEntries[kCapacity];
+        size_t mHead = 0;
+        size_t mCount = 0;
     };
 
     Mode mMode;
+    // mBuffer's range is the unread data: dequeuing an access unit only
+    // moves the range offset, the data is moved when appending runs out of
+    // room at the end of the buffer.
     sptr<AmlMpBuffer> mBuffer;
-    std::list<RangeInfo> mRangeInfos;
+    RangeInfoRing mRangeInfos;
+    // the range the last access unit passed to fetchTimestamp() started in
+    RangeInfo mAUInfo;
+    OutputFormat mOutputFormat = OUTPUT_PES;
+    PcmFormat mPcmFormat;
+
+    // the latest VPS, SPS and PPS, by NAL unit type and PPS id
+    std::map<uint32_t, sptr<AmlMpBuffer>> mParameterSets;
+    VideoConfig mVideoConfig;
 
     sptr<AmlMpBuffer> mFormat;
+    sptr<AmlMpBufferPool> mPool;
 
     int mAUIndex = 0;
+    uint64_t mBytesMoved = 0;
 
     sptr<AmlMpBuffer> dequeueAccessUnitH264();
     sptr<AmlMpBuffer> dequeueAccessUnitH265();
@@ -61,8 +201,14 @@ private:
     sptr<AmlMpBuffer> dequeueAccessUnitPCMAudio();
     sptr<AmlMpBuffer> dequeueAccessUnitMetadata();
 
+    void reserve(size_t size);
+    void consume(size_t size);
+    ssize_t findSyncOffset(const uint8_t* ptr, size_t size) const;
     int64_t fetchTimestamp(size_t size, int32_t *pesOffset = NULL);
     size_t makePESHeader(uint8_t* data, size_t size, size_t frameLength, int64_t pts);
+    void finishAccessUnit(const sptr<AmlMpBuffer>& accessUnit, size_t frameLength, int64_t pts);
+    size_t writeNalPrefix(uint8_t* data, size_t nalSize) const;
+    int32_t inspectNalUnit(const uint8_t* nal, size_t nalSize);
 
 private:
     ElementaryStreamQueue(const ElementaryStreamQueue&) = delete;
@@ -12,13 +12,21 @@
 #include <utils/AmlMpLog.h>
 #include <Aml_MP/Aml_MP.h>
 #include "AmlHwDemux.h"
+#include "AmlDvrInjector.h"
+#include "AmlDmxDevice.h"
 #include <utils/AmlMpHandle.h>
 #include <utils/AmlMpBuffer.h>
-#include <utils/AmlMpEventLooper.h>
+#include <utils/AmlMpBufferPool.h>
 #include <utils/AmlMpUtils.h>
+#include <utils/AmlMpThread.h>
+#include <utils/AmlMpConfig.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <sstream>
+#include <deque>
+#include <condition_variable>
+#include <chrono>
+#include <inttypes.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
@@ -33,6 +41,13 @@ static const char* mName = LOG_TAG;
 
 namespace aml_mp {
 static const int kPesFilterBufferSize = 2 * 1024 * 1024;
+static const int kSectionFilterBufferSize = 4096;
+static const int kPesReadSize = 256 * 1024;
+// a readable fd is drained by up to this many reads before the next fd of the epoll round
+static const int kMaxReadsPerEvent = 16;
+// reads of a filter queued to its worker, above this its fd stops being polled
+static const int kMaxPendingReads = 8;
+static const int kMaxCallbackWorkers = 4;
 
 class HwTsParser : public AmlDemuxBase::ITsParser, public LooperCallback
 {
@@ -42,20 +57,48 @@ public:
     int dvr_open(int demuxId, bool isHardwareSource, bool isSecureBuffer);
     int feedTs(const uint8_t* buffer, size_t size);
     int dvr_close();
+    void flushInjection();
+    int setFeedParams(const Aml_MP_DemuxFeedParams* params);
+    int getInjectStatistics(Aml_MP_DemuxInjectStatistics* stats);
+    std::shared_ptr<AmlDvrInjector> injector();
     void reset();
     int addDemuxFilter(int pid, const Aml_MP_DemuxFilterParams* params) override;
     void removeDemuxFilter(int pid) override;
 
+    // PES filters are called back on the workers, PSI always on the poll thread
+    int startCallbackWorkers(const sptr<Looper>& looper, int count);
+    void stopCallbackWorkers(bool resume = true);
+    // drops the deliveries still queued to the workers, a paused filter is polled again
+    void flushCallbackWorkers();
+    void prepareFilter(AmlHwDemux::FilterParams* filter);
+    void releaseFilter(AmlHwDemux::FilterParams* filter);
+
 private:
+    struct Delivery;
+    struct CallbackWorker;
+
     virtual int handleEvent(int fd, int events, void* data);
+    void onRead(AmlHwDemux::FilterParams* filter);
+    void finishDelivery(Delivery& delivery, bool notify, bool resume);
+    void pauseFilter(AmlHwDemux::FilterParams* filter);
+    void watchFilter(AmlHwDemux::FilterParams* filter, bool input);
 
     std::string mDemuxName;
+    AmlDmxDevice* mDevice;
     bool mIsSecurebuffer = false;
 
     std::mutex mLock;
     std::map<int, int> mChannelFds; //pid, fd
     int mDvrFd;
-    sptr<AmlMpBuffer> mCallbackBuffer;
+    // feedTs() queues on its own reference, dvr_close() doesn't wait for the feeder
+    std::shared_ptr<AmlDvrInjector> mInjector;
+    bool mHasFeedParams = false;
+    Aml_MP_DemuxFeedParams mFeedParams;
+
+    sptr<Looper> mLooper;
+    // mWorkersLock is only for flushCallbackWorkers(), the rest runs on the control thread
+    std::mutex mWorkersLock;
+    std::vector<sptr<CallbackWorker>> mWorkers;
 
 private:
     HwTsParser(const HwTsParser&) = delete;
@@ -123,6 +166,8 @@ int AmlHwDemux::start()
         }
     }
 
+    mTsParser->startCallbackWorkers(mLooper, AmlMpConfig::instance().mHwDemuxCallbackWorkers);
+
     mThread = std::thread([this] {
         threadLoop();
     });
@@ -148,6 +193,7 @@ int AmlHwDemux::stop()
         mThread.join();
     }
 
+    mTsParser->stopCallbackWorkers();
     mTsParser->dvr_close();
 
     MLOGI("stopped!");
@@ -158,26 +204,76 @@ int AmlHwDemux::flush()
 {
     MLOG();
 
+    // not under mLock, flushing releases a feeder blocked in the injector
+    sptr<HwTsParser> tsParser;
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        tsParser = mTsParser;
+    }
+    if (tsParser != nullptr) {
+        tsParser->flushInjection();
+        tsParser->flushCallbackWorkers();
+    }
+    mPidCounter.flush();
+
     return 0;
 }
 
 int AmlHwDemux::feedTs(const uint8_t* buffer, size_t size)
+{
+    // the injector may block, flush() and stop() mustn't wait for it
+    sptr<HwTsParser> tsParser;
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        if (mStopped || mTsParser == nullptr) {
+            return 0;
+        }
+        tsParser = mTsParser;
+    }
+
+    int ret = tsParser->feedTs(buffer, size);
+    if (ret > 0 && !mIsSecureBuffer) {
+        mPidCounter.update(buffer, ret);
+    }
+
+    return ret;
+}
+
+int AmlHwDemux::setFeedParams(const Aml_MP_DemuxFeedParams* params)
 {
     std::lock_guard<std::mutex> _l(mLock);
-    if (mStopped) {
-        return 0;
+    if (mTsParser == nullptr) {
+        return -1;
     }
-    return mTsParser->feedTs(buffer, size);
+
+    MLOGI("policy:%d, doneCb:%p", params->policy, params->doneCb);
+    return mTsParser->setFeedParams(params);
+}
+
+int AmlHwDemux::getInjectStatistics(Aml_MP_DemuxInjectStatistics* stats)
+{
+    std::lock_guard<std::mutex> _l(mLock);
+    if (mTsParser == nullptr) {
+        return -1;
+    }
+
+    return mTsParser->getInjectStatistics(stats);
+}
+
+int AmlHwDemux::getPidStatistics(int pid, Aml_MP_DemuxPidStat* stat)
+{
+    return mPidCounter.getStatistics(pid, stat);
 }
 
 int AmlHwDemux::addDemuxFilter(int pid, const Aml_MP_DemuxFilterParams* params)
 {
     int channelFd = mTsParser->addDemuxFilter(pid, params);
 
-    std::unique_ptr<FilterParams> filterParams(new FilterParams);
+    std::shared_ptr<FilterParams> filterParams = std::make_shared<FilterParams>();
     filterParams->pid = pid;
     filterParams->fd = channelFd;
     filterParams->params = *params;
+    mTsParser->prepareFilter(filterParams.get());
 
     int ret = mLooper->addFd(
             channelFd,
@@ -188,6 +284,7 @@ int AmlHwDemux::addDemuxFilter(int pid, const Aml_MP_DemuxFilterParams* params)
 
     if (ret <= 0) {
         MLOGE("addFd failed! fd:%d", channelFd);
+        mTsParser->releaseFilter(filterParams.get());
     } else {
         mFilterParams.emplace(pid, std::move(filterParams));
     }
@@ -202,9 +299,12 @@ int AmlHwDemux::removeDemuxFilter(int pid)
         MLOGE("removeFd failed! invalid pid:%d", pid);
         return -1;
     }
-    std::unique_ptr<FilterParams> filterParams = std::move(it->second);
+    std::shared_ptr<FilterParams> filterParams = std::move(it->second);
     mFilterParams.erase(it);
 
+    // reads still queued to a worker hold filterParams, but aren't called back
+    mTsParser->releaseFilter(filterParams.get());
+
     int channelFd = filterParams->fd;
     int ret = mLooper->removeFd(channelFd);
     if (ret <= 0) {
@@ -249,10 +349,92 @@ void AmlHwDemux::threadLoop()
     MLOGI("AmlHwDemux threadLoop exited!");
 }
 
+///////////////////////////////////////////////////////////////////////////////
+struct HwTsParser::Delivery {
+    std::shared_ptr<AmlHwDemux::FilterParams> filter;
+    sptr<AmlMpBuffer> data;
+    int version;
+};
+
+struct HwTsParser::CallbackWorker : public AmlMpThread {
+    explicit CallbackWorker(HwTsParser* parser)
+    : mParser(parser)
+    {
+    }
+
+    // only called on the poll thread
+    void queue(Delivery&& delivery);
+    // drops what is still queued, a delivery the thread is calling back completes
+    void flush(bool resume);
+    virtual void requestExit() override;
+
+    int filters = 0;
+
+private:
+    virtual bool threadLoop() override;
+
+    HwTsParser* mParser;    // stops the workers before it goes away
+
+    std::mutex mLock;
+    std::condition_variable mCond;
+    std::deque<Delivery> mQueue;
+};
+
+void HwTsParser::CallbackWorker::queue(Delivery&& delivery)
+{
+    std::lock_guard<std::mutex> _l(mLock);
+    mQueue.push_back(std::move(delivery));
+    mCond.notify_one();
+}
+
+void HwTsParser::CallbackWorker::flush(bool resume)
+{
+    std::deque<Delivery> queue;
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        queue.swap(mQueue);
+    }
+
+    for (Delivery& delivery : queue) {
+        mParser->finishDelivery(delivery, false, resume);
+    }
+}
+
+void HwTsParser::CallbackWorker::requestExit()
+{
+    AmlMpThread::requestExit();
+
+    std::lock_guard<std::mutex> _l(mLock);
+    mCond.notify_all();
+}
+
+bool HwTsParser::CallbackWorker::threadLoop()
+{
+    Delivery delivery;
+
+    {
+        std::unique_lock<std::mutex> l(mLock);
+        if (mQueue.empty()) {
+            if (!exitPending()) {
+                mCond.wait_for(l, std::chrono::milliseconds(100));
+            }
+            return true;
+        }
+
+        delivery = std::move(mQueue.front());
+        mQueue.pop_front();
+    }
+
+    mParser->finishDelivery(delivery, true, true);
+
+    return true;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 HwTsParser::HwTsParser(const std::function<FilterCallback>& cb, const std::string& name)
 : ITsParser(cb)
 , mDemuxName(name)
+, mDevice(AmlDmxDevice::instance())
 {
     MLOG();
     mDvrFd = -1;
@@ -261,6 +443,106 @@ HwTsParser::HwTsParser(const std::function<FilterCallback>& cb, const std::strin
 HwTsParser::~HwTsParser()
 {
     MLOG();
+
+    stopCallbackWorkers(false);
+}
+
+int HwTsParser::startCallbackWorkers(const sptr<Looper>& looper, int count)
+{
+    mLooper = looper;
+
+    if (count <= 0 || !mWorkers.empty()) {
+        return 0;
+    }
+
+    if (count > kMaxCallbackWorkers) {
+        count = kMaxCallbackWorkers;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        sptr<CallbackWorker> worker = new CallbackWorker(this);
+        std::string name = "hwDemuxCb" + std::to_string(i);
+        if (worker->run(name.c_str()) != 0) {
+            MLOGE("start callback worker %d failed!", i);
+            stopCallbackWorkers();
+            return -1;
+        }
+        std::lock_guard<std::mutex> _l(mWorkersLock);
+        mWorkers.push_back(worker);
+    }
+
+    MLOGI("started %d callback workers", count);
+
+    return 0;
+}
+
+void HwTsParser::stopCallbackWorkers(bool resume)
+{
+    for (auto& worker : mWorkers) {
+        worker->requestExit();
+        worker->requestExitAndWait();
+    }
+
+    // paused filters get their fds polled again
+    for (auto& worker : mWorkers) {
+        worker->flush(resume);
+    }
+
+    std::lock_guard<std::mutex> _l(mWorkersLock);
+    mWorkers.clear();
+}
+
+void HwTsParser::flushCallbackWorkers()
+{
+    std::vector<sptr<CallbackWorker>> workers;
+    {
+        std::lock_guard<std::mutex> _l(mWorkersLock);
+        workers = mWorkers;
+    }
+
+    // the workers keep running, finishDelivery() drops pendingReads and
+    // resumes the paused filters as for a delivery called back
+    for (auto& worker : workers) {
+        worker->flush(true);
+    }
+}
+
+void HwTsParser::prepareFilter(AmlHwDemux::FilterParams* filter)
+{
+    bool isSection = filter->params.type == AML_MP_DEMUX_FILTER_PSI;
+    filter->readSize = isSection ? kSectionFilterBufferSize : kPesReadSize;
+
+    char name[32];
+    snprintf(name, sizeof(name), "HwDemux_%d", filter->pid);
+    filter->bufferPool = new AmlMpBufferPool(name, (kMaxPendingReads + 2) * filter->readSize);
+
+    filter->worker = -1;
+    if (isSection || mWorkers.empty()) {
+        return;
+    }
+
+    // sections stay on the poll thread, a slow ES consumer can't hold up ECMs or tables
+    size_t index = 0;
+    for (size_t i = 1; i < mWorkers.size(); ++i) {
+        if (mWorkers[i]->filters < mWorkers[index]->filters) {
+            index = i;
+        }
+    }
+
+    filter->worker = index;
+    ++mWorkers[index]->filters;
+}
+
+void HwTsParser::releaseFilter(AmlHwDemux::FilterParams* filter)
+{
+    {
+        std::lock_guard<std::mutex> _l(filter->lock);
+        filter->removed = true;
+    }
+
+    if (filter->worker >= 0 && filter->worker < (int)mWorkers.size()) {
+        --mWorkers[filter->worker]->filters;
+    }
 }
 
 
@@ -268,7 +550,7 @@ int HwTsParser::dvr_open(int demuxId, bool isHardwareSource, bool isSecurebuffer
     int ret = 0;
     char name[32];
     snprintf(name, sizeof(name), "/dev/dvb0.dvr%d", demuxId);
-    mDvrFd = open(name, O_WRONLY);
+    mDvrFd = mDevice->open(name, O_WRONLY | O_NONBLOCK);
     if (mDvrFd == -1) {
         MLOGE("cannot open \"%s\" (%s)", name, strerror(errno));
         return -1;
@@ -280,14 +562,14 @@ int HwTsParser::dvr_open(int demuxId, bool isHardwareSource, bool isSecurebuffer
         if (!isHardwareSource) {
             if (isSecurebuffer) {
                 MLOGI("set ---> INPUT_LOCAL_SEC \n");
-                ret = ioctl(mDvrFd, DMX_SET_INPUT, INPUT_LOCAL_SEC);
+                ret = mDevice->ioctl(mDvrFd, DMX_SET_INPUT, (void*)(long)INPUT_LOCAL_SEC);
             } else {
                 MLOGI("set ---> INPUT_LOCAL \n");
-                ret = ioctl(mDvrFd, DMX_SET_INPUT, INPUT_LOCAL);
+                ret = mDevice->ioctl(mDvrFd, DMX_SET_INPUT, (void*)(long)INPUT_LOCAL);
             }
         } else {
             MLOGI("set ---> INPUT_DEMOD \n" );
-            ret = ioctl(mDvrFd, DMX_SET_INPUT, INPUT_DEMOD);
+            ret = mDevice->ioctl(mDvrFd, DMX_SET_INPUT, (void*)(long)INPUT_DEMOD);
         }
         MLOGI("DMX_SET_INPUT ret:%d\n", ret);
         if (ret < 0) {
@@ -296,58 +578,91 @@ int HwTsParser::dvr_open(int demuxId, bool isHardwareSource, bool isSecurebuffer
         }
     }
 
+    std::shared_ptr<AmlDvrInjector> injector = std::make_shared<AmlDvrInjector>(mDvrFd, isSecurebuffer);
+    if (mHasFeedParams) {
+        injector->setFeedParams(&mFeedParams);
+    }
+    injector->start();
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        mInjector = injector;
+    }
+
     return 0;
 }
 
 int HwTsParser::dvr_close() {
+    std::shared_ptr<AmlDvrInjector> injector;
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        injector.swap(mInjector);
+    }
+
+    // wakes a blocked feeder, which still holds the injector
+    if (injector) {
+        injector->stop();
+    }
+
     if (mDvrFd > 0) {
-        close(mDvrFd);
+        mDevice->close(mDvrFd);
     }
+    mDvrFd = -1;
     return 0;
 }
 
-int HwTsParser::feedTs(const uint8_t* buffer, size_t size)
+std::shared_ptr<AmlDvrInjector> HwTsParser::injector()
 {
-    int ret;
-    int left = size;
-    int off = 0;
+    std::lock_guard<std::mutex> _l(mLock);
+    return mInjector;
+}
 
-    if (mDvrFd < 0) {
+int HwTsParser::feedTs(const uint8_t* buffer, size_t size)
+{
+    std::shared_ptr<AmlDvrInjector> injector = this->injector();
+    if (injector == nullptr) {
         return -1;
     }
-    uint8_t* buffer_secure = NULL;
-    struct dmx_sec_ts_data ts_sec_data;
-    if (mIsSecurebuffer) {
-        ts_sec_data.buf_start = (uint32_t)(long)buffer;
-        ts_sec_data.buf_end = (uint32_t)(long)(buffer+size);
-        buffer_secure = (uint8_t *)(&ts_sec_data);
-        left = sizeof(struct dmx_sec_ts_data);
-    }
-    while (left > 0) {
-        if (mIsSecurebuffer) {
-            ret = write(mDvrFd, buffer_secure, left);
-            // MLOGI("Write DVR data: buffer_secure:%p, left:%d, ret:%d", buffer_secure, left, ret);
-        } else {
-            ret = write(mDvrFd, buffer + off, left);
-        }
-        if (ret == -1) {
-            if (errno != EINTR) {
-                MLOGE("Write DVR data failed: %s", strerror(errno));
-                break;
-            }
-            ret = 0;
-        }
-        left -= ret;
-        off += ret;
+
+    return injector->queue(buffer, size);
+}
+
+void HwTsParser::flushInjection()
+{
+    std::shared_ptr<AmlDvrInjector> injector = this->injector();
+    if (injector) {
+        injector->flush();
+    }
+}
+
+int HwTsParser::setFeedParams(const Aml_MP_DemuxFeedParams* params)
+{
+    mFeedParams = *params;
+    mHasFeedParams = true;
+
+    std::shared_ptr<AmlDvrInjector> injector = this->injector();
+    if (injector) {
+        return injector->setFeedParams(params);
     }
-    return (size - left);
+
+    return 0;
+}
+
+int HwTsParser::getInjectStatistics(Aml_MP_DemuxInjectStatistics* stats)
+{
+    std::shared_ptr<AmlDvrInjector> injector = this->injector();
+    if (injector == nullptr) {
+        return -1;
+    }
+
+    injector->getStatistics(stats);
+    return 0;
 }
 
 int HwTsParser::addDemuxFilter(int pid, const Aml_MP_DemuxFilterParams* params)
 {
     int fd = -1;
     int ret = 0;
-    fd = ::open(mDemuxName.c_str(), O_RDWR);
+    fd = mDevice->open(mDemuxName.c_str(), O_RDWR | O_NONBLOCK);
     if (fd < 0) {
         MLOG("open %s failed! %s", mDemuxName.c_str(), strerror(errno));
         return -1;
@@ -355,58 +670,63 @@ int HwTsParser::addDemuxFilter(int pid, const Aml_MP_DemuxFilterParams* params)
 
     if (params->type == AML_MP_DEMUX_FILTER_PSI) {
         int buffersize = 32 * 1024;
-        ret = ioctl(fd, DMX_SET_BUFFER_SIZE, buffersize);
+        ret = mDevice->ioctl(fd, DMX_SET_BUFFER_SIZE, (void*)(long)buffersize);
         if (ret < 0) {
             MLOG("set buffer size failed!");
-            ::close(fd);
+            mDevice->close(fd);
             return -1;
         }
 
         struct dmx_sct_filter_params filter_param;
         memset(&filter_param, 0, sizeof(filter_param));
         filter_param.pid = pid;
-        filter_param.flags = params->flags;
+        filter_param.flags = params->flags & ~AML_MP_DEMUX_PRIVATE_FLAGS_MASK;
+        memcpy(filter_param.filter.filter, params->filter, sizeof(filter_param.filter.filter));
+        memcpy(filter_param.filter.mask, params->mask, sizeof(filter_param.filter.mask));
+        memcpy(filter_param.filter.mode, params->mode, sizeof(filter_param.filter.mode));
 
-        ret = ioctl(fd, DMX_SET_FILTER, &filter_param);
+        ret = mDevice->ioctl(fd, DMX_SET_FILTER, &filter_param);
         if (ret < 0) {
             MLOG("set filter failed!");
-            ::close(fd);
+            mDevice->close(fd);
             return -1;
         }
     } else {
         int buffersize = kPesFilterBufferSize;
-        ret = ioctl(fd, DMX_SET_BUFFER_SIZE, buffersize);
+        ret = mDevice->ioctl(fd, DMX_SET_BUFFER_SIZE, (void*)(long)buffersize);
         if (ret < 0) {
             MLOG("set pes buffer size failed!");
-            ::close(fd);
+            mDevice->close(fd);
             return -1;
         }
 
         struct dmx_pes_filter_params filter_param;
         memset(&filter_param, 0, sizeof(filter_param));
         filter_param.pid = pid;
-        filter_param.flags = params->flags;
+        filter_param.flags = params->flags & ~AML_MP_DEMUX_PRIVATE_FLAGS_MASK;
         filter_param.input = DMX_IN_FRONTEND;
         filter_param.output = DMX_OUT_TAP;
         if (params->type == AML_MP_DEMUX_FILTER_AUDIO) {
             filter_param.pes_type = DMX_PES_AUDIO;
         } else if (params->type == AML_MP_DEMUX_FILTER_VIDEO) {
             filter_param.pes_type = DMX_PES_VIDEO0;
+        } else {
+            filter_param.pes_type = DMX_PES_OTHER;
         }
 
         MLOGI("create pes filter, pid:%d, type:%d, fd:%d, flags:%#x", pid, params->type, fd, params->flags);
-        ret = ioctl(fd, DMX_SET_PES_FILTER, &filter_param);
+        ret = mDevice->ioctl(fd, DMX_SET_PES_FILTER, &filter_param);
         if (ret < 0) {
             MLOG("set pes filter failed! %d", ret);
-            ::close(fd);
+            mDevice->close(fd);
             return -1;
         }
     }
 
-    ret = ioctl(fd, DMX_START);
+    ret = mDevice->ioctl(fd, DMX_START);
     if (ret < 0) {
         MLOG("dmx start failed!");
-        ::close(fd);
+        mDevice->close(fd);
         return -1;
     }
 
@@ -442,13 +762,13 @@ void HwTsParser::removeDemuxFilter(int pid)
         return;
     }
 
-    int ret = ioctl(fd, DMX_STOP);
+    int ret = mDevice->ioctl(fd, DMX_STOP);
     if (ret < 0) {
         MLOG("dmx stop failed!");
         return;
     }
 
-    ::close(fd);
+    mDevice->close(fd);
 }
 
 void HwTsParser::reset()
@@ -458,34 +778,114 @@ void HwTsParser::reset()
 
 int HwTsParser::handleEvent(int fd, int events, void* data)
 {
-    sptr<AmlMpBuffer>& buffer = mCallbackBuffer;
-    if (mCallbackBuffer == nullptr) {
-        mCallbackBuffer = new AmlMpBuffer(kPesFilterBufferSize);
-    }
+    AML_MP_UNUSED(events);
+    AmlHwDemux::FilterParams* filter = (AmlHwDemux::FilterParams*)data;
+
+    // the fd is level triggered, what is left after kMaxReadsPerEvent is read
+    // in the next round, after the other ready fds
+    for (int i = 0; i < kMaxReadsPerEvent; ++i) {
+        if (filter->worker >= 0 && filter->pendingReads.load() >= kMaxPendingReads) {
+            pauseFilter(filter);
+            break;
+        }
 
-    if (events & Looper::EVENT_INPUT) {
-        int len = ::read(fd, buffer->base(), buffer->capacity());
+        sptr<AmlMpBuffer>& buffer = filter->readBuffer;
+        if (buffer == nullptr) {
+            buffer = filter->bufferPool->acquire(filter->readSize);
+            if (buffer == nullptr) {
+                break;
+            }
+        }
+
+        int len = mDevice->read(fd, buffer->base(), buffer->capacity());
         if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EOVERFLOW) {
+                MLOGW("pid:%d demux buffer overflowed, data lost", filter->pid);
+                continue;
+            }
+
             MLOGE("read failed, %s", strerror(errno));
             return 0;
+        } else if (len == 0) {
+            break;
         }
 
         buffer->setRange(0, len);
+        onRead(filter);
     }
 
+    return 1;
+}
+
+void HwTsParser::onRead(AmlHwDemux::FilterParams* filter)
+{
+    sptr<AmlMpBuffer>& buffer = filter->readBuffer;
     int version = -1;
 
-    AmlHwDemux::FilterParams* filterParams = (AmlHwDemux::FilterParams*)data;
-    if (filterParams->params.type == AML_MP_DEMUX_FILTER_PSI) {
+    if (filter->params.type == AML_MP_DEMUX_FILTER_PSI && buffer->size() > 5) {
         version = buffer->data()[5]>>1 & 0x1F;
     }
-    int pid = filterParams->pid;
-    MLOGV("fd:%d, pid:%d, size:%zu", fd, pid, buffer->size());
+
+    int pid = filter->pid;
+    MLOGV("fd:%d, pid:%d, size:%zu", filter->fd, pid, buffer->size());
+
+    if (filter->worker >= 0) {
+        filter->pendingReads.fetch_add(1);
+        mWorkers[filter->worker]->queue({filter->shared_from_this(), std::move(buffer), version});
+        return;
+    }
+
     if (mFilterCallback) {
         mFilterCallback(pid, buffer, version);
     }
 
-    return 1;
+    if (buffer->getStrongCount() > 1) {
+        // leased by a filter, read the next data into another buffer
+        buffer.clear();
+    }
+}
+
+void HwTsParser::finishDelivery(Delivery& delivery, bool notify, bool resume)
+{
+    AmlHwDemux::FilterParams* filter = delivery.filter.get();
+
+    if (notify && !filter->removed.load() && mFilterCallback) {
+        mFilterCallback(filter->pid, delivery.data, delivery.version);
+    }
+    delivery.data.clear();
+
+    filter->pendingReads.fetch_sub(1);
+
+    std::lock_guard<std::mutex> _l(filter->lock);
+    if (resume && filter->paused && !filter->removed) {
+        filter->paused = false;
+        watchFilter(filter, true);
+    }
+}
+
+void HwTsParser::pauseFilter(AmlHwDemux::FilterParams* filter)
+{
+    std::lock_guard<std::mutex> _l(filter->lock);
+    // checked again under the lock, or the worker could have finished and missed the pause
+    if (filter->removed || filter->paused || filter->pendingReads.load() < kMaxPendingReads) {
+        return;
+    }
+
+    MLOGV("pid:%d callbacks behind, stop polling", filter->pid);
+    filter->paused = true;
+    watchFilter(filter, false);
+}
+
+void HwTsParser::watchFilter(AmlHwDemux::FilterParams* filter, bool input)
+{
+    int events = Looper::EVENT_ERROR | (input ? Looper::EVENT_INPUT : 0);
+    if (mLooper->addFd(filter->fd, Looper::POLL_CALLBACK, events, this, filter) <= 0) {
+        MLOGE("update fd %d failed!", filter->fd);
+    }
 }
 
 }
@@ -11,10 +11,15 @@
 #define _AML_HW_DEMUX_H_
 
 #include "AmlDemuxBase.h"
+#include "AmlTsPidStatistics.h"
 #include <thread>
 #include <map>
 #include <set>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <utils/AmlMpLooper.h>
+#include <utils/AmlMpBufferPool.h>
 
 namespace aml_mp {
 class HwTsParser;
@@ -22,10 +27,22 @@ class HwTsParser;
 class AmlHwDemux : public AmlDemuxBase
 {
 public:
-    struct FilterParams {
+    struct FilterParams : public std::enable_shared_from_this<FilterParams> {
         int pid;
         int fd;
         Aml_MP_DemuxFilterParams params;
+
+        // sized for one section or one PES read, readBuffer is only used on the poll thread
+        sptr<AmlMpBufferPool> bufferPool;
+        sptr<AmlMpBuffer> readBuffer;
+        size_t readSize = 0;
+
+        int worker = -1;                    // callback worker, -1 calls back on the poll thread
+        std::atomic<int> pendingReads{0};   // queued to the worker, not called back yet
+        std::atomic<bool> removed{false};
+
+        std::mutex lock;                    // for paused and setting removed
+        bool paused = false;                // fd is off the looper until the worker catches up
     };
 
     AmlHwDemux();
@@ -36,6 +53,10 @@ public:
     int stop() override;
     int flush() override;
     virtual int feedTs(const uint8_t* buffer, size_t size) override;
+    virtual int setFeedParams(const Aml_MP_DemuxFeedParams* params) override;
+    virtual int getInjectStatistics(Aml_MP_DemuxInjectStatistics* stats) override;
+    // counts the TS fed to the dvr, a demod source isn't seen here
+    virtual int getPidStatistics(int pid, Aml_MP_DemuxPidStat* stat) override;
 
 private:
     void threadLoop();
@@ -53,7 +74,8 @@ private:
 
     std::atomic<bool> mStopped{};
 
-    std::map<int, std::unique_ptr<FilterParams>> mFilterParams;
+    std::map<int, std::shared_ptr<FilterParams>> mFilterParams;
+    AmlTsPidCounter mPidCounter;
 
 private:
     AmlHwDemux(const AmlHwDemux&) = delete;
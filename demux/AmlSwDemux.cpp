@@ -11,6 +11,7 @@
 #include <utils/AmlMpLog.h>
 #include "AmlSwDemux.h"
 #include "AmlESQueue.h"
+#include "AmlTsPidStatistics.h"
 #include <utils/AmlMpUtils.h>
 #include <map>
 #include <utils/AmlMpEventLooper.h>
@@ -18,6 +19,14 @@
 #include <utils/AmlMpMessage.h>
 #include <utils/AmlMpEventHandlerReflector.h>
 #include <utils/AmlMpBitReader.h>
+#include <utils/AmlMpTsScanner.h>
+#include <utils/AmlMpCrc32.h>
+#include <utils/AmlMpSectionCache.h>
+#include <utils/AmlMpSpscQueue.h>
+#include <utils/AmlMpThread.h>
+#include <utils/AmlMpConfig.h>
+#include <chrono>
+#include <future>
 #include <inttypes.h>
 #include <Aml_MP/Aml_MP.h>
 #include <fcntl.h>
@@ -32,6 +41,9 @@ namespace aml_mp {
     do { unsigned tmp = y; (void)tmp; MLOGV(x, tmp); } while (0)
 
 const size_t kTSPacketSize = 188;
+// max pending buffers parsed per kWhatDrainQueue, so filter and flush
+// messages are not delayed behind a long queue.
+static const int kMaxDrainBatch = 8;
 
 class SwTsParser: public AmlDemuxBase::ITsParser
 {
@@ -69,31 +81,54 @@ public:
     void reset() override;
     int addDemuxFilter(int pid, const Aml_MP_DemuxFilterParams* params) override;
     void removeDemuxFilter(int pid) override;
+    // the buffers passed to feedTs() are about to be reused
+    void releaseInput();
+    int getStreamStatistics(int pid, Aml_MP_DemuxStreamStatistics* stats) const;
+    int getVideoConfig(int pid, Aml_MP_DemuxVideoConfig* config) const;
+    // adds the counters of pid to stat, safe to call from any thread
+    void accumulatePidStatistics(int pid, Aml_MP_DemuxPidStat* stat, int64_t nowUs) const;
 
 private:
     struct PSISection;
     struct Program;
     struct Stream;
 
-    void parseAdaptationField(AmlMpBitReader *br, unsigned PID);
-    int parseTS(AmlMpBitReader *br);
+    enum PidKind : uint8_t {
+        PID_KIND_NONE,
+        PID_KIND_SECTION,
+        PID_KIND_PES,
+        PID_KIND_PCR,
+    };
+
+    // mPSISections and mStreams own the handlers, this is only for dispatch
+    struct PidEntry {
+        PidKind kind = PID_KIND_NONE;
+        AmlMpRefBase* handler = nullptr;
+        // written by the parser thread only, read by accumulatePidStatistics() from any thread
+        AmlTsPidStatistics stats;
+    };
+
+    void updatePidEntry(unsigned pid);
+    void parseAdaptationField(const AmlMpTsAdaptationField& adaptationField, unsigned PID);
+    int parseTS(const uint8_t* packet);
     void parseProgramAssociationTable(AmlMpBitReader *br);
-    int parsePID(AmlMpBitReader* br, unsigned PID, unsigned continuity_counter, unsigned payload_unit_start_indicator);
+    int parsePID(const uint8_t* payload, size_t size, unsigned PID, unsigned continuity_counter, unsigned payload_unit_start_indicator);
     int programMapPID() const {return mProgramMapPID;}
 
-    void initCrcTable();
-    uint32_t crc32(const uint8_t *p_start, size_t length);
-
     std::vector<sptr<Program> > mPrograms;
     int mPcrPid = 0x1FFF;
     size_t mNumTSPacketsParsed = 0;
 
-    uint32_t mCrcTable[256];
     std::map<unsigned, sptr<PSISection> > mPSISections;
     unsigned mProgramMapPID = 0x1FFF;
 
     std::map<unsigned, sptr<Stream>> mStreams;
 
+    static const unsigned kMaxPidCount = 0x2000;
+    PidEntry mPidTable[kMaxPidCount];
+    // sampled once per fed buffer, in releaseInput()
+    int64_t mNowUs = 0;
+
 private:
     SwTsParser(const SwTsParser&);
     SwTsParser& operator= (const SwTsParser&) = delete;
@@ -119,9 +154,25 @@ struct SwTsParser::PSISection : public AmlMpRefBase {
 
     bool parse(int PID, unsigned continuity_counter,
                    unsigned payload_unit_start_indicator,
-                   AmlMpBitReader *br);
+                   const uint8_t** payload, size_t* size);
     int parseSection(AmlMpBitReader* br);
 
+    // called when a channel is created on the pid
+    void setFilter(const Aml_MP_DemuxFilterParams* params);
+    bool hasFilter() const {return mFilterLength > 0;}
+    bool hasListener() const {return mHasListener;}
+    uint64_t filteredSections() const {return mFilteredSections;}
+    // true if the complete section is the same as the last one delivered
+    // since it passed the CRC check, so it needs no check again
+    bool isRepeated();
+    void onDelivered();
+    const AmlMpSectionCache& sectionCache() const {return mSectionCache;}
+    void clearSectionCache() {mSectionCache.clear();}
+    // 1 if the section passes the filter, 0 if not, -1 if more bytes are needed
+    int matchFilter() const;
+    // drops the section until the next payload_unit_start_indicator
+    void skip();
+
 protected:
     virtual ~PSISection();
 
@@ -136,6 +187,21 @@ private:
     std::map<int, int> mSectionVersions;
     bool mChanged = false;
 
+    // mode is split in the bits which must be equal and the bits of which one must differ
+    uint8_t mFilter[AML_MP_DEMUX_FILTER_SIZE]{};
+    uint8_t mPositiveMask[AML_MP_DEMUX_FILTER_SIZE]{};
+    uint8_t mNegativeMask[AML_MP_DEMUX_FILTER_SIZE]{};
+    size_t mFilterLength = 0;
+    bool mHasNegativeMask = false;
+    uint64_t mFilteredSections = 0;
+
+    // sections nobody asked for are only parsed internally, their repetitions
+    // are useless too. The filters of a channel drop the repetitions
+    // themselves, each one must get the current sections once.
+    bool mHasListener = false;
+    bool mDeliverOnChange = true;
+    AmlMpSectionCache mSectionCache;
+
     //DISALLOW_EVIL_CONSTRUCTORS(PSISection);
 	PSISection(const PSISection&) = delete;
 	PSISection& operator=(const PSISection&) = delete;
@@ -169,13 +235,22 @@ struct SwTsParser::Stream : public AmlMpRefBase
 {
 public:
     Stream(int pid, const Aml_MP_DemuxFilterParams* params);
-    int parse(unsigned continuity_counter, unsigned payload_unit_start_indicator, AmlMpBitReader* br);
+    int parse(unsigned continuity_counter, unsigned payload_unit_start_indicator, const uint8_t* payload, size_t size);
     sptr<AmlMpBuffer> dequeueFrame();
+    bool isPcrOnly() const { return mType == AML_MP_DEMUX_FILTER_PCR; }
+    void releaseInput();
+    void getStatistics(Aml_MP_DemuxStreamStatistics* stats) const;
+    int getVideoConfig(Aml_MP_DemuxVideoConfig* config) const;
+    // after a flush the next frames don't follow the previous ones
+    void waitForKeyFrame();
 
 private:
     int flush();
+    void clearPES();
+    void copySegments();
     int parsePES(AmlMpBitReader* br);
-    void onPayloadData(unsigned PTS_DTS_flags, uint64_t PTS, uint64_t DTS, const uint8_t* data, size_t size, int32_t payloadOffset);
+    void onPayloadData(unsigned stream_id, unsigned data_alignment_indicator,
+            unsigned PTS_DTS_flags, uint64_t PTS, uint64_t DTS, size_t size, int32_t payloadOffset);
 
     int mPid;
     Aml_MP_CodecID mCodecType;
@@ -183,16 +258,134 @@ private:
     uint32_t mFlags;
 
     int32_t mExpectedContinuityCounter = -1;
-    sptr<AmlMpBuffer> mBuffer;
     bool mPayloadStarted = false;
 
+    // The PES being reassembled is mBuffer followed by mSegments. mSegments
+    // points into the packets being fed, which are copied to mBuffer only
+    // when releaseInput() is called before the PES is complete.
+    sptr<AmlMpBuffer> mBuffer;
+    std::vector<struct iovec> mSegments;
+    size_t mPESSize = 0;
+    size_t mExpectedPESSize = 0;
+    std::vector<struct iovec> mPayloadIov;
+
+    uint64_t mBytesReferenced = 0;
+    uint64_t mBytesCopied = 0;
+
     sptr<ElementaryStreamQueue> mQueue;
     std::list<sptr<AmlMpBuffer>> mFrames;
 
+    // only H.264/H.265 frames are flagged, the others are all key frames
+    bool mHasKeyFrameFlags = false;
+    bool mKeyFrameFound = true;
+    uint32_t mFramesBeforeKeyFrame = 0;
+
     Stream(const Stream&) = delete;
     Stream& operator=(const Stream&) = delete;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+static const int kMaxParserWorkers = 8;
+static const size_t kWorkerQueueSize = 64;
+
+struct AmlSwDemux::WorkItem {
+    sptr<AmlMpBuffer> chunk;                // keeps packets valid until parsed
+    std::vector<const uint8_t*> packets;
+    std::function<void(SwTsParser*)> task;  // runs instead of parsing, if set
+};
+
+struct AmlSwDemux::ParserWorker : public AmlMpThread {
+    explicit ParserWorker(const sptr<SwTsParser>& parser)
+    : mParser(parser)
+    , mQueue(kWorkerQueueSize)
+    {
+    }
+
+    // only called on the swDemux looper
+    void queue(WorkItem&& item);
+    virtual void requestExit() override;
+
+private:
+    virtual bool threadLoop() override;
+    void wakeUp(const std::atomic<bool>& waiting);
+
+    sptr<SwTsParser> mParser;
+    AmlMpSpscQueue<WorkItem> mQueue;
+
+    // the queue itself is lock free, these are only to sleep on it
+    std::mutex mLock;
+    std::condition_variable mCond;
+    std::atomic<bool> mConsumerWaiting{false};
+    std::atomic<bool> mProducerWaiting{false};
+};
+
+void AmlSwDemux::ParserWorker::wakeUp(const std::atomic<bool>& waiting)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiting.load()) {
+        std::lock_guard<std::mutex> _l(mLock);
+        mCond.notify_all();
+    }
+}
+
+void AmlSwDemux::ParserWorker::queue(WorkItem&& item)
+{
+    while (!mQueue.tryPush(std::move(item))) {
+        std::unique_lock<std::mutex> l(mLock);
+        mProducerWaiting = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (mQueue.size() == mQueue.capacity()) {
+            mCond.wait_for(l, std::chrono::milliseconds(100));
+        }
+        mProducerWaiting = false;
+    }
+
+    wakeUp(mConsumerWaiting);
+}
+
+void AmlSwDemux::ParserWorker::requestExit()
+{
+    AmlMpThread::requestExit();
+
+    std::lock_guard<std::mutex> _l(mLock);
+    mCond.notify_all();
+}
+
+bool AmlSwDemux::ParserWorker::threadLoop()
+{
+    WorkItem item;
+
+    if (!mQueue.tryPop(&item)) {
+        std::unique_lock<std::mutex> l(mLock);
+        mConsumerWaiting = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (mQueue.empty() && !exitPending()) {
+            mCond.wait_for(l, std::chrono::milliseconds(100));
+        }
+        mConsumerWaiting = false;
+        return true;
+    }
+
+    wakeUp(mProducerWaiting);
+
+    if (item.task) {
+        item.task(mParser.get());
+        return true;
+    }
+
+    for (const uint8_t* packet : item.packets) {
+        int err = mParser->feedTs(packet, kTSPacketSize);
+        if (err != 0) {
+            MLOGE("%d feedTSPacket failed, err:%d", __LINE__, err);
+        }
+    }
+
+    // item.chunk is released with item
+    mParser->releaseInput();
+
+    return true;
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 AmlSwDemux::AmlSwDemux()
 : mRemainingBytesBuffer(new AmlMpBuffer(kTSPacketSize))
@@ -216,14 +409,67 @@ int AmlSwDemux::open(bool isHardwareSource, Aml_MP_DemuxId demuxId, bool isSecur
     }
 
     if (mTsParser == nullptr) {
-        mTsParser = new SwTsParser([this](int pid, const sptr<AmlMpBuffer>& data, int version) {
-            return notifyData(pid, data, version);
-        });
+        mTsParser = createTsParser();
+
+        std::lock_guard<std::mutex> _l(mLock);
+        mParsers.push_back(mTsParser);
     }
 
     return 0;
 }
 
+sptr<SwTsParser> AmlSwDemux::createTsParser()
+{
+    return new SwTsParser([this](int pid, const sptr<AmlMpBuffer>& data, int version) {
+        return notifyData(pid, data, version);
+    });
+}
+
+// feeds a SwTsParser synchronously, for createStandaloneParser()
+struct StandaloneTsParser : public AmlDemuxBase::ITsParser {
+    explicit StandaloneTsParser(const std::function<FilterCallback>& cb)
+    : ITsParser(cb)
+    , mParser(new SwTsParser(cb))
+    {
+    }
+
+    int feedTs(const uint8_t* buffer, size_t size) override {
+        size_t offset = 0;
+        while (offset + kTSPacketSize <= size) {
+            if (buffer[offset] != 0x47) {
+                offset += tsFindSyncLock(buffer + offset, size - offset);
+                continue;
+            }
+
+            mParser->feedTs(buffer + offset, kTSPacketSize);
+            offset += kTSPacketSize;
+        }
+        mParser->releaseInput();
+
+        return size;
+    }
+
+    void reset() override {
+        mParser->reset();
+    }
+
+    int addDemuxFilter(int pid, const Aml_MP_DemuxFilterParams* params) override {
+        return mParser->addDemuxFilter(pid, params);
+    }
+
+    void removeDemuxFilter(int pid) override {
+        mParser->removeDemuxFilter(pid);
+    }
+
+private:
+    sptr<SwTsParser> mParser;
+};
+
+sptr<AmlDemuxBase::ITsParser> AmlSwDemux::createStandaloneParser(const std::function<ITsParser::FilterCallback>& cb)
+{
+    return new StandaloneTsParser(cb);
+}
+
 int AmlSwDemux::close()
 {
     flush();
@@ -234,6 +480,8 @@ int AmlSwDemux::close()
         mLooper.clear();
     }
 
+    stopWorkers();
+
     if (mDumpFd >= 0) {
         MLOGI("close dumpfd %d", mDumpFd);
         ::close(mDumpFd);
@@ -260,6 +508,8 @@ int AmlSwDemux::start()
     }
 
     if (mLooper == nullptr) {
+        startWorkers(AmlMpConfig::instance().mSwDemuxWorkers);
+
         mLooper = new AmlMpEventLooper;
         mLooper->setName("swDemux");
         mLooper->registerHandler(mHandler);
@@ -270,20 +520,131 @@ int AmlSwDemux::start()
     return 0;
 }
 
-int AmlSwDemux::stop()
+int AmlSwDemux::startWorkers(int count)
 {
-    if (mStopped) {
+    if (count <= 1 || !mWorkers.empty() || mTsParser == nullptr) {
+        return 0;
+    }
+
+    if (count > kMaxParserWorkers) {
+        count = kMaxParserWorkers;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        sptr<SwTsParser> parser = i == 0 ? mTsParser : createTsParser();
+        sptr<ParserWorker> worker = new ParserWorker(parser);
+        std::string name = "swDemux" + std::to_string(i);
+        if (worker->run(name.c_str()) != 0) {
+            MLOGE("start parser worker %d failed!", i);
+            stopWorkers();
+            return -1;
+        }
+        mWorkers.push_back(worker);
+
+        if (i > 0) {
+            std::lock_guard<std::mutex> _l(mLock);
+            mParsers.push_back(parser);
+        }
+    }
+
+    mWorkerPackets.resize(count);
+    mWorkerStreams.assign(count, 0);
+    memset(mPidWorker, 0, sizeof(mPidWorker));
+    MLOGI("started %d parser workers", count);
+
+    return 0;
+}
+
+void AmlSwDemux::stopWorkers()
+{
+    for (auto& worker : mWorkers) {
+        worker->requestExit();
+        worker->requestExitAndWait();
+    }
+
+    mWorkers.clear();
+    mWorkerPackets.clear();
+    mWorkerStreams.clear();
+
+    std::lock_guard<std::mutex> _l(mLock);
+    mParsers.resize(std::min<size_t>(mParsers.size(), 1));
+}
+
+size_t AmlSwDemux::workerForFilter(int pid, const Aml_MP_DemuxFilterParams* params) const
+{
+    if (mPidWorker[pid] != 0) {
+        return mPidWorker[pid];
+    }
+
+    if (params->type != AML_MP_DEMUX_FILTER_VIDEO && params->type != AML_MP_DEMUX_FILTER_AUDIO
+            && params->type != AML_MP_DEMUX_FILTER_METADATA) {
         return 0;
     }
 
-    mStopped = true;
+    // PES streams go to the least loaded worker, worker 0 is kept for PSI
+    size_t index = 1;
+    for (size_t i = 2; i < mWorkers.size(); ++i) {
+        if (mWorkerStreams[i] < mWorkerStreams[index]) {
+            index = i;
+        }
+    }
+
+    return index;
+}
+
+void AmlSwDemux::runOnWorker(size_t index, const std::function<void(SwTsParser*)>& task, bool wait)
+{
+    WorkItem item;
+
+    if (!wait) {
+        item.task = task;
+        mWorkers[index]->queue(std::move(item));
+        return;
+    }
+
+    std::promise<void> done;
+    item.task = [&](SwTsParser* parser) {
+        task(parser);
+        done.set_value();
+    };
+    mWorkers[index]->queue(std::move(item));
+    done.get_future().wait();
+}
+
+int AmlSwDemux::stop()
+{
+    std::deque<PendingBuffer> cancelled;
+    {
+        // under mFeedLock, or a feeder that just saw !mStopped misses the wakeup
+        std::lock_guard<std::mutex> _l(mFeedLock);
+        if (mStopped) {
+            return 0;
+        }
+
+        mStopped = true;
+        cancelled.swap(mPendingBuffers);
+    }
+    mFeedCond.notify_all();
+
+    for (auto& buffer : cancelled) {
+        completeBuffer(buffer, -ECANCELED);
+    }
 
     return 0;
 }
 
 int AmlSwDemux::flush()
 {
-    ++mBufferGeneration;
+    std::deque<PendingBuffer> flushed;
+    {
+        std::lock_guard<std::mutex> _l(mFeedLock);
+        ++mBufferGeneration;
+        flushed.swap(mPendingBuffers);
+    }
+    mFeedCond.notify_all();
+    for (auto& buffer : flushed) {
+        completeBuffer(buffer, -ECANCELED);
+    }
 
     sptr<AmlMpMessage> msg = new AmlMpMessage(kWhatFlush, mHandler);
 
@@ -300,6 +661,10 @@ int AmlSwDemux::feedTs(const uint8_t* buffer, size_t size)
         return -1;
     }
 
+    if (mAsyncFeed) {
+        return queueTs(buffer, size);
+    }
+
     sptr<AmlMpBuffer> data = new AmlMpBuffer((void*)buffer, size);
     data->setRange(0, size);
 
@@ -319,6 +684,214 @@ int AmlSwDemux::feedTs(const uint8_t* buffer, size_t size)
     return size;
 }
 
+int AmlSwDemux::setFeedParams(const Aml_MP_DemuxFeedParams* params)
+{
+    if (params == nullptr) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> _l(mFeedLock);
+    if (!mPendingBuffers.empty() || mInflightBuffers > 0) {
+        MLOGE("can't change feed params while %zu buffers are pending!", mPendingBuffers.size() + mInflightBuffers);
+        return -1;
+    }
+
+    mFeedParams = *params;
+    mAsyncFeed = mFeedParams.maxPendingBuffers > 0;
+    MLOGI("maxPendingBuffers:%zu, policy:%d, doneCb:%p", mFeedParams.maxPendingBuffers, mFeedParams.policy, mFeedParams.doneCb);
+
+    return 0;
+}
+
+int AmlSwDemux::getStreamStatistics(int pid, Aml_MP_DemuxStreamStatistics* stats)
+{
+    if (stats == nullptr) {
+        return -1;
+    }
+
+    sptr<AmlMpMessage> msg = new AmlMpMessage(kWhatGetStatistics, mHandler);
+    msg->setInt32("pid", pid);
+
+    sptr<AmlMpMessage> response;
+    msg->postAndAwaitResponse(&response);
+
+    int32_t err = -1;
+    if (response == nullptr || !response->findInt32("err", &err) || err != 0) {
+        return -1;
+    }
+
+    response->findInt64("bytes-referenced", (int64_t*)&stats->bytesReferenced);
+    response->findInt64("bytes-copied", (int64_t*)&stats->bytesCopied);
+    response->findInt64("au-pool-hits", (int64_t*)&stats->auPoolHits);
+    response->findInt64("au-pool-misses", (int64_t*)&stats->auPoolMisses);
+    response->findInt64("au-pool-cached-bytes", (int64_t*)&stats->auPoolCachedBytes);
+    response->findInt64("au-pool-high-water-bytes", (int64_t*)&stats->auPoolHighWaterBytes);
+
+    return 0;
+}
+
+int AmlSwDemux::getVideoConfig(int pid, Aml_MP_DemuxVideoConfig* config)
+{
+    if (config == nullptr) {
+        return -1;
+    }
+
+    sptr<AmlMpMessage> msg = new AmlMpMessage(kWhatGetVideoConfig, mHandler);
+    msg->setInt32("pid", pid);
+    msg->setPointer("config", config);
+
+    sptr<AmlMpMessage> response;
+    msg->postAndAwaitResponse(&response);
+
+    int32_t err = -1;
+    if (response == nullptr || !response->findInt32("err", &err)) {
+        return -1;
+    }
+
+    return err;
+}
+
+int AmlSwDemux::getPidStatistics(int pid, Aml_MP_DemuxPidStat* stat)
+{
+    if (stat == nullptr || pid < 0 || pid >= 0x2000) {
+        return -1;
+    }
+
+    memset(stat, 0, sizeof(*stat));
+    stat->pid = pid;
+
+    // the counters are atomics, read them here instead of waiting behind the feed.
+    // A pid moved to another worker keeps its old counters there, so sum all of them.
+    int64_t nowUs = AmlMpEventLooper::GetNowUs();
+    std::lock_guard<std::mutex> _l(mLock);
+    if (mParsers.empty()) {
+        return -1;
+    }
+
+    for (const auto& parser : mParsers) {
+        parser->accumulatePidStatistics(pid, stat, nowUs);
+    }
+
+    return 0;
+}
+
+int AmlSwDemux::queueTs(const uint8_t* buffer, size_t size)
+{
+    PendingBuffer entry;
+    entry.data = buffer;
+    entry.size = size;
+    if (mFeedParams.doneCb != nullptr) {
+        entry.buffer = new AmlMpBuffer((void*)buffer, size);
+        entry.buffer->setRange(0, size);
+    } else {
+        // the caller reuses its buffer as soon as we return
+        entry.buffer = AmlMpBuffer::CreateAsCopy(buffer, size);
+    }
+
+    int ret = size;
+    bool needPost = false;
+    std::deque<PendingBuffer> dropped;
+    {
+        std::unique_lock<std::mutex> l(mFeedLock);
+        for (;;) {
+            if (mStopped) {
+                ret = -1;
+                break;
+            }
+
+            if (mPendingBuffers.size() + mInflightBuffers < mFeedParams.maxPendingBuffers) {
+                break;
+            }
+
+            if (mFeedParams.policy == AML_MP_DEMUX_FEED_POLICY_FAIL) {
+                ret = -EAGAIN;
+                break;
+            }
+
+            if (mFeedParams.policy == AML_MP_DEMUX_FEED_POLICY_DROP_OLDEST && !mPendingBuffers.empty()) {
+                dropped.push_back(std::move(mPendingBuffers.front()));
+                mPendingBuffers.pop_front();
+                if (mDroppedBuffers++ % 100 == 0) {
+                    MLOGW("feed queue full, dropped %" PRId64 " buffers", mDroppedBuffers);
+                }
+                continue;
+            }
+
+            mFeedCond.wait(l);
+        }
+
+        if (ret > 0) {
+            entry.generation = mBufferGeneration;
+            mPendingBuffers.push_back(std::move(entry));
+            if (!mDrainPosted) {
+                mDrainPosted = true;
+                needPost = true;
+            }
+        }
+    }
+
+    for (auto& buffer : dropped) {
+        completeBuffer(buffer, -ECANCELED);
+    }
+
+    if (needPost) {
+        sptr<AmlMpMessage> msg = new AmlMpMessage(kWhatDrainQueue, mHandler);
+        msg->post();
+    }
+
+    if (ret > 0 && mDumpFd >= 0) {
+        if (::write(mDumpFd, buffer, size) != (int)size) {
+            MLOGE("write dump file failed!!!");
+        }
+    }
+
+    return ret;
+}
+
+void AmlSwDemux::completeBuffer(const PendingBuffer& entry, int result)
+{
+    if (mFeedParams.doneCb != nullptr) {
+        mFeedParams.doneCb(entry.data, entry.size, result, mFeedParams.userData);
+    }
+}
+
+void AmlSwDemux::onDrainQueue()
+{
+    for (int i = 0; i < kMaxDrainBatch; ++i) {
+        PendingBuffer entry;
+        {
+            std::lock_guard<std::mutex> _l(mFeedLock);
+            if (mPendingBuffers.empty()) {
+                mDrainPosted = false;
+                return;
+            }
+
+            entry = std::move(mPendingBuffers.front());
+            mPendingBuffers.pop_front();
+            ++mInflightBuffers;
+        }
+
+        int result = -ECANCELED;
+        if (entry.generation == mBufferGeneration) {
+            // without doneCb the buffer is our own copy
+            onFeedData(entry.buffer, mFeedParams.doneCb == nullptr);
+            result = 0;
+        }
+
+        entry.buffer.clear();
+        completeBuffer(entry, result);
+
+        {
+            std::lock_guard<std::mutex> _l(mFeedLock);
+            --mInflightBuffers;
+        }
+        mFeedCond.notify_all();
+    }
+
+    sptr<AmlMpMessage> msg = new AmlMpMessage(kWhatDrainQueue, mHandler);
+    msg->post();
+}
+
 int AmlSwDemux::addDemuxFilter(int pid, const Aml_MP_DemuxFilterParams* params)
 {
     sptr<AmlMpMessage> msg = new AmlMpMessage(kWhatAddPid, mHandler);
@@ -326,6 +899,13 @@ int AmlSwDemux::addDemuxFilter(int pid, const Aml_MP_DemuxFilterParams* params)
     msg->setInt32("type", params->type);
     msg->setInt32("codec-type", params->codecType);
     msg->setInt32("flags", params->flags);
+    if (params->type == AML_MP_DEMUX_FILTER_PSI) {
+        sptr<AmlMpBuffer> sectionFilter = new AmlMpBuffer(AML_MP_DEMUX_FILTER_SIZE * 3);
+        memcpy(sectionFilter->data(), params->filter, AML_MP_DEMUX_FILTER_SIZE);
+        memcpy(sectionFilter->data() + AML_MP_DEMUX_FILTER_SIZE, params->mask, AML_MP_DEMUX_FILTER_SIZE);
+        memcpy(sectionFilter->data() + AML_MP_DEMUX_FILTER_SIZE * 2, params->mode, AML_MP_DEMUX_FILTER_SIZE);
+        msg->setBuffer("section-filter", sectionFilter);
+    }
     msg->post();
 
     return 0;
@@ -370,14 +950,27 @@ void AmlSwDemux::onMessageReceived(const sptr<AmlMpMessage>& msg)
     }
     break;
 
+    case kWhatDrainQueue:
+    {
+        onDrainQueue();
+    }
+    break;
+
     case kWhatAddPid:
     {
         int pid = AML_MP_INVALID_PID;
         Aml_MP_DemuxFilterParams params;
+        memset(&params, 0, sizeof(params));
         msg->findInt32("pid", &pid);
         msg->findInt32("type", (int32_t*)&params.type);
         msg->findInt32("codec-type", (int32_t*)&params.codecType);
         msg->findInt32("flags", (int32_t*)&params.flags);
+        sptr<AmlMpBuffer> sectionFilter;
+        if (msg->findBuffer("section-filter", &sectionFilter) && sectionFilter->size() == AML_MP_DEMUX_FILTER_SIZE * 3) {
+            memcpy(params.filter, sectionFilter->data(), AML_MP_DEMUX_FILTER_SIZE);
+            memcpy(params.mask, sectionFilter->data() + AML_MP_DEMUX_FILTER_SIZE, AML_MP_DEMUX_FILTER_SIZE);
+            memcpy(params.mode, sectionFilter->data() + AML_MP_DEMUX_FILTER_SIZE * 2, AML_MP_DEMUX_FILTER_SIZE);
+        }
         onAddFilterPid(pid, &params);
     }
     break;
@@ -390,6 +983,68 @@ void AmlSwDemux::onMessageReceived(const sptr<AmlMpMessage>& msg)
     }
     break;
 
+    case kWhatGetStatistics:
+    {
+        int pid = AML_MP_INVALID_PID;
+        msg->findInt32("pid", &pid);
+
+        sptr<AReplyToken> replyID;
+        AML_MP_CHECK(msg->senderAwaitsResponse(&replyID));
+
+        Aml_MP_DemuxStreamStatistics stats;
+        int err = -1;
+        if (!mWorkers.empty()) {
+            if (pid >= 0 && pid < 0x2000) {
+                runOnWorker(mPidWorker[pid], [&](SwTsParser* parser) {
+                    err = parser->getStreamStatistics(pid, &stats);
+                }, true);
+            }
+        } else if (mTsParser != nullptr) {
+            err = mTsParser->getStreamStatistics(pid, &stats);
+        }
+
+        sptr<AmlMpMessage> response = new AmlMpMessage;
+        response->setInt32("err", err);
+        if (err == 0) {
+            response->setInt64("bytes-referenced", stats.bytesReferenced);
+            response->setInt64("bytes-copied", stats.bytesCopied);
+            response->setInt64("au-pool-hits", stats.auPoolHits);
+            response->setInt64("au-pool-misses", stats.auPoolMisses);
+            response->setInt64("au-pool-cached-bytes", stats.auPoolCachedBytes);
+            response->setInt64("au-pool-high-water-bytes", stats.auPoolHighWaterBytes);
+        }
+        response->postReply(replyID);
+    }
+    break;
+
+    case kWhatGetVideoConfig:
+    {
+        int pid = AML_MP_INVALID_PID;
+        msg->findInt32("pid", &pid);
+        Aml_MP_DemuxVideoConfig* config = nullptr;
+        msg->findPointer("config", (void**)&config);
+
+        sptr<AReplyToken> replyID;
+        AML_MP_CHECK(msg->senderAwaitsResponse(&replyID));
+
+        // the caller waits, config can be filled in on the worker
+        int err = -1;
+        if (!mWorkers.empty()) {
+            if (pid >= 0 && pid < 0x2000) {
+                runOnWorker(mPidWorker[pid], [&](SwTsParser* parser) {
+                    err = parser->getVideoConfig(pid, config);
+                }, true);
+            }
+        } else if (mTsParser != nullptr) {
+            err = mTsParser->getVideoConfig(pid, config);
+        }
+
+        sptr<AmlMpMessage> response = new AmlMpMessage;
+        response->setInt32("err", err);
+        response->postReply(replyID);
+    }
+    break;
+
     case kWhatFlush:
     {
         onFlush();
@@ -407,9 +1062,15 @@ void AmlSwDemux::onMessageReceived(const sptr<AmlMpMessage>& msg)
     }
 }
 
-void AmlSwDemux::onFeedData(const sptr<AmlMpBuffer>& entry)
+void AmlSwDemux::onFeedData(const sptr<AmlMpBuffer>& data, bool ownsData)
 {
     int err = 0;
+    sptr<AmlMpBuffer> entry = data;
+
+    if (!mWorkers.empty() && !ownsData) {
+        // the workers parse it after the caller got its buffer back
+        entry = AmlMpBuffer::CreateAsCopy(data->data(), data->size());
+    }
 
     if (mRemainingBytesBuffer->size() > 0) {
         //CHECK_LE(mRemainingBytesBuffer->size(), kTSPacketSize);
@@ -421,27 +1082,23 @@ void AmlSwDemux::onFeedData(const sptr<AmlMpBuffer>& entry)
         entry->setRange(entry->offset() + copySize, entry->size() - copySize);
 
         if (mRemainingBytesBuffer->size() == kTSPacketSize) {
-            err = mTsParser->feedTs(mRemainingBytesBuffer->data(), kTSPacketSize);
+            sptr<AmlMpBuffer> packet = mRemainingBytesBuffer;
+            if (!mWorkers.empty()) {
+                packet = AmlMpBuffer::CreateAsCopy(mRemainingBytesBuffer->data(), kTSPacketSize);
+            }
+
+            err = feedPacket(packet->data());
             if (err != 0) {
                 const uint8_t* p = mRemainingBytesBuffer->data();
                 MLOGI("%d %" PRId64 ", feedTSPacket err:%d, %#x, %#x, %#x, %#x, %#x", __LINE__, mOutBufferCount.load(), err,
                         p[0], p[1], p[2], p[3], p[4]);
             }
+            dispatchPackets(packet);
             mRemainingBytesBuffer->setRange(0, 0);
         }
     }
 
-    while (entry->size() > 0) {
-        if (entry->size() < kTSPacketSize) {
-            if (*entry->data() == 0x47) {
-                memcpy(mRemainingBytesBuffer->data(), entry->data(), entry->size());
-                mRemainingBytesBuffer->setRange(mRemainingBytesBuffer->offset(), mRemainingBytesBuffer->size() + entry->size());
-            } else {
-                MLOGW("left data doesn't start with 0x47, discard it!");
-            }
-            break;
-        }
-
+    while (entry->size() >= kTSPacketSize) {
         if (*entry->data() != 0x47) {
             MLOGI("mOutBufferCount:%" PRId64 ", entry start bytes:%#x, offset:%zu, size:%zu",
                   mOutBufferCount.load(), *entry->data(), entry->offset(), entry->size());
@@ -451,50 +1108,77 @@ void AmlSwDemux::onFeedData(const sptr<AmlMpBuffer>& entry)
             err = resync(entry);
             if (err < 0) {
                 MLOGE("resync ts buffer failed! %d, size:%zu", err, entry->size());
-                return;
+                entry->setRange(entry->offset() + entry->size(), 0);
+                break;
             } else {
                 MLOGV("resync add offset:%d", err);
                 continue;
             }
         }
 
-        err = mTsParser->feedTs(entry->data(), kTSPacketSize);
+        err = feedPacket(entry->data());
         if (err != 0) {
             MLOGE("%d feedTSPacket failed, err:%d", __LINE__, err);
         }
         entry->setRange(entry->offset() + kTSPacketSize, entry->size() - kTSPacketSize);
     }
+
+    dispatchPackets(entry);
+
+    if (entry->size() > 0) {
+        if (*entry->data() == 0x47) {
+            memcpy(mRemainingBytesBuffer->data(), entry->data(), entry->size());
+            mRemainingBytesBuffer->setRange(mRemainingBytesBuffer->offset(), mRemainingBytesBuffer->size() + entry->size());
+        } else {
+            MLOGW("left data doesn't start with 0x47, discard it!");
+        }
+    }
 }
 
-int AmlSwDemux::resync(const sptr<AmlMpBuffer>& buffer)
+int AmlSwDemux::feedPacket(const uint8_t* packet)
 {
-    const uint8_t* p = buffer->data();
-    size_t size = buffer->size();
+    if (mWorkers.empty()) {
+        return mTsParser->feedTs(packet, kTSPacketSize);
+    }
 
-    if (p == nullptr || size < kTSPacketSize)
-        return -1;
+    unsigned pid = (packet[1] & 0x1F) << 8 | packet[2];
+    mWorkerPackets[mPidWorker[pid]].push_back(packet);
 
-    bool synced = false;
-    size_t offset = 0;
-    while (offset < size) {
-        if (p[offset] != 0x47) {
-            ++offset;
-            continue;
-        }
+    return 0;
+}
 
-        if (offset + kTSPacketSize < size) {
-            if (p[offset + kTSPacketSize] != 0x47) {
-                ++offset;
-                MLOGV("next ts packet header check failed, try sync again...");
-                continue;
-            }
+// all packets passed to feedPacket() since the last call live in chunk
+void AmlSwDemux::dispatchPackets(const sptr<AmlMpBuffer>& chunk)
+{
+    if (mWorkers.empty()) {
+        // the parser references the packets, it must copy what it still
+        // needs before chunk is reused.
+        mTsParser->releaseInput();
+        return;
+    }
+
+    for (size_t i = 0; i < mWorkers.size(); ++i) {
+        if (mWorkerPackets[i].empty()) {
+            continue;
         }
 
-        synced = true;
-        break;
+        WorkItem item;
+        item.chunk = chunk;
+        item.packets.swap(mWorkerPackets[i]);
+        mWorkers[i]->queue(std::move(item));
     }
+}
+
+int AmlSwDemux::resync(const sptr<AmlMpBuffer>& buffer)
+{
+    const uint8_t* p = buffer->data();
+    size_t size = buffer->size();
+
+    if (p == nullptr || size < kTSPacketSize)
+        return -1;
 
-    if (synced) {
+    size_t offset = tsFindSyncLock(p, size, kTSPacketSize);
+    if (offset < size) {
         buffer->setRange(buffer->offset() + offset, buffer->size() - offset);
         return offset;
     }
@@ -506,7 +1190,11 @@ void AmlSwDemux::onFlush()
 {
     mOutBufferCount = 0;
 
-    if (mTsParser != nullptr) {
+    if (!mWorkers.empty()) {
+        for (size_t i = 0; i < mWorkers.size(); ++i) {
+            runOnWorker(i, [](SwTsParser* parser) { parser->reset(); }, true);
+        }
+    } else if (mTsParser != nullptr) {
         mTsParser->reset();
     }
 
@@ -515,7 +1203,23 @@ void AmlSwDemux::onFlush()
 
 void AmlSwDemux::onAddFilterPid(int pid, Aml_MP_DemuxFilterParams* params)
 {
-    if (mTsParser != nullptr) {
+    if (pid < 0 || pid >= 0x2000) {
+        return;
+    }
+
+    if (!mWorkers.empty()) {
+        size_t index = workerForFilter(pid, params);
+        MLOGI("add filter pid:%d(%#x) on worker %zu", pid, pid, index);
+        if (index != 0 && mPidWorker[pid] == 0) {
+            mPidWorker[pid] = index;
+            ++mWorkerStreams[index];
+        }
+
+        Aml_MP_DemuxFilterParams filterParams = *params;
+        runOnWorker(index, [pid, filterParams](SwTsParser* parser) {
+            parser->addDemuxFilter(pid, &filterParams);
+        }, false);
+    } else if (mTsParser != nullptr) {
         MLOGI("add filter pid:%d(%#x)", pid, pid);
         mTsParser->addDemuxFilter(pid, params);
     }
@@ -523,7 +1227,22 @@ void AmlSwDemux::onAddFilterPid(int pid, Aml_MP_DemuxFilterParams* params)
 
 void AmlSwDemux::onRemoveFilterPid(int pid)
 {
-    if (mTsParser != nullptr) {
+    if (pid < 0 || pid >= 0x2000) {
+        return;
+    }
+
+    if (!mWorkers.empty()) {
+        size_t index = mPidWorker[pid];
+        MLOGI("remove filter pid:%d(%#x) on worker %zu", pid, pid, index);
+        if (index != 0) {
+            --mWorkerStreams[index];
+            mPidWorker[pid] = 0;
+        }
+
+        runOnWorker(index, [pid](SwTsParser* parser) {
+            parser->removeDemuxFilter(pid);
+        }, false);
+    } else if (mTsParser != nullptr) {
         MLOGI("remove filter pid:%d(%#x)", pid, pid);
         mTsParser->removeDemuxFilter(pid);
     }
@@ -537,7 +1256,10 @@ SwTsParser::SwTsParser(const std::function<FilterCallback>& cb)
 
     mPSISections.emplace(0 /* PID */, new PSISection(0, this));
     mPSISections.emplace(1 /* PID */, new PSISection(1, this));
-    initCrcTable();
+    updatePidEntry(0);
+    updatePidEntry(1);
+
+    mNowUs = AmlMpEventLooper::GetNowUs();
 }
 
 SwTsParser::~SwTsParser()
@@ -545,61 +1267,23 @@ SwTsParser::~SwTsParser()
     MLOG();
 }
 
-void SwTsParser::initCrcTable()
-{
-#if 0
-    uint32_t poly = 0x04C11DB7;
-
-    for (int i = 0; i < 256; i++) {
-        uint32_t crc = i << 24;
-        for (int j = 0; j < 8; j++) {
-            crc = (crc << 1) ^ ((crc & 0x80000000) ? (poly) : 0);
-        }
-        mCrcTable[i] = crc;
-    }
-#endif
-
-    for (uint32_t i = 0; i < 256; i++) {
-        uint32_t k = 0;
-        for (uint32_t j = (i << 24) | 0x800000; j != 0x80000000; j <<= 1) {
-            k = (k << 1) ^ (((k ^ j) & 0x80000000) ? 0x04c11db7 : 0);
-        }
-
-        mCrcTable[i] = k;
-    }
-}
-
-/**
- * Compute CRC32 checksum for buffer starting at offset start and for length
- * bytes.
- */
-uint32_t SwTsParser::crc32(const uint8_t *p_start, size_t length)
+int SwTsParser::feedTs(const uint8_t* buffer, size_t size)
 {
-#if 0
-    uint32_t crc = 0xFFFFFFFF;
-    const uint8_t *p;
+    AML_MP_UNUSED(size);
+    //CHECK_EQ(size, kTSPacketSize);
 
-    for (p = p_start; p < p_start + length; p++) {
-        crc = (crc << 8) ^ mCrcTable[((crc >> 24) ^ *p) & 0xFF];
+    AmlMpTsHeader header(buffer);
+    PidEntry& entry = mPidTable[header.pid()];
+    if (header.syncByte() == 0x47u) {
+        entry.stats.update(header, buffer, mNowUs);
     }
 
-    return crc;
-#endif
-
-    uint32_t crc32_reg = 0xFFFFFFFF;
-    for (uint32_t i = 0; i < length; i++) {
-        crc32_reg = (crc32_reg << 8) ^ mCrcTable[((crc32_reg >> 24) ^ *p_start++) & 0xFF];
+    if (entry.kind == PID_KIND_NONE) {
+        ++mNumTSPacketsParsed;
+        return 0;
     }
-    return crc32_reg;
-}
-
-int SwTsParser::feedTs(const uint8_t* buffer, size_t size)
-{
-    AML_MP_UNUSED(size);
-    //CHECK_EQ(size, kTSPacketSize);
 
-    AmlMpBitReader br(buffer, kTSPacketSize);
-    return parseTS(&br);
+    return parseTS(buffer);
 }
 
 void SwTsParser::reset()
@@ -613,6 +1297,16 @@ void SwTsParser::reset()
 
     for (auto& p : mPSISections) {
         p.second->clear();
+        p.second->clearSectionCache();
+    }
+
+    // the next packets don't follow the previous ones
+    for (PidEntry& entry : mPidTable) {
+        entry.stats.resetContinuity();
+    }
+
+    for (auto& p : mStreams) {
+        p.second->waitForKeyFrame();
     }
 }
 
@@ -622,10 +1316,12 @@ int SwTsParser::addDemuxFilter(int pid, const Aml_MP_DemuxFilterParams* params)
         return -1;
 
     if (params->type == AML_MP_DEMUX_FILTER_PSI) {
-        if (mPSISections.find(pid) == mPSISections.end()) {
+        auto it = mPSISections.find(pid);
+        if (it == mPSISections.end()) {
             MLOGW("add section pid:%d(%#x)", pid, pid);
-            mPSISections.emplace(pid, new PSISection(pid, this));
+            it = mPSISections.emplace(pid, new PSISection(pid, this)).first;
         }
+        it->second->setFilter(params);
     } else {
         if (mStreams.find(pid) == mStreams.end()) {
             MLOGW("add pes filter:%d(%#x)", pid, pid);
@@ -633,6 +1329,7 @@ int SwTsParser::addDemuxFilter(int pid, const Aml_MP_DemuxFilterParams* params)
         }
     }
 
+    updatePidEntry(pid);
 
     return 0;
 }
@@ -642,113 +1339,137 @@ void SwTsParser::removeDemuxFilter(int pid)
     if (pid == 0x1FFF)
         return;
 
-    if (mPSISections.find(pid) != mPSISections.end()) {
-        MLOGW("remove section pid:%d(%#x)", pid, pid);
-        mPSISections.erase(pid);
+    auto sectionIndex = mPSISections.find(pid);
+    if (sectionIndex != mPSISections.end()) {
+        const AmlMpSectionCache& cache = sectionIndex->second->sectionCache();
+        MLOGW("remove section pid:%d(%#x), filtered out:%" PRIu64 ", repeated:%" PRIu64 ", changed:%" PRIu64,
+                pid, pid, sectionIndex->second->filteredSections(), cache.hits(), cache.misses());
+        mPSISections.erase(sectionIndex);
     } else if (mStreams.find(pid) != mStreams.end()) {
-        MLOGW("remove pes pid:%d(%#x)", pid, pid);
+        Aml_MP_DemuxStreamStatistics stats;
+        mStreams[pid]->getStatistics(&stats);
+        MLOGW("remove pes pid:%d(%#x), bytes referenced:%" PRIu64 ", copied:%" PRIu64 ", au pool hits:%" PRIu64 ", misses:%" PRIu64,
+                pid, pid, stats.bytesReferenced, stats.bytesCopied, stats.auPoolHits, stats.auPoolMisses);
         mStreams.erase(pid);
     }
+
+    updatePidEntry(pid);
 }
 
-void SwTsParser::parseAdaptationField(AmlMpBitReader *br, unsigned PID)
+void SwTsParser::releaseInput()
 {
-    unsigned adaptation_field_length = br->getBits(8);
-
-    if (adaptation_field_length > 0) {
-        unsigned discontinuity_indicator = br->getBits(1);
+    for (auto& p : mStreams) {
+        p.second->releaseInput();
+    }
 
-        if (discontinuity_indicator) {
-            MLOGV("PID 0x%04x: discontinuity_indicator = 1 (!!!)", PID);
-        }
+    mNowUs = AmlMpEventLooper::GetNowUs();
+}
 
-        br->skipBits(2);
-        unsigned PCR_flag = br->getBits(1);
+int SwTsParser::getStreamStatistics(int pid, Aml_MP_DemuxStreamStatistics* stats) const
+{
+    auto it = mStreams.find(pid);
+    if (it == mStreams.end()) {
+        return -1;
+    }
 
-        size_t numBitsRead = 4;
+    it->second->getStatistics(stats);
+    return 0;
+}
 
-        if (PCR_flag && (mPcrPid == 0x1FFF || mPcrPid == (int)PID)) {
-            br->skipBits(4);
-            uint64_t PCR_base = br->getBits(32);
-            PCR_base = (PCR_base << 1) | br->getBits(1);
+int SwTsParser::getVideoConfig(int pid, Aml_MP_DemuxVideoConfig* config) const
+{
+    auto it = mStreams.find(pid);
+    if (it == mStreams.end()) {
+        return -1;
+    }
 
-            //PCR_base = recoverPTS(PCR_base, mLastRecoveredPCR);
+    return it->second->getVideoConfig(config);
+}
 
-            br->skipBits(6);
-            unsigned PCR_ext = br->getBits(9);
-            (void)PCR_ext;
+void SwTsParser::accumulatePidStatistics(int pid, Aml_MP_DemuxPidStat* stat, int64_t nowUs) const
+{
+    mPidTable[pid].stats.accumulate(stat, nowUs);
+}
 
-            // The number of bytes from the start of the current
-            // MPEG2 transport stream packet up and including
-            // the final byte of this PCR_ext field.
-            //size_t byteOffsetFromStartOfTSPacket =
-                //(188 - br->numBitsLeft() / 8);
+void SwTsParser::updatePidEntry(unsigned pid)
+{
+    PidEntry& entry = mPidTable[pid];
 
-            //int64_t PCR = PCR_base * 300 + PCR_ext;
+    auto sectionIndex = mPSISections.find(pid);
+    if (sectionIndex != mPSISections.end()) {
+        entry.kind = PID_KIND_SECTION;
+        entry.handler = sectionIndex->second.get();
+        return;
+    }
 
-            //MLOGV("PID 0x%04x: PCR = 0x%016" PRIx64 " (%.2f)",
-                  //PID, PCR, PCR / 27E6);
+    auto streamIndex = mStreams.find(pid);
+    if (streamIndex != mStreams.end()) {
+        entry.kind = streamIndex->second->isPcrOnly() ? PID_KIND_PCR : PID_KIND_PES;
+        entry.handler = streamIndex->second.get();
+        return;
+    }
 
-            // The number of bytes received by this parser up to and
-            // including the final byte of this PCR_ext field.
-            //size_t byteOffsetFromStart =
-                //mNumTSPacketsParsed * 188 + byteOffsetFromStartOfTSPacket;
+    entry.kind = PID_KIND_NONE;
+    entry.handler = nullptr;
+}
 
-            //for (size_t i = 0; i < mPrograms.size(); ++i) {
-                //updatePCR(PID, PCR, byteOffsetFromStart);
-            //}
+void SwTsParser::parseAdaptationField(const AmlMpTsAdaptationField& adaptationField, unsigned PID)
+{
+    if (adaptationField.discontinuity) {
+        MLOGV("PID 0x%04x: discontinuity_indicator = 1 (!!!)", PID);
+    }
 
-            numBitsRead += 52;
-        }
+    if (adaptationField.hasPcr && (mPcrPid == 0x1FFF || mPcrPid == (int)PID)) {
+        uint64_t PCR_base = adaptationField.pcrBase;
+        unsigned PCR_ext = adaptationField.pcrExtension;
+        (void)PCR_base;
+        (void)PCR_ext;
 
-        //CHECK_GE(adaptation_field_length * 8, numBitsRead);
+        //int64_t PCR = PCR_base * 300 + PCR_ext;
 
-        br->skipBits(adaptation_field_length * 8 - numBitsRead);
+        //MLOGV("PID 0x%04x: PCR = 0x%016" PRIx64 " (%.2f)",
+              //PID, PCR, PCR / 27E6);
     }
 }
 
-int SwTsParser::parseTS(AmlMpBitReader *br)
+int SwTsParser::parseTS(const uint8_t* packet)
 {
     MLOGV("---");
 
-    unsigned sync_byte = br->getBits(8);
-    if (sync_byte != 0x47u) {
-        MLOGE("[error] parseTS: return error as sync_byte=0x%x", sync_byte);
+    AmlMpTsHeader header(packet);
+    if (header.syncByte() != 0x47u) {
+        MLOGE("[error] parseTS: return error as sync_byte=0x%x", header.syncByte());
         return -EINVAL;
     }
 
-    if (br->getBits(1)) {  // transport_error_indicator
+    if (header.transportErrorIndicator()) {
         // silently ignore.
         return 0;
     }
 
-    unsigned payload_unit_start_indicator = br->getBits(1);
-    MLOGV("payload_unit_start_indicator = %u", payload_unit_start_indicator);
-
-    MY_LOGV("transport_priority = %u", br->getBits(1));
+    unsigned payload_unit_start_indicator = header.payloadUnitStartIndicator();
+    unsigned PID = header.pid();
+    unsigned continuity_counter = header.continuityCounter();
+    MLOGV("PID = 0x%04x, payload_unit_start_indicator = %u, adaptation_field_control = %u, continuity_counter = %u",
+            PID, payload_unit_start_indicator, header.adaptationFieldControl(), continuity_counter);
 
-    unsigned PID = br->getBits(13);
-    MLOGV("PID = 0x%04x", PID);
-
-    MY_LOGV("transport_scrambling_control = %u", br->getBits(2));
-
-    unsigned adaptation_field_control = br->getBits(2);
-    MLOGV("adaptation_field_control = %u", adaptation_field_control);
-
-    unsigned continuity_counter = br->getBits(4);
-    MLOGV("PID = 0x%04x, continuity_counter = %u", PID, continuity_counter);
-
-    // MLOGI("PID = 0x%04x, continuity_counter = %u", PID, continuity_counter);
+    size_t payloadOffset = 4;
+    if (header.hasAdaptationField()) {
+        AmlMpTsAdaptationField adaptationField;
+        if (!adaptationField.parse(packet)) {
+            MLOGW("PID 0x%04x: invalid adaptation_field_length %u", PID, adaptationField.length);
+            return 0;
+        }
 
-    if (adaptation_field_control == 2 || adaptation_field_control == 3) {
-        parseAdaptationField(br, PID);
+        parseAdaptationField(adaptationField, PID);
+        payloadOffset = adaptationField.payloadOffset();
     }
 
     int err = 0;
 
-    if (adaptation_field_control == 1 || adaptation_field_control == 3) {
-        err = parsePID(
-                br, PID, continuity_counter, payload_unit_start_indicator);
+    if (header.hasPayload()) {
+        err = parsePID(packet + payloadOffset, kTSPacketSize - payloadOffset,
+                PID, continuity_counter, payload_unit_start_indicator);
     }
 
     ++mNumTSPacketsParsed;
@@ -822,6 +1543,7 @@ void SwTsParser::parseProgramAssociationTable(AmlMpBitReader *br)
 
             if (mPSISections.find(programMapPID) == mPSISections.end()) {
                 mPSISections.emplace(programMapPID, new PSISection(programMapPID, this));
+                updatePidEntry(programMapPID);
             }
         }
     }
@@ -830,31 +1552,46 @@ void SwTsParser::parseProgramAssociationTable(AmlMpBitReader *br)
 }
 
 int SwTsParser::parsePID(
-        AmlMpBitReader *br, unsigned PID,
+        const uint8_t* payload, size_t size, unsigned PID,
         unsigned continuity_counter,
         unsigned payload_unit_start_indicator) {
-    auto sectionIndex = mPSISections.find(PID);
+    const PidEntry& entry = mPidTable[PID];
 
-    if (sectionIndex != mPSISections.end()) {
-        sptr<PSISection> section = mPSISections.at(PID);
+    if (entry.kind == PID_KIND_SECTION) {
+        sptr<PSISection> section = static_cast<PSISection*>(entry.handler);
 
-        if (!section->parse(PID, continuity_counter, payload_unit_start_indicator, br)) {
+        if (!section->parse(PID, continuity_counter, payload_unit_start_indicator, &payload, &size)) {
             MLOGW("pre parse failed!!!! PID = %d", PID);
             return 0;
         }
 
-        AML_MP_CHECK((br->numBitsLeft() % 8) == 0);
-        int err = section->append(br->data(), br->numBitsLeft() / 8);
+        int err = section->append(payload, size);
 
         if (err != 0) {
-            MLOGW("section append data %zu size failed!", br->numBitsLeft()/8);
+            MLOGW("section append data %zu size failed!", size);
             return err;
         }
 
+        if (section->hasFilter() && section->matchFilter() == 0) {
+            section->skip();
+            return 0;
+        }
+
         if (!section->isComplete()) {
             return 0;
         }
 
+        if (section->isRepeated()) {
+            // verified already, the filters know whether they have it
+            if (section->hasListener()) {
+                section->setRange(0, section->sectionLength());
+                int version = section->needCheckVersionChange() ? section->sectionVersion() : -1;
+                mFilterCallback(PID, section->rawBuffer(), version);
+            }
+            section->clear();
+            return 0;
+        }
+
         AmlMpBitReader sectionBits2(section->data(), section->size());
         bool notifyListener = true;
 
@@ -907,6 +1644,7 @@ int SwTsParser::parsePID(
             if (notifyListener) {
                 int version = section->needCheckVersionChange() ? section->sectionVersion() : -1;
                 mFilterCallback(PID, section->rawBuffer(), version);
+                section->onDelivered();
             }
 
             //section->clear();
@@ -950,10 +1688,9 @@ int SwTsParser::parsePID(
         return 0;
     }
 
-    auto streamIndex = mStreams.find(PID);
-    if (streamIndex != mStreams.end()) {
-        sptr<Stream> stream = streamIndex->second;
-        int err = stream->parse(continuity_counter, payload_unit_start_indicator, br);
+    if (entry.kind == PID_KIND_PES) {
+        sptr<Stream> stream = static_cast<Stream*>(entry.handler);
+        int err = stream->parse(continuity_counter, payload_unit_start_indicator, payload, size);
         if (err != 0) {
             return err;
         }
@@ -1007,6 +1744,11 @@ int SwTsParser::PSISection::append(const void *data, size_t size) {
 }
 
 void SwTsParser::PSISection::clear() {
+    if (mBuffer != NULL && mBuffer->getStrongCount() > 1) {
+        // leased by a filter, the next section goes to a new buffer
+        mBuffer.clear();
+    }
+
     if (mBuffer != NULL) {
         mBuffer->setRange(0, 0);
     }
@@ -1077,15 +1819,92 @@ int SwTsParser::PSISection::sectionVersion() const
     return version;
 }
 
+void SwTsParser::PSISection::setFilter(const Aml_MP_DemuxFilterParams* params)
+{
+    // the cache only holds sections which passed the checks, it stays valid
+    mHasListener = true;
+    mDeliverOnChange = params->flags & AML_MP_DEMUX_DELIVER_ON_CHANGE;
+
+    mFilterLength = 0;
+    mHasNegativeMask = false;
+
+    for (size_t i = 0; i < AML_MP_DEMUX_FILTER_SIZE; ++i) {
+        mFilter[i] = params->filter[i];
+        mPositiveMask[i] = params->mask[i] & ~params->mode[i];
+        mNegativeMask[i] = params->mask[i] & params->mode[i];
+
+        if (params->mask[i]) {
+            mFilterLength = i + 1;
+        }
+        if (mNegativeMask[i]) {
+            mHasNegativeMask = true;
+        }
+    }
+
+    if (mFilterLength > 0) {
+        MLOGI("pid:%d(%#x) section filter length:%zu, table_id:%#x/%#x", mPid, mPid,
+                mFilterLength, mFilter[0], params->mask[0]);
+    }
+}
+
+int SwTsParser::PSISection::matchFilter() const
+{
+    const uint8_t* data = mBuffer->data();
+    size_t size = mBuffer->size();
+    uint8_t notEqual = 0;
+
+    for (size_t i = 0; i < mFilterLength; ++i) {
+        // the filter skips section_length
+        size_t offset = i == 0 ? 0 : i + 2;
+        if (offset >= size) {
+            if (!isComplete()) {
+                return -1;
+            }
+
+            if (mPositiveMask[i]) {
+                return 0;
+            }
+            continue;
+        }
+
+        uint8_t diff = data[offset] ^ mFilter[i];
+        if (diff & mPositiveMask[i]) {
+            return 0;
+        }
+        notEqual |= diff & mNegativeMask[i];
+    }
+
+    return (!mHasNegativeMask || notEqual) ? 1 : 0;
+}
+
+bool SwTsParser::PSISection::isRepeated()
+{
+    return mDeliverOnChange && mSectionCache.isRepeated(mBuffer->data(), mBuffer->size());
+}
+
+void SwTsParser::PSISection::onDelivered()
+{
+    if (mDeliverOnChange) {
+        mSectionCache.update(mBuffer->data(), mBuffer->size());
+    }
+}
+
+void SwTsParser::PSISection::skip()
+{
+    clear();
+    mPayloadStarted = false;
+    ++mFilteredSections;
+}
+
 bool SwTsParser::PSISection::parse(int PID, unsigned continuity_counter,
                    unsigned payload_unit_start_indicator,
-                   AmlMpBitReader *br)
+                   const uint8_t** payload, size_t* size)
 {
     (void)PID;
     (void)continuity_counter;
 #if 0
     if (mExpectedContinuityCounter >= 0 && (unsigned)mExpectedContinuityCounter != continuity_counter) {
-        MLOGW("section discontinuity on stream pid 0x%04x(%d)", PID, PID);
+        MLOGV("section discontinuity on stream pid 0x%04x(%d)", PID, PID);
 
         mPayloadStarted = false;
         mBuffer->setRange(0, 0);
@@ -1108,11 +1927,18 @@ bool SwTsParser::PSISection::parse(int PID, unsigned continuity_counter,
             clear();
         }
 
-        unsigned skip = br->getBits(8);
+        unsigned skip = (*size > 0) ? (*payload)[0] : 0;
+        if (skip + 1 > *size) {
+            MLOGW("invalid pointer_field %u, payload size %zu", skip, *size);
+            mPayloadStarted = false;
+            return false;
+        }
+
         if (skip > 0) {
             MLOGW("skip %d bytes!", skip);
         }
-        br->skipBits(skip * 8);
+        *payload += skip + 1;
+        *size -= skip + 1;
 
         mPayloadStarted = true;
     }
@@ -1177,7 +2003,7 @@ int SwTsParser::PSISection::parseSection(AmlMpBitReader* br)
             }
         }
 
-        uint32_t crc = mTsParser->crc32(mBuffer->data(), section_length + 3);
+        uint32_t crc = crc32_mpeg2(mBuffer->data(), section_length + 3);
         if (crc != 0) {
             MLOGE("crc error: %#x", crc);
             return ERROR_CRC;
@@ -1197,6 +2023,11 @@ SwTsParser::Stream::Stream(int pid, const Aml_MP_DemuxFilterParams* params)
     mType = params->type;
     mFlags = params->flags;
 
+    if (isPcrOnly()) {
+        // the PCR is taken from the adaptation field, the payload is never parsed
+        return;
+    }
+
     ElementaryStreamQueue::Mode mode = ElementaryStreamQueue::INVALID;
 
     switch (mCodecType) {
@@ -1233,23 +2064,54 @@ SwTsParser::Stream::Stream(int pid, const Aml_MP_DemuxFilterParams* params)
         mode = ElementaryStreamQueue::EAC3;
         break;
 
+    case AML_MP_AUDIO_CODEC_AC4:
+        mode = ElementaryStreamQueue::AC4;
+        break;
+
+    case AML_MP_AUDIO_CODEC_PCM:
+        mode = ElementaryStreamQueue::PCM_AUDIO;
+        break;
+
     default:
+        if (mType == AML_MP_DEMUX_FILTER_METADATA) {
+            mode = ElementaryStreamQueue::METADATA;
+            break;
+        }
         ALOGE("stream PID 0x%02x has invalid codec type %s", mPid, mpCodecId2Str(mCodecType));
         return;
     }
 
     mQueue = new ElementaryStreamQueue(mode);
+    mHasKeyFrameFlags = mode == ElementaryStreamQueue::H264 || mode == ElementaryStreamQueue::H265;
+    mKeyFrameFound = !mHasKeyFrameFlags;
+
+    switch (mFlags & AML_MP_DEMUX_ES_FORMAT_MASK) {
+    case AML_MP_DEMUX_ES_FORMAT_RAW:
+        mQueue->setOutputFormat(ElementaryStreamQueue::OUTPUT_RAW);
+        break;
+
+    case AML_MP_DEMUX_ES_FORMAT_LENGTH_PREFIXED:
+        mQueue->setOutputFormat(ElementaryStreamQueue::OUTPUT_LENGTH_PREFIXED);
+        break;
+
+    case AML_MP_DEMUX_ES_FORMAT_LATM:
+        mQueue->setOutputFormat(ElementaryStreamQueue::OUTPUT_LATM);
+        break;
+
+    default:
+        break;
+    }
 
     mBuffer = new AmlMpBuffer(kInitialStreamBufferSize);
     mBuffer->setRange(0, 0);
 }
 
-int SwTsParser::Stream::parse(unsigned continuity_counter, unsigned payload_unit_start_indicator, AmlMpBitReader* br)
+int SwTsParser::Stream::parse(unsigned continuity_counter, unsigned payload_unit_start_indicator, const uint8_t* payload, size_t size)
 {
     if (mExpectedContinuityCounter >= 0 && (unsigned)mExpectedContinuityCounter != continuity_counter) {
-        MLOGI("discontinuity on stream pid 0x%04x, continuity_counter:%u", mPid, continuity_counter);
+        MLOGV("discontinuity on stream pid 0x%04x, continuity_counter:%u", mPid, continuity_counter);
         mPayloadStarted = false;
-        mBuffer->setRange(0, 0);
+        clearPES();
         mExpectedContinuityCounter = -1;
 
         if (!payload_unit_start_indicator) {
@@ -1271,17 +2133,103 @@ int SwTsParser::Stream::parse(unsigned continuity_counter, unsigned payload_unit
         mPayloadStarted = true;
     }
 
-    if (!mPayloadStarted) {
+    if (!mPayloadStarted || size == 0) {
         return 0;
     }
 
-    size_t payloadSizeBits = br->numBitsLeft();
-    if (payloadSizeBits % 8 != 0u) {
-        MLOGE("wrong value!");
+    if (payload_unit_start_indicator) {
+        // a bounded PES is parsed as soon as it's complete, while its
+        // packets are still referenced, rather than on the next PUSI.
+        size_t PES_packet_length = size >= 6 ? (payload[4] << 8 | payload[5]) : 0;
+        mExpectedPESSize = PES_packet_length ? PES_packet_length + 6 : 0;
+    }
+
+    struct iovec segment;
+    segment.iov_base = const_cast<uint8_t*>(payload);
+    segment.iov_len = size;
+    mSegments.push_back(segment);
+    mPESSize += size;
+
+    if (mExpectedPESSize > 0 && mPESSize >= mExpectedPESSize) {
+        int err = flush();
+        if (err != 0) {
+            MLOGW("Error (%08x) happened while flushing; we simply discard "
+                              "the PES packet and continue.", err);
+        }
+        mPayloadStarted = false;
+    }
+
+    return 0;
+}
+
+void SwTsParser::Stream::releaseInput()
+{
+    if (!mSegments.empty()) {
+        copySegments();
+    }
+}
+
+void SwTsParser::Stream::getStatistics(Aml_MP_DemuxStreamStatistics* stats) const
+{
+    stats->bytesReferenced = mBytesReferenced;
+    stats->bytesCopied = mBytesCopied;
+
+    AmlMpBufferPool::Stats poolStats{};
+    if (mQueue != nullptr) {
+        mQueue->getPoolStats(&poolStats);
+    }
+    stats->auPoolHits = poolStats.hits;
+    stats->auPoolMisses = poolStats.misses;
+    stats->auPoolCachedBytes = poolStats.cachedBytes;
+    stats->auPoolHighWaterBytes = poolStats.highWaterBytes;
+}
+
+int SwTsParser::Stream::getVideoConfig(Aml_MP_DemuxVideoConfig* config) const
+{
+    ElementaryStreamQueue::VideoConfig videoConfig;
+    if (mQueue == nullptr || !mQueue->getVideoConfig(&videoConfig)) {
+        return -1;
+    }
+
+    if (videoConfig.configData->size() > sizeof(config->configData)) {
+        MLOGE("pid %#x parameter sets too large: %zu", mPid, videoConfig.configData->size());
         return -1;
     }
 
-    size_t neededSize = mBuffer->size() + payloadSizeBits/8;
+    config->width = videoConfig.width;
+    config->height = videoConfig.height;
+    config->profile = videoConfig.profile;
+    config->level = videoConfig.level;
+    config->generation = videoConfig.generation;
+    config->keyFrameFound = mKeyFrameFound;
+    config->framesBeforeKeyFrame = mFramesBeforeKeyFrame;
+    config->configDataSize = videoConfig.configData->size();
+    memcpy(config->configData, videoConfig.configData->data(), config->configDataSize);
+
+    return 0;
+}
+
+void SwTsParser::Stream::waitForKeyFrame()
+{
+    if (mHasKeyFrameFlags) {
+        mKeyFrameFound = false;
+        mFramesBeforeKeyFrame = 0;
+    }
+}
+
+void SwTsParser::Stream::clearPES()
+{
+    if (mBuffer != nullptr) {
+        mBuffer->setRange(0, 0);
+    }
+    mSegments.clear();
+    mPESSize = 0;
+    mExpectedPESSize = 0;
+}
+
+void SwTsParser::Stream::copySegments()
+{
+    size_t neededSize = mPESSize;
     if (mBuffer == nullptr || neededSize > mBuffer->capacity()) {
         neededSize = (neededSize + 65535) & ~65535;
 
@@ -1295,29 +2243,45 @@ int SwTsParser::Stream::parse(unsigned continuity_counter, unsigned payload_unit
         mBuffer = newBuffer;
     }
 
-    memcpy(mBuffer->data() + mBuffer->size(), br->data(), payloadSizeBits / 8);
-    mBuffer->setRange(0, mBuffer->size() + payloadSizeBits / 8);
-
-    return 0;
+    for (const struct iovec& segment : mSegments) {
+        memcpy(mBuffer->data() + mBuffer->size(), segment.iov_base, segment.iov_len);
+        mBuffer->setRange(0, mBuffer->size() + segment.iov_len);
+        mBytesCopied += segment.iov_len;
+    }
+    mSegments.clear();
 }
 
 int SwTsParser::Stream::flush()
 {
     int err = 0;
 
-    if (mBuffer == nullptr || mBuffer->size() == 0) {
+    if (mPESSize == 0) {
         return 0;
     }
 
+    // parsePES() reads the PES header in place, so it has to be contiguous.
+    // It nearly always fits in the first packet.
+    const uint8_t* head = mBuffer != nullptr && mBuffer->size() > 0 ? mBuffer->data() : (const uint8_t*)mSegments[0].iov_base;
+    size_t headSize = mBuffer != nullptr && mBuffer->size() > 0 ? mBuffer->size() : mSegments[0].iov_len;
+    if (headSize < mPESSize && (headSize < 9 || headSize < 9u + head[8])) {
+        copySegments();
+        head = mBuffer->data();
+        headSize = mBuffer->size();
+    }
+
 #if 0
     std::string result;
-    hexdump(mBuffer->data(), std::min(mBuffer->size(), (size_t)16), result);
+    hexdump(head, std::min(headSize, (size_t)16), result);
     MLOGI("flush:%s", result.c_str());
 #endif
 
-    AmlMpBitReader br(mBuffer->data(), mBuffer->size());
+    AmlMpBitReader br(head, headSize);
     err = parsePES(&br);
-    mBuffer->setRange(0, 0);
+
+    for (const struct iovec& segment : mSegments) {
+        mBytesReferenced += segment.iov_len;
+    }
+    clearPES();
 
     return err;
 }
@@ -1356,7 +2320,8 @@ int SwTsParser::Stream::parsePES(AmlMpBitReader* br)
         MLOGV("PES_scrambling_control = %u", PES_scrambling_control);
 
         MY_LOGV("PES_priority = %u", br->getBits(1));
-        MY_LOGV("data_alignment_indicator = %u", br->getBits(1));
+        unsigned data_alignment_indicator = br->getBits(1);
+        MLOGV("data_alignment_indicator = %u", data_alignment_indicator);
         MY_LOGV("copyright = %u", br->getBits(1));
         MY_LOGV("original_or_copy = %u", br->getBits(1));
 
@@ -1486,8 +2451,9 @@ int SwTsParser::Stream::parsePES(AmlMpBitReader* br)
 
         br->skipBits(optional_bytes_remaining * 8);
 
-        // ES data follows.
+        // ES data follows, br only covers the head of the PES.
         int32_t pesOffset = br->data() - basePtr;
+        size_t payloadSize = mPESSize - pesOffset;
 
         if (PES_packet_length != 0) {
             if (PES_packet_length < PES_header_data_length + 3) {
@@ -1497,10 +2463,10 @@ int SwTsParser::Stream::parsePES(AmlMpBitReader* br)
             unsigned dataLength =
                 PES_packet_length - 3 - PES_header_data_length;
 
-            if (br->numBitsLeft() < dataLength * 8) {
+            if (payloadSize < dataLength) {
                 ALOGE("PES packet does not carry enough data to contain "
-                     "payload. (numBitsLeft = %zu, required = %u)",
-                     br->numBitsLeft(), dataLength * 8);
+                     "payload. (payloadSize = %zu, required = %u)",
+                     payloadSize, dataLength);
 
                 return -1;
             }
@@ -1509,22 +2475,17 @@ int SwTsParser::Stream::parsePES(AmlMpBitReader* br)
                     dataLength, PES_packet_length, pesOffset);
 
             onPayloadData(
+                    stream_id, data_alignment_indicator,
                     PTS_DTS_flags, PTS, DTS,
-                    br->data(), dataLength, pesOffset);
-
-            br->skipBits(dataLength * 8);
+                    dataLength, pesOffset);
         } else {
             onPayloadData(
+                    stream_id, data_alignment_indicator,
                     PTS_DTS_flags, PTS, DTS,
-                    br->data(), br->numBitsLeft() / 8, pesOffset);
-
-            size_t payloadSizeBits = br->numBitsLeft();
-            if (payloadSizeBits % 8 != 0u) {
-                return -1;
-            }
+                    payloadSize, pesOffset);
 
             ALOGV("There's %zu bytes of payload, offset=%d",
-                    payloadSizeBits / 8, pesOffset);
+                    payloadSize, pesOffset);
         }
     } else if (stream_id == 0xbe) {  // padding_stream
         if (PES_packet_length == 0u) {
@@ -1542,9 +2503,41 @@ int SwTsParser::Stream::parsePES(AmlMpBitReader* br)
 }
 
 
-void SwTsParser::Stream::onPayloadData(unsigned PTS_DTS_flags __unused, uint64_t PTS, uint64_t DTS __unused, const uint8_t* data, size_t size, int32_t payloadOffset)
+void SwTsParser::Stream::onPayloadData(unsigned stream_id, unsigned data_alignment_indicator,
+        unsigned PTS_DTS_flags, uint64_t PTS, uint64_t DTS, size_t size, int32_t payloadOffset)
 {
-    int err = mQueue->appendData(data, size, PTS, payloadOffset);
+    // gather [payloadOffset, payloadOffset + size) of the PES
+    size_t skip = payloadOffset;
+    auto addRange = [&](uint8_t* data, size_t length) {
+        if (skip >= length) {
+            skip -= length;
+            return;
+        }
+
+        struct iovec iov;
+        iov.iov_base = data + skip;
+        iov.iov_len = std::min(length - skip, size);
+        mPayloadIov.push_back(iov);
+        size -= iov.iov_len;
+        skip = 0;
+    };
+
+    mPayloadIov.clear();
+    if (mBuffer != nullptr) {
+        addRange(mBuffer->data(), mBuffer->size());
+    }
+    for (size_t i = 0; i < mSegments.size() && size > 0; ++i) {
+        addRange((uint8_t*)mSegments[i].iov_base, mSegments[i].iov_len);
+    }
+
+    ElementaryStreamQueue::PesInfo pesInfo;
+    pesInfo.pts = PTS;
+    pesInfo.dts = PTS_DTS_flags == 3 ? (int64_t)DTS : -1;
+    pesInfo.streamId = stream_id;
+    pesInfo.dataAlignment = data_alignment_indicator;
+    pesInfo.payloadOffset = payloadOffset;
+
+    int err = mQueue->appendData(mPayloadIov.data(), (int)mPayloadIov.size(), pesInfo);
     if (err != 0) {
         MLOGE("append data failed!");
         return;
@@ -1552,6 +2545,18 @@ void SwTsParser::Stream::onPayloadData(unsigned PTS_DTS_flags __unused, uint64_t
 
     sptr<AmlMpBuffer> accessUnit;
     while ((accessUnit = mQueue->dequeueAccessUnit()) != nullptr) {
+        if (!mKeyFrameFound) {
+            if (accessUnit->int32Data() & (ElementaryStreamQueue::AU_FLAG_KEY_FRAME | ElementaryStreamQueue::AU_FLAG_RECOVERY_POINT)) {
+                MLOGI("pid %#x first key frame after %u frames", mPid, mFramesBeforeKeyFrame);
+                mKeyFrameFound = true;
+            } else {
+                ++mFramesBeforeKeyFrame;
+                if (mFlags & AML_MP_DEMUX_START_ON_KEY_FRAME) {
+                    continue;
+                }
+            }
+        }
+
         mFrames.push_back(accessUnit);
     }
 }
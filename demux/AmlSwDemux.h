@@ -11,6 +11,10 @@
 #define _AML_MP_SW_DEMUX_H_
 
 #include "AmlDemuxBase.h"
+#include <deque>
+#include <vector>
+#include <functional>
+#include <condition_variable>
 
 namespace aml_mp {
 class SwTsParser;
@@ -31,6 +35,14 @@ public:
     virtual int stop() override;
     virtual int flush() override;
     virtual int feedTs(const uint8_t* buffer, size_t size) override;
+    virtual int setFeedParams(const Aml_MP_DemuxFeedParams* params) override;
+    virtual int getStreamStatistics(int pid, Aml_MP_DemuxStreamStatistics* stats) override;
+    virtual int getPidStatistics(int pid, Aml_MP_DemuxPidStat* stat) override;
+    virtual int getVideoConfig(int pid, Aml_MP_DemuxVideoConfig* config) override;
+
+    // the TS parser without a demux around it. Its feedTs() takes whole TS
+    // packets and calls cb before it returns, on the caller's thread.
+    static sptr<ITsParser> createStandaloneParser(const std::function<ITsParser::FilterCallback>& cb);
 
 private:
     friend struct AmlMpEventHandlerReflector<AmlSwDemux>;
@@ -40,6 +52,19 @@ private:
         kWhatAddPid   = 'apid',
         kWhatRemovePid = 'rpid',
         kWhatDumpInfo = 'dmpI',
+        kWhatDrainQueue = 'drnQ',
+        kWhatGetStatistics = 'gsta',
+        kWhatGetVideoConfig = 'gvcf',
+    };
+
+    struct WorkItem;
+    struct ParserWorker;
+
+    struct PendingBuffer {
+        sptr<AmlMpBuffer> buffer;
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+        int32_t generation = 0;
     };
 
     virtual int addDemuxFilter(int pid, const Aml_MP_DemuxFilterParams* params) override;
@@ -48,7 +73,17 @@ private:
 
     void onMessageReceived(const sptr<AmlMpMessage>& msg);
 
-    void onFeedData(const sptr<AmlMpBuffer>& data);
+    int queueTs(const uint8_t* buffer, size_t size);
+    void completeBuffer(const PendingBuffer& entry, int result);
+    void onDrainQueue();
+    void onFeedData(const sptr<AmlMpBuffer>& data, bool ownsData = false);
+    int feedPacket(const uint8_t* packet);
+    void dispatchPackets(const sptr<AmlMpBuffer>& chunk);
+    sptr<SwTsParser> createTsParser();
+    int startWorkers(int count);
+    void stopWorkers();
+    size_t workerForFilter(int pid, const Aml_MP_DemuxFilterParams* params) const;
+    void runOnWorker(size_t index, const std::function<void(SwTsParser*)>& task, bool wait);
     int resync(const sptr<AmlMpBuffer>& buffer);
     void onFlush();
     void onAddFilterPid(int pid, Aml_MP_DemuxFilterParams* params);
@@ -63,10 +98,28 @@ private:
 
     std::mutex mLock;
     sptr<SwTsParser> mTsParser;
+    // every parser, for getPidStatistics(), guarded by mLock
+    std::vector<sptr<SwTsParser>> mParsers;
     sptr<AmlMpBuffer> mRemainingBytesBuffer;
 
     int mDumpFd = -1;
 
+    std::atomic<bool> mAsyncFeed{false};
+    std::mutex mFeedLock;
+    std::condition_variable mFeedCond;
+    Aml_MP_DemuxFeedParams mFeedParams{};
+    std::deque<PendingBuffer> mPendingBuffers;
+    size_t mInflightBuffers = 0;
+    bool mDrainPosted = false;
+    int64_t mDroppedBuffers = 0;
+
+    // PID sharded mode: mWorkers[0] owns mTsParser and gets every PID
+    // without a PES filter, each worker parses its PIDs on its own thread.
+    std::vector<sptr<ParserWorker>> mWorkers;
+    std::vector<std::vector<const uint8_t*>> mWorkerPackets;
+    std::vector<int> mWorkerStreams;
+    uint8_t mPidWorker[0x2000];
+
 private:
     AmlSwDemux(const AmlSwDemux&) = delete;
     AmlSwDemux& operator= (const AmlSwDemux&) = delete;
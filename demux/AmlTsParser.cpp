@@ -13,6 +13,16 @@
 #include "AmlTsParser.h"
 #include <vector>
 #include <utils/AmlMpUtils.h>
+#include <utils/AmlMpTsScanner.h>
+#include <utils/AmlMpEventLooper.h>
+#include <utils/AmlMpCrc32.h>
+#include <utils/AmlMpConfig.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
 
 static const char* mName = LOG_TAG;
 
@@ -102,6 +112,624 @@ void ProgramInfo::debugLog() const
     }
 }
 
+sptr<ProgramInfo> ProgramInfo::clone() const
+{
+    sptr<ProgramInfo> info = new ProgramInfo;
+    info->programNumber = programNumber;
+    info->pmtPid = pmtPid;
+    info->caSystemId = caSystemId;
+    info->emmPid = emmPid;
+    info->scrambled = scrambled;
+    info->scrambleInfo = scrambleInfo;
+    info->privateDataLength = privateDataLength;
+    memcpy(info->privateData, privateData, sizeof(privateData));
+    info->serviceIndex = serviceIndex;
+    info->serviceNum = serviceNum;
+    memcpy(info->ecmPid, ecmPid, sizeof(ecmPid));
+    info->audioCodec = audioCodec;
+    info->videoCodec = videoCodec;
+    info->subtitleCodec = subtitleCodec;
+    info->adCodec = adCodec;
+    info->audioPid = audioPid;
+    info->videoPid = videoPid;
+    info->subtitlePid = subtitlePid;
+    info->adPid = adPid;
+    info->compositionPageId = compositionPageId;
+    info->ancillaryPageId = ancillaryPageId;
+    info->magazine = magazine;
+    info->page = page;
+    info->audioStreams = audioStreams;
+    info->videoStreams = videoStreams;
+    info->subtitleStreams = subtitleStreams;
+
+    return info;
+}
+
+static bool isSameStreams(const std::vector<StreamInfo>& a, const std::vector<StreamInfo>& b)
+{
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const StreamInfo& x, const StreamInfo& y) {
+        return x.type == y.type && x.pid == y.pid && x.codecId == y.codecId;
+    });
+}
+
+bool ProgramInfo::isSameProgram(const ProgramInfo& other) const
+{
+    return programNumber == other.programNumber &&
+           pmtPid == other.pmtPid &&
+           scrambled == other.scrambled &&
+           caSystemId == other.caSystemId &&
+           emmPid == other.emmPid &&
+           std::equal(std::begin(ecmPid), std::end(ecmPid), std::begin(other.ecmPid)) &&
+           audioPid == other.audioPid && audioCodec == other.audioCodec &&
+           videoPid == other.videoPid && videoCodec == other.videoCodec &&
+           subtitlePid == other.subtitlePid && subtitleCodec == other.subtitleCodec &&
+           adPid == other.adPid && adCodec == other.adCodec &&
+           isSameStreams(audioStreams, other.audioStreams) &&
+           isSameStreams(videoStreams, other.videoStreams) &&
+           isSameStreams(subtitleStreams, other.subtitleStreams);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+ProgramInfoCache& ProgramInfoCache::instance()
+{
+    static ProgramInfoCache cache;
+    return cache;
+}
+
+ProgramInfoCache::ProgramInfoCache()
+{
+    setPersistentPath(AmlMpConfig::instance().mZapCachePath);
+}
+
+ProgramInfoCache::~ProgramInfoCache()
+{
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        mSaveThreadExit = true;
+    }
+    mSaveCond.notify_all();
+
+    if (mSaveThread.joinable()) {
+        mSaveThread.join();
+    }
+
+    flush();
+}
+
+std::string ProgramInfoCache::makeKey(int transportStreamId, int programNumber)
+{
+    char key[32];
+    snprintf(key, sizeof(key), "ts:%d/%d", transportStreamId, programNumber);
+    return key;
+}
+
+std::string ProgramInfoCache::makeKey(const std::string& uri, int programNumber)
+{
+    return uri + "#" + std::to_string(programNumber);
+}
+
+sptr<ProgramInfo> ProgramInfoCache::lookup(const std::string& key, int* pmtVersion)
+{
+    std::lock_guard<std::mutex> _l(mLock);
+    ++mStats.lookups;
+
+    auto it = mEntries.find(key);
+    if (it == mEntries.end()) {
+        return nullptr;
+    }
+
+    ++mStats.hits;
+    it->second.lastUsed = ++mUseCount;
+    if (pmtVersion != nullptr) {
+        *pmtVersion = it->second.pmtVersion;
+    }
+
+    return it->second.info->clone();
+}
+
+void ProgramInfoCache::update(const std::string& key, const sptr<ProgramInfo>& info, int pmtVersion)
+{
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        auto it = mEntries.find(key);
+        if (it != mEntries.end() && it->second.pmtVersion == pmtVersion && it->second.info->isSameProgram(*info)) {
+            it->second.lastUsed = ++mUseCount;
+            return;
+        }
+
+        mEntries[key] = {info->clone(), pmtVersion, ++mUseCount};
+        evict_l();
+    }
+
+    persist();
+}
+
+void ProgramInfoCache::erase(const std::string& key)
+{
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        if (mEntries.erase(key) == 0) {
+            return;
+        }
+    }
+
+    persist();
+}
+
+void ProgramInfoCache::evict_l()
+{
+    while (mEntries.size() > kMaxEntries) {
+        auto oldest = std::min_element(mEntries.begin(), mEntries.end(), [](const std::pair<const std::string, Entry>& a, const std::pair<const std::string, Entry>& b) {
+            return a.second.lastUsed < b.second.lastUsed;
+        });
+        mEntries.erase(oldest);
+    }
+}
+
+void ProgramInfoCache::clear()
+{
+    // leaves the file as it is
+    std::unique_lock<std::mutex> l(mLock);
+    mSaveCond.wait(l, [this] { return !mSaving; });
+    mSavePending = false;
+    mEntries.clear();
+    mStats = Stats{};
+}
+
+void ProgramInfoCache::recordValidation(bool changed, int64_t acquisitionUs)
+{
+    std::lock_guard<std::mutex> _l(mLock);
+    if (changed) {
+        ++mStats.corrected;
+    } else {
+        ++mStats.confirmed;
+        mStats.savedUs += acquisitionUs;
+    }
+}
+
+void ProgramInfoCache::getStats(Stats* stats) const
+{
+    std::lock_guard<std::mutex> _l(mLock);
+    *stats = mStats;
+}
+
+////////////////////////////////////////
+// The file is a header and the entries, least recently used first:
+//   header: "AMZC", format version, entry count, payload size, CRC_32 of the payload
+//   entry:  key, pmt version, program info
+// All fields are little endian. A file of another format version is ignored,
+// kFileVersion must be bumped whenever writeProgramInfo() changes.
+static const uint8_t kFileMagic[4] = {'A', 'M', 'Z', 'C'};
+static const uint32_t kFileVersion = 1;
+static const size_t kFileHeaderSize = 20;
+
+namespace {
+class ByteWriter
+{
+public:
+    explicit ByteWriter(std::vector<uint8_t>& data) : mData(data) {}
+
+    void put8(uint32_t value) {
+        mData.push_back(value);
+    }
+
+    void put16(uint32_t value) {
+        put8(value);
+        put8(value >> 8);
+    }
+
+    void put32(uint32_t value) {
+        put16(value);
+        put16(value >> 16);
+    }
+
+    void putBytes(const void* data, size_t size) {
+        mData.insert(mData.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+    }
+
+private:
+    std::vector<uint8_t>& mData;
+};
+
+// reads return 0 once past the end, ok() is false from then on
+class ByteReader
+{
+public:
+    ByteReader(const uint8_t* data, size_t size) : mData(data), mEnd(data + size) {}
+
+    bool ok() const {
+        return mOk;
+    }
+
+    bool atEnd() const {
+        return mData == mEnd;
+    }
+
+    uint32_t get8() {
+        if (!check(1)) {
+            return 0;
+        }
+        return *mData++;
+    }
+
+    uint32_t get16() {
+        uint32_t value = get8();
+        return value | get8() << 8;
+    }
+
+    uint32_t get32() {
+        uint32_t value = get16();
+        return value | get16() << 16;
+    }
+
+    bool getBytes(void* data, size_t size) {
+        if (!check(size)) {
+            return false;
+        }
+        memcpy(data, mData, size);
+        mData += size;
+        return true;
+    }
+
+private:
+    bool check(size_t size) {
+        mOk = mOk && (size_t)(mEnd - mData) >= size;
+        return mOk;
+    }
+
+    const uint8_t* mData;
+    const uint8_t* mEnd;
+    bool mOk = true;
+};
+
+void writeStreams(ByteWriter& w, const std::vector<StreamInfo>& streams)
+{
+    w.put16(streams.size());
+    for (const StreamInfo& stream : streams) {
+        w.put8(stream.type);
+        w.put16(stream.pid);
+        w.put32(stream.codecId);
+        w.put32(stream.compositionPageId);
+        w.put32(stream.ancillaryPageId);
+        w.put32(stream.magazine);
+        w.put32(stream.page);
+    }
+}
+
+void readStreams(ByteReader& r, std::vector<StreamInfo>& streams)
+{
+    size_t count = r.get16();
+    for (size_t i = 0; i < count && r.ok(); ++i) {
+        StreamInfo stream;
+        stream.type = (STREAM_TYPE_t)r.get8();
+        stream.pid = r.get16();
+        stream.codecId = (Aml_MP_CodecID)r.get32();
+        stream.compositionPageId = r.get32();
+        stream.ancillaryPageId = r.get32();
+        stream.magazine = r.get32();
+        stream.page = r.get32();
+        streams.push_back(stream);
+    }
+}
+
+void writeProgramInfo(ByteWriter& w, const ProgramInfo& info)
+{
+    w.put32(info.programNumber);
+    w.put16(info.pmtPid);
+    w.put32(info.caSystemId);
+    w.put16(info.emmPid);
+    w.put8(info.scrambled);
+    w.put8(info.scrambleInfo.algo);
+    w.put8(info.scrambleInfo.mode);
+    w.put8(info.scrambleInfo.alignment);
+    w.put8(info.scrambleInfo.has_iv_value);
+    w.putBytes(info.scrambleInfo.iv_value_data, sizeof(info.scrambleInfo.iv_value_data));
+    size_t privateDataLength = std::min<size_t>(std::max(info.privateDataLength, 0), sizeof(info.privateData));
+    w.put16(privateDataLength);
+    w.putBytes(info.privateData, privateDataLength);
+    w.put32(info.serviceIndex);
+    w.put32(info.serviceNum);
+    for (int ecmPid : info.ecmPid) {
+        w.put16(ecmPid);
+    }
+    w.put32(info.audioCodec);
+    w.put32(info.videoCodec);
+    w.put32(info.subtitleCodec);
+    w.put32(info.adCodec);
+    w.put16(info.audioPid);
+    w.put16(info.videoPid);
+    w.put16(info.subtitlePid);
+    w.put16(info.adPid);
+    w.put32(info.compositionPageId);
+    w.put32(info.ancillaryPageId);
+    w.put32(info.magazine);
+    w.put32(info.page);
+    writeStreams(w, info.audioStreams);
+    writeStreams(w, info.videoStreams);
+    writeStreams(w, info.subtitleStreams);
+}
+
+sptr<ProgramInfo> readProgramInfo(ByteReader& r)
+{
+    sptr<ProgramInfo> info = new ProgramInfo;
+    info->programNumber = r.get32();
+    info->pmtPid = r.get16();
+    info->caSystemId = r.get32();
+    info->emmPid = r.get16();
+    info->scrambled = r.get8();
+    info->scrambleInfo.algo = (SCRAMBLE_ALGO_t)r.get8();
+    info->scrambleInfo.mode = (SCRAMBLE_MODE_t)r.get8();
+    info->scrambleInfo.alignment = (SCRAMBLE_ALIGNMENT_t)r.get8();
+    info->scrambleInfo.has_iv_value = r.get8();
+    r.getBytes(info->scrambleInfo.iv_value_data, sizeof(info->scrambleInfo.iv_value_data));
+    info->privateDataLength = r.get16();
+    if ((size_t)info->privateDataLength > sizeof(info->privateData)) {
+        return nullptr;
+    }
+    r.getBytes(info->privateData, info->privateDataLength);
+    info->serviceIndex = r.get32();
+    info->serviceNum = r.get32();
+    for (int& ecmPid : info->ecmPid) {
+        ecmPid = r.get16();
+    }
+    info->audioCodec = (Aml_MP_CodecID)r.get32();
+    info->videoCodec = (Aml_MP_CodecID)r.get32();
+    info->subtitleCodec = (Aml_MP_CodecID)r.get32();
+    info->adCodec = (Aml_MP_CodecID)r.get32();
+    info->audioPid = r.get16();
+    info->videoPid = r.get16();
+    info->subtitlePid = r.get16();
+    info->adPid = r.get16();
+    info->compositionPageId = r.get32();
+    info->ancillaryPageId = r.get32();
+    info->magazine = r.get32();
+    info->page = r.get32();
+    readStreams(r, info->audioStreams);
+    readStreams(r, info->videoStreams);
+    readStreams(r, info->subtitleStreams);
+
+    return r.ok() ? info : nullptr;
+}
+}
+
+int ProgramInfoCache::setPersistentPath(const std::string& path)
+{
+    // the changes so far belong to the previous path
+    flush();
+
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        mPath = path;
+    }
+
+    if (path.empty()) {
+        return 0;
+    }
+
+    return load(path);
+}
+
+int ProgramInfoCache::load(const std::string& path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        MLOGI("no zap cache %s: %s", path.c_str(), strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < kFileHeaderSize) {
+        MLOGW("zap cache %s is truncated", path.c_str());
+        ::close(fd);
+        return -1;
+    }
+
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        MLOGE("mmap %s failed: %s", path.c_str(), strerror(errno));
+        return -1;
+    }
+
+    const uint8_t* p = (const uint8_t*)data;
+    ByteReader header(p, kFileHeaderSize);
+    uint8_t magic[sizeof(kFileMagic)];
+    header.getBytes(magic, sizeof(magic));
+    uint32_t version = header.get32();
+    uint32_t entryCount = header.get32();
+    uint32_t payloadSize = header.get32();
+    uint32_t crc = header.get32();
+
+    std::vector<std::pair<std::string, Entry>> entries;
+    bool valid = false;
+    if (memcmp(magic, kFileMagic, sizeof(magic)) != 0 || version != kFileVersion) {
+        MLOGW("zap cache %s has another format, version:%u", path.c_str(), version);
+    } else if (payloadSize != (size_t)st.st_size - kFileHeaderSize || crc32_mpeg2(p + kFileHeaderSize, payloadSize) != crc) {
+        MLOGW("zap cache %s is corrupt", path.c_str());
+    } else {
+        ByteReader r(p + kFileHeaderSize, payloadSize);
+        for (uint32_t i = 0; i < entryCount; ++i) {
+            std::string key(r.get16(), '\0');
+            r.getBytes(&key[0], key.size());
+            int pmtVersion = (int8_t)r.get8();
+            sptr<ProgramInfo> info = readProgramInfo(r);
+            if (info == nullptr) {
+                break;
+            }
+            entries.push_back({key, {info, pmtVersion, 0}});
+        }
+
+        valid = entries.size() == entryCount && r.atEnd();
+        if (!valid) {
+            MLOGW("zap cache %s is corrupt", path.c_str());
+        }
+    }
+    munmap(data, st.st_size);
+
+    if (!valid) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> _l(mLock);
+    for (auto& entry : entries) {
+        entry.second.lastUsed = ++mUseCount;
+        mEntries.insert(entry);
+    }
+    evict_l();
+    MLOGI("zap cache %s loaded, %zu programs", path.c_str(), entries.size());
+
+    return 0;
+}
+
+int ProgramInfoCache::save(const std::string& path) const
+{
+    std::lock_guard<std::mutex> _s(mSaveLock);
+
+    std::vector<uint8_t> payload;
+    uint32_t entryCount;
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        std::vector<const std::pair<const std::string, Entry>*> entries;
+        for (const auto& entry : mEntries) {
+            entries.push_back(&entry);
+        }
+        std::sort(entries.begin(), entries.end(), [](const std::pair<const std::string, Entry>* a, const std::pair<const std::string, Entry>* b) {
+            return a->second.lastUsed < b->second.lastUsed;
+        });
+
+        ByteWriter w(payload);
+        for (const auto* entry : entries) {
+            w.put16(entry->first.size());
+            w.putBytes(entry->first.data(), entry->first.size());
+            w.put8(entry->second.pmtVersion);
+            writeProgramInfo(w, *entry->second.info);
+        }
+        entryCount = entries.size();
+    }
+
+    std::vector<uint8_t> file;
+    ByteWriter w(file);
+    w.putBytes(kFileMagic, sizeof(kFileMagic));
+    w.put32(kFileVersion);
+    w.put32(entryCount);
+    w.put32(payload.size());
+    w.put32(crc32_mpeg2(payload.data(), payload.size()));
+    file.insert(file.end(), payload.begin(), payload.end());
+
+    std::string tmpPath = path + ".tmp";
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        MLOGE("open %s failed: %s", tmpPath.c_str(), strerror(errno));
+        return -1;
+    }
+
+    size_t written = 0;
+    while (written < file.size()) {
+        ssize_t ret = ::write(fd, file.data() + written, file.size() - written);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret <= 0) {
+            break;
+        }
+        written += ret;
+    }
+
+    // the data must be on disk before the rename, or a crash can leave an empty cache
+    if (written != file.size() || fsync(fd) < 0) {
+        MLOGE("write %s failed: %s", tmpPath.c_str(), strerror(errno));
+        ::close(fd);
+        unlink(tmpPath.c_str());
+        return -1;
+    }
+    ::close(fd);
+
+    if (rename(tmpPath.c_str(), path.c_str()) < 0) {
+        MLOGE("rename %s failed: %s", tmpPath.c_str(), strerror(errno));
+        unlink(tmpPath.c_str());
+        return -1;
+    }
+
+    // and the rename is only durable once the directory is synced
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || fsync(fd) < 0) {
+        MLOGW("sync %s failed: %s", dir.c_str(), strerror(errno));
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+
+    return 0;
+}
+
+void ProgramInfoCache::flush()
+{
+    std::string path;
+    {
+        std::unique_lock<std::mutex> l(mLock);
+        mSaveCond.wait(l, [this] { return !mSaving; });
+        if (!mSavePending) {
+            return;
+        }
+        mSavePending = false;
+        path = mPath;
+    }
+
+    if (!path.empty()) {
+        save(path);
+    }
+}
+
+void ProgramInfoCache::persist()
+{
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        if (mPath.empty() || mSavePending) {
+            return;
+        }
+
+        // the changes until the deadline go in the same save
+        mSavePending = true;
+        mSaveDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(kSaveDelayMs);
+        if (!mSaveThread.joinable() && !mSaveThreadExit) {
+            mSaveThread = std::thread([this] {
+                saveThreadLoop();
+            });
+        }
+    }
+
+    mSaveCond.notify_all();
+}
+
+void ProgramInfoCache::saveThreadLoop()
+{
+    std::unique_lock<std::mutex> l(mLock);
+    for (;;) {
+        mSaveCond.wait(l, [this] { return mSavePending || mSaveThreadExit; });
+        if (mSaveThreadExit) {
+            break;
+        }
+
+        mSaveCond.wait_until(l, mSaveDeadline, [this] { return !mSavePending || mSaveThreadExit; });
+        if (!mSavePending || mSaveThreadExit) {
+            // flushed, or left to the destructor
+            continue;
+        }
+
+        mSavePending = false;
+        mSaving = true;
+        std::string path = mPath;
+        l.unlock();
+        if (!path.empty()) {
+            save(path);
+        }
+        l.lock();
+        mSaving = false;
+        mSaveCond.notify_all();
+    }
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 Parser::Parser(Aml_MP_DemuxId demuxId, bool isHardwareSource, Aml_MP_DemuxType demuxType, bool isSecureBuffer)
 : mIsHardwareSource(isHardwareSource)
@@ -159,10 +787,24 @@ void Parser::selectProgram(int vPid, int aPid)
     mAPid = aPid;
 }
 
+void Parser::setCacheKey(const std::string& key)
+{
+    std::lock_guard<std::mutex> _l(mLock);
+    mCacheKey = key;
+}
+
+bool Parser::isProgramInfoCached() const
+{
+    std::lock_guard<std::mutex> _l(mLock);
+    return mCachedProgramInfo != nullptr;
+}
+
 void Parser::parseProgramInfoAsync()
 {
+    lookupProgramInfoCache();
+
     addSectionFilter(0, patCb, this);
-    addSectionFilter(1, catCb, this);
+    addSectionFilter(1, catCb, this, true, true);
 }
 
 int Parser::waitCATSectionDataParsed()
@@ -235,7 +877,7 @@ sptr<ProgramInfo> Parser::getProgramInfo() const
         return info;
     }
 
-    return nullptr;
+    return mCachedProgramInfo;
 }
 
 int Parser::writeData(const uint8_t* buffer, size_t size)
@@ -255,6 +897,21 @@ int Parser::writeData(const uint8_t* buffer, size_t size)
     return wlen;
 }
 
+int Parser::getPidStatistics(int pid, Aml_MP_DemuxPidStat* stat)
+{
+    sptr<AmlDemuxBase> demux;
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        demux = mDemux;
+    }
+
+    if (demux == nullptr) {
+        return -1;
+    }
+
+    return demux->getPidStatistics(pid, stat);
+}
+
 int Parser::patCb(int pid, size_t size, const uint8_t* data, void* userData)
 {
     AML_MP_UNUSED(pid);
@@ -298,9 +955,11 @@ int Parser::patCb(int pid, size_t size, const uint8_t* data, void* userData)
     return 0;
 }
 
-int Parser::pmtCb(int pid, size_t size, const uint8_t* data, void* userData)
+int Parser::pmtCb(int pid, const sptr<AmlMpBuffer>& buffer, void* userData)
 {
     Parser* parser = (Parser*)userData;
+    size_t size = buffer->size();
+    const uint8_t* data = buffer->data();
 
     MLOGI("pmt cb, pid:%d, size:%zu", pid, size);
     Section section(data, size);
@@ -541,7 +1200,7 @@ int Parser::pmtCb(int pid, size_t size, const uint8_t* data, void* userData)
     }
 
     if (parser) {
-        SectionData sectionData(pid, size, (uint8_t *)data);
+        SectionData sectionData(pid, buffer);
         parser->onPmtParsed(sectionData, results);
     }
 
@@ -549,9 +1208,11 @@ int Parser::pmtCb(int pid, size_t size, const uint8_t* data, void* userData)
 }
 
 
-int Parser::catCb(int pid, size_t size, const uint8_t* data, void* userData)
+int Parser::catCb(int pid, const sptr<AmlMpBuffer>& buffer, void* userData)
 {
     Parser* parser = (Parser*)userData;
+    size_t size = buffer->size();
+    const uint8_t* data = buffer->data();
 
     MLOGI("cat cb, size:%zu", size);
     Section section(data, size);
@@ -603,30 +1264,27 @@ int Parser::catCb(int pid, size_t size, const uint8_t* data, void* userData)
     }
 
     if (parser) {
-        SectionData sectionData(pid, size, (uint8_t *)data);
+        SectionData sectionData(pid, buffer);
         parser->onCatParsed(sectionData, results);
     }
 
     return 0;
 }
 
-int Parser::ecmCb(int pid, size_t size, const uint8_t* data, void* userData)
+int Parser::ecmCb(int pid, const sptr<AmlMpBuffer>& buffer, void* userData)
 {
     Parser* parser = (Parser*)userData;
 
-    MLOGI("ecm cb, pid:0x%04X, size:%zu", pid, size);
+    MLOGI("ecm cb, pid:0x%04X, size:%zu", pid, buffer->size());
     ECMSection results;
     results.ecmPid = pid;
-    results.size = size;
-    results.data = new uint8_t[size];
-    memcpy(results.data, data, size);
+    results.size = buffer->size();
+    results.data = buffer->data();
 
     if (parser) {
         parser->onEcmParsed(results);
     }
 
-    delete[] results.data;
-
     return 0;
 }
 
@@ -634,6 +1292,7 @@ void Parser::onPatParsed(const PATSection& result)
 {
     MLOGI("PATSection parsed: version:%d", result.version_number);
     removeFilter(0);
+    checkCachedProgram(result);
 
     int programCount = 0;
     mPidProgramMap.clear();
@@ -647,7 +1306,7 @@ void Parser::onPatParsed(const PATSection& result)
         if (useFirstProgram && mProgramNumber == -1) {
             mProgramNumber = p.programNumber;
         }
-        addSectionFilter(p.pmtPid, pmtCb, this);
+        addSectionFilter(p.pmtPid, pmtCb, this, true, true);
     }
 
     if (programCount == 0) {
@@ -718,7 +1377,7 @@ void Parser::onPmtParsed(const SectionData& sectionData, const PMTSection& resul
 
     if (isNewEcm && results.scrambled) {
         // filter ecmData
-        addSectionFilter(results.ecmPid, ecmCb, this, false);
+        addSectionFilter(results.ecmPid, ecmCb, this, false, true);
     }
 
     sptr<ProgramInfo> programInfo = mProgramInfo;
@@ -864,6 +1523,8 @@ void Parser::onPmtParsed(const SectionData& sectionData, const PMTSection& resul
     }
 
     if (mProgramInfo->isComplete()) {
+        updateProgramInfoCache(results);
+
         std::lock_guard<std::mutex> _l(mLock);
         notifyParseDone_l();
     }
@@ -1025,15 +1686,127 @@ bool Parser::checkPidChange(const PMTSection& oldPmt, const PMTSection& newPmt,
     return isPidChange;
 }
 
+void Parser::lookupProgramInfoCache()
+{
+    std::lock_guard<std::mutex> _l(mLock);
+    mParseStartUs = AmlMpEventLooper::GetNowUs();
+    if (mCacheKey.empty()) {
+        return;
+    }
+
+    // a program selected by its pids has to have them
+    auto hasPid = [](const std::vector<StreamInfo>& streams, int pid) {
+        return pid == AML_MP_INVALID_PID || std::any_of(streams.begin(), streams.end(), [pid](const StreamInfo& stream) {
+            return stream.pid == pid;
+        });
+    };
+
+    sptr<ProgramInfo> info = ProgramInfoCache::instance().lookup(mCacheKey, &mCachedPmtVersion);
+    if (info == nullptr || !info->isComplete() ||
+            (mProgramNumber != -1 && mProgramNumber != info->programNumber) ||
+            !hasPid(info->videoStreams, mVPid) || !hasPid(info->audioStreams, mAPid)) {
+        MLOGI("%s not cached", mCacheKey.c_str());
+        return;
+    }
+
+    MLOGI("%s cached, program:%d, pmt version:%d", mCacheKey.c_str(), info->programNumber, mCachedPmtVersion);
+    mCachedProgramInfo = info;
+    notifyParseDone_l();
+}
+
+void Parser::checkCachedProgram(const PATSection& results)
+{
+    std::string key;
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        if (mCachedProgramInfo == nullptr) {
+            return;
+        }
+
+        int programNumber = mCachedProgramInfo->programNumber;
+        if (std::any_of(results.pmtInfos.begin(), results.pmtInfos.end(), [programNumber](const PMTInfo& info) {
+            return info.programNumber == programNumber;
+        })) {
+            return;
+        }
+
+        MLOGW("cached program %d is not in the PAT any more", programNumber);
+        key = mCacheKey;
+        mCachedProgramInfo.clear();
+    }
+
+    ProgramInfoCache::instance().erase(key);
+    ProgramInfoCache::instance().recordValidation(true, 0);
+
+    if (mCb) {
+        mCb(ProgramEventType::EVENT_PROGRAM_CHANGED, AML_MP_INVALID_PID, -1, nullptr);
+    }
+}
+
+void Parser::updateProgramInfoCache(const PMTSection& results)
+{
+    std::string key;
+    sptr<ProgramInfo> cached;
+    int cachedPmtVersion;
+    int64_t acquisitionUs;
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        if (mCacheKey.empty()) {
+            return;
+        }
+
+        key = mCacheKey;
+        cached = mCachedProgramInfo;
+        cachedPmtVersion = mCachedPmtVersion;
+        mCachedProgramInfo.clear();
+        acquisitionUs = AmlMpEventLooper::GetNowUs() - mParseStartUs;
+    }
+
+    ProgramInfoCache& cache = ProgramInfoCache::instance();
+    if (cached != nullptr) {
+        // the same PMT version can only describe the same program
+        bool changed = !(cached->pmtPid == results.pmtPid && cachedPmtVersion == results.version_number) &&
+                       !cached->isSameProgram(*mProgramInfo);
+        cache.recordValidation(changed, acquisitionUs);
+
+        if (changed) {
+            MLOGW("cached program %d changed, pmt version:%d -> %d", cached->programNumber, cachedPmtVersion, results.version_number);
+            if (mCb) {
+                mCb(ProgramEventType::EVENT_PROGRAM_CHANGED, mProgramInfo->pmtPid, mProgramInfo->programNumber, mProgramInfo.get());
+            }
+        } else {
+            MLOGI("cached program %d confirmed, %" PRId64 " ms of PSI acquisition saved", cached->programNumber, acquisitionUs / 1000);
+        }
+    }
+
+    cache.update(key, mProgramInfo, results.version_number);
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 int Parser::addFilter(int pid, Aml_MP_Demux_FilterCb cb, void* userData, const Aml_MP_DemuxFilterParams* params)
 {
-    int ret = 0;
     if (mFilters.find(pid) != mFilters.end()) {
         MLOGW("addFilter repeatedly, pid:%d", pid);
         return -1;
     }
 
+    return addFilter(pid, mDemux->createFilter(cb, userData), params);
+}
+
+int Parser::addFilter(int pid, Aml_MP_Demux_FilterLeaseCb cb, void* userData, const Aml_MP_DemuxFilterParams* params)
+{
+    if (mFilters.find(pid) != mFilters.end()) {
+        MLOGW("addFilter repeatedly, pid:%d", pid);
+        return -1;
+    }
+
+    return addFilter(pid, mDemux->createFilter(cb, userData), params);
+}
+
+int Parser::addFilter(int pid, AmlDemuxBase::FILTER filter, const Aml_MP_DemuxFilterParams* params)
+{
+    int ret = 0;
+
     sptr<FilterContext> context = new FilterContext(pid);
     if (context == nullptr) {
         return -1;
@@ -1043,14 +1816,11 @@ int Parser::addFilter(int pid, Aml_MP_Demux_FilterCb cb, void* userData, const A
     ret = mDemux->openChannel(context->channel);
     if (ret < 0) {
         MLOGE("open channel pid:%d failed!", pid);
+        mDemux->destroyFilter(filter);
         return ret;
     }
 
-    context->filter = mDemux->createFilter(cb, userData);
-    if (ret < 0) {
-        MLOGE("create filter for pid:%d failed!", pid);
-        return ret;
-    }
+    context->filter = filter;
 
     ret = mDemux->attachFilter(context->filter, context->channel);
     if (ret < 0) {
@@ -1127,32 +1897,17 @@ void Parser::notifyParseDone_l()
 
 size_t findEcmPacket(const uint8_t* buffer, size_t size, const std::vector<int>& ecmPids, size_t* ecmSize)
 {
-    size_t offset = 0;
-    int pid = -1;
-
-    for (; offset <= size-TS_PACKET_SIZE; ) {
-        if (buffer[offset] != 0x47 || buffer[offset+TS_PACKET_SIZE] != 0x47) {
-            ++offset;
-            continue;
-        }
-
-        pid = (buffer[offset+1]<<8 | buffer[offset+2]) & 0x1FFF;
-        if (pid == 0 || pid == 0x1FFF) {
-            offset += TS_PACKET_SIZE;
-            continue;
+    AmlMpTsPidSet pids;
+    for (int pid : ecmPids) {
+        if (pid != 0 && pid != 0x1FFF) {
+            pids.add(pid);
         }
-
-        for (size_t i = 0; i < ecmPids.size(); ++i) {
-            if (pid == ecmPids[i]) {
-                *ecmSize = TS_PACKET_SIZE;
-                return offset;
-            }
-        }
-        offset += TS_PACKET_SIZE;
     }
 
-    *ecmSize = 0;
-    return size;
+    size_t offset = tsFindPidPacket(buffer, size, pids, TS_PACKET_SIZE);
+    *ecmSize = offset < size ? TS_PACKET_SIZE : 0;
+
+    return offset;
 }
 
 
@@ -12,11 +12,16 @@
 
 #include <utils/AmlMpRefBase.h>
 #include <utils/AmlMpLog.h>
+#include <utils/AmlMpBuffer.h>
 #include <map>
 #include <vector>
 #include <set>
+#include <string>
 #include <mutex>
+#include <thread>
+#include <chrono>
 #include <condition_variable>
+#include <string.h>
 #include <Aml_MP/Common.h>
 #include <demux/AmlDemuxBase.h>
 
@@ -131,6 +136,7 @@ struct SectionData : public AmlMpRefBase
     int pid;
     int size;
     uint8_t* data = nullptr;
+    sptr<AmlMpBuffer> buffer;   // set if data points into a leased buffer, not a copy
 
     SectionData()
     {
@@ -142,6 +148,14 @@ struct SectionData : public AmlMpRefBase
         init(pid, size, data);
     }
 
+    SectionData(int pid, const sptr<AmlMpBuffer>& buffer)
+    : pid(pid)
+    , size(buffer->size())
+    , data(buffer->data())
+    , buffer(buffer)
+    {
+    }
+
     ~SectionData()
     {
         reset();
@@ -157,8 +171,9 @@ struct SectionData : public AmlMpRefBase
 
     void reset()
     {
-        if (data)
-        {
+        if (buffer != nullptr) {
+            buffer.clear();
+        } else if (data) {
             delete[] data;
         }
 
@@ -219,6 +234,94 @@ public:
                (!scrambled || (hasEcmPid || hasEmmPid));
     }
     void debugLog() const;
+    // AmlMpRefBase can't be copied, this copies the fields into a new ProgramInfo
+    sptr<ProgramInfo> clone() const;
+    // same streams, codecs and CA setup
+    bool isSameProgram(const ProgramInfo& other) const;
+};
+
+// The ProgramInfo of the programs played recently, so a zap back to one of
+// them can start before its PAT and PMT come around again. Parser serves
+// the cached info and validates it against the live PMT, see
+// Parser::setCacheKey(). The player uses it for a channel named by
+// AML_MP_PLAYER_PARAMETER_PROGRAM_CACHE_KEY.
+class ProgramInfoCache
+{
+public:
+    struct Stats {
+        uint64_t lookups;
+        uint64_t hits;
+        uint64_t confirmed;         // hits the live PSI agreed with
+        uint64_t corrected;         // hits the live PSI changed
+        int64_t savedUs;            // PSI acquisition time of the confirmed hits
+    };
+
+    static const size_t kMaxEntries = 64;
+    static const int kSaveDelayMs = 1000;
+
+    static ProgramInfoCache& instance();
+
+    // a key for a program of a transport stream, or of a source uri
+    static std::string makeKey(int transportStreamId, int programNumber);
+    static std::string makeKey(const std::string& uri, int programNumber);
+
+    // a copy of the cached info, nullptr if key isn't cached
+    sptr<ProgramInfo> lookup(const std::string& key, int* pmtVersion = nullptr);
+    // keeps a copy of info, the least recently used entry goes above kMaxEntries
+    void update(const std::string& key, const sptr<ProgramInfo>& info, int pmtVersion);
+    void erase(const std::string& key);
+    // drops the entries and a save not written yet
+    void clear();
+
+    void recordValidation(bool changed, int64_t acquisitionUs);
+    void getStats(Stats* stats) const;
+
+    // Loads path, then saves the cache to it whenever an entry is added, changed
+    // or erased, so the first zap after a reboot is a hit. Empty path keeps the
+    // cache in memory only. Set from vendor.amlmp.zap-cache-path at startup.
+    // The saves are written by a background thread, kSaveDelayMs after the
+    // first change, so the section callbacks never wait for the disk.
+    int setPersistentPath(const std::string& path);
+    // writes a save scheduled by a change now, and waits for one in progress
+    void flush();
+    // adds the entries of a file written by save() that aren't cached yet,
+    // -1 if it is missing, corrupt or of another format version
+    int load(const std::string& path);
+    // writes path.tmp and renames it over path
+    int save(const std::string& path) const;
+
+private:
+    struct Entry {
+        sptr<ProgramInfo> info;
+        int pmtVersion;
+        uint64_t lastUsed;
+    };
+
+    ProgramInfoCache();
+    ~ProgramInfoCache();
+    void evict_l();
+    void persist();
+    void saveThreadLoop();
+
+    mutable std::mutex mLock;
+    std::map<std::string, Entry> mEntries;
+    uint64_t mUseCount = 0;
+    Stats mStats{};
+    std::string mPath;
+
+    // keeps the saves of concurrent updates in order
+    mutable std::mutex mSaveLock;
+
+    // started by the first change to save
+    std::thread mSaveThread;
+    std::condition_variable mSaveCond;
+    std::chrono::steady_clock::time_point mSaveDeadline;
+    bool mSavePending = false;
+    bool mSaving = false;
+    bool mSaveThreadExit = false;
+
+    ProgramInfoCache(const ProgramInfoCache&) = delete;
+    ProgramInfoCache& operator=(const ProgramInfoCache&) = delete;
 };
 
 class Parser : public AmlMpRefBase
@@ -229,18 +332,31 @@ public:
     int open();
     void selectProgram(int programNumber);
     void selectProgram(int vPid, int aPid);
+    // Before parseProgramInfoAsync(). If key is in ProgramInfoCache, waitProgramInfoParsed()
+    // returns at once and getProgramInfo() returns the cached info until the live PMT is
+    // parsed. EVENT_PROGRAM_CHANGED is sent if the live PSI differs from it.
+    void setCacheKey(const std::string& key);
+    // true while getProgramInfo() returns the cached info
+    bool isProgramInfoCached() const;
     void parseProgramInfoAsync();
     int waitProgramInfoParsed();
     int waitCATSectionDataParsed();
     sptr<ProgramInfo> parseProgramInfo();
     sptr<ProgramInfo> getProgramInfo() const;
     int addFilter(int pid, Aml_MP_Demux_FilterCb cb, void* userData, const Aml_MP_DemuxFilterParams* params);
+    int addFilter(int pid, Aml_MP_Demux_FilterLeaseCb cb, void* userData, const Aml_MP_DemuxFilterParams* params);
     int removeFilter(int pid);
 
-    int addSectionFilter(int pid, Aml_MP_Demux_FilterCb cb, void* userData, bool checkCRC = true) {
+    // FilterCb is Aml_MP_Demux_FilterCb or Aml_MP_Demux_FilterLeaseCb
+    template <typename FilterCb>
+    int addSectionFilter(int pid, FilterCb cb, void* userData, bool checkCRC = true, bool deliverOnChange = false) {
         Aml_MP_DemuxFilterParams params;
+        memset(&params, 0, sizeof(params));
         params.type = AML_MP_DEMUX_FILTER_PSI;
         params.flags = checkCRC;
+        if (deliverOnChange) {
+            params.flags |= AML_MP_DEMUX_DELIVER_ON_CHANGE;
+        }
         return addFilter(pid, cb, userData, &params);
     }
 
@@ -254,13 +370,17 @@ public:
         return mDemuxId;
     }
     virtual int writeData(const uint8_t* buffer, size_t size);
+    int getPidStatistics(int pid, Aml_MP_DemuxPidStat* stat);
 
     enum ProgramEventType {
         EVENT_PROGRAM_PARSED,
         EVENT_PMT_PARSED,
         EVENT_CAT_PARSED,
         EVENT_AV_PID_CHANGED,
-        EVENT_ECM_DATA_PARSED
+        EVENT_ECM_DATA_PARSED,
+        // the cached program info was wrong, data is the live ProgramInfo,
+        // or nullptr if the program is no longer in the PAT
+        EVENT_PROGRAM_CHANGED,
     };
     using ProgramEventCallback = void(ProgramEventType event, int programPid, int param, void* data);
     void setEventCallback(const std::function<ProgramEventCallback>& cb);
@@ -317,10 +437,13 @@ private:
     void clearAllFilters();
     void notifyParseDone_l();
 
+    int addFilter(int pid, AmlDemuxBase::FILTER filter, const Aml_MP_DemuxFilterParams* params);
+
     static int patCb(int pid, size_t size, const uint8_t* data, void* userData);
-    static int pmtCb(int pid, size_t size, const uint8_t* data, void* userData);
-    static int catCb(int pid, size_t size, const uint8_t* data, void* userData);
-    static int ecmCb(int pid, size_t size, const uint8_t* data, void* userData);
+    // these pass the section on, they keep the buffer instead of a copy
+    static int pmtCb(int pid, const sptr<AmlMpBuffer>& data, void* userData);
+    static int catCb(int pid, const sptr<AmlMpBuffer>& data, void* userData);
+    static int ecmCb(int pid, const sptr<AmlMpBuffer>& data, void* userData);
 
     void onPatParsed(const PATSection& results);
     void onPmtParsed(const SectionData& sectionData, const PMTSection& results);
@@ -329,6 +452,10 @@ private:
 
     bool checkPidChange(const PMTSection& oldPmt, const PMTSection& newPmt, std::vector<Aml_MP_PlayerEventPidChangeInfo> *pidChangeInfo);
 
+    void lookupProgramInfoCache();
+    void checkCachedProgram(const PATSection& results);
+    void updateProgramInfoCache(const PMTSection& results);
+
     std::function<ProgramEventCallback> mCb = nullptr;
 
 private:
@@ -356,6 +483,11 @@ private:
 
     std::atomic_bool mRequestQuit{false};
 
+    std::string mCacheKey;
+    sptr<ProgramInfo> mCachedProgramInfo;   // served until the live PMT is parsed
+    int mCachedPmtVersion = -1;
+    int64_t mParseStartUs = 0;
+
     Parser(const Parser&) = delete;
     Parser& operator=(const Parser&) = delete;
 };
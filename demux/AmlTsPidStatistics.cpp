@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#include "AmlTsPidStatistics.h"
+#include <utils/AmlMpEventLooper.h>
+#include <algorithm>
+#include <string.h>
+
+namespace aml_mp {
+
+// the bitrate is averaged over windows of kBitrateWindowUs
+static const int64_t kBitrateWindowUs = 500000;
+static const int64_t kBitrateStaleUs = 4 * kBitrateWindowUs;
+
+// only one thread writes the counters, so a relaxed load and store
+// is enough and avoids a locked read-modify-write per packet.
+static inline void bumpCounter(std::atomic<uint64_t>& counter)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+void AmlTsPidStatistics::update(const AmlMpTsHeader& header, const uint8_t* packet, int64_t nowUs)
+{
+    bumpCounter(packets);
+
+    int64_t elapsedUs = nowUs - windowStartUs.load(std::memory_order_relaxed);
+    if (elapsedUs >= kBitrateWindowUs) {
+        uint32_t rate = 0;
+        if (elapsedUs < kBitrateStaleUs) {
+            uint64_t windowRate = (uint64_t)windowPackets * kTsPacketSize * 8 * 1000000 / elapsedUs;
+            rate = bitrate.load(std::memory_order_relaxed);
+            rate = rate == 0 ? windowRate : rate + ((int64_t)windowRate - rate) / 4;
+        }
+        bitrate.store(rate, std::memory_order_relaxed);
+        windowStartUs.store(nowUs, std::memory_order_relaxed);
+        windowPackets = 0;
+    }
+    ++windowPackets;
+
+    if (header.transportErrorIndicator()) {
+        // the rest of the header can't be trusted
+        bumpCounter(teiPackets);
+        return;
+    }
+
+    if (header.scramblingControl()) {
+        bumpCounter(scrambledPackets);
+    }
+
+    bool discontinuity = false;
+    if (header.hasAdaptationField() && packet[4] > 0) {
+        discontinuity = packet[5] & 0x80;
+        if ((packet[5] & 0x10) && packet[4] >= 7) {
+            bumpCounter(pcrCount);
+        }
+    }
+
+    if (header.pid() == 0x1FFF) {
+        return;
+    }
+
+    // continuity_counter only increments with a payload, a packet may be duplicated once.
+    unsigned continuity_counter = header.continuityCounter();
+    if (lastContinuityCounter >= 0 && !discontinuity) {
+        unsigned last = lastContinuityCounter;
+        bool ok = header.hasPayload() ? (continuity_counter == ((last + 1) & 0x0f) || continuity_counter == last)
+                                      : continuity_counter == last;
+        if (!ok) {
+            bumpCounter(ccErrors);
+        }
+    }
+    lastContinuityCounter = continuity_counter;
+}
+
+void AmlTsPidStatistics::accumulate(Aml_MP_DemuxPidStat* stat, int64_t nowUs) const
+{
+    uint64_t count = packets.load(std::memory_order_relaxed);
+    stat->packets += count;
+    stat->bytes += count * kTsPacketSize;
+    stat->ccErrors += ccErrors.load(std::memory_order_relaxed);
+    stat->teiPackets += teiPackets.load(std::memory_order_relaxed);
+    stat->scrambledPackets += scrambledPackets.load(std::memory_order_relaxed);
+    stat->pcrCount += pcrCount.load(std::memory_order_relaxed);
+
+    // the average is only updated by new packets, don't report a rate for a pid which stopped
+    if (nowUs - windowStartUs.load(std::memory_order_relaxed) < kBitrateStaleUs) {
+        stat->bitrate += bitrate.load(std::memory_order_relaxed);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+AmlTsPidCounter::~AmlTsPidCounter()
+{
+    delete[] mPids.load();
+}
+
+void AmlTsPidCounter::update(const uint8_t* data, size_t size)
+{
+    std::lock_guard<std::mutex> _l(mLock);
+    AmlTsPidStatistics* pids = mPids.load(std::memory_order_relaxed);
+    if (pids == nullptr) {
+        pids = new AmlTsPidStatistics[0x2000];
+        mPids.store(pids, std::memory_order_release);
+    }
+
+    int64_t nowUs = AmlMpEventLooper::GetNowUs();
+    if (mPartialSize > 0) {
+        size_t n = std::min(kTsPacketSize - mPartialSize, size);
+        memcpy(mPartial + mPartialSize, data, n);
+        mPartialSize += n;
+        data += n;
+        size -= n;
+        if (mPartialSize < kTsPacketSize) {
+            return;
+        }
+
+        AmlMpTsHeader header(mPartial);
+        pids[header.pid()].update(header, mPartial, nowUs);
+        mPartialSize = 0;
+    }
+
+    while (size >= kTsPacketSize) {
+        if (data[0] != 0x47) {
+            size_t offset = tsFindSyncLock(data, size);
+            data += offset;
+            size -= offset;
+            continue;
+        }
+
+        AmlMpTsHeader header(data);
+        pids[header.pid()].update(header, data, nowUs);
+        data += kTsPacketSize;
+        size -= kTsPacketSize;
+    }
+
+    if (size > 0 && data[0] == 0x47) {
+        memcpy(mPartial, data, size);
+        mPartialSize = size;
+    }
+}
+
+int AmlTsPidCounter::getStatistics(int pid, Aml_MP_DemuxPidStat* stat) const
+{
+    AmlTsPidStatistics* pids = mPids.load(std::memory_order_acquire);
+    if (stat == nullptr || pid < 0 || pid >= 0x2000 || pids == nullptr) {
+        return -1;
+    }
+
+    memset(stat, 0, sizeof(*stat));
+    stat->pid = pid;
+    pids[pid].accumulate(stat, AmlMpEventLooper::GetNowUs());
+
+    return 0;
+}
+
+void AmlTsPidCounter::flush()
+{
+    std::lock_guard<std::mutex> _l(mLock);
+    mPartialSize = 0;
+
+    AmlTsPidStatistics* pids = mPids.load(std::memory_order_relaxed);
+    if (pids != nullptr) {
+        for (int pid = 0; pid < 0x2000; ++pid) {
+            pids[pid].resetContinuity();
+        }
+    }
+}
+
+}
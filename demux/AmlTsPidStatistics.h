@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#ifndef _AML_TS_PID_STATISTICS_H_
+#define _AML_TS_PID_STATISTICS_H_
+
+#include <Aml_MP/Common.h>
+#include <utils/AmlMpTsScanner.h>
+#include <atomic>
+#include <mutex>
+
+namespace aml_mp {
+
+// The Aml_MP_DemuxPidStat counters of one pid. update() is called by one
+// thread at a time, accumulate() can be called from any thread.
+struct AmlTsPidStatistics {
+    std::atomic<uint64_t> packets{0};
+    std::atomic<uint64_t> ccErrors{0};
+    std::atomic<uint64_t> teiPackets{0};
+    std::atomic<uint64_t> scrambledPackets{0};
+    std::atomic<uint64_t> pcrCount{0};
+    std::atomic<uint32_t> bitrate{0};
+    std::atomic<int64_t> windowStartUs{0};
+    uint32_t windowPackets = 0;
+    int8_t lastContinuityCounter = -1;
+
+    void update(const AmlMpTsHeader& header, const uint8_t* packet, int64_t nowUs);
+    // adds the counters to stat, the bitrate only if the pid is still arriving
+    void accumulate(Aml_MP_DemuxPidStat* stat, int64_t nowUs) const;
+    // the next packet doesn't follow the previous one
+    void resetContinuity() {
+        lastContinuityCounter = -1;
+    }
+};
+
+// Counts every pid of a TS which doesn't go through the sw demux, as the dvr
+// input of the hw demux or the TS written to the player.
+class AmlTsPidCounter
+{
+public:
+    AmlTsPidCounter() = default;
+    ~AmlTsPidCounter();
+
+    // data may start and end anywhere in a packet, a packet split over two
+    // calls is counted when it is complete
+    void update(const uint8_t* data, size_t size);
+    // -1 if nothing was counted yet
+    int getStatistics(int pid, Aml_MP_DemuxPidStat* stat) const;
+    // drops a partial packet and the continuity, after a flush
+    void flush();
+
+private:
+    std::mutex mLock;
+    // 0x2000 entries, allocated by the first update() and kept until destruction
+    std::atomic<AmlTsPidStatistics*> mPids{nullptr};
+    uint8_t mPartial[kTsPacketSize];
+    size_t mPartialSize = 0;
+
+    AmlTsPidCounter(const AmlTsPidCounter&) = delete;
+    AmlTsPidCounter& operator= (const AmlTsPidCounter&) = delete;
+};
+
+}
+
+#endif
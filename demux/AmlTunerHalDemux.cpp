@@ -23,6 +23,7 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <algorithm>
 
 static const char* mName = LOG_TAG;
 
@@ -149,6 +150,7 @@ void SectionFilterCallback::onFilterEvent(const DemuxFilterEvent& filterEvent) {
 
         sptr<AmlMpBuffer> data = new AmlMpBuffer(dataLength);
         size_t readLen = mTunerFilter->read(data->base(), dataLength);
+        data->setRange(0, std::min(readLen, dataLength));
         MLOGI("SectionFilterCallback::onFilterEvent event datalen: %zu, readLen: %zu", dataLength, readLen);
         mAmlTunerHalDemux->notifyDataWrapper(mPid, data, sectionEvent.version);
     }
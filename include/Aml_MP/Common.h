@@ -425,6 +425,7 @@ typedef enum {
     AML_MP_PLAYER_PARAMETER_VIDEO_AFD_ASPECT_MODE,          //setVideoAFDAspectMode(Aml_MP_VideoAFDAspectMode *)
     AML_MP_PLAYER_PARAMETER_LIBDVR_FAKE_PID,                //setLibDvrFakePID(int*)
     AML_MP_PLAYER_PARAMETER_AUDIO_BLOCK_ALIGN,              //setAudioBlockAlign(int*)
+    AML_MP_PLAYER_PARAMETER_PROGRAM_CACHE_KEY,              //setProgramCacheKey(const char*)
 
     //get only
     AML_MP_PLAYER_PARAMETER_GET_BASE        = 0x2000,
@@ -441,6 +442,7 @@ typedef enum {
     AML_MP_PLAYER_PARAMETER_VIDEO_SHOW_STATE,               //getVideoShowState(bool*)
     AML_MP_PLAYER_PARAMETER_AV_INFO_JSON,                   //getAVInfo(Aml_MP_AvInfo*)
     AML_MP_PLAYER_PARAMETER_TSPLAYER_HANDLE,                //getTsPlayerHandle(am_tsplayer_handle*)
+    AML_MP_PLAYER_PARAMETER_DEMUX_PID_STAT,                 //getDemuxPidStat(Aml_MP_DemuxPidStat*)
 } Aml_MP_PlayerParameterKey;
 
 ////////////////////////////////////////
@@ -636,6 +638,27 @@ typedef struct {
     long reserved[8];
 } Aml_MP_SubDecStat;
 
+////////////////////////////////////////
+//AML_MP_PLAYER_PARAMETER_DEMUX_PID_STAT
+typedef struct {
+    int pid;                               // set by the caller
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t ccErrors;                     // continuity_counter discontinuities
+    uint64_t teiPackets;                   // transport_error_indicator set
+    uint64_t scrambledPackets;             // transport_scrambling_control not 0
+    uint64_t pcrCount;
+    uint32_t bitrate;                      // bits per second, moving average of the arrival rate
+    long reserved[8];
+} Aml_MP_DemuxPidStat;
+
+////////////////////////////////////////
+//AML_MP_PLAYER_PARAMETER_PROGRAM_CACHE_KEY
+// A string naming the channel, e.g. its frequency and service id, set before
+// the decoding is started. A TS source whose codecs are unknown is decoded at
+// once with the codecs the PMT had the last time the channel was played, and
+// corrected when the PMT arrives. An empty string turns the cache off.
+
 ////////////////////////////////////////
 //AML_MP_PLAYER_PARAMETER_TELETEXT_CONTROL
 typedef enum {
@@ -508,6 +508,7 @@ int AmlMpPlayerImpl::flush()
     int ret;
 
     ret = mPlayer->flush();
+    mPidCounter.flush();
 
     if (ret != AML_MP_ERROR_DEAD_OBJECT) {
         return ret;
@@ -720,6 +721,10 @@ int AmlMpPlayerImpl::writeData(const uint8_t* buffer, size_t size)
 
     if (written > 0) {
         statisticWriteDataRate_l(written);
+        // a secure memory buffer is a handle, not TS
+        if (mCreateParams.drmMode != AML_MP_INPUT_STREAM_SECURE_MEMORY) {
+            mPidCounter.update(buffer, written);
+        }
     }
 
     return written;
@@ -1228,6 +1233,13 @@ int AmlMpPlayerImpl::setParameter_l(Aml_MP_PlayerParameterKey key, void* paramet
         break;
     }
 
+    case AML_MP_PLAYER_PARAMETER_PROGRAM_CACHE_KEY:
+    {
+        mProgramCacheKey = parameter != nullptr ? (const char*)parameter : "";
+        MLOGI("set program cache key:%s", mProgramCacheKey.c_str());
+        return 0;
+    }
+
     default:
         MLOGW("unhandled key: %s", mpPlayerParameterKey2Str(key));
         return ret;
@@ -1282,6 +1294,18 @@ int AmlMpPlayerImpl::getParameter(Aml_MP_PlayerParameterKey key, void* parameter
             break;
         }
 
+        case AML_MP_PLAYER_PARAMETER_DEMUX_PID_STAT:
+        {
+            Aml_MP_DemuxPidStat* stat = static_cast<Aml_MP_DemuxPidStat*>(parameter);
+            // the A/V pids are written to the player, the parser only filters the PSI
+            if (mPidCounter.getStatistics(stat->pid, stat) == 0) {
+                ret = AML_MP_OK;
+            } else if (mParser != nullptr && mParser->getPidStatistics(stat->pid, stat) == 0) {
+                ret = AML_MP_OK;
+            }
+            break;
+        }
+
         default:
             break;
         }
@@ -1895,6 +1919,9 @@ void AmlMpPlayerImpl::openParser_l() {
         mParser = new Parser(mCreateParams.demuxId, mCreateParams.sourceType == AML_MP_INPUT_SOURCE_TS_DEMOD, AML_MP_DEMUX_TYPE_HARDWARE, mCreateParams.drmMode == AML_MP_INPUT_STREAM_SECURE_MEMORY);
         mParser->open();
         mParser->selectProgram(mVideoParams.pid, mAudioParams.pid);
+        if (!mProgramCacheKey.empty()) {
+            mParser->setCacheKey(mProgramCacheKey);
+        }
         mParser->setEventCallback([this] (Parser::ProgramEventType event, int param1, int param2, void* data) {
                 return programEventCallback(event, param1, param2, data);
         });
@@ -1941,7 +1968,7 @@ bool AmlMpPlayerImpl::tryWaitEcm_l() {
                     playerImpl->programEventCallback(Parser::ProgramEventType::EVENT_ECM_DATA_PARSED, pid, size, (void*)data);
                 }
                 return 0;
-            }, this, false);
+            }, this, false, true);
             lastEcmPid = ecmPid;
         }
     }
@@ -1960,12 +1987,69 @@ bool AmlMpPlayerImpl::tryWaitCodecId_l() {
         (mADParams.audioCodec == AML_MP_CODEC_UNKNOWN && mADParams.pid != AML_MP_INVALID_PID))) {
         openParser_l();
         mParser->parseProgramInfoAsync();
+        if (mParser->isProgramInfoCached()) {
+            // decode with the cached codecs, EVENT_PROGRAM_CHANGED corrects them
+            sptr<ProgramInfo> programInfo = mParser->getProgramInfo();
+            if (programInfo != nullptr) {
+                updateCodecIds_l(*programInfo);
+                if ((mVideoParams.videoCodec != AML_MP_CODEC_UNKNOWN || mVideoParams.pid == AML_MP_INVALID_PID) &&
+                    (mAudioParams.audioCodec != AML_MP_CODEC_UNKNOWN || mAudioParams.pid == AML_MP_INVALID_PID)) {
+                    MLOGI("program %d cached, don't wait for the PMT", programInfo->programNumber);
+                    mCodecIdsFromCache = true;
+                    return false;
+                }
+            }
+        }
         mPrepareWaitingType |= kPrepareWaitingCodecId;
         return true;
     }
     return false;
 }
 
+void AmlMpPlayerImpl::updateCodecIds_l(const ProgramInfo& programInfo)
+{
+    for (auto it : programInfo.videoStreams) {
+        if (it.pid == mVideoParams.pid) {
+            mVideoParams.videoCodec = it.codecId;
+        }
+    }
+
+    for (auto it : programInfo.audioStreams) {
+        if (it.pid == mAudioParams.pid) {
+            mAudioParams.audioCodec = it.codecId;
+        }
+    }
+}
+
+// the codecs of a started stream may have come from ProgramInfoCache or
+// an older PMT, the decoder is restarted with the new one
+void AmlMpPlayerImpl::restartDecodingIfCodecChanged_l(const ProgramInfo& programInfo)
+{
+    Aml_MP_CodecID videoCodec = mVideoParams.videoCodec;
+    Aml_MP_CodecID audioCodec = mAudioParams.audioCodec;
+    updateCodecIds_l(programInfo);
+
+    if (mState != STATE_RUNNING && mState != STATE_PAUSED) {
+        return;
+    }
+
+    if (videoCodec != mVideoParams.videoCodec &&
+        getDecodingState_l(AML_MP_STREAM_TYPE_VIDEO) == AML_MP_DECODING_STATE_STARTED) {
+        MLOGW("video codec %s -> %s, restart video decoding", mpCodecId2Str(videoCodec), mpCodecId2Str(mVideoParams.videoCodec));
+        mPlayer->stopVideoDecoding();
+        setDecodingState_l(AML_MP_STREAM_TYPE_VIDEO, AML_MP_DECODING_STATE_STOPPED);
+        startVideoDecoding_l();
+    }
+
+    if (audioCodec != mAudioParams.audioCodec &&
+        getDecodingState_l(AML_MP_STREAM_TYPE_AUDIO) == AML_MP_DECODING_STATE_STARTED) {
+        MLOGW("audio codec %s -> %s, restart audio decoding", mpCodecId2Str(audioCodec), mpCodecId2Str(mAudioParams.audioCodec));
+        mPlayer->stopAudioDecoding();
+        setDecodingState_l(AML_MP_STREAM_TYPE_AUDIO, AML_MP_DECODING_STATE_STOPPED);
+        startAudioDecoding_l();
+    }
+}
+
 bool AmlMpPlayerImpl::tryMonitorPidChange_l() {
     if (mCreateParams.options & AML_MP_OPTION_MONITOR_PID_CHANGE) {
         openParser_l();
@@ -1987,23 +2071,35 @@ void AmlMpPlayerImpl::programEventCallback(Parser::ProgramEventType event, int p
             programInfo->debugLog();
 
             std::lock_guard<std::mutex> _l(mLock);
-            for (auto it : programInfo->videoStreams) {
-                if (it.pid == mVideoParams.pid) {
-                    mVideoParams.videoCodec = it.codecId;
-                }
+            if (mCodecIdsFromCache) {
+                // the decoding started with the cached codecs, a difference
+                // comes as EVENT_PROGRAM_CHANGED next
+                mCodecIdsFromCache = false;
+                break;
             }
 
-            for (auto it : programInfo->audioStreams) {
-                if (it.pid == mAudioParams.pid) {
-                    mAudioParams.audioCodec = it.codecId;
-                }
-            }
+            restartDecodingIfCodecChanged_l(*programInfo);
 
             mPrepareWaitingType &= ~kPrepareWaitingCodecId;
             finishPreparingIfNeeded_l();
 
             break;
         }
+        case Parser::ProgramEventType::EVENT_PROGRAM_CHANGED:
+        {
+            std::lock_guard<std::mutex> _l(mLock);
+            mCodecIdsFromCache = false;
+            if (data == nullptr) {
+                // corrected by EVENT_PROGRAM_PARSED if another program has the pids
+                MLOGW("programEventCallback: cached program is not in the PAT any more");
+                break;
+            }
+
+            ProgramInfo* programInfo = (ProgramInfo*)data;
+            MLOGI("programEventCallback: cached program(programNumber=%d,pid= 0x%x) changed", programInfo->programNumber, programInfo->pmtPid);
+            restartDecodingIfCodecChanged_l(*programInfo);
+            break;
+        }
         case Parser::ProgramEventType::EVENT_AV_PID_CHANGED:
         {
             Aml_MP_PlayerEventPidChangeInfo* info = (Aml_MP_PlayerEventPidChangeInfo*)data;
@@ -2103,6 +2199,7 @@ int AmlMpPlayerImpl::reset_l(std::unique_lock<std::mutex>& lock, bool clearCasSe
     }
 
     mParser.clear();
+    mCodecIdsFromCache = false;
     mPlayer.clear();
 
     if (!mIsStandaloneCas) {
@@ -20,6 +20,7 @@
 #include <condition_variable>
 #include "cas/AmlCasBase.h"
 #include "demux/AmlTsParser.h"
+#include "demux/AmlTsPidStatistics.h"
 #ifdef ANDROID
 #ifndef __ANDROID_VNDK__
 #include <gui/Surface.h>
@@ -133,6 +134,8 @@ private:
     void openParser_l();
     bool tryWaitEcm_l();
     bool tryWaitCodecId_l();
+    void updateCodecIds_l(const ProgramInfo& programInfo);
+    void restartDecodingIfCodecChanged_l(const ProgramInfo& programInfo);
     bool tryMonitorPidChange_l();
     int prepare_l();
     int finishPreparingIfNeeded_l();
@@ -265,7 +268,13 @@ private:
 #endif
 
     sptr<Parser> mParser;
+    // AML_MP_PLAYER_PARAMETER_PROGRAM_CACHE_KEY
+    std::string mProgramCacheKey;
+    // the codec ids were taken from ProgramInfoCache, the live PMT isn't parsed yet
+    bool mCodecIdsFromCache = false;
     AmlMpChunkFifo mTsBuffer;
+    // the pids of the TS written by writeData, for AML_MP_PLAYER_PARAMETER_DEMUX_PID_STAT
+    AmlTsPidCounter mPidCounter;
     sptr<AmlMpBuffer> mWriteBuffer;
 
     int64_t mLastBytesWritten = 0;
@@ -54,6 +54,7 @@ AmlMpTestSupporter::AmlMpTestSupporter()
 AmlMpTestSupporter::~AmlMpTestSupporter()
 {
     MLOGI("%s", __FUNCTION__);
+    stopCacheValidation();
 }
 
 void AmlMpTestSupporter::playerRegisterEventCallback(Aml_MP_PlayerEventCallback cb, void* userData)
@@ -180,6 +181,7 @@ int AmlMpTestSupporter::prepare(bool cryptoMode)
         return -1;
     }
     mParser->selectProgram(programNumber);
+    mParser->setCacheKey(ProgramInfoCache::makeKey(mUrl, programNumber));
     mParser->setEventCallback([this] (Parser::ProgramEventType event, int param1, int param2, void* data) {
             return programEventCallback(event, param1, param2, data);
     });
@@ -223,11 +225,84 @@ int AmlMpTestSupporter::prepare(bool cryptoMode)
     MLOGI("parsed done!");
     mSource->removeSourceReceiver(mParserReceiver);
     mSource->restart();
-    mParser->close();
+
+    if (mParser->isProgramInfoCached()) {
+        // play the cached program, the parser is kept until the live PMT confirms or corrects it
+        MLOGI("program %d from cache, validating", mProgramInfo->programNumber);
+        mValidatingCache = true;
+        mCacheValidationThread = std::thread([this] {
+            validateCachedProgram();
+        });
+    } else {
+        mParser->close();
+    }
 
     return 0;
 }
 
+void AmlMpTestSupporter::validateCachedProgram()
+{
+    std::unique_lock<std::mutex> l(mLock);
+    // woken by the program events, the live PMT clears the cached info before EVENT_PROGRAM_CHANGED
+    while (mValidatingCache && !mQuitPending && mParser->isProgramInfoCached()) {
+        mCacheValidationCond.wait_for(l, std::chrono::milliseconds(100));
+    }
+    if (!mValidatingCache || mQuitPending) {
+        return;
+    }
+    mValidatingCache = false;
+
+    if (mParserReceiverLinked) {
+        mSource->addSourceReceiver(mPlayback);
+        mParserReceiverLinked = false;
+    }
+
+    sptr<ProgramInfo> programInfo = mParser->getProgramInfo();
+    if (programInfo != nullptr) {
+        programInfo = programInfo->clone();
+    }
+    l.unlock();
+    mParser->close();
+    l.lock();
+
+    if (programInfo != nullptr && programInfo->isSameProgram(*mProgramInfo)) {
+        MLOGI("cached program %d confirmed", mProgramInfo->programNumber);
+        return;
+    }
+
+    if (programInfo == nullptr) {
+        MLOGE("cached program %d is not in the stream any more!", mProgramInfo->programNumber);
+        if (mPlaybackStarted) {
+            mPlayback->stop();
+            mPlaybackStarted = false;
+        }
+        return;
+    }
+
+    MLOGW("cached program %d changed, restart playback", mProgramInfo->programNumber);
+    mProgramInfo = programInfo;
+    if (mPlaybackStarted) {
+        mPlayback->stop();
+        if (mPlayback->start(mProgramInfo, mCasSession, mPlayMode) < 0) {
+            MLOGE("playback restart failed!");
+            mPlaybackStarted = false;
+        }
+    }
+}
+
+void AmlMpTestSupporter::stopCacheValidation()
+{
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        mValidatingCache = false;
+    }
+    mCacheValidationCond.notify_all();
+
+    if (mCacheValidationThread.joinable()) {
+        mCacheValidationThread.join();
+    }
+}
+
 int AmlMpTestSupporter::setParameter(Aml_MP_PlayerParameterKey key, void* parameter)
 {
     int ret = 0;
@@ -365,7 +440,12 @@ int AmlMpTestSupporter::startPlay(PlayMode playMode, bool mStart, bool mSourceRe
         {
             mPlayback->setPcrPid(mPcrPid);
         }
-        ret = mPlayback->start(mProgramInfo, casSession, mPlayMode);
+        {
+            std::lock_guard<std::mutex> _l(mLock);
+            ret = mPlayback->start(mProgramInfo, casSession, mPlayMode);
+            mCasSession = casSession;
+            mPlaybackStarted = ret >= 0;
+        }
         if (ret < 0)
         {
             MLOGE("playback start failed!");
@@ -376,7 +456,15 @@ int AmlMpTestSupporter::startPlay(PlayMode playMode, bool mStart, bool mSourceRe
     }
     if (mSourceReceiver == true)
     {
-        mSource->addSourceReceiver(mPlayback);
+        std::lock_guard<std::mutex> _l(mLock);
+        if (mValidatingCache) {
+            // the parser sees what the player takes until the cached program is validated
+            mParserReceiver->linkNextReceiver(mPlayback);
+            mSource->addSourceReceiver(mParserReceiver);
+            mParserReceiverLinked = true;
+        } else {
+            mSource->addSourceReceiver(mPlayback);
+        }
     }else {
         ALOGI("<<<<AmlMpTestSupporter haven't addSourceReceiver\n");
     }
@@ -575,6 +663,8 @@ int AmlMpTestSupporter::stop()
 {
     MLOGI("stopping...");
 
+    stopCacheValidation();
+
     if (mSource != nullptr) {
         mSource->stop();
         mSource.clear();
@@ -724,6 +814,7 @@ void AmlMpTestSupporter::signalQuit()
     MLOGI("received SIGINT, %s", __FUNCTION__);
 
     mQuitPending = true;
+    mCacheValidationCond.notify_all();
 
     if (mSource) mSource->signalQuit();
     if (mParser) mParser->signalQuit();
@@ -760,6 +851,7 @@ void AmlMpTestSupporter::programEventCallback(Parser::ProgramEventType event, in
         case Parser::ProgramEventType::EVENT_PROGRAM_PARSED:
         {
             MLOGI("received program parsed event");
+            mCacheValidationCond.notify_all();
             break;
         }
         case Parser::ProgramEventType::EVENT_AV_PID_CHANGED:
@@ -772,6 +864,12 @@ void AmlMpTestSupporter::programEventCallback(Parser::ProgramEventType event, in
             MLOGI("received program ecm data parsed event");
             break;
         }
+        case Parser::ProgramEventType::EVENT_PROGRAM_CHANGED:
+        {
+            MLOGI("received cached program changed event, pmtPid:%d, programNumber:%d", param1, param2);
+            mCacheValidationCond.notify_all();
+            break;
+        }
     }
 }
 
@@ -19,6 +19,7 @@
 #include <Aml_MP/Aml_MP.h>
 #include "TestUtils.h"
 #include <mutex>
+#include <condition_variable>
 #include <Aml_MP/Dvr.h>
 #include <demux/AmlTsParser.h>
 
@@ -111,6 +112,8 @@ private:
     bool processCommand(const std::vector<std::string>& args);
     void signalQuit();
     void programEventCallback(Parser::ProgramEventType event, int param1, int param2, void* data);
+    void validateCachedProgram();
+    void stopCacheValidation();
 
     std::string mUrl;
     sptr<Source> mSource;
@@ -152,6 +155,14 @@ private:
     bool mEsMode = false;
     bool mClearTVP = false;
 
+    // a cached program is played until the live PMT confirms it, or playback is restarted
+    std::thread mCacheValidationThread;
+    std::condition_variable mCacheValidationCond;
+    bool mValidatingCache = false;
+    bool mParserReceiverLinked = false;
+    bool mPlaybackStarted = false;
+    AML_MP_CASSESSION mCasSession = AML_MP_INVALID_HANDLE;
+
     AmlMpTestSupporter(const AmlMpTestSupporter&) = delete;
     AmlMpTestSupporter& operator=(const AmlMpTestSupporter&) = delete;
 };
@@ -981,6 +981,16 @@ StreamParser::StreamParser(Aml_MP_StreamType streamType, StreamCategory streamCa
 
 int StreamParser::append(const uint8_t* data, size_t size)
 {
+    if (mLease != nullptr) {
+        // a frame spans more than one lease, gather it in mBuffer
+        sptr<AmlMpBuffer> lease = mLease;
+        mLease.clear();
+        int ret = append(lease->data() + mLeaseOffset, lease->size() - mLeaseOffset);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     size_t neededSize = (mBuffer == nullptr ? 0 : mBuffer->size()) + size;
     if (mBuffer == nullptr || neededSize > mBuffer->capacity()) {
         neededSize = (neededSize + 65535) & ~65535;
@@ -1007,6 +1017,17 @@ int StreamParser::append(const uint8_t* data, size_t size)
     return 0;
 }
 
+int StreamParser::append(const sptr<AmlMpBuffer>& lease)
+{
+    if (totalBufferSize() > 0) {
+        return append(lease->data(), lease->size());
+    }
+
+    mLease = lease;
+    mLeaseOffset = 0;
+    return 0;
+}
+
 int StreamParser::lockFrame(Frame* frame)
 {
     int ret = 0;
@@ -1016,8 +1037,12 @@ int StreamParser::lockFrame(Frame* frame)
     switch (mStreamCategory) {
     case PES:
     {
-        const uint8_t* data = mBuffer->data();
-        size_t size = mBuffer->size();
+        if (totalBufferSize() == 0) {
+            return -1;
+        }
+
+        const uint8_t* data = mLease != nullptr ? mLease->data() + mLeaseOffset : mBuffer->data();
+        size_t size = totalBufferSize();
         int startPos = -1;
 
         startPos = findPES(data, size);
@@ -1064,6 +1089,14 @@ int StreamParser::lockFrame(Frame* frame)
 
 int StreamParser::unlockFrame(Frame* frame)
 {
+    if (mLease != nullptr) {
+        mLeaseOffset = frame->data + frame->size - mLease->data();
+        if (mLeaseOffset >= mLease->size()) {
+            mLease.clear();
+        }
+        return 0;
+    }
+
     size_t consumed = frame->data + frame->size - mBuffer->data();
     if (consumed != mBuffer->size()) {
         MLOGD("unlockFrame consumed:%zu, left:%zu", consumed, mBuffer->size()-consumed);
@@ -287,7 +287,12 @@ public:
     ~StreamParser() = default;
 
     int append(const uint8_t* data, size_t size);
+    // keeps a leased demux buffer and parses it in place if nothing else is pending
+    int append(const sptr<AmlMpBuffer>& lease);
     size_t totalBufferSize() const {
+        if (mLease != nullptr) {
+            return mLease->size() - mLeaseOffset;
+        }
         return mBuffer ? mBuffer->size() : 0;
     }
     int lockFrame(Frame* frame);
@@ -301,6 +306,8 @@ private:
     Aml_MP_StreamType mStreamType;
     StreamCategory mStreamCategory;
     sptr<AmlMpBuffer> mBuffer;
+    sptr<AmlMpBuffer> mLease;   // read only, mBuffer is empty while it is set
+    size_t mLeaseOffset = 0;
 
     StreamParser(const StreamParser&) = delete;
     StreamParser& operator=(const StreamParser&) = delete;
@@ -23,10 +23,14 @@ ParserReceiver::~ParserReceiver()
 
 int ParserReceiver::writeData(const uint8_t* buffer, size_t size)
 {
-    if (mAmlTsParser) {
-        mAmlTsParser->writeData(buffer, size);
+    // the source writes again what the next receiver didn't take
+    int ret = size;
+    if (mNextReceiver) {
+        ret = mNextReceiver->writeData(buffer, size);
+    }
+    if (mAmlTsParser && ret > 0) {
+        mAmlTsParser->writeData(buffer, ret);
     }
-    int ret = ISourceReceiver::writeData(buffer, size);
     return ret;
 }
 
@@ -251,6 +251,14 @@ TsDemuxer::TsDemuxer(Aml_MP_DemuxType demuxType, Aml_MP_DemuxId demuxId)
     mDemux = AmlDemuxBase::create(demuxType);
     mDemux->open(false, demuxId, false);
     mDemux->start();
+
+    if (demuxType == AML_MP_DEMUX_TYPE_SOFTWARE) {
+        // let the source thread read ahead while the previous buffers are parsed
+        Aml_MP_DemuxFeedParams feedParams{};
+        feedParams.maxPendingBuffers = 16;
+        feedParams.policy = AML_MP_DEMUX_FEED_POLICY_BLOCK;
+        mDemux->setFeedParams(&feedParams);
+    }
 }
 
 TsDemuxer::~TsDemuxer()
@@ -391,7 +399,7 @@ int TsDemuxer::startStream(Aml_MP_StreamType streamType, int pid, Aml_MP_CodecID
         return ret;
     }
 
-    stream->filter = mDemux->createFilter([](int pid, size_t size, const uint8_t* data, void* userData) -> int {
+    stream->filter = mDemux->createFilter([](int pid, const sptr<AmlMpBuffer>& data, void* userData) -> int {
         int ret = 0;
         TsDemuxer* demuxer = (TsDemuxer*)userData;
         Aml_MP_StreamType streamType = demuxer->mPids[pid];
@@ -402,8 +410,8 @@ int TsDemuxer::startStream(Aml_MP_StreamType streamType, int pid, Aml_MP_CodecID
         }
 
         if (stream->bufferQueue) {
-            MLOGV("filter(%d) size:%zu(%zu), cbCount:%zu", pid, size, size-14, ++stream->filterCbCount);
-            stream->streamParser->append(data, size);
+            MLOGV("filter(%d) size:%zu(%zu), cbCount:%zu", pid, data->size(), data->size()-14, ++stream->filterCbCount);
+            stream->streamParser->append(data);
 
             int ret = 0;
             StreamParser::Frame frame;
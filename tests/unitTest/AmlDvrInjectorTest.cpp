@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#define LOG_TAG "AmlDvrInjectorTest"
+#include <utils/AmlMpLog.h>
+#include <demux/AmlDvrInjector.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+using namespace aml_mp;
+
+static const char* mName = LOG_TAG;
+
+// reads the other end of the pipe the injector writes to, like the dvr device
+struct PipeReader {
+    PipeReader() {
+        EXPECT_EQ(0, pipe(fds));
+    }
+
+    ~PipeReader() {
+        stop();
+        ::close(fds[0]);
+        ::close(fds[1]);
+    }
+
+    void start() {
+        mThread = std::thread([this] {
+            uint8_t buffer[64 * 1024];
+            while (!mStopped) {
+                struct pollfd pfd = {fds[0], POLLIN, 0};
+                if (::poll(&pfd, 1, 10) <= 0) {
+                    continue;
+                }
+                ssize_t len = ::read(fds[0], buffer, sizeof(buffer));
+                if (len > 0) {
+                    data.insert(data.end(), buffer, buffer + len);
+                    ++reads;
+                }
+            }
+        });
+    }
+
+    void stop() {
+        mStopped = true;
+        if (mThread.joinable()) {
+            mThread.join();
+        }
+    }
+
+    int fds[2];
+    std::vector<uint8_t> data;
+    int reads = 0;
+
+private:
+    std::thread mThread;
+    std::atomic<bool> mStopped{false};
+};
+
+static void waitWritten(AmlDvrInjector& injector)
+{
+    Aml_MP_DemuxInjectStatistics stats;
+    for (int i = 0; i < 200; ++i) {
+        injector.getStatistics(&stats);
+        if (stats.queuedBytes == 0) {
+            break;
+        }
+        usleep(10 * 1000);
+    }
+}
+
+TEST(AmlDvrInjectorTest, CoalescesClearTs)
+{
+    PipeReader reader;
+    reader.start();
+
+    // IPTV datagrams of 7 TS packets
+    const size_t kDatagramSize = 7 * 188;
+    const int kDatagrams = 500;
+    std::vector<uint8_t> expected;
+
+    AmlDvrInjector injector(reader.fds[1], false, 256 * 1024, 188 * 64, 10);
+    ASSERT_EQ(0, injector.start());
+    for (int i = 0; i < kDatagrams; ++i) {
+        std::vector<uint8_t> datagram(kDatagramSize);
+        for (size_t j = 0; j < kDatagramSize; ++j) {
+            datagram[j] = (uint8_t)(i * 31 + j);
+        }
+        ASSERT_EQ((int)kDatagramSize, injector.queue(datagram.data(), datagram.size()));
+        expected.insert(expected.end(), datagram.begin(), datagram.end());
+    }
+    waitWritten(injector);
+
+    Aml_MP_DemuxInjectStatistics stats;
+    injector.getStatistics(&stats);
+    injector.stop();
+    reader.stop();
+
+    EXPECT_EQ(expected, reader.data);
+    EXPECT_EQ((uint64_t)kDatagrams, stats.feeds);
+    EXPECT_EQ(expected.size(), stats.bytesWritten);
+    EXPECT_EQ(0u, stats.bytesDropped);
+    // 9 datagrams fill the target write size
+    EXPECT_LE(stats.writes, (uint64_t)kDatagrams / 8);
+    MLOGI("%d datagrams in %" PRIu64 " writes", kDatagrams, stats.writes);
+}
+
+TEST(AmlDvrInjectorTest, FullQueue)
+{
+    PipeReader reader;
+    int capacity = fcntl(reader.fds[1], F_GETPIPE_SZ);
+    ASSERT_GT(capacity, 0);
+
+    const size_t kCapacity = 64 * 1024;
+    AmlDvrInjector injector(reader.fds[1], false, kCapacity, 188 * 64, 1);
+    Aml_MP_DemuxFeedParams params{};
+    params.policy = AML_MP_DEMUX_FEED_POLICY_FAIL;
+    injector.setFeedParams(&params);
+    ASSERT_EQ(0, injector.start());
+
+    // nobody reads: the pipe fills up, then the queue
+    std::vector<uint8_t> chunk(188 * 10, 0x47);
+    size_t accepted = 0;
+    for (;;) {
+        int ret = injector.queue(chunk.data(), chunk.size());
+        if (ret == -EAGAIN) {
+            break;
+        }
+        ASSERT_GT(ret, 0);
+        accepted += ret;
+        if (ret < (int)chunk.size()) {
+            continue;
+        }
+        usleep(1000);
+    }
+    EXPECT_GE(accepted, kCapacity);
+    EXPECT_LE(accepted, (size_t)capacity + kCapacity);
+
+    Aml_MP_DemuxInjectStatistics stats;
+    injector.getStatistics(&stats);
+    EXPECT_EQ(kCapacity, stats.queuedBytes);
+    EXPECT_EQ(kCapacity, stats.capacity);
+    EXPECT_GT(stats.stalls, 0u);
+
+    // draining the device lets the queue empty out
+    reader.start();
+    waitWritten(injector);
+    injector.getStatistics(&stats);
+    EXPECT_EQ(0u, stats.queuedBytes);
+    EXPECT_EQ(accepted, stats.bytesWritten);
+
+    // flush drops what is queued
+    reader.stop();
+    for (int i = 0; i < 100 && injector.queue(chunk.data(), chunk.size()) > 0; ++i) {
+    }
+    injector.flush();
+    injector.getStatistics(&stats);
+    EXPECT_EQ(0u, stats.queuedBytes);
+    EXPECT_GT(stats.bytesDropped, 0u);
+}
+
+TEST(AmlDvrInjectorTest, MergesAdjacentSecureBuffers)
+{
+    PipeReader reader;
+
+    struct Done {
+        std::atomic<int> count{0};
+        std::atomic<int> failed{0};
+    } done;
+
+    AmlDvrInjector injector(reader.fds[1], true);
+    Aml_MP_DemuxFeedParams params{};
+    params.maxPendingBuffers = 16;
+    params.policy = AML_MP_DEMUX_FEED_POLICY_BLOCK;
+    params.userData = &done;
+    params.doneCb = [](const uint8_t*, size_t, int result, void* userData) {
+        Done* done = (Done*)userData;
+        ++done->count;
+        if (result != 0) {
+            ++done->failed;
+        }
+    };
+    injector.setFeedParams(&params);
+
+    // only the addresses are written, the secure ring is never touched
+    std::vector<uint8_t> secureRing(188 * 40);
+    const uint8_t* base = secureRing.data();
+
+    // queued before the thread runs, the first 8 are adjacent, then a gap
+    for (int i = 0; i < 8; ++i) {
+        ASSERT_EQ(188, injector.queue(base + i * 188, 188));
+    }
+    ASSERT_EQ(188 * 4, injector.queue(base + 20 * 188, 188 * 4));
+
+    reader.start();
+    ASSERT_EQ(0, injector.start());
+    for (int i = 0; i < 200 && done.count < 9; ++i) {
+        usleep(10 * 1000);
+    }
+    injector.stop();
+    reader.stop();
+
+    EXPECT_EQ(9, done.count.load());
+    EXPECT_EQ(0, done.failed.load());
+
+    // struct dmx_sec_ts_data, 2 descriptors
+    ASSERT_EQ(4 * sizeof(uint32_t), reader.data.size());
+    const uint32_t* descriptors = (const uint32_t*)reader.data.data();
+    EXPECT_EQ((uint32_t)(long)base, descriptors[0]);
+    EXPECT_EQ((uint32_t)(long)(base + 8 * 188), descriptors[1]);
+    EXPECT_EQ((uint32_t)(long)(base + 20 * 188), descriptors[2]);
+    EXPECT_EQ((uint32_t)(long)(base + 24 * 188), descriptors[3]);
+}
@@ -0,0 +1,747 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#define LOG_TAG "AmlESQueueTest"
+#include <utils/AmlMpLog.h>
+#include <utils/AmlMpBuffer.h>
+#include <utils/AmlMpBitReader.h>
+#include <demux/AmlESQueue.h>
+#include <gtest/gtest.h>
+#include <string.h>
+#include <inttypes.h>
+#include <random>
+#include <vector>
+#include <list>
+
+using namespace aml_mp;
+
+static const char* mName = LOG_TAG;
+
+static const size_t kPesHeaderSize = 14;
+
+// HEVC access units about the size of a 4K stream's: an IRAP picture with
+// parameter sets, then trailing pictures, each one sent in a single PES.
+struct HevcStreamWriter {
+    explicit HevcStreamWriter(uint32_t seed)
+    : mRng(seed)
+    {
+    }
+
+    // returns the expected access unit, as the framer outputs it
+    std::vector<uint8_t> makeAccessUnit(bool irap, std::vector<uint8_t>* es) {
+        std::vector<uint8_t> au;
+        if (irap) {
+            appendNal(32, 24, es, &au);     // VPS
+            appendNal(33, 64, es, &au);     // SPS
+            appendNal(34, 16, es, &au);     // PPS
+            appendNal(19, 300 * 1024 + mRng() % (100 * 1024), es, &au);
+        } else {
+            appendNal(1, 40 * 1024 + mRng() % (40 * 1024), es, &au);
+        }
+        return au;
+    }
+
+private:
+    void appendNal(unsigned nalType, size_t size, std::vector<uint8_t>* es, std::vector<uint8_t>* au) {
+        static const uint8_t kStartCode[] = {0x00, 0x00, 0x00, 0x01};
+        std::vector<uint8_t> nal(size);
+        nal[0] = nalType << 1;
+        nal[1] = 0x01;
+        // first_slice_segment_in_pic_flag, and no start code emulation
+        for (size_t i = 2; i < size; ++i) {
+            nal[i] = 0x80 | (mRng() & 0x7F);
+        }
+
+        es->insert(es->end(), kStartCode, kStartCode + 4);
+        es->insert(es->end(), nal.begin(), nal.end());
+        au->insert(au->end(), kStartCode, kStartCode + 4);
+        au->insert(au->end(), nal.begin(), nal.end());
+    }
+
+    std::mt19937 mRng;
+};
+
+TEST(AmlESQueueTest, H265AccessUnits)
+{
+    HevcStreamWriter writer(265);
+    sptr<ElementaryStreamQueue> queue = new ElementaryStreamQueue(ElementaryStreamQueue::H265);
+
+    const int kFrames = 120;
+    std::vector<std::vector<uint8_t>> expected;
+    size_t dequeued = 0;
+    uint64_t legacyBytesMoved = 0;
+
+    for (int i = 0; i < kFrames; ++i) {
+        std::vector<uint8_t> pes;
+        expected.push_back(writer.makeAccessUnit(i % 30 == 0, &pes));
+        ASSERT_EQ(0, queue->appendData(pes.data(), pes.size(), 3600 * i, 0));
+
+        sptr<AmlMpBuffer> accessUnit;
+        while ((accessUnit = queue->dequeueAccessUnit()) != nullptr) {
+            ASSERT_LT(dequeued, expected.size());
+            const std::vector<uint8_t>& au = expected[dequeued];
+            ASSERT_EQ(au.size() + kPesHeaderSize, accessUnit->size());
+            EXPECT_EQ(0, memcmp(au.data(), accessUnit->data() + kPesHeaderSize, au.size()));
+
+            const uint8_t* p = accessUnit->data() + 9;
+            int64_t pts = (int64_t)(p[0] & 0x0E) << 29 | p[1] << 22 | (p[2] & 0xFE) << 14 | p[3] << 7 | p[4] >> 1;
+            EXPECT_EQ(3600 * (int64_t)dequeued, pts);
+
+            // what moving the unread bytes to the front on every access unit costs
+            legacyBytesMoved += queue->size();
+            ++dequeued;
+        }
+    }
+
+    // a picture ends on the first slice of the next one, and that slice is
+    // only complete once another start code follows it.
+    EXPECT_EQ((size_t)kFrames - 2, dequeued);
+
+    printf("H265 %d frames: bytes moved per frame %.0f, was %.0f\n", kFrames,
+            (double)queue->bytesMoved() / dequeued, (double)legacyBytesMoved / dequeued);
+    EXPECT_LT(queue->bytesMoved(), legacyBytesMoved);
+}
+
+TEST(AmlESQueueTest, AccessUnitPool)
+{
+    HevcStreamWriter writer(60);
+    sptr<ElementaryStreamQueue> queue = new ElementaryStreamQueue(ElementaryStreamQueue::H265);
+
+    // the consumer keeps a few frames, like a decoder input queue does
+    const size_t kHeldFrames = 4;
+    std::list<sptr<AmlMpBuffer>> held;
+    size_t dequeued = 0;
+    for (int i = 0; i < 300; ++i) {
+        std::vector<uint8_t> pes;
+        writer.makeAccessUnit(i % 60 == 0, &pes);
+        ASSERT_EQ(0, queue->appendData(pes.data(), pes.size(), 3000 * i, 0));
+
+        sptr<AmlMpBuffer> accessUnit;
+        while ((accessUnit = queue->dequeueAccessUnit()) != nullptr) {
+            held.push_back(accessUnit);
+            if (held.size() > kHeldFrames) {
+                held.pop_front();
+            }
+            ++dequeued;
+        }
+    }
+
+    AmlMpBufferPool::Stats stats;
+    queue->getPoolStats(&stats);
+    printf("AU pool: hits %" PRIu64 ", misses %" PRIu64 ", cached %zu, high water %zu bytes\n",
+            stats.hits, stats.misses, stats.cachedBytes, stats.highWaterBytes);
+    EXPECT_EQ(dequeued, stats.hits + stats.misses);
+    EXPECT_GT(stats.hits, stats.misses * 10);
+    EXPECT_LE(stats.highWaterBytes, (kHeldFrames + 1) * 512 * 1024);
+
+    // the pool outlives the queue until the last access unit is released
+    queue.clear();
+    held.clear();
+}
+
+TEST(AmlESQueueTest, BufferPoolTrimsToHighWater)
+{
+    sptr<AmlMpBufferPool> pool = new AmlMpBufferPool("test");
+
+    // a burst of 32 buffers in flight
+    std::vector<sptr<AmlMpBuffer>> burst;
+    for (int i = 0; i < 32; ++i) {
+        burst.push_back(pool->acquire(3000));
+        ASSERT_EQ(3000u, burst.back()->size());
+        ASSERT_EQ(4096u, burst.back()->capacity());
+    }
+    burst.clear();
+
+    AmlMpBufferPool::Stats stats;
+    pool->getStats(&stats);
+    EXPECT_EQ(32u * 4096, stats.cachedBytes);
+    EXPECT_EQ(0u, stats.inUseBytes);
+
+    // then two at a time: after two trim intervals only those two are cached
+    for (int i = 0; i < 1024; ++i) {
+        sptr<AmlMpBuffer> a = pool->acquire(4000);
+        sptr<AmlMpBuffer> b = pool->acquire(2100);
+    }
+    pool->getStats(&stats);
+    EXPECT_EQ(2u * 4096, stats.cachedBytes);
+    EXPECT_EQ(30u * 4096, stats.trimmedBytes);
+    EXPECT_EQ(32u, stats.misses);
+
+    pool->trim();
+    pool->getStats(&stats);
+    EXPECT_EQ(0u, stats.cachedBytes);
+}
+
+TEST(AmlESQueueTest, SkipToSyncWord)
+{
+    sptr<ElementaryStreamQueue> queue = new ElementaryStreamQueue(ElementaryStreamQueue::H265);
+
+    // garbage before the first start code is dropped, not part of any access unit
+    HevcStreamWriter writer(1);
+    std::vector<uint8_t> pes(100, 0x5A);
+    std::vector<uint8_t> au = writer.makeAccessUnit(true, &pes);
+    ASSERT_EQ(0, queue->appendData(pes.data(), pes.size(), 0, 0));
+    // synced on the 3 byte start code
+    EXPECT_EQ(au.size() - 1, queue->size());
+
+    std::vector<uint8_t> next;
+    writer.makeAccessUnit(false, &next);
+    writer.makeAccessUnit(false, &next);
+    ASSERT_EQ(0, queue->appendData(next.data(), next.size(), 3600, 0));
+
+    sptr<AmlMpBuffer> accessUnit = queue->dequeueAccessUnit();
+    ASSERT_TRUE(accessUnit != nullptr);
+    ASSERT_EQ(au.size() + kPesHeaderSize, accessUnit->size());
+    EXPECT_EQ(0, memcmp(au.data(), accessUnit->data() + kPesHeaderSize, au.size()));
+    EXPECT_EQ(next.size(), queue->size());
+
+    queue->clear();
+    EXPECT_EQ(0u, queue->size());
+}
+
+static void appendAdtsFrame(std::vector<uint8_t>* es, size_t frameLength, uint8_t fill)
+{
+    const uint8_t header[] = {
+        0xFF, 0xF1, 0x50, (uint8_t)(0x80 | frameLength >> 11), (uint8_t)(frameLength >> 3),
+        (uint8_t)((frameLength & 0x07) << 5 | 0x1F), 0xFC,
+    };
+    es->insert(es->end(), header, header + sizeof(header));
+    es->insert(es->end(), frameLength - sizeof(header), fill);
+}
+
+TEST(AmlESQueueTest, AdtsFrames)
+{
+    sptr<ElementaryStreamQueue> queue = new ElementaryStreamQueue(ElementaryStreamQueue::AAC);
+
+    // bytes resembling a sync word before the first frame are skipped
+    std::vector<uint8_t> pes = {0xFF, 0x12, 0xFF, 0xFF, 0x0F};
+    std::vector<uint8_t> frames;
+    for (int i = 0; i < 3; ++i) {
+        appendAdtsFrame(&frames, 371, 0xFF);
+    }
+    pes.insert(pes.end(), frames.begin(), frames.end());
+    ASSERT_EQ(0, queue->appendData(pes.data(), pes.size(), 1800, 0));
+    EXPECT_EQ(frames.size(), queue->size());
+
+    std::vector<uint8_t> next;
+    appendAdtsFrame(&next, 300, 0x00);
+    appendAdtsFrame(&next, 280, 0x0B);
+    ASSERT_EQ(0, queue->appendData(next.data(), next.size(), 3600, 0));
+
+    sptr<AmlMpBuffer> accessUnit = queue->dequeueAccessUnit();
+    ASSERT_TRUE(accessUnit != nullptr);
+    ASSERT_EQ(frames.size() + kPesHeaderSize, accessUnit->size());
+    EXPECT_EQ(0, memcmp(frames.data(), accessUnit->data() + kPesHeaderSize, frames.size()));
+
+    accessUnit = queue->dequeueAccessUnit();
+    ASSERT_TRUE(accessUnit != nullptr);
+    ASSERT_EQ(next.size() + kPesHeaderSize, accessUnit->size());
+    EXPECT_EQ(0, memcmp(next.data(), accessUnit->data() + kPesHeaderSize, next.size()));
+    EXPECT_EQ(0u, queue->size());
+}
+
+static int64_t readTimestamp(const uint8_t* p)
+{
+    return (int64_t)(p[0] & 0x0E) << 29 | p[1] << 22 | (p[2] & 0xFE) << 14 | p[3] << 7 | p[4] >> 1;
+}
+
+TEST(AmlESQueueTest, PesHeaderKeepsDts)
+{
+    HevcStreamWriter writer(3);
+    sptr<ElementaryStreamQueue> queue = new ElementaryStreamQueue(ElementaryStreamQueue::H265);
+
+    std::vector<std::vector<uint8_t>> expected;
+    for (int i = 0; i < 3; ++i) {
+        std::vector<uint8_t> pes;
+        expected.push_back(writer.makeAccessUnit(i == 0, &pes));
+
+        ElementaryStreamQueue::PesInfo info;
+        info.pts = 9000 + 3000 * i;
+        info.dts = i == 0 ? info.pts : 3000 * i;   // the first one has no DTS
+        info.streamId = 0xE1;
+        info.dataAlignment = true;
+        struct iovec iov = {pes.data(), pes.size()};
+        ASSERT_EQ(0, queue->appendData(&iov, 1, info));
+    }
+
+    sptr<AmlMpBuffer> accessUnit = queue->dequeueAccessUnit();
+    ASSERT_TRUE(accessUnit != nullptr);
+    const uint8_t* p = accessUnit->data();
+    EXPECT_EQ(0xE1, p[3]);
+    EXPECT_EQ(0x84, p[6]);                  // data_alignment_indicator
+    EXPECT_EQ(0x80, p[7]);                  // PTS only, it equals the DTS
+    ASSERT_EQ(5, p[8]);
+    EXPECT_EQ(9000, readTimestamp(p + 9));
+    EXPECT_EQ(0, memcmp(expected[0].data(), p + 14, expected[0].size()));
+
+    queue->appendData(expected[0].data(), expected[0].size(), 0, 0);
+    accessUnit = queue->dequeueAccessUnit();
+    ASSERT_TRUE(accessUnit != nullptr);
+    p = accessUnit->data();
+    EXPECT_EQ(0xC0, p[7]);
+    ASSERT_EQ(10, p[8]);
+    EXPECT_EQ(0x3, p[9] >> 4);
+    EXPECT_EQ(12000, readTimestamp(p + 9));
+    EXPECT_EQ(0x1, p[14] >> 4);
+    EXPECT_EQ(3000, readTimestamp(p + 14));
+    ASSERT_EQ(19 + expected[1].size(), accessUnit->size());
+    EXPECT_EQ(13 + expected[1].size(), (size_t)(p[4] << 8 | p[5]));
+    EXPECT_EQ(0, memcmp(expected[1].data(), p + 19, expected[1].size()));
+}
+
+TEST(AmlESQueueTest, LengthPrefixedOutput)
+{
+    HevcStreamWriter writer(4);
+    sptr<ElementaryStreamQueue> queue = new ElementaryStreamQueue(ElementaryStreamQueue::H265);
+    queue->setOutputFormat(ElementaryStreamQueue::OUTPUT_LENGTH_PREFIXED);
+
+    std::vector<uint8_t> es;
+    std::vector<uint8_t> au = writer.makeAccessUnit(true, &es);
+    writer.makeAccessUnit(false, &es);
+    writer.makeAccessUnit(false, &es);
+    ASSERT_EQ(0, queue->appendData(es.data(), es.size(), 0, 0));
+
+    sptr<AmlMpBuffer> accessUnit = queue->dequeueAccessUnit();
+    ASSERT_TRUE(accessUnit != nullptr);
+    ASSERT_EQ(au.size(), accessUnit->size());
+
+    // same NAL units, each start code replaced by the NAL unit size
+    const uint8_t* p = accessUnit->data();
+    size_t offset = 0;
+    int nals = 0;
+    while (offset < au.size()) {
+        size_t nalSize = (size_t)p[offset] << 24 | p[offset + 1] << 16 | p[offset + 2] << 8 | p[offset + 3];
+        EXPECT_EQ(0, memcmp("\x00\x00\x00\x01", &au[offset], 4));
+        EXPECT_EQ(0, memcmp(&au[offset + 4], p + offset + 4, nalSize));
+        offset += 4 + nalSize;
+        ++nals;
+    }
+    EXPECT_EQ(au.size(), offset);
+    EXPECT_EQ(4, nals);
+}
+
+TEST(AmlESQueueTest, LatmOutput)
+{
+    sptr<ElementaryStreamQueue> queue = new ElementaryStreamQueue(ElementaryStreamQueue::AAC);
+    queue->setOutputFormat(ElementaryStreamQueue::OUTPUT_LATM);
+
+    // AAC LC, 48kHz, stereo
+    std::vector<uint8_t> adts;
+    appendAdtsFrame(&adts, 300, 0x5A);
+    appendAdtsFrame(&adts, 700, 0xA5);
+    ASSERT_EQ(0, queue->appendData(adts.data(), adts.size(), 0, 0));
+
+    sptr<AmlMpBuffer> accessUnit = queue->dequeueAccessUnit();
+    ASSERT_TRUE(accessUnit != nullptr);
+
+    const uint8_t* p = accessUnit->data();
+    size_t size = accessUnit->size();
+    for (size_t frameLength : {300, 700}) {
+        ASSERT_GE(size, 3u);
+        AmlMpBitReader br(p, size);
+        ASSERT_EQ(0x2B7u, br.getBits(11));
+        size_t audioMuxLengthBytes = br.getBits(13);
+        ASSERT_GE(size, 3 + audioMuxLengthBytes);
+
+        EXPECT_EQ(0u, br.getBits(1));       // useSameStreamMux
+        EXPECT_EQ(0u, br.getBits(1));       // audioMuxVersion
+        EXPECT_EQ(1u, br.getBits(1));
+        br.skipBits(6 + 4 + 3);
+        EXPECT_EQ(2u, br.getBits(5));       // AAC LC
+        EXPECT_EQ(4u, br.getBits(4));       // 44.1kHz
+        EXPECT_EQ(2u, br.getBits(4));
+        br.skipBits(3 + 3 + 8 + 1 + 1);
+
+        size_t payloadSize = 0;
+        unsigned tmp;
+        do {
+            tmp = br.getBits(8);
+            payloadSize += tmp;
+        } while (tmp == 255);
+        ASSERT_EQ(frameLength - 7, payloadSize);
+        for (size_t i = 0; i < payloadSize; ++i) {
+            ASSERT_EQ(frameLength == 300 ? 0x5Au : 0xA5u, br.getBits(8));
+        }
+
+        p += 3 + audioMuxLengthBytes;
+        size -= 3 + audioMuxLengthBytes;
+    }
+    EXPECT_EQ(0u, size);
+}
+
+TEST(AmlESQueueTest, TimestampsAcrossPesBoundaries)
+{
+    // MPEG-1 layer III, 128kbps, 44.1kHz: 417 byte frames
+    const size_t kFrameSize = 417;
+    const int kFrames = 200;
+    std::vector<uint8_t> es;
+    for (int i = 0; i < kFrames; ++i) {
+        size_t offset = es.size();
+        es.resize(offset + kFrameSize, i & 0x7F);
+        memcpy(&es[offset], "\xFF\xFB\x90\x00", 4);
+    }
+
+    // the std::list walk the queue used to do
+    struct Range {
+        int64_t pts;
+        size_t length;
+    };
+    std::list<Range> ranges;
+    auto oldFetchTimestamp = [&ranges](size_t size) {
+        int64_t pts = -1;
+        bool first = true;
+        while (size > 0 && !ranges.empty()) {
+            Range& range = ranges.front();
+            if (first) {
+                pts = range.pts;
+                first = false;
+            }
+            if (range.length > size) {
+                range.length -= size;
+                size = 0;
+            } else {
+                size -= range.length;
+                ranges.erase(ranges.begin());
+            }
+        }
+        return pts;
+    };
+
+    // tiny PES next to ones carrying several frames, so frames start,
+    // end and span whole PES at any offset
+    std::mt19937 rng(15);
+    sptr<ElementaryStreamQueue> queue = new ElementaryStreamQueue(ElementaryStreamQueue::MPEG_AUDIO);
+    size_t offset = 0;
+    int64_t pts = 1000;
+    int frames = 0;
+    while (offset < es.size()) {
+        size_t size = (rng() & 3) ? rng() % 20 + 1 : rng() % 1500 + 1;
+        size = std::min(size, es.size() - offset);
+        ASSERT_EQ(0, queue->appendData(&es[offset], size, pts, 0));
+        ranges.push_back({pts, size});
+        offset += size;
+        pts += 10;
+
+        sptr<AmlMpBuffer> accessUnit;
+        while ((accessUnit = queue->dequeueAccessUnit()) != nullptr) {
+            ASSERT_EQ(kPesHeaderSize + kFrameSize, accessUnit->size());
+            EXPECT_EQ(oldFetchTimestamp(kFrameSize), readTimestamp(accessUnit->data() + 9)) << "frame " << frames;
+            EXPECT_EQ(frames & 0x7F, accessUnit->data()[kPesHeaderSize + 4]);
+            ++frames;
+        }
+    }
+
+    EXPECT_EQ(kFrames, frames);
+    EXPECT_EQ(0u, queue->size());
+    EXPECT_TRUE(ranges.empty());
+}
+
+static std::vector<uint8_t> makeAc4Frame(size_t frameSize, unsigned sequenceCounter, bool crc)
+{
+    std::vector<uint8_t> frame = {0xAC, (uint8_t)(crc ? 0x41 : 0x40),
+            (uint8_t)(frameSize >> 8), (uint8_t)frameSize};
+
+    // ac4_toc(): bitstream_version 2, sequence_counter, b_wait_frames 0,
+    // fs_index 1, frame_rate_index 2
+    uint32_t toc = (2u << 16 | (sequenceCounter & 0x3FF) << 6 | 1 << 4 | 2) << 6;
+    frame.push_back(toc >> 16);
+    frame.push_back(toc >> 8);
+    frame.push_back(toc);
+    frame.resize(4 + frameSize + (crc ? 2 : 0), (uint8_t)sequenceCounter);
+    return frame;
+}
+
+TEST(AmlESQueueTest, Ac4SyncFrames)
+{
+    sptr<ElementaryStreamQueue> queue = new ElementaryStreamQueue(ElementaryStreamQueue::AC4);
+    queue->setOutputFormat(ElementaryStreamQueue::OUTPUT_RAW);
+
+    std::vector<std::vector<uint8_t>> frames;
+    for (unsigned i = 0; i < 8; ++i) {
+        frames.push_back(makeAc4Frame(300 + 50 * i, i, i == 5));
+    }
+
+    // junk before the first sync frame is skipped
+    std::vector<uint8_t> pes = {0x12, 0xAC, 0x40, 0x00, 0x00};
+    pes.insert(pes.end(), frames[0].begin(), frames[0].end());
+    ASSERT_EQ(0, queue->appendData(pes.data(), pes.size(), 3000, 0));
+    for (size_t i = 1; i < frames.size(); ++i) {
+        ASSERT_EQ(0, queue->appendData(frames[i].data(), frames[i].size(), 3000 + 3600 * i, 0));
+    }
+
+    for (size_t i = 0; i < frames.size(); ++i) {
+        sptr<AmlMpBuffer> accessUnit = queue->dequeueAccessUnit();
+        ASSERT_TRUE(accessUnit != nullptr) << "frame " << i;
+        ASSERT_EQ(frames[i].size(), accessUnit->size());
+        EXPECT_EQ(0, memcmp(frames[i].data(), accessUnit->data(), frames[i].size()));
+    }
+    EXPECT_TRUE(queue->dequeueAccessUnit() == nullptr);
+    EXPECT_EQ(0u, queue->size());
+}
+
+TEST(AmlESQueueTest, LpcmHeaders)
+{
+    ElementaryStreamQueue::PcmFormat format;
+
+    // Blu-ray LPCM, 5ms of 48kHz stereo 16 bit samples per PES
+    sptr<ElementaryStreamQueue> queue = new ElementaryStreamQueue(ElementaryStreamQueue::PCM_AUDIO);
+    EXPECT_FALSE(queue->getPcmFormat(&format));
+
+    std::vector<uint8_t> bd = {0x03, 0xC0, 0x31, 0x40};
+    bd.resize(4 + 960, 0x5A);
+    std::vector<uint8_t> bad = {0x01, 0x00, 0x21, 0x40};    // reserved channel_assignment
+    bad.resize(4 + 256, 0x00);
+    ASSERT_EQ(0, queue->appendData(bad.data(), bad.size(), 1000, 0));
+    ASSERT_EQ(0, queue->appendData(bd.data(), bd.size(), 1450, 0));
+    ASSERT_EQ(0, queue->appendData(bd.data(), bd.size(), 1900, 0));
+
+    for (int64_t pts : {1450, 1900}) {
+        sptr<AmlMpBuffer> accessUnit = queue->dequeueAccessUnit();
+        ASSERT_TRUE(accessUnit != nullptr);
+        ASSERT_EQ(kPesHeaderSize + bd.size(), accessUnit->size());
+        EXPECT_EQ(pts, readTimestamp(accessUnit->data() + 9));
+        EXPECT_EQ(0, memcmp(bd.data(), accessUnit->data() + kPesHeaderSize, bd.size()));
+    }
+    EXPECT_TRUE(queue->dequeueAccessUnit() == nullptr);
+    ASSERT_TRUE(queue->getPcmFormat(&format));
+    EXPECT_EQ(48000, format.sampleRate);
+    EXPECT_EQ(2, format.channels);
+    EXPECT_EQ(16, format.bitsPerSample);
+
+    // DVD LPCM, 96kHz 6 channels 24 bit, raw output drops the header
+    queue = new ElementaryStreamQueue(ElementaryStreamQueue::PCM_AUDIO);
+    queue->setOutputFormat(ElementaryStreamQueue::OUTPUT_RAW);
+    std::vector<uint8_t> dvd = {0xA0, 0x01, 0x00, 0x04, 0x00, 0x95, 0x80};
+    dvd.resize(7 + 6 * 3 * 40, 0xA5);
+    ASSERT_EQ(0, queue->appendData(dvd.data(), dvd.size(), 0, 0));
+
+    sptr<AmlMpBuffer> accessUnit = queue->dequeueAccessUnit();
+    ASSERT_TRUE(accessUnit != nullptr);
+    ASSERT_EQ(dvd.size() - 7, accessUnit->size());
+    EXPECT_EQ(0, memcmp(dvd.data() + 7, accessUnit->data(), accessUnit->size()));
+    ASSERT_TRUE(queue->getPcmFormat(&format));
+    EXPECT_EQ(96000, format.sampleRate);
+    EXPECT_EQ(6, format.channels);
+    EXPECT_EQ(24, format.bitsPerSample);
+}
+
+TEST(AmlESQueueTest, TimedMetadata)
+{
+    sptr<ElementaryStreamQueue> queue = new ElementaryStreamQueue(ElementaryStreamQueue::METADATA);
+    queue->setOutputFormat(ElementaryStreamQueue::OUTPUT_RAW);
+
+    // an ID3 tag with a 200 byte frame area, stuffing behind it is dropped
+    std::vector<uint8_t> id3 = {'I', 'D', '3', 0x04, 0x00, 0x00, 0x00, 0x00, 0x01, 0x48};
+    id3.resize(10 + 200, 'x');
+    std::vector<uint8_t> pes = id3;
+    pes.resize(pes.size() + 20, 0xFF);
+    ASSERT_EQ(0, queue->appendData(pes.data(), pes.size(), 90000, 0));
+
+    sptr<AmlMpBuffer> accessUnit = queue->dequeueAccessUnit();
+    ASSERT_TRUE(accessUnit != nullptr);
+    ASSERT_EQ(id3.size(), accessUnit->size());
+    EXPECT_EQ(0, memcmp(id3.data(), accessUnit->data(), id3.size()));
+
+    // two KLV packets, short and long form BER lengths
+    std::vector<uint8_t> klv = {0x06, 0x0E, 0x2B, 0x34, 0x02, 0x0B, 0x01, 0x01,
+            0x0E, 0x01, 0x03, 0x01, 0x01, 0x00, 0x00, 0x00, 0x10};
+    klv.resize(klv.size() + 0x10, 0x11);
+    std::vector<uint8_t> longKlv(klv.begin(), klv.begin() + 16);
+    longKlv.push_back(0x82);
+    longKlv.push_back(0x01);
+    longKlv.push_back(0x2C);
+    longKlv.resize(longKlv.size() + 300, 0x22);
+    pes = klv;
+    pes.insert(pes.end(), longKlv.begin(), longKlv.end());
+    ASSERT_EQ(0, queue->appendData(pes.data(), pes.size(), 93000, 0));
+
+    accessUnit = queue->dequeueAccessUnit();
+    ASSERT_TRUE(accessUnit != nullptr);
+    ASSERT_EQ(pes.size(), accessUnit->size());
+    EXPECT_EQ(0, memcmp(pes.data(), accessUnit->data(), pes.size()));
+
+    // in a metadata stream the KLV packet is split over two AU cells
+    pes = {0x00, 0x01, 0x80, 0x00, 0x10};
+    pes.insert(pes.end(), klv.begin(), klv.begin() + 0x10);
+    pes.insert(pes.end(), {0x00, 0x01, 0x40, 0x00, (uint8_t)(klv.size() - 0x10)});
+    pes.insert(pes.end(), klv.begin() + 0x10, klv.end());
+
+    ElementaryStreamQueue::PesInfo info;
+    info.pts = 96000;
+    info.streamId = 0xFC;
+    struct iovec iov = {pes.data(), pes.size()};
+    ASSERT_EQ(0, queue->appendData(&iov, 1, info));
+
+    accessUnit = queue->dequeueAccessUnit();
+    ASSERT_TRUE(accessUnit != nullptr);
+    ASSERT_EQ(klv.size(), accessUnit->size());
+    EXPECT_EQ(0, memcmp(klv.data(), accessUnit->data(), klv.size()));
+    EXPECT_TRUE(queue->dequeueAccessUnit() == nullptr);
+}
+
+TEST(AmlESQueueTest, WholePesWhenRangesFull)
+{
+    // more PES than the ranges hold, the oldest are dropped and each
+    // access unit is still one PES with its own timestamp
+    const int kPesCount = 300;
+    std::vector<uint8_t> lpcm = {0x00, 0xC0, 0x31, 0x40};
+    lpcm.resize(4 + 192, 0x5A);
+    std::vector<uint8_t> id3 = {'I', 'D', '3', 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40};
+    id3.resize(10 + 64, 'x');
+
+    for (ElementaryStreamQueue::Mode mode : {ElementaryStreamQueue::PCM_AUDIO, ElementaryStreamQueue::METADATA}) {
+        const std::vector<uint8_t>& pes = mode == ElementaryStreamQueue::PCM_AUDIO ? lpcm : id3;
+        sptr<ElementaryStreamQueue> queue = new ElementaryStreamQueue(mode);
+        for (int i = 0; i < kPesCount; ++i) {
+            ASSERT_EQ(0, queue->appendData(pes.data(), pes.size(), 90 * i, 0));
+        }
+
+        // the last 256 are left
+        int i = kPesCount - 256;
+        sptr<AmlMpBuffer> accessUnit;
+        while ((accessUnit = queue->dequeueAccessUnit()) != nullptr) {
+            ASSERT_EQ(kPesHeaderSize + pes.size(), accessUnit->size()) << "mode " << mode;
+            EXPECT_EQ(90 * i, readTimestamp(accessUnit->data() + 9));
+            EXPECT_EQ(0, memcmp(pes.data(), accessUnit->data() + kPesHeaderSize, pes.size()));
+            ++i;
+        }
+        EXPECT_EQ(kPesCount, i) << "mode " << mode;
+    }
+}
+
+static void appendNalUnit(std::vector<uint8_t>* es, std::vector<uint8_t> nal, size_t size = 0)
+{
+    // slice data without start code emulation
+    for (size_t i = nal.size(); i < size; ++i) {
+        nal.push_back(0x80 | (i & 0x7F));
+    }
+    es->insert(es->end(), {0x00, 0x00, 0x00, 0x01});
+    es->insert(es->end(), nal.begin(), nal.end());
+}
+
+// High profile, level 4.0, 1920x1088 cropped to 1080
+static const std::vector<uint8_t> kAvcSps = {0x67, 0x64, 0x00, 0x28, 0xAC, 0xE5, 0x01, 0xE0, 0x08, 0x9F, 0x95};
+static const std::vector<uint8_t> kAvcPps0 = {0x68, 0xCE, 0x38, 0x80};
+static const std::vector<uint8_t> kAvcPps1 = {0x68, 0x4B, 0x3C, 0x80};
+
+TEST(AmlESQueueTest, H264KeyFramesAndParameterSets)
+{
+    const std::vector<uint8_t> aud = {0x09, 0xF0};
+    const std::vector<uint8_t> idr = {0x65, 0x88};
+    const std::vector<uint8_t> slice = {0x41, 0x9A};
+    const std::vector<uint8_t> recoveryPoint = {0x06, 0x05, 0x01, 0x11, 0x06, 0x01, 0xC4, 0x80};
+
+    std::vector<std::vector<uint8_t>> aus(6);
+    appendNalUnit(&aus[0], aud);
+    appendNalUnit(&aus[0], kAvcSps);
+    appendNalUnit(&aus[0], kAvcPps0);
+    appendNalUnit(&aus[0], idr, 200);
+    appendNalUnit(&aus[1], aud);
+    appendNalUnit(&aus[1], slice, 100);
+    appendNalUnit(&aus[2], aud);
+    appendNalUnit(&aus[2], recoveryPoint);
+    appendNalUnit(&aus[2], slice, 100);
+    appendNalUnit(&aus[3], aud);
+    appendNalUnit(&aus[3], kAvcSps);
+    appendNalUnit(&aus[3], kAvcPps0);
+    appendNalUnit(&aus[3], idr, 200);
+    appendNalUnit(&aus[4], aud);
+    appendNalUnit(&aus[4], kAvcPps1);
+    appendNalUnit(&aus[4], slice, 100);
+    appendNalUnit(&aus[5], aud);
+    appendNalUnit(&aus[5], slice, 100);
+
+    sptr<ElementaryStreamQueue> queue = new ElementaryStreamQueue(ElementaryStreamQueue::H264);
+    queue->setOutputFormat(ElementaryStreamQueue::OUTPUT_RAW);
+    ElementaryStreamQueue::VideoConfig config;
+    EXPECT_FALSE(queue->getVideoConfig(&config));
+
+    std::vector<int32_t> flags;
+    for (size_t i = 0; i < aus.size(); ++i) {
+        ASSERT_EQ(0, queue->appendData(aus[i].data(), aus[i].size(), 3000 * i, 0));
+        sptr<AmlMpBuffer> accessUnit;
+        while ((accessUnit = queue->dequeueAccessUnit()) != nullptr) {
+            ASSERT_EQ(aus[flags.size()].size(), accessUnit->size());
+            flags.push_back(accessUnit->int32Data());
+        }
+    }
+
+    const int32_t kKey = ElementaryStreamQueue::AU_FLAG_KEY_FRAME;
+    const int32_t kRecovery = ElementaryStreamQueue::AU_FLAG_RECOVERY_POINT;
+    const int32_t kChanged = ElementaryStreamQueue::AU_FLAG_CONFIG_CHANGED;
+    EXPECT_EQ(std::vector<int32_t>({kKey | kChanged, 0, kRecovery, kKey, kChanged}), flags);
+
+    ASSERT_TRUE(queue->getVideoConfig(&config));
+    EXPECT_EQ(1920, config.width);
+    EXPECT_EQ(1080, config.height);
+    EXPECT_EQ(100, config.profile);
+    EXPECT_EQ(40, config.level);
+    EXPECT_EQ(3u, config.generation);
+
+    std::vector<uint8_t> configData;
+    appendNalUnit(&configData, kAvcSps);
+    appendNalUnit(&configData, kAvcPps0);
+    appendNalUnit(&configData, kAvcPps1);
+    ASSERT_TRUE(config.configData != nullptr);
+    ASSERT_EQ(configData.size(), config.configData->size());
+    EXPECT_EQ(0, memcmp(configData.data(), config.configData->data(), configData.size()));
+}
+
+TEST(AmlESQueueTest, H265KeyFramesAndParameterSets)
+{
+    // Main profile, level 5.1, 3840x2176 cropped to 2160, with emulation
+    // prevention bytes in the general_constraint flags
+    const std::vector<uint8_t> sps = {0x42, 0x01, 0x01, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00, 0x90,
+            0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x99, 0xA0, 0x01, 0xE0, 0x20, 0x02, 0x20, 0x7C, 0x4E};
+    const std::vector<uint8_t> vps = {0x40, 0x01, 0x0C, 0x01, 0xFF, 0xFF};
+    const std::vector<uint8_t> pps = {0x44, 0x01, 0xC1, 0x72};
+    const std::vector<uint8_t> idr = {0x26, 0x01, 0xAF};
+    const std::vector<uint8_t> cra = {0x2A, 0x01, 0xAD};
+    const std::vector<uint8_t> trail = {0x02, 0x01, 0xD0};
+    const std::vector<uint8_t> recoveryPoint = {0x4E, 0x01, 0x06, 0x01, 0xC4, 0x80};
+
+    std::vector<std::vector<uint8_t>> aus(6);
+    appendNalUnit(&aus[0], vps);
+    appendNalUnit(&aus[0], sps);
+    appendNalUnit(&aus[0], pps);
+    appendNalUnit(&aus[0], idr, 300);
+    appendNalUnit(&aus[1], trail, 100);
+    appendNalUnit(&aus[2], recoveryPoint);
+    appendNalUnit(&aus[2], trail, 100);
+    appendNalUnit(&aus[3], cra, 300);
+    appendNalUnit(&aus[4], trail, 100);
+    appendNalUnit(&aus[5], trail, 100);
+
+    sptr<ElementaryStreamQueue> queue = new ElementaryStreamQueue(ElementaryStreamQueue::H265);
+    queue->setOutputFormat(ElementaryStreamQueue::OUTPUT_RAW);
+
+    std::vector<int32_t> flags;
+    for (size_t i = 0; i < aus.size(); ++i) {
+        ASSERT_EQ(0, queue->appendData(aus[i].data(), aus[i].size(), 3000 * i, 0));
+        sptr<AmlMpBuffer> accessUnit;
+        while ((accessUnit = queue->dequeueAccessUnit()) != nullptr) {
+            ASSERT_EQ(aus[flags.size()].size(), accessUnit->size());
+            flags.push_back(accessUnit->int32Data());
+        }
+    }
+
+    EXPECT_EQ(std::vector<int32_t>({
+            ElementaryStreamQueue::AU_FLAG_KEY_FRAME | ElementaryStreamQueue::AU_FLAG_CONFIG_CHANGED,
+            0,
+            ElementaryStreamQueue::AU_FLAG_RECOVERY_POINT,
+            ElementaryStreamQueue::AU_FLAG_KEY_FRAME}), flags);
+
+    ElementaryStreamQueue::VideoConfig config;
+    ASSERT_TRUE(queue->getVideoConfig(&config));
+    EXPECT_EQ(3840, config.width);
+    EXPECT_EQ(2160, config.height);
+    EXPECT_EQ(1, config.profile);
+    EXPECT_EQ(153, config.level);
+    EXPECT_EQ(3u, config.generation);
+}
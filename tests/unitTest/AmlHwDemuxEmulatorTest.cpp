@@ -0,0 +1,488 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#define LOG_TAG "AmlHwDemuxEmulatorTest"
+#include <utils/AmlMpLog.h>
+#include <utils/AmlMpConfig.h>
+#include <demux/AmlDemuxBase.h>
+#include <demux/AmlDmxEmulator.h>
+#include "TsTestUtils.h"
+#include <gtest/gtest.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+#include <atomic>
+#include <chrono>
+#include <vector>
+#include <thread>
+#include <condition_variable>
+#include <mutex>
+
+#define CONFIG_AMLOGIC_DVB_COMPAT
+extern "C" {
+#include <dmx.h>
+}
+
+using namespace aml_mp;
+
+static const char* mName = LOG_TAG;
+
+namespace {
+// written after the data of a test, once its filter has it the emulator is done with the rest
+const int kSentinelPid = 0x1FF0;
+
+bool waitReadable(int fd, int timeoutMs = 2000)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    return ::poll(&pfd, 1, timeoutMs) == 1;
+}
+
+void writeFully(int fd, const std::vector<uint8_t>& data)
+{
+    size_t offset = 0;
+    while (offset < data.size()) {
+        ssize_t ret = ::write(fd, data.data() + offset, data.size() - offset);
+        ASSERT_GT(ret, 0) << strerror(errno);
+        offset += ret;
+    }
+}
+}
+
+class AmlHwDemuxEmulatorTest : public testing::Test
+{
+protected:
+    void SetUp() override {
+        mDevice = AmlDmxEmulator::instance();
+        mDvrFd = mDevice->open("/dev/dvb0.dvr7", O_WRONLY);
+        ASSERT_GE(mDvrFd, 0);
+
+        mSentinelFd = openSectionFilter(kSentinelPid, 0, 0);
+        ASSERT_GE(mSentinelFd, 0);
+    }
+
+    void TearDown() override {
+        mDevice->close(mSentinelFd);
+        mDevice->close(mDvrFd);
+    }
+
+    int openSectionFilter(int pid, uint8_t tableId, uint8_t mask, size_t bufferSize = 0) {
+        int fd = mDevice->open("/dev/dvb0.demux7", O_RDWR | O_NONBLOCK);
+        if (fd < 0) {
+            return -1;
+        }
+
+        if (bufferSize > 0) {
+            EXPECT_EQ(0, mDevice->ioctl(fd, DMX_SET_BUFFER_SIZE, (void*)(long)bufferSize));
+        }
+
+        struct dmx_sct_filter_params params;
+        memset(&params, 0, sizeof(params));
+        params.pid = pid;
+        params.filter.filter[0] = tableId;
+        params.filter.mask[0] = mask;
+        params.flags = DMX_IMMEDIATE_START;
+        EXPECT_EQ(0, mDevice->ioctl(fd, DMX_SET_FILTER, &params));
+        return fd;
+    }
+
+    // feeds ts and waits until the emulator has parsed it
+    void feed(std::vector<uint8_t> ts) {
+        TsPacketWriter(kSentinelPid).appendSection(ts, mSentinelCc++, 0x42, 0, 0);
+        writeFully(mDvrFd, ts);
+
+        uint8_t section[1024];
+        ASSERT_TRUE(waitReadable(mSentinelFd));
+        ASSERT_EQ(20, mDevice->read(mSentinelFd, section, sizeof(section)));
+    }
+
+    AmlDmxDevice* mDevice = nullptr;
+    int mDvrFd = -1;
+    int mSentinelFd = -1;
+    unsigned mSentinelCc = 0;
+};
+
+TEST_F(AmlHwDemuxEmulatorTest, SectionFilter)
+{
+    EXPECT_EQ(-1, mDevice->open("/dev/dvb0.dvr7", O_WRONLY));
+    EXPECT_EQ(EBUSY, errno);
+
+    int fd = openSectionFilter(0x12, 0x4E, 0xFF);
+    ASSERT_GE(fd, 0);
+    EXPECT_EQ(-1, mDevice->ioctl(fd, DMX_SET_BUFFER_SIZE, (void*)(long)65536));
+    EXPECT_EQ(EBUSY, errno);
+
+    TsPacketWriter eit(0x12);
+    std::vector<uint8_t> ts;
+    unsigned cc = 0;
+    for (uint16_t serviceId = 1; serviceId <= 3; ++serviceId) {
+        eit.appendSection(ts, cc++, 0x4E, serviceId, 0);
+        eit.appendSection(ts, cc++, 0x4F, serviceId, 0);
+    }
+    feed(ts);
+
+    // one section per read, a short read leaves the rest for the next one
+    uint8_t section[1024];
+    ASSERT_EQ(8, mDevice->read(fd, section, 8));
+    EXPECT_EQ(0x4E, section[0]);
+    ASSERT_EQ(12, mDevice->read(fd, section, sizeof(section)));
+    for (uint16_t serviceId = 2; serviceId <= 3; ++serviceId) {
+        ASSERT_EQ(20, mDevice->read(fd, section, sizeof(section)));
+        EXPECT_EQ(0x4E, section[0]);
+        EXPECT_EQ(serviceId, section[3] << 8 | section[4]);
+    }
+    EXPECT_EQ(-1, mDevice->read(fd, section, sizeof(section)));
+    EXPECT_EQ(EAGAIN, errno);
+    EXPECT_FALSE(waitReadable(fd, 0));
+
+    EXPECT_EQ(0, mDevice->close(fd));
+}
+
+TEST_F(AmlHwDemuxEmulatorTest, DvrInput)
+{
+    EXPECT_EQ(0, mDevice->ioctl(mDvrFd, DMX_SET_INPUT, (void*)(long)INPUT_LOCAL));
+    EXPECT_EQ(-1, mDevice->ioctl(mDvrFd, DMX_SET_INPUT, (void*)(long)INPUT_LOCAL_SEC));
+    EXPECT_EQ(EINVAL, errno);
+
+    int fd = openSectionFilter(0x12, 0x4E, 0xFF);
+    ASSERT_GE(fd, 0);
+
+    // a stray sync byte in the garbage before the TS, and garbage between two packets
+    TsPacketWriter eit(0x12);
+    std::vector<uint8_t> ts(100, 0x00);
+    ts[30] = 0x47;
+    unsigned cc = 0;
+    eit.appendSection(ts, cc++, 0x4E, 1, 0);
+    eit.appendSection(ts, cc++, 0x4E, 2, 0);
+    ts.insert(ts.end(), 5, 0x00);
+    eit.appendSection(ts, cc++, 0x4E, 3, 0);
+    eit.appendSection(ts, cc++, 0x4E, 4, 0);
+    feed(ts);
+
+    uint8_t section[1024];
+    for (uint16_t serviceId = 1; serviceId <= 4; ++serviceId) {
+        ASSERT_EQ(20, mDevice->read(fd, section, sizeof(section)));
+        EXPECT_EQ(serviceId, section[3] << 8 | section[4]);
+    }
+    EXPECT_EQ(-1, mDevice->read(fd, section, sizeof(section)));
+    EXPECT_EQ(EAGAIN, errno);
+
+    EXPECT_EQ(0, mDevice->close(fd));
+}
+
+TEST_F(AmlHwDemuxEmulatorTest, SectionOverflow)
+{
+    int fd = openSectionFilter(0x12, 0, 0, 1024);
+    ASSERT_GE(fd, 0);
+
+    // 51 sections of 20 bytes don't fit in 1024
+    TsPacketWriter eit(0x12);
+    std::vector<uint8_t> ts;
+    unsigned cc = 0;
+    for (int i = 0; i < 60; ++i) {
+        eit.appendSection(ts, cc++, 0x4E, i, 0);
+    }
+    feed(ts);
+
+    // the error is reported first and drops what was buffered, as dmxdev does
+    uint8_t section[1024];
+    ASSERT_TRUE(waitReadable(fd, 0));
+    EXPECT_EQ(-1, mDevice->read(fd, section, sizeof(section)));
+    EXPECT_EQ(EOVERFLOW, errno);
+    EXPECT_EQ(-1, mDevice->read(fd, section, sizeof(section)));
+    EXPECT_EQ(EAGAIN, errno);
+
+    ts.clear();
+    eit.appendSection(ts, cc++, 0x4E, 100, 0);
+    feed(ts);
+    ASSERT_EQ(20, mDevice->read(fd, section, sizeof(section)));
+    EXPECT_EQ(100, section[3] << 8 | section[4]);
+
+    EXPECT_EQ(0, mDevice->close(fd));
+}
+
+TEST_F(AmlHwDemuxEmulatorTest, PesFilter)
+{
+    const int pid = 0x100;
+    int fd = mDevice->open("/dev/dvb0.demux7", O_RDWR | O_NONBLOCK);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(0, mDevice->ioctl(fd, DMX_SET_BUFFER_SIZE, (void*)(long)(64 * 1024)));
+
+    struct dmx_pes_filter_params params;
+    memset(&params, 0, sizeof(params));
+    params.pid = pid;
+    params.input = DMX_IN_FRONTEND;
+    params.output = DMX_OUT_TAP;
+    params.pes_type = DMX_PES_VIDEO0;
+    ASSERT_EQ(0, mDevice->ioctl(fd, DMX_SET_PES_FILTER, &params));
+    ASSERT_EQ(0, mDevice->ioctl(fd, DMX_START));
+
+    // the tail of a PES that started before the filter is skipped
+    TsPacketWriter writer(pid);
+    std::vector<uint8_t> ts;
+    std::vector<uint8_t> expected;
+    unsigned cc = 0;
+    writer.appendPes(ts, cc, makePes(500, 0x11));
+    ts.erase(ts.begin(), ts.begin() + kTsPacketSize);
+    for (int i = 1; i <= 3; ++i) {
+        std::vector<uint8_t> pes = makePes(1000 * i, 0x11 * i);
+        writer.appendPes(ts, cc, pes);
+        expected.insert(expected.end(), pes.begin(), pes.end());
+    }
+    feed(ts);
+
+    // the TS payloads, whatever the read size
+    std::vector<uint8_t> data;
+    uint8_t buffer[1000];
+    ssize_t len;
+    while ((len = mDevice->read(fd, buffer, sizeof(buffer))) > 0) {
+        data.insert(data.end(), buffer, buffer + len);
+    }
+    EXPECT_EQ(EAGAIN, errno);
+    EXPECT_EQ(expected, data);
+
+    // 32 packets of payload don't fit in 4K, the overflow is reported once
+    ASSERT_EQ(0, mDevice->ioctl(fd, DMX_STOP));
+    ASSERT_EQ(0, mDevice->ioctl(fd, DMX_SET_BUFFER_SIZE, (void*)(long)4096));
+    ASSERT_EQ(0, mDevice->ioctl(fd, DMX_START));
+    ts.clear();
+    writer.appendPes(ts, cc, makePes(184 * 32, 0x55));
+    feed(ts);
+    EXPECT_EQ(-1, mDevice->read(fd, buffer, sizeof(buffer)));
+    EXPECT_EQ(EOVERFLOW, errno);
+    EXPECT_EQ(-1, mDevice->read(fd, buffer, sizeof(buffer)));
+    EXPECT_EQ(EAGAIN, errno);
+
+    EXPECT_EQ(0, mDevice->close(fd));
+}
+
+// AmlHwDemux on the emulator, from feedTs() to the filter callback
+TEST(AmlHwDemuxEmulatorThroughputTest, VideoPes)
+{
+    const int pid = 0x100;
+    const size_t kPesPayloadSize = 64 * 1024;
+    const int kPesCount = 256;
+
+    TsPacketWriter writer(pid);
+    std::vector<uint8_t> ts;
+    size_t expectedBytes = 0;
+    unsigned cc = 0;
+    for (int i = 0; i < kPesCount; ++i) {
+        std::vector<uint8_t> pes = makePes(kPesPayloadSize, i);
+        writer.appendPes(ts, cc, pes);
+        expectedBytes += pes.size();
+    }
+
+    // the device is picked when the demux is opened
+    AmlMpConfig::instance().mHwDemuxEmulator = 1;
+    sptr<AmlDemuxBase> demux = AmlDemuxBase::create(AML_MP_DEMUX_TYPE_HARDWARE);
+    ASSERT_TRUE(demux != nullptr);
+    int ret = demux->open(false, AML_MP_HW_DEMUX_ID_6);
+    AmlMpConfig::instance().mHwDemuxEmulator = 0;
+    ASSERT_EQ(0, ret);
+    ASSERT_EQ(0, demux->start());
+
+    Aml_MP_DemuxFilterParams params;
+    memset(&params, 0, sizeof(params));
+    params.type = AML_MP_DEMUX_FILTER_VIDEO;
+    std::atomic<size_t> bytes{0};
+    AmlDemuxBase::CHANNEL channel = demux->createChannel(pid, &params);
+    AmlDemuxBase::FILTER filter = demux->createFilter([](int, size_t size, const uint8_t*, void* userData) {
+        *static_cast<std::atomic<size_t>*>(userData) += size;
+        return 0;
+    }, &bytes);
+    demux->attachFilter(filter, channel);
+    demux->openChannel(channel);
+
+    auto begin = std::chrono::steady_clock::now();
+    const size_t kChunkSize = kTsPacketSize * 7;
+    for (size_t offset = 0; offset < ts.size(); offset += kChunkSize) {
+        size_t size = std::min(kChunkSize, ts.size() - offset);
+        ASSERT_EQ((int)size, demux->feedTs(&ts[offset], size));
+    }
+    waitFor([&] { return bytes >= expectedBytes; }, 10000);
+    auto elapsedUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count();
+
+    Aml_MP_DemuxInjectStatistics stats;
+    ASSERT_EQ(0, demux->getInjectStatistics(&stats));
+
+    demux->closeChannel(channel);
+    demux->detachFilter(filter, channel);
+    demux->destroyFilter(filter);
+    demux->destroyChannel(channel);
+    demux->stop();
+    demux->close();
+
+    EXPECT_EQ(expectedBytes, bytes.load());
+    MLOGI("%zu TS bytes in %lld us, %.1f MB/s, %" PRIu64 " dvr writes",
+            ts.size(), (long long)elapsedUs, ts.size() / (double)std::max<int64_t>(elapsedUs, 1), stats.writes);
+}
+
+// flush() drops the reads queued to a callback worker, the filter goes on
+TEST(AmlHwDemuxEmulatorFlushTest, DropsQueuedCallbacks)
+{
+    const int pid = 0x100;
+    const int kChunks = 16;
+    TsPacketWriter writer(pid);
+    std::vector<std::vector<uint8_t>> chunks(kChunks);
+    size_t fedBytes = 0;
+    unsigned cc = 0;
+    for (auto& chunk : chunks) {
+        std::vector<uint8_t> pes = makePes(4096, 0x11);
+        writer.appendPes(chunk, cc, pes);
+        fedBytes += pes.size();
+    }
+
+    AmlMpConfig::instance().mHwDemuxEmulator = 1;
+    int workers = AmlMpConfig::instance().mHwDemuxCallbackWorkers;
+    AmlMpConfig::instance().mHwDemuxCallbackWorkers = 1;
+    sptr<AmlDemuxBase> demux = AmlDemuxBase::create(AML_MP_DEMUX_TYPE_HARDWARE);
+    ASSERT_TRUE(demux != nullptr);
+    EXPECT_EQ(0, demux->flush());
+    int ret = demux->open(false, AML_MP_HW_DEMUX_ID_6);
+    AmlMpConfig::instance().mHwDemuxEmulator = 0;
+    ASSERT_EQ(0, ret);
+    ret = demux->start();
+    AmlMpConfig::instance().mHwDemuxCallbackWorkers = workers;
+    ASSERT_EQ(0, ret);
+
+    // the first callback blocks the worker until the flush is done
+    struct State {
+        std::mutex lock;
+        std::condition_variable cond;
+        bool blocked = true;
+        size_t bytes = 0;
+        int callbacks = 0;
+    } state;
+    Aml_MP_DemuxFilterParams params;
+    memset(&params, 0, sizeof(params));
+    params.type = AML_MP_DEMUX_FILTER_VIDEO;
+    AmlDemuxBase::CHANNEL channel = demux->createChannel(pid, &params);
+    AmlDemuxBase::FILTER filter = demux->createFilter([](int, size_t size, const uint8_t*, void* userData) {
+        State* state = static_cast<State*>(userData);
+        std::unique_lock<std::mutex> l(state->lock);
+        state->bytes += size;
+        ++state->callbacks;
+        state->cond.notify_all();
+        state->cond.wait(l, [state] { return !state->blocked; });
+        return 0;
+    }, &state);
+    demux->attachFilter(filter, channel);
+    demux->openChannel(channel);
+
+    // one read per chunk, they queue up behind the blocked callback
+    for (const auto& chunk : chunks) {
+        ASSERT_EQ((int)chunk.size(), demux->feedTs(chunk.data(), chunk.size()));
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    {
+        std::unique_lock<std::mutex> l(state.lock);
+        ASSERT_TRUE(state.cond.wait_for(l, std::chrono::seconds(2), [&] { return state.callbacks > 0; }));
+    }
+    ASSERT_EQ(0, demux->flush());
+    {
+        std::lock_guard<std::mutex> l(state.lock);
+        state.blocked = false;
+        state.cond.notify_all();
+    }
+
+    // what wasn't queued yet is still delivered, and so is what comes next
+    std::vector<uint8_t> ts;
+    std::vector<uint8_t> pes = makePes(4096, 0x22);
+    writer.appendPes(ts, cc, pes);
+    size_t before = 0;
+    for (size_t last = SIZE_MAX; last != before;) {
+        last = before;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        std::lock_guard<std::mutex> l(state.lock);
+        before = state.bytes;
+    }
+    ASSERT_EQ((int)ts.size(), demux->feedTs(ts.data(), ts.size()));
+    EXPECT_TRUE(waitFor([&] {
+        std::lock_guard<std::mutex> l(state.lock);
+        return state.bytes >= before + pes.size();
+    }, 2000));
+
+    demux->closeChannel(channel);
+    demux->detachFilter(filter, channel);
+    demux->destroyFilter(filter);
+    demux->destroyChannel(channel);
+    demux->stop();
+    demux->close();
+
+    std::lock_guard<std::mutex> l(state.lock);
+    EXPECT_EQ(before + pes.size(), state.bytes);
+    EXPECT_LT(before, fedBytes);
+    MLOGI("%zu of %zu bytes delivered around the flush, %d callbacks", before, fedBytes, state.callbacks);
+}
+
+// the dvr input is counted per pid, whatever the feedTs() boundaries
+TEST(AmlHwDemuxEmulatorPidStatTest, DvrInput)
+{
+    const int pid = 0x100;
+    TsPacketWriter eit(0x12);
+    TsPacketWriter writer(pid);
+    std::vector<uint8_t> ts;
+    unsigned cc = 0;
+    writer.appendPes(ts, cc, makePes(184 * 10, 0x11));
+    // one packet lost
+    ++cc;
+    writer.appendPes(ts, cc, makePes(184 * 5, 0x22));
+    unsigned sectionCc = 0;
+    eit.appendSection(ts, sectionCc++, 0x4E, 1, 0);
+    const uint64_t kPesPackets = ts.size() / kTsPacketSize - 1;
+
+    AmlMpConfig::instance().mHwDemuxEmulator = 1;
+    sptr<AmlDemuxBase> demux = AmlDemuxBase::create(AML_MP_DEMUX_TYPE_HARDWARE);
+    ASSERT_TRUE(demux != nullptr);
+    int ret = demux->open(false, AML_MP_HW_DEMUX_ID_6);
+    AmlMpConfig::instance().mHwDemuxEmulator = 0;
+    ASSERT_EQ(0, ret);
+    ASSERT_EQ(0, demux->start());
+
+    Aml_MP_DemuxPidStat stat;
+    EXPECT_EQ(-1, demux->getPidStatistics(pid, &stat));
+
+    // a packet split over two calls is counted once it is complete
+    const size_t kChunkSize = 1000;
+    for (size_t offset = 0; offset < ts.size(); offset += kChunkSize) {
+        size_t size = std::min(kChunkSize, ts.size() - offset);
+        ASSERT_EQ((int)size, demux->feedTs(&ts[offset], size));
+    }
+
+    ASSERT_EQ(0, demux->getPidStatistics(pid, &stat));
+    EXPECT_EQ(pid, stat.pid);
+    EXPECT_EQ(kPesPackets, stat.packets);
+    EXPECT_EQ(kPesPackets * kTsPacketSize, stat.bytes);
+    EXPECT_EQ(1u, stat.ccErrors);
+
+    ASSERT_EQ(0, demux->getPidStatistics(0x12, &stat));
+    EXPECT_EQ(1u, stat.packets);
+    EXPECT_EQ(0u, stat.ccErrors);
+
+    ASSERT_EQ(0, demux->getPidStatistics(0x200, &stat));
+    EXPECT_EQ(0u, stat.packets);
+
+    // the next packet doesn't have to follow the last one after a flush
+    ASSERT_EQ(0, demux->flush());
+    ts.clear();
+    cc = 7;
+    writer.appendPes(ts, cc, makePes(184, 0x33));
+    ASSERT_EQ((int)ts.size(), demux->feedTs(ts.data(), ts.size()));
+    ASSERT_EQ(0, demux->getPidStatistics(pid, &stat));
+    EXPECT_EQ(kPesPackets + 2, stat.packets);
+    EXPECT_EQ(1u, stat.ccErrors);
+
+    demux->stop();
+    demux->close();
+}
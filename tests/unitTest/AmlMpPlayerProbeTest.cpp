@@ -40,6 +40,37 @@ TEST_F(AmlMpTest, BufferTest)
     }
 }
 
+TEST_F(AmlMpTest, DemuxPidStatTest)
+{
+    std::string url;
+    for (auto &url: mUrls)
+    {
+        MLOGI("----------DemuxPidStatTest START----------\n");
+        createMpTestSupporter();
+        mpTestSupporter->setDataSource(url);
+        mpTestSupporter->prepare();
+        sptr<ProgramInfo> mProgramInfo = mpTestSupporter->getProgramInfo();
+        if (mProgramInfo == nullptr)
+        {
+            printf("Format for this stream is not ts.");
+            continue;
+        }
+        mpTestSupporter->startPlay();
+        waitPlaying(2 * 1000ll);
+        void *player = getPlayer();
+        Aml_MP_DemuxPidStat stat;
+        memset(&stat, 0, sizeof(stat));
+        stat.pid = mProgramInfo->videoPid;
+        EXPECT_EQ(Aml_MP_Player_GetParameter(player, AML_MP_PLAYER_PARAMETER_DEMUX_PID_STAT, &stat), AML_MP_OK);
+        EXPECT_EQ(stat.pid, mProgramInfo->videoPid);
+        EXPECT_GT(stat.packets, 0u);
+        EXPECT_EQ(stat.bytes, stat.packets * 188);
+        EXPECT_FALSE(waitPlayingErrors());
+        stopPlaying();
+        MLOGI("----------DemuxPidStatTest END----------\n");
+    }
+}
+
 TEST_F(AmlMpTest, PtsTest)
 {
     std::string url;
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#define LOG_TAG "AmlMpSpscQueueTest"
+#include <utils/AmlMpLog.h>
+#include <utils/AmlMpSpscQueue.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <thread>
+
+using namespace aml_mp;
+
+static const char* mName = LOG_TAG;
+
+TEST(AmlMpSpscQueueTest, FullAndEmpty)
+{
+    AmlMpSpscQueue<int> queue(5);
+    ASSERT_EQ(8u, queue.capacity());
+    EXPECT_TRUE(queue.empty());
+
+    int item = -1;
+    EXPECT_FALSE(queue.tryPop(&item));
+    EXPECT_EQ(-1, item);
+
+    for (int i = 0; i < 8; ++i) {
+        ASSERT_TRUE(queue.tryPush(int(i)));
+        EXPECT_EQ((size_t)i + 1, queue.size());
+    }
+    EXPECT_FALSE(queue.tryPush(8));
+    EXPECT_EQ(8u, queue.size());
+
+    // one slot freed, one more fits
+    ASSERT_TRUE(queue.tryPop(&item));
+    EXPECT_EQ(0, item);
+    ASSERT_TRUE(queue.tryPush(8));
+    EXPECT_FALSE(queue.tryPush(9));
+
+    for (int i = 1; i <= 8; ++i) {
+        ASSERT_TRUE(queue.tryPop(&item));
+        EXPECT_EQ(i, item);
+    }
+    EXPECT_FALSE(queue.tryPop(&item));
+    EXPECT_TRUE(queue.empty());
+}
+
+TEST(AmlMpSpscQueueTest, Wraparound)
+{
+    AmlMpSpscQueue<int> queue(4);
+    int next = 0;
+    int expected = 0;
+
+    // the fill level cycles through every offset of the ring
+    for (int round = 0; round < 100; ++round) {
+        int push = round % 4 + 1;
+        for (int i = 0; i < push; ++i) {
+            if (!queue.tryPush(int(next))) {
+                ASSERT_EQ(queue.capacity(), queue.size());
+                break;
+            }
+            ++next;
+        }
+        int pop = (round + 3) % 4 + 1;
+        for (int i = 0; i < pop && !queue.empty(); ++i) {
+            int item;
+            ASSERT_TRUE(queue.tryPop(&item));
+            ASSERT_EQ(expected++, item);
+        }
+        ASSERT_LE(queue.size(), queue.capacity());
+    }
+
+    int item;
+    while (queue.tryPop(&item)) {
+        ASSERT_EQ(expected++, item);
+    }
+    EXPECT_EQ(next, expected);
+}
+
+TEST(AmlMpSpscQueueTest, PopReleasesSlot)
+{
+    AmlMpSpscQueue<std::shared_ptr<int>> queue(2);
+    std::shared_ptr<int> value = std::make_shared<int>(1);
+
+    ASSERT_TRUE(queue.tryPush(std::shared_ptr<int>(value)));
+    EXPECT_EQ(2, value.use_count());
+
+    std::shared_ptr<int> item;
+    ASSERT_TRUE(queue.tryPop(&item));
+    EXPECT_EQ(2, value.use_count());
+    item.reset();
+    // the queue doesn't keep the popped item alive
+    EXPECT_EQ(1, value.use_count());
+}
+
+TEST(AmlMpSpscQueueTest, ProducerConsumer)
+{
+    const uint32_t kItems = 1000000;
+    AmlMpSpscQueue<uint32_t> queue(64);
+
+    std::thread producer([&] {
+        for (uint32_t i = 0; i < kItems;) {
+            if (queue.tryPush(uint32_t(i))) {
+                ++i;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    });
+
+    uint32_t expected = 0;
+    uint32_t mismatches = 0;
+    while (expected < kItems) {
+        uint32_t item;
+        if (queue.tryPop(&item)) {
+            mismatches += item != expected;
+            ++expected;
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    producer.join();
+
+    EXPECT_EQ(0u, mismatches);
+    EXPECT_TRUE(queue.empty());
+}
@@ -0,0 +1,875 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#define LOG_TAG "AmlSwDemuxTest"
+#include <utils/AmlMpLog.h>
+#include <utils/AmlMpCrc32.h>
+#include <utils/AmlMpConfig.h>
+#include <utils/AmlMpBuffer.h>
+#include <utils/AmlMpEventLooper.h>
+#include <demux/AmlDemuxBase.h>
+#include "TsTestUtils.h"
+#include <gtest/gtest.h>
+#include <string.h>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+
+using namespace aml_mp;
+
+static const char* mName = LOG_TAG;
+
+class AmlSwDemuxTest : public testing::Test
+{
+protected:
+    void SetUp() override {
+        mDemux = AmlDemuxBase::create(AML_MP_DEMUX_TYPE_SOFTWARE);
+        ASSERT_TRUE(mDemux != nullptr);
+        ASSERT_EQ(0, mDemux->open(false));
+        ASSERT_EQ(0, mDemux->start());
+    }
+
+    void TearDown() override {
+        if (mDemux != nullptr) {
+            mDemux->stop();
+            mDemux->close();
+        }
+    }
+
+    // returns the table_id of every section delivered on pid
+    std::vector<int> filterSections(int pid, const Aml_MP_DemuxFilterParams& params, const std::vector<uint8_t>& ts) {
+        std::vector<int> tableIds;
+        AmlDemuxBase::CHANNEL channel = mDemux->createChannel(pid, &params);
+        AmlDemuxBase::FILTER filter = mDemux->createFilter([](int, size_t size, const uint8_t* data, void* userData) {
+            if (size > 0) {
+                static_cast<std::vector<int>*>(userData)->push_back(data[0]);
+            }
+            return 0;
+        }, &tableIds);
+        mDemux->attachFilter(filter, channel);
+        mDemux->openChannel(channel);
+
+        mDemux->feedTs(ts.data(), ts.size());
+
+        mDemux->closeChannel(channel);
+        mDemux->detachFilter(filter, channel);
+        mDemux->destroyFilter(filter);
+        mDemux->destroyChannel(channel);
+        return tableIds;
+    }
+
+    sptr<AmlDemuxBase> mDemux;
+};
+
+TEST_F(AmlSwDemuxTest, PidStatistics)
+{
+    const int pid = 0x200;
+    TsPacketWriter writer(pid);
+    std::vector<uint8_t> ts;
+
+    for (unsigned cc = 0; cc < 10; ++cc) {
+        writer.append(ts, cc);
+    }
+    writer.append(ts, 9);                   // duplicate, allowed once
+    writer.append(ts, 12);                  // two packets lost
+    writer.appendPcr(ts, 13);
+    writer.append(ts, 14)[3] |= 0x80;       // scrambled
+    writer.append(ts, 0)[1] |= 0x80;        // transport error, not checked
+    writer.append(ts, 15);
+    uint8_t* p = writer.appendPcr(ts, 3);   // discontinuity_indicator set
+    p[5] |= 0x80;
+
+    ASSERT_EQ((int)ts.size(), mDemux->feedTs(ts.data(), ts.size()));
+
+    Aml_MP_DemuxPidStat stat;
+    ASSERT_EQ(0, mDemux->getPidStatistics(pid, &stat));
+    EXPECT_EQ(pid, stat.pid);
+    EXPECT_EQ(17u, stat.packets);
+    EXPECT_EQ(17u * kTsPacketSize, stat.bytes);
+    EXPECT_EQ(1u, stat.ccErrors);
+    EXPECT_EQ(1u, stat.teiPackets);
+    EXPECT_EQ(1u, stat.scrambledPackets);
+    EXPECT_EQ(2u, stat.pcrCount);
+
+    ASSERT_EQ(0, mDemux->getPidStatistics(0x201, &stat));
+    EXPECT_EQ(0u, stat.packets);
+
+    EXPECT_NE(0, mDemux->getPidStatistics(0x2000, &stat));
+}
+
+TEST_F(AmlSwDemuxTest, SectionFilter)
+{
+    const int pid = 0x12;
+    TsPacketWriter writer(pid);
+    std::vector<uint8_t> ts;
+    unsigned cc = 0;
+
+    // EIT present/following actual and other, schedule actual, for two services
+    for (uint16_t serviceId : {0x101, 0x102}) {
+        for (uint8_t tableId : {0x4E, 0x4F, 0x50, 0x51, 0x60}) {
+            writer.appendSection(ts, cc++, tableId, serviceId, 3);
+        }
+    }
+
+    Aml_MP_DemuxFilterParams params;
+    memset(&params, 0, sizeof(params));
+    params.type = AML_MP_DEMUX_FILTER_PSI;
+    params.flags = DMX_CHECK_CRC;
+    EXPECT_EQ(std::vector<int>({0x4E, 0x4F, 0x50, 0x51, 0x60, 0x4E, 0x4F, 0x50, 0x51, 0x60}), filterSections(pid, params, ts));
+
+    // present/following actual only
+    params.filter[0] = 0x4E;
+    params.mask[0] = 0xFF;
+    EXPECT_EQ(std::vector<int>({0x4E, 0x4E}), filterSections(pid, params, ts));
+
+    // schedule actual 0x50..0x5F, of service 0x102: filter[1] and [2] are table_id_extension
+    params.filter[0] = 0x50;
+    params.mask[0] = 0xF0;
+    params.filter[1] = 0x01;
+    params.filter[2] = 0x02;
+    params.mask[1] = 0xFF;
+    params.mask[2] = 0xFF;
+    EXPECT_EQ(std::vector<int>({0x50, 0x51}), filterSections(pid, params, ts));
+
+    // anything but present/following actual
+    memset(&params.filter, 0, sizeof(params.filter));
+    memset(&params.mask, 0, sizeof(params.mask));
+    params.filter[0] = 0x4E;
+    params.mask[0] = 0xFF;
+    params.mode[0] = 0xFF;
+    EXPECT_EQ(std::vector<int>({0x4F, 0x50, 0x51, 0x60, 0x4F, 0x50, 0x51, 0x60}), filterSections(pid, params, ts));
+
+    // version_number is byte 3 of the filter, mode 1 matches any other version
+    memset(&params, 0, sizeof(params));
+    params.type = AML_MP_DEMUX_FILTER_PSI;
+    params.filter[3] = 3 << 1;
+    params.mask[3] = 0x3E;
+    params.mode[3] = 0xFF;
+    EXPECT_TRUE(filterSections(pid, params, ts).empty());
+}
+
+TEST_F(AmlSwDemuxTest, DeliverOnChange)
+{
+    const int pid = 0x100;
+    TsPacketWriter writer(pid);
+    std::vector<uint8_t> ts;
+    unsigned cc = 0;
+
+    // PMT repeated, then updated, for two programs on one PID
+    for (uint8_t version : {1, 1, 1, 2, 2}) {
+        writer.appendSection(ts, cc++, 0x02, 1, version);
+        writer.appendSection(ts, cc++, 0x02, 2, 7);
+    }
+
+    Aml_MP_DemuxFilterParams params;
+    memset(&params, 0, sizeof(params));
+    params.type = AML_MP_DEMUX_FILTER_PSI;
+    params.flags = DMX_CHECK_CRC;
+    EXPECT_EQ(10u, filterSections(pid, params, ts).size());
+
+    params.flags |= AML_MP_DEMUX_DELIVER_ON_CHANGE;
+    EXPECT_EQ(3u, filterSections(pid, params, ts).size());
+
+    // a section failing the CRC check is not cached, its next copy is delivered
+    std::vector<uint8_t> corrupted = ts;
+    corrupted[20] ^= 0x01;
+    EXPECT_EQ(3u, filterSections(pid, params, corrupted).size());
+}
+
+TEST_F(AmlSwDemuxTest, DeliverOnChangePerFilter)
+{
+    const int pid = 0x100;
+    TsPacketWriter writer(pid);
+    unsigned cc = 0;
+    auto repetition = [&] {
+        std::vector<uint8_t> ts;
+        writer.appendSection(ts, cc++, 0x02, 1, 3);
+        writer.appendSection(ts, cc++, 0x02, 2, 7);
+        return ts;
+    };
+
+    Aml_MP_DemuxFilterParams params;
+    memset(&params, 0, sizeof(params));
+    params.type = AML_MP_DEMUX_FILTER_PSI;
+    params.flags = DMX_CHECK_CRC | AML_MP_DEMUX_DELIVER_ON_CHANGE;
+
+    auto count = [](int, size_t, const uint8_t*, void* userData) {
+        ++*static_cast<int*>(userData);
+        return 0;
+    };
+    int first = 0, second = 0;
+    AmlDemuxBase::CHANNEL channel = mDemux->createChannel(pid, &params);
+    AmlDemuxBase::FILTER firstFilter = mDemux->createFilter(count, &first);
+    AmlDemuxBase::FILTER secondFilter = mDemux->createFilter(count, &second);
+    mDemux->attachFilter(firstFilter, channel);
+    mDemux->openChannel(channel);
+
+    for (int i = 0; i < 3; ++i) {
+        std::vector<uint8_t> ts = repetition();
+        mDemux->feedTs(ts.data(), ts.size());
+    }
+    EXPECT_EQ(2, first);
+
+    // a filter attached later gets the current sections, the first one
+    // still doesn't get them again
+    mDemux->attachFilter(secondFilter, channel);
+    for (int i = 0; i < 3; ++i) {
+        std::vector<uint8_t> ts = repetition();
+        mDemux->feedTs(ts.data(), ts.size());
+    }
+    EXPECT_EQ(2, first);
+    EXPECT_EQ(2, second);
+
+    // so does a filter attached again
+    mDemux->detachFilter(firstFilter, channel);
+    mDemux->attachFilter(firstFilter, channel);
+    std::vector<uint8_t> ts = repetition();
+    mDemux->feedTs(ts.data(), ts.size());
+    EXPECT_EQ(4, first);
+    EXPECT_EQ(2, second);
+
+    mDemux->closeChannel(channel);
+    mDemux->detachFilter(firstFilter, channel);
+    mDemux->detachFilter(secondFilter, channel);
+    mDemux->destroyFilter(firstFilter);
+    mDemux->destroyFilter(secondFilter);
+    mDemux->destroyChannel(channel);
+}
+
+static void appendNalUnit(std::vector<uint8_t>* es, std::vector<uint8_t> nal, size_t size = 0)
+{
+    for (size_t i = nal.size(); i < size; ++i) {
+        nal.push_back(0x80 | (i & 0x7F));
+    }
+    es->insert(es->end(), {0x00, 0x00, 0x00, 0x01});
+    es->insert(es->end(), nal.begin(), nal.end());
+}
+
+TEST_F(AmlSwDemuxTest, StartOnKeyFrame)
+{
+    const int pid = 0x100;
+    // High profile, level 4.0, 1920x1080
+    const std::vector<uint8_t> sps = {0x67, 0x64, 0x00, 0x28, 0xAC, 0xE5, 0x01, 0xE0, 0x08, 0x9F, 0x95};
+    const std::vector<uint8_t> pps = {0x68, 0xCE, 0x38, 0x80};
+    const std::vector<uint8_t> aud = {0x09, 0xF0};
+
+    // joined in the middle of a GOP: two frames that can't be decoded
+    std::vector<std::vector<uint8_t>> aus(6);
+    for (size_t i = 0; i < aus.size(); ++i) {
+        appendNalUnit(&aus[i], aud);
+        if (i == 2) {
+            appendNalUnit(&aus[i], sps);
+            appendNalUnit(&aus[i], pps);
+            appendNalUnit(&aus[i], {0x65, 0x88}, 1000);
+        } else {
+            appendNalUnit(&aus[i], {0x41, 0x9A}, 300);
+        }
+    }
+
+    TsPacketWriter writer(pid);
+    std::vector<uint8_t> ts;
+    unsigned cc = 0;
+    for (size_t i = 0; i < aus.size(); ++i) {
+        writer.appendPes(ts, cc, 0xE0, 3600 * i, aus[i]);
+    }
+
+    Aml_MP_DemuxFilterParams params;
+    memset(&params, 0, sizeof(params));
+    params.type = AML_MP_DEMUX_FILTER_VIDEO;
+    params.codecType = AML_MP_VIDEO_CODEC_H264;
+    params.flags = AML_MP_DEMUX_START_ON_KEY_FRAME | AML_MP_DEMUX_ES_FORMAT_RAW;
+
+    std::vector<std::vector<uint8_t>> frames;
+    AmlDemuxBase::CHANNEL channel = mDemux->createChannel(pid, &params);
+    AmlDemuxBase::FILTER filter = mDemux->createFilter([](int, size_t size, const uint8_t* data, void* userData) {
+        static_cast<std::vector<std::vector<uint8_t>>*>(userData)->emplace_back(data, data + size);
+        return 0;
+    }, &frames);
+    mDemux->attachFilter(filter, channel);
+    mDemux->openChannel(channel);
+
+    Aml_MP_DemuxVideoConfig config;
+    EXPECT_NE(0, mDemux->getVideoConfig(pid, &config));
+
+    mDemux->feedTs(ts.data(), ts.size());
+
+    // the last frame is only output once the next one starts
+    ASSERT_EQ(3u, frames.size());
+    EXPECT_EQ(aus[2], frames[0]);
+    EXPECT_EQ(aus[3], frames[1]);
+
+    ASSERT_EQ(0, mDemux->getVideoConfig(pid, &config));
+    EXPECT_EQ(1920, config.width);
+    EXPECT_EQ(1080, config.height);
+    EXPECT_EQ(100, config.profile);
+    EXPECT_EQ(40, config.level);
+    EXPECT_EQ(1, config.keyFrameFound);
+    EXPECT_EQ(2u, config.framesBeforeKeyFrame);
+
+    std::vector<uint8_t> configData;
+    appendNalUnit(&configData, sps);
+    appendNalUnit(&configData, pps);
+    ASSERT_EQ(configData.size(), config.configDataSize);
+    EXPECT_EQ(0, memcmp(configData.data(), config.configData, configData.size()));
+
+    EXPECT_NE(0, mDemux->getVideoConfig(0x101, &config));
+
+    mDemux->closeChannel(channel);
+    mDemux->detachFilter(filter, channel);
+    mDemux->destroyFilter(filter);
+    mDemux->destroyChannel(channel);
+}
+
+TEST_F(AmlSwDemuxTest, PesSplitAcrossFeeds)
+{
+    const int pid = 0x100;
+    TsPacketWriter writer(pid);
+    unsigned cc = 0;
+
+    // bounded PES of about 12 packets, one access unit each
+    std::vector<std::vector<uint8_t>> aus(5);
+    std::vector<std::vector<uint8_t>> pes(aus.size());
+    std::vector<std::vector<uint8_t>> ts(aus.size());
+    for (size_t i = 0; i < aus.size(); ++i) {
+        appendNalUnit(&aus[i], {0x09, 0xF0});
+        appendNalUnit(&aus[i], {(uint8_t)(i == 0 ? 0x65 : 0x41), 0x88}, 2000 + 100 * i);
+        pes[i] = makePes(0xE0, 3600 * i, aus[i]);
+        writer.appendPes(ts[i], cc, pes[i]);
+    }
+
+    std::vector<std::vector<uint8_t>> frames;
+    Aml_MP_DemuxFilterParams params;
+    memset(&params, 0, sizeof(params));
+    params.type = AML_MP_DEMUX_FILTER_VIDEO;
+    params.codecType = AML_MP_VIDEO_CODEC_H264;
+    params.flags = AML_MP_DEMUX_ES_FORMAT_RAW;
+    AmlDemuxBase::CHANNEL channel = mDemux->createChannel(pid, &params);
+    AmlDemuxBase::FILTER filter = mDemux->createFilter([](int, size_t size, const uint8_t* data, void* userData) {
+        static_cast<std::vector<std::vector<uint8_t>>*>(userData)->emplace_back(data, data + size);
+        return 0;
+    }, &frames);
+    mDemux->attachFilter(filter, channel);
+    mDemux->openChannel(channel);
+
+    auto feed = [&](const uint8_t* data, size_t size) {
+        ASSERT_EQ((int)size, mDemux->feedTs(data, size));
+    };
+    Aml_MP_DemuxStreamStatistics stats;
+
+    // in a single call the PES is framed from the fed buffer
+    feed(ts[0].data(), ts[0].size());
+    ASSERT_EQ(0, mDemux->getStreamStatistics(pid, &stats));
+    EXPECT_EQ(pes[0].size(), stats.bytesReferenced);
+    EXPECT_EQ(0u, stats.bytesCopied);
+
+    // over three calls split at packet boundaries, what the first two
+    // carried is copied when they return, the last one is referenced
+    const size_t packets = ts[1].size() / kTsPacketSize;
+    const size_t cuts[] = {0, packets / 3 * kTsPacketSize, packets * 2 / 3 * kTsPacketSize, ts[1].size()};
+    for (size_t i = 0; i + 1 < 4; ++i) {
+        feed(&ts[1][cuts[i]], cuts[i + 1] - cuts[i]);
+    }
+    const uint64_t copied = (kTsPacketSize - 4) * (packets * 2 / 3);
+    ASSERT_EQ(0, mDemux->getStreamStatistics(pid, &stats));
+    EXPECT_EQ(copied, stats.bytesCopied);
+    EXPECT_EQ(pes[0].size() + pes[1].size() - copied, stats.bytesReferenced);
+
+    // cut inside the packets, the remainders are stitched
+    for (size_t offset = 0; offset < ts[2].size(); offset += 1000) {
+        feed(&ts[2][offset], std::min<size_t>(1000, ts[2].size() - offset));
+    }
+    ASSERT_EQ(0, mDemux->getStreamStatistics(pid, &stats));
+    EXPECT_GT(stats.bytesCopied, copied);
+    EXPECT_EQ(pes[0].size() + pes[1].size() + pes[2].size(), stats.bytesReferenced + stats.bytesCopied);
+
+    // and whole again, nothing more is copied
+    const uint64_t copiedBefore = stats.bytesCopied;
+    feed(ts[3].data(), ts[3].size());
+    feed(ts[4].data(), ts[4].size());
+    ASSERT_EQ(0, mDemux->getStreamStatistics(pid, &stats));
+    EXPECT_EQ(copiedBefore, stats.bytesCopied);
+    uint64_t total = 0;
+    for (const auto& p : pes) {
+        total += p.size();
+    }
+    EXPECT_EQ(total, stats.bytesReferenced + stats.bytesCopied);
+
+    // the last access unit is only output once the next one starts
+    ASSERT_EQ(aus.size() - 1, frames.size());
+    for (size_t i = 0; i < frames.size(); ++i) {
+        EXPECT_EQ(aus[i], frames[i]) << "access unit " << i;
+    }
+
+    mDemux->closeChannel(channel);
+    mDemux->detachFilter(filter, channel);
+    mDemux->destroyFilter(filter);
+    mDemux->destroyChannel(channel);
+}
+
+TEST_F(AmlSwDemuxTest, LeaseFilter)
+{
+    const int pid = 0x100;
+    TsPacketWriter writer(pid);
+    std::vector<uint8_t> ts;
+    unsigned cc = 0;
+    for (uint8_t version = 0; version < 5; ++version) {
+        writer.appendSection(ts, cc++, 0x02, 1, version);
+    }
+
+    // the leases are kept until all sections are parsed
+    std::vector<sptr<AmlMpBuffer>> leases;
+    auto keep = [](int, const sptr<AmlMpBuffer>& data, void* userData) {
+        static_cast<std::vector<sptr<AmlMpBuffer>>*>(userData)->push_back(data);
+        return 0;
+    };
+
+    Aml_MP_DemuxFilterParams params;
+    memset(&params, 0, sizeof(params));
+    params.type = AML_MP_DEMUX_FILTER_PSI;
+    params.flags = DMX_CHECK_CRC;
+    AmlDemuxBase::CHANNEL channel = mDemux->createChannel(pid, &params);
+    AmlDemuxBase::FILTER filter = mDemux->createFilter(keep, &leases);
+    mDemux->attachFilter(filter, channel);
+    mDemux->openChannel(channel);
+    mDemux->feedTs(ts.data(), ts.size());
+
+    ASSERT_EQ(5u, leases.size());
+    for (size_t i = 0; i < leases.size(); ++i) {
+        ASSERT_EQ(3u + 17, leases[i]->size());
+        EXPECT_EQ(0x02, leases[i]->data()[0]);
+        EXPECT_EQ(i, (leases[i]->data()[5] >> 1) & 0x1F);
+        EXPECT_EQ(0u, crc32_mpeg2(leases[i]->data(), leases[i]->size()));
+    }
+
+    mDemux->detachFilter(filter, channel);
+    mDemux->destroyFilter(filter);
+    mDemux->destroyChannel(channel);
+
+    // access units, each in a buffer of its own
+    std::vector<std::vector<uint8_t>> aus(5);
+    ts.clear();
+    cc = 0;
+    for (size_t i = 0; i < aus.size(); ++i) {
+        appendNalUnit(&aus[i], {0x09, 0xF0});
+        appendNalUnit(&aus[i], {(uint8_t)(i == 0 ? 0x65 : 0x41), 0x88}, 200 + 10 * i);
+        writer.appendPes(ts, cc, 0xE0, 3600 * i, aus[i]);
+    }
+
+    leases.clear();
+    params.type = AML_MP_DEMUX_FILTER_VIDEO;
+    params.codecType = AML_MP_VIDEO_CODEC_H264;
+    params.flags = AML_MP_DEMUX_ES_FORMAT_RAW;
+    channel = mDemux->createChannel(pid, &params);
+    filter = mDemux->createFilter(keep, &leases);
+    mDemux->attachFilter(filter, channel);
+    mDemux->openChannel(channel);
+    mDemux->feedTs(ts.data(), ts.size());
+
+    ASSERT_EQ(aus.size() - 1, leases.size());
+    for (size_t i = 0; i < leases.size(); ++i) {
+        EXPECT_EQ(aus[i], std::vector<uint8_t>(leases[i]->data(), leases[i]->data() + leases[i]->size()));
+    }
+
+    mDemux->closeChannel(channel);
+    mDemux->detachFilter(filter, channel);
+    mDemux->destroyFilter(filter);
+    mDemux->destroyChannel(channel);
+}
+
+TEST_F(AmlSwDemuxTest, BatchFilter)
+{
+    const int pid = 0x12;
+    TsPacketWriter writer(pid);
+    std::vector<uint8_t> ts;
+    for (unsigned i = 0; i < 10; ++i) {
+        writer.appendSection(ts, i, 0x50, 1, i);
+    }
+
+    struct Batches {
+        std::mutex lock;
+        std::condition_variable cond;
+        std::vector<std::vector<int>> versions;
+        int64_t lastDelayUs = 0;
+    } batches;
+
+    auto onBatch = [](int, const Aml_MP_DemuxRecord* records, size_t count, void* userData) {
+        Batches* b = static_cast<Batches*>(userData);
+        std::vector<int> versions;
+        for (size_t i = 0; i < count; ++i) {
+            versions.push_back(records[i].data[5] >> 1 & 0x1F);
+        }
+
+        std::lock_guard<std::mutex> _l(b->lock);
+        b->versions.push_back(versions);
+        b->lastDelayUs = AmlMpEventLooper::GetNowUs() - records[0].timeUs;
+        b->cond.notify_all();
+        return 0;
+    };
+
+    Aml_MP_DemuxFilterParams params;
+    memset(&params, 0, sizeof(params));
+    params.type = AML_MP_DEMUX_FILTER_PSI;
+    params.flags = DMX_CHECK_CRC;
+    AmlDemuxBase::CHANNEL channel = mDemux->createChannel(pid, &params);
+    AmlDemuxBase::FILTER filter = mDemux->createFilter(onBatch, &batches, 4, 20);
+    mDemux->attachFilter(filter, channel);
+    mDemux->openChannel(channel);
+    mDemux->feedTs(ts.data(), ts.size());
+
+    // two full batches, the rest comes when the latency bound expires
+    std::unique_lock<std::mutex> l(batches.lock);
+    EXPECT_TRUE(batches.cond.wait_for(l, std::chrono::seconds(2), [&] {
+        return batches.versions.size() == 3;
+    }));
+    EXPECT_EQ(std::vector<std::vector<int>>({{0, 1, 2, 3}, {4, 5, 6, 7}, {8, 9}}), batches.versions);
+    EXPECT_GE(batches.lastDelayUs, 20000);
+    l.unlock();
+
+    mDemux->closeChannel(channel);
+    mDemux->detachFilter(filter, channel);
+    mDemux->destroyFilter(filter);
+    mDemux->destroyChannel(channel);
+}
+
+TEST_F(AmlSwDemuxTest, StopReleasesBlockedFeeder)
+{
+    const int pid = 0x12;
+    TsPacketWriter writer(pid);
+    std::vector<uint8_t> ts[3];
+    for (unsigned i = 0; i < 3; ++i) {
+        writer.appendSection(ts[i], i, 0x50, 1, i);
+    }
+
+    // the filter holds the first buffer until released
+    struct Consumer {
+        std::mutex lock;
+        std::condition_variable cond;
+        bool delivering = false;
+        bool released = false;
+        std::vector<int> results;
+    } consumer;
+
+    Aml_MP_DemuxFeedParams feedParams{};
+    feedParams.maxPendingBuffers = 2;
+    feedParams.policy = AML_MP_DEMUX_FEED_POLICY_BLOCK;
+    feedParams.doneCb = [](const uint8_t*, size_t, int result, void* userData) {
+        Consumer* c = static_cast<Consumer*>(userData);
+        std::lock_guard<std::mutex> _l(c->lock);
+        c->results.push_back(result);
+        c->cond.notify_all();
+    };
+    feedParams.userData = &consumer;
+    ASSERT_EQ(0, mDemux->setFeedParams(&feedParams));
+
+    Aml_MP_DemuxFilterParams params;
+    memset(&params, 0, sizeof(params));
+    params.type = AML_MP_DEMUX_FILTER_PSI;
+    AmlDemuxBase::CHANNEL channel = mDemux->createChannel(pid, &params);
+    AmlDemuxBase::FILTER filter = mDemux->createFilter([](int, size_t, const uint8_t*, void* userData) {
+        Consumer* c = static_cast<Consumer*>(userData);
+        std::unique_lock<std::mutex> l(c->lock);
+        c->delivering = true;
+        c->cond.notify_all();
+        c->cond.wait(l, [c] { return c->released; });
+        return 0;
+    }, &consumer);
+    mDemux->attachFilter(filter, channel);
+    mDemux->openChannel(channel);
+
+    EXPECT_EQ((int)ts[0].size(), mDemux->feedTs(ts[0].data(), ts[0].size()));
+    {
+        std::unique_lock<std::mutex> l(consumer.lock);
+        ASSERT_TRUE(consumer.cond.wait_for(l, std::chrono::seconds(2), [&] { return consumer.delivering; }));
+    }
+    EXPECT_EQ((int)ts[1].size(), mDemux->feedTs(ts[1].data(), ts[1].size()));
+
+    std::atomic<int> blockedResult{0};
+    std::thread feeder([&] {
+        blockedResult = mDemux->feedTs(ts[2].data(), ts[2].size());
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    EXPECT_EQ(0, blockedResult);
+
+    mDemux->stop();
+    feeder.join();
+    EXPECT_EQ(-1, blockedResult);
+    {
+        // the pending buffer is cancelled, the one being parsed isn't done yet
+        std::unique_lock<std::mutex> l(consumer.lock);
+        EXPECT_EQ(std::vector<int>({-ECANCELED}), consumer.results);
+        consumer.released = true;
+        consumer.cond.notify_all();
+        EXPECT_TRUE(consumer.cond.wait_for(l, std::chrono::seconds(2), [&] { return consumer.results.size() == 2; }));
+    }
+
+    mDemux->closeChannel(channel);
+    mDemux->detachFilter(filter, channel);
+    mDemux->destroyFilter(filter);
+    mDemux->destroyChannel(channel);
+}
+
+TEST(AmlSwDemuxStressTest, AttachDetachWhileDelivering)
+{
+    // parse the PIDs on several threads, so notifyData() runs concurrently
+    const int kWorkers = 4;
+    int workers = AmlMpConfig::instance().mSwDemuxWorkers;
+    AmlMpConfig::instance().mSwDemuxWorkers = kWorkers;
+    sptr<AmlDemuxBase> demux = AmlDemuxBase::create(AML_MP_DEMUX_TYPE_SOFTWARE);
+    ASSERT_EQ(0, demux->open(false));
+    // the workers are started by start()
+    int ret = demux->start();
+    AmlMpConfig::instance().mSwDemuxWorkers = workers;
+    ASSERT_EQ(0, ret);
+
+    const int kPids = 8;
+    const int kFiltersPerPid = 4;
+    const int kSectionsPerPid = 16;         // continuity_counter wraps at the end of the stream
+    const int kMinLoops = 200;
+    const uint32_t kMinChurns = 1000;
+
+    std::vector<uint8_t> ts;
+    for (int i = 0; i < kSectionsPerPid; ++i) {
+        for (int pid = 0x20; pid < 0x20 + kPids; ++pid) {
+            TsPacketWriter(pid).appendSection(ts, i, 0x42, i, 0);
+        }
+    }
+
+    Aml_MP_DemuxFilterParams params;
+    memset(&params, 0, sizeof(params));
+    params.type = AML_MP_DEMUX_FILTER_PSI;
+
+    auto count = [](int, size_t, const uint8_t*, void* userData) {
+        static_cast<std::atomic<uint32_t>*>(userData)->fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    };
+
+    std::vector<AmlDemuxBase::CHANNEL> channels;
+    std::vector<AmlDemuxBase::FILTER> filters;
+    std::vector<std::atomic<uint32_t>> counts(kPids * kFiltersPerPid);
+    for (int i = 0; i < kPids; ++i) {
+        channels.push_back(demux->createChannel(0x20 + i, &params));
+        for (int j = 0; j < kFiltersPerPid; ++j) {
+            counts[filters.size()] = 0;
+            filters.push_back(demux->createFilter(count, &counts[filters.size()]));
+            demux->attachFilter(filters.back(), channels.back());
+        }
+        demux->openChannel(channels.back());
+    }
+
+    // a slow filter keeps its worker reading most of the time, so there is
+    // hardly a moment without any reader
+    auto slow = [](int, size_t, const uint8_t*, void* userData) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+        static_cast<std::atomic<uint32_t>*>(userData)->fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    };
+    std::atomic<uint32_t> slowCount{0};
+    AmlDemuxBase::FILTER slowFilter = demux->createFilter(slow, &slowCount);
+    demux->attachFilter(slowFilter, channels[0]);
+
+    // meanwhile, filters come and go on the same channels
+    std::atomic_bool done{false};
+    std::atomic<uint32_t> churnCount{0};
+    std::atomic<uint32_t> churns{0};
+    size_t maxRetired = 0;
+    std::thread churn([&] {
+        while (!done.load()) {
+            AmlDemuxBase::CHANNEL channel = channels[churns.load() % kPids];
+            AmlDemuxBase::FILTER filter = demux->createFilter(count, &churnCount);
+            demux->attachFilter(filter, channel);
+            std::this_thread::yield();
+            demux->detachFilter(filter, channel);
+            demux->destroyFilter(filter);
+            maxRetired = std::max(maxRetired, demux->retiredSnapshotCount());
+            ++churns;
+        }
+    });
+
+    int loops = 0;
+    auto begin = std::chrono::steady_clock::now();
+    while (loops < kMinLoops || churns.load() < kMinChurns) {
+        ASSERT_EQ((int)ts.size(), demux->feedTs(ts.data(), ts.size()));
+        ++loops;
+    }
+    // the workers may still be parsing, a statistics query waits for the worker of the pid
+    for (int i = 0; i < kPids; ++i) {
+        Aml_MP_DemuxStreamStatistics stats;
+        demux->getStreamStatistics(0x20 + i, &stats);
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    done = true;
+    churn.join();
+
+    // the filters that stayed attached got every section
+    for (auto& c : counts) {
+        EXPECT_EQ((uint32_t)(loops * kSectionsPerPid), c.load());
+    }
+    EXPECT_EQ((uint32_t)(loops * kSectionsPerPid), slowCount.load());
+    // the workers never all left at once, yet each held back at most one
+    // replaced snapshot
+    EXPECT_LE(maxRetired, (size_t)kWorkers);
+    printf("%d filters: %.0f callbacks/s, %u attach/detach meanwhile, %u callbacks to them, at most %zu snapshots retired\n",
+            kPids * kFiltersPerPid, loops * kSectionsPerPid * kPids * kFiltersPerPid / elapsed.count(),
+            churns.load(), churnCount.load(), maxRetired);
+
+    demux->detachFilter(slowFilter, channels[0]);
+    demux->destroyFilter(slowFilter);
+    for (int i = 0; i < kPids; ++i) {
+        demux->closeChannel(channels[i]);
+        for (int j = 0; j < kFiltersPerPid; ++j) {
+            demux->detachFilter(filters[i * kFiltersPerPid + j], channels[i]);
+            demux->destroyFilter(filters[i * kFiltersPerPid + j]);
+        }
+        demux->destroyChannel(channels[i]);
+    }
+    EXPECT_EQ(0u, demux->retiredSnapshotCount());
+    demux->stop();
+    demux->close();
+}
+
+TEST(AmlSwDemuxWorkersTest, PidsStayInOrder)
+{
+    const int kWorkers = 3;
+    int workers = AmlMpConfig::instance().mSwDemuxWorkers;
+    AmlMpConfig::instance().mSwDemuxWorkers = kWorkers;
+    sptr<AmlDemuxBase> demux = AmlDemuxBase::create(AML_MP_DEMUX_TYPE_SOFTWARE);
+    ASSERT_EQ(0, demux->open(false));
+    // the workers are started by start()
+    int ret = demux->start();
+    AmlMpConfig::instance().mSwDemuxWorkers = workers;
+    ASSERT_EQ(0, ret);
+
+    const int kPsiPid = 0x20;
+    const int kVideoPids[] = {0x100, 0x101, 0x102, 0x103};
+    const size_t kStreams = sizeof(kVideoPids) / sizeof(kVideoPids[0]);
+    const int kAccessUnits = 40;
+    const int kSections = 20;
+
+    // the packets of all pids interleaved, each access unit tagged with its pid and index
+    std::vector<std::vector<std::vector<uint8_t>>> aus(kStreams);
+    std::vector<std::vector<uint8_t>> packets(kStreams + 1);
+    for (size_t s = 0; s < kStreams; ++s) {
+        TsPacketWriter writer(kVideoPids[s]);
+        unsigned cc = 0;
+        for (int i = 0; i < kAccessUnits; ++i) {
+            std::vector<uint8_t> au;
+            appendNalUnit(&au, {0x09, 0xF0});
+            appendNalUnit(&au, {(uint8_t)(i == 0 ? 0x65 : 0x41), (uint8_t)(0x80 | s), (uint8_t)(0x80 | i)},
+                    300 + 37 * ((i + s) % 7));
+            writer.appendPes(packets[s], cc, 0xE0, 3600 * i, au);
+            aus[s].push_back(std::move(au));
+        }
+    }
+    TsPacketWriter psi(kPsiPid);
+    for (int i = 0; i < kSections; ++i) {
+        psi.appendSection(packets[kStreams], i, 0x42, i, 0);
+    }
+
+    std::vector<uint8_t> ts;
+    for (size_t offset = 0;; offset += kTsPacketSize) {
+        bool more = false;
+        for (const auto& p : packets) {
+            if (offset < p.size()) {
+                ts.insert(ts.end(), p.begin() + offset, p.begin() + offset + kTsPacketSize);
+                more = true;
+            }
+        }
+        if (!more) {
+            break;
+        }
+    }
+
+    struct Received {
+        std::mutex lock;
+        std::map<int, std::vector<std::vector<uint8_t>>> data;
+        std::map<int, std::set<std::thread::id>> threads;
+    } received;
+    auto record = [](int pid, size_t size, const uint8_t* data, void* userData) {
+        Received* r = static_cast<Received*>(userData);
+        std::lock_guard<std::mutex> _l(r->lock);
+        r->data[pid].emplace_back(data, data + size);
+        r->threads[pid].insert(std::this_thread::get_id());
+        return 0;
+    };
+
+    std::vector<AmlDemuxBase::CHANNEL> channels;
+    std::vector<AmlDemuxBase::FILTER> filters;
+    auto open = [&](int pid, const Aml_MP_DemuxFilterParams& params) {
+        channels.push_back(demux->createChannel(pid, &params));
+        filters.push_back(demux->createFilter(record, &received));
+        demux->attachFilter(filters.back(), channels.back());
+        demux->openChannel(channels.back());
+    };
+
+    Aml_MP_DemuxFilterParams params;
+    memset(&params, 0, sizeof(params));
+    params.type = AML_MP_DEMUX_FILTER_PSI;
+    params.flags = DMX_CHECK_CRC;
+    open(kPsiPid, params);
+    params.type = AML_MP_DEMUX_FILTER_VIDEO;
+    params.codecType = AML_MP_VIDEO_CODEC_H264;
+    params.flags = AML_MP_DEMUX_ES_FORMAT_RAW;
+    for (int pid : kVideoPids) {
+        open(pid, params);
+    }
+
+    // uneven chunks, so packets are also stitched
+    for (size_t offset = 0; offset < ts.size(); offset += 5000) {
+        size_t size = std::min<size_t>(5000, ts.size() - offset);
+        ASSERT_EQ((int)size, demux->feedTs(&ts[offset], size));
+    }
+    // a statistics query waits for the worker of its pid
+    Aml_MP_DemuxStreamStatistics stats;
+    demux->getStreamStatistics(kPsiPid, &stats);
+    for (int pid : kVideoPids) {
+        demux->getStreamStatistics(pid, &stats);
+    }
+
+    {
+        std::lock_guard<std::mutex> _l(received.lock);
+        ASSERT_EQ((size_t)kSections, received.data[kPsiPid].size());
+        for (int i = 0; i < kSections; ++i) {
+            const std::vector<uint8_t>& section = received.data[kPsiPid][i];
+            ASSERT_GE(section.size(), 5u);
+            EXPECT_EQ(i, section[3] << 8 | section[4]);
+        }
+        ASSERT_EQ(1u, received.threads[kPsiPid].size());
+        std::thread::id psiThread = *received.threads[kPsiPid].begin();
+
+        std::set<std::thread::id> esThreads;
+        for (size_t s = 0; s < kStreams; ++s) {
+            int pid = kVideoPids[s];
+            // the last access unit is only output once the next one starts
+            ASSERT_EQ((size_t)kAccessUnits - 1, received.data[pid].size()) << "pid " << pid;
+            for (int i = 0; i < kAccessUnits - 1; ++i) {
+                ASSERT_EQ(aus[s][i], received.data[pid][i]) << "pid " << pid << " access unit " << i;
+            }
+            ASSERT_EQ(1u, received.threads[pid].size()) << "pid " << pid;
+            EXPECT_NE(psiThread, *received.threads[pid].begin()) << "pid " << pid;
+            esThreads.insert(*received.threads[pid].begin());
+        }
+        // worker 0 is kept for PSI, the others share the streams
+        EXPECT_EQ((size_t)kWorkers - 1, esThreads.size());
+    }
+
+    for (size_t i = 0; i < channels.size(); ++i) {
+        demux->closeChannel(channels[i]);
+        demux->detachFilter(filters[i], channels[i]);
+        demux->destroyFilter(filters[i]);
+        demux->destroyChannel(channels[i]);
+    }
+    demux->stop();
+    demux->close();
+}
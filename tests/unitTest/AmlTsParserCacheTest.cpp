@@ -0,0 +1,408 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#define LOG_TAG "AmlTsParserCacheTest"
+#include <utils/AmlMpLog.h>
+#include <demux/AmlTsParser.h>
+#include "TsTestUtils.h"
+#include <gtest/gtest.h>
+#include <inttypes.h>
+#include <algorithm>
+#include <atomic>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace aml_mp;
+
+static const char* mName = LOG_TAG;
+
+namespace {
+const int kPmtPid = 0x100;
+const int kProgramNumber = 1;
+const char* kCacheKey = "AmlTsParserCacheTest#1";
+
+void appendPat(std::vector<uint8_t>& ts, int programNumber)
+{
+    TsPacketWriter(0).appendSection(ts, 0, 0x00, 1, 0, {
+        (uint8_t)(programNumber >> 8), (uint8_t)programNumber,
+        (uint8_t)(0xE0 | kPmtPid >> 8), (uint8_t)kPmtPid,
+    });
+}
+
+// one H.264 video and one AAC audio stream
+void appendPmt(std::vector<uint8_t>& ts, int version, int videoPid, int audioPid)
+{
+    TsPacketWriter(kPmtPid).appendSection(ts, 0, 0x02, kProgramNumber, version, {
+        (uint8_t)(0xE0 | videoPid >> 8), (uint8_t)videoPid, 0xF0, 0x00,
+        0x1B, (uint8_t)(0xE0 | videoPid >> 8), (uint8_t)videoPid, 0xF0, 0x00,
+        0x0F, (uint8_t)(0xE0 | audioPid >> 8), (uint8_t)audioPid, 0xF0, 0x00,
+    });
+}
+}
+
+class AmlTsParserCacheTest : public testing::Test
+{
+protected:
+    void SetUp() override {
+        ProgramInfoCache::instance().clear();
+
+        mParser = new Parser(AML_MP_HW_DEMUX_ID_0, false, AML_MP_DEMUX_TYPE_SOFTWARE);
+        mParser->setCacheKey(kCacheKey);
+        mParser->selectProgram(kProgramNumber);
+        mParser->setEventCallback([this](Parser::ProgramEventType event, int, int, void* data) {
+            if (event == Parser::ProgramEventType::EVENT_PROGRAM_CHANGED) {
+                mChangedInfo = data != nullptr ? ((ProgramInfo*)data)->clone() : nullptr;
+                mChangedCount++;
+            }
+        });
+        ASSERT_EQ(0, mParser->open());
+    }
+
+    void TearDown() override {
+        mParser->close();
+        mParser.clear();
+        ProgramInfoCache::instance().clear();
+    }
+
+    // as a previous zap to the channel would have left it
+    void primeCache(int videoPid, int audioPid, int pmtVersion, int programNumber = kProgramNumber) {
+        sptr<ProgramInfo> info = new ProgramInfo;
+        info->programNumber = programNumber;
+        info->pmtPid = kPmtPid;
+        std::fill(std::begin(info->ecmPid), std::end(info->ecmPid), AML_MP_INVALID_PID);
+        info->privateDataLength = 0;
+        info->videoPid = videoPid;
+        info->videoCodec = AML_MP_VIDEO_CODEC_H264;
+        info->audioPid = audioPid;
+        info->audioCodec = AML_MP_AUDIO_CODEC_AAC;
+        info->videoStreams.push_back({TYPE_VIDEO, videoPid, AML_MP_VIDEO_CODEC_H264});
+        info->audioStreams.push_back({TYPE_AUDIO, audioPid, AML_MP_AUDIO_CODEC_AAC});
+        ProgramInfoCache::instance().update(kCacheKey, info, pmtVersion);
+    }
+
+    void writePsi(int programNumber, int version, int videoPid, int audioPid) {
+        std::vector<uint8_t> ts;
+        appendPat(ts, programNumber);
+        appendPmt(ts, version, videoPid, audioPid);
+        ASSERT_EQ((int)ts.size(), mParser->writeData(ts.data(), ts.size()));
+    }
+
+    ProgramInfoCache::Stats getStats() {
+        ProgramInfoCache::Stats stats;
+        ProgramInfoCache::instance().getStats(&stats);
+        return stats;
+    }
+
+    sptr<Parser> mParser;
+    std::atomic<int> mChangedCount{0};
+    sptr<ProgramInfo> mChangedInfo;
+};
+
+TEST_F(AmlTsParserCacheTest, MissFillsCache)
+{
+    mParser->parseProgramInfoAsync();
+    EXPECT_EQ(nullptr, mParser->getProgramInfo().get());
+
+    writePsi(kProgramNumber, 3, 0x101, 0x102);
+    ASSERT_EQ(0, mParser->waitProgramInfoParsed());
+    ASSERT_NE(nullptr, mParser->getProgramInfo().get());
+    EXPECT_FALSE(mParser->isProgramInfoCached());
+
+    int pmtVersion = -1;
+    sptr<ProgramInfo> cached = ProgramInfoCache::instance().lookup(kCacheKey, &pmtVersion);
+    ASSERT_NE(nullptr, cached.get());
+    EXPECT_EQ(3, pmtVersion);
+    EXPECT_EQ(0x101, cached->videoPid);
+    EXPECT_EQ(0x102, cached->audioPid);
+    EXPECT_TRUE(cached->isSameProgram(*mParser->getProgramInfo()));
+    EXPECT_EQ(0, mChangedCount);
+}
+
+TEST_F(AmlTsParserCacheTest, HitIsConfirmed)
+{
+    primeCache(0x101, 0x102, 3);
+
+    // parsed before any PSI is fed
+    mParser->parseProgramInfoAsync();
+    ASSERT_EQ(0, mParser->waitProgramInfoParsed());
+    sptr<ProgramInfo> info = mParser->getProgramInfo();
+    ASSERT_NE(nullptr, info.get());
+    EXPECT_EQ(0x101, info->videoPid);
+    EXPECT_EQ(0x102, info->audioPid);
+    EXPECT_TRUE(mParser->isProgramInfoCached());
+
+    writePsi(kProgramNumber, 3, 0x101, 0x102);
+    ASSERT_TRUE(waitFor([this] { return getStats().confirmed == 1; }));
+    EXPECT_FALSE(mParser->isProgramInfoCached());
+
+    ProgramInfoCache::Stats stats = getStats();
+    EXPECT_EQ(1u, stats.hits);
+    EXPECT_EQ(0u, stats.corrected);
+    EXPECT_EQ(0, mChangedCount);
+    MLOGI("saved %" PRId64 " us", stats.savedUs);
+}
+
+TEST_F(AmlTsParserCacheTest, ChangedProgramIsCorrected)
+{
+    primeCache(0x101, 0x102, 3);
+
+    mParser->parseProgramInfoAsync();
+    ASSERT_NE(nullptr, mParser->getProgramInfo().get());
+
+    writePsi(kProgramNumber, 4, 0x111, 0x102);
+    ASSERT_TRUE(waitFor([this] { return mChangedCount == 1; }));
+    ASSERT_NE(nullptr, mChangedInfo.get());
+    EXPECT_EQ(0x111, mChangedInfo->videoPid);
+    EXPECT_EQ(0x111, mParser->getProgramInfo()->videoPid);
+
+    int pmtVersion = -1;
+    sptr<ProgramInfo> cached = ProgramInfoCache::instance().lookup(kCacheKey, &pmtVersion);
+    ASSERT_NE(nullptr, cached.get());
+    EXPECT_EQ(4, pmtVersion);
+    EXPECT_EQ(0x111, cached->videoPid);
+    EXPECT_EQ(1u, getStats().corrected);
+}
+
+TEST_F(AmlTsParserCacheTest, NewVersionOfSameProgramIsConfirmed)
+{
+    primeCache(0x101, 0x102, 3);
+
+    mParser->parseProgramInfoAsync();
+    writePsi(kProgramNumber, 4, 0x101, 0x102);
+    ASSERT_TRUE(waitFor([this] { return getStats().confirmed == 1; }));
+    EXPECT_EQ(0, mChangedCount);
+
+    int pmtVersion = -1;
+    ProgramInfoCache::instance().lookup(kCacheKey, &pmtVersion);
+    EXPECT_EQ(4, pmtVersion);
+}
+
+TEST_F(AmlTsParserCacheTest, ProgramLeftPat)
+{
+    primeCache(0x101, 0x102, 3);
+
+    mParser->parseProgramInfoAsync();
+    ASSERT_NE(nullptr, mParser->getProgramInfo().get());
+
+    std::vector<uint8_t> ts;
+    appendPat(ts, kProgramNumber + 1);
+    mParser->writeData(ts.data(), ts.size());
+    ASSERT_TRUE(waitFor([this] { return mChangedCount == 1; }));
+    EXPECT_EQ(nullptr, mChangedInfo.get());
+    EXPECT_FALSE(mParser->isProgramInfoCached());
+    EXPECT_EQ(nullptr, mParser->getProgramInfo().get());
+    EXPECT_EQ(nullptr, ProgramInfoCache::instance().lookup(kCacheKey).get());
+}
+
+// as the player does, only a cached program with both pids is a hit
+TEST_F(AmlTsParserCacheTest, SelectedByPids)
+{
+    primeCache(0x101, 0x102, 3);
+
+    for (int audioPid : {0x103, 0x102}) {
+        mParser->close();
+        mParser = new Parser(AML_MP_HW_DEMUX_ID_0, false, AML_MP_DEMUX_TYPE_SOFTWARE);
+        mParser->setCacheKey(kCacheKey);
+        mParser->selectProgram(0x101, audioPid);
+        ASSERT_EQ(0, mParser->open());
+        mParser->parseProgramInfoAsync();
+        EXPECT_EQ(audioPid == 0x102, mParser->isProgramInfoCached()) << "audio pid " << audioPid;
+    }
+    EXPECT_EQ(0x102, mParser->getProgramInfo()->audioPid);
+}
+
+TEST_F(AmlTsParserCacheTest, FirstZapAfterRestartIsHit)
+{
+    std::string path = testing::TempDir() + "AmlTsParserCacheTest.zap";
+    unlink(path.c_str());
+    ASSERT_EQ(-1, ProgramInfoCache::instance().setPersistentPath(path));
+
+    mParser->parseProgramInfoAsync();
+    writePsi(kProgramNumber, 3, 0x101, 0x102);
+    ASSERT_EQ(0, mParser->waitProgramInfoParsed());
+    mParser->close();
+    ProgramInfoCache::instance().flush();
+
+    // all that is left after a reboot is the file
+    ProgramInfoCache::instance().clear();
+    ASSERT_EQ(0, ProgramInfoCache::instance().setPersistentPath(path));
+
+    mParser = new Parser(AML_MP_HW_DEMUX_ID_0, false, AML_MP_DEMUX_TYPE_SOFTWARE);
+    mParser->setCacheKey(kCacheKey);
+    mParser->selectProgram(kProgramNumber);
+    ASSERT_EQ(0, mParser->open());
+    mParser->parseProgramInfoAsync();
+    ASSERT_EQ(0, mParser->waitProgramInfoParsed());
+    sptr<ProgramInfo> info = mParser->getProgramInfo();
+    ASSERT_NE(nullptr, info.get());
+    EXPECT_EQ(0x101, info->videoPid);
+    EXPECT_EQ(AML_MP_VIDEO_CODEC_H264, info->videoCodec);
+    EXPECT_EQ(0x102, info->audioPid);
+
+    ProgramInfoCache::instance().setPersistentPath("");
+    unlink(path.c_str());
+}
+
+TEST(ProgramInfoCacheTest, EvictsLeastRecentlyUsed)
+{
+    ProgramInfoCache& cache = ProgramInfoCache::instance();
+    cache.clear();
+
+    sptr<ProgramInfo> info = new ProgramInfo;
+    info->videoPid = 0x100;
+    for (size_t i = 0; i < ProgramInfoCache::kMaxEntries; ++i) {
+        cache.update(ProgramInfoCache::makeKey(1, i), info, 0);
+    }
+    // keep the first entry in use
+    ASSERT_NE(nullptr, cache.lookup(ProgramInfoCache::makeKey(1, 0)).get());
+
+    cache.update(ProgramInfoCache::makeKey(2, 0), info, 0);
+    EXPECT_NE(nullptr, cache.lookup(ProgramInfoCache::makeKey(1, 0)).get());
+    EXPECT_EQ(nullptr, cache.lookup(ProgramInfoCache::makeKey(1, 1)).get());
+    EXPECT_NE(nullptr, cache.lookup(ProgramInfoCache::makeKey(2, 0)).get());
+    cache.clear();
+}
+
+namespace {
+sptr<ProgramInfo> makeScrambledProgram()
+{
+    sptr<ProgramInfo> info = new ProgramInfo;
+    info->programNumber = 7;
+    info->pmtPid = 0x200;
+    info->scrambled = true;
+    info->caSystemId = 0x4AE1;
+    info->emmPid = 0x20;
+    info->ecmPid[ECM_INDEX_AUDIO] = 0x301;
+    info->ecmPid[ECM_INDEX_VIDEO] = 0x302;
+    info->ecmPid[ECM_INDEX_SUB] = AML_MP_INVALID_PID;
+    info->privateDataLength = 3;
+    info->privateData[0] = 0x11;
+    info->privateData[1] = 0x22;
+    info->privateData[2] = 0x33;
+    info->videoPid = 0x210;
+    info->videoCodec = AML_MP_VIDEO_CODEC_HEVC;
+    info->audioPid = 0x211;
+    info->audioCodec = AML_MP_AUDIO_CODEC_EAC3;
+    info->subtitlePid = 0x212;
+    info->subtitleCodec = AML_MP_SUBTITLE_CODEC_DVB;
+    info->compositionPageId = 1;
+    info->ancillaryPageId = 2;
+    info->videoStreams.push_back({TYPE_VIDEO, 0x210, AML_MP_VIDEO_CODEC_HEVC});
+    info->audioStreams.push_back({TYPE_AUDIO, 0x211, AML_MP_AUDIO_CODEC_EAC3});
+    info->audioStreams.push_back({TYPE_AUDIO, 0x213, AML_MP_AUDIO_CODEC_AAC});
+    info->subtitleStreams.push_back({TYPE_SUBTITLE, 0x212, AML_MP_SUBTITLE_CODEC_DVB, 1, 2});
+    return info;
+}
+}
+
+TEST(ProgramInfoCacheTest, SaveAndLoad)
+{
+    ProgramInfoCache& cache = ProgramInfoCache::instance();
+    cache.clear();
+    std::string path = testing::TempDir() + "ProgramInfoCacheTest.zap";
+
+    sptr<ProgramInfo> scrambled = makeScrambledProgram();
+    sptr<ProgramInfo> clear = new ProgramInfo;
+    clear->programNumber = 1;
+    clear->videoPid = 0x100;
+    clear->privateDataLength = 0;
+    cache.update(ProgramInfoCache::makeKey("dvb://1", 7), scrambled, 5);
+    cache.update(ProgramInfoCache::makeKey(2, 1), clear, 0);
+    ASSERT_EQ(0, cache.save(path));
+
+    cache.clear();
+    ASSERT_EQ(0, cache.load(path));
+
+    int pmtVersion = -1;
+    sptr<ProgramInfo> info = cache.lookup(ProgramInfoCache::makeKey("dvb://1", 7), &pmtVersion);
+    ASSERT_NE(nullptr, info.get());
+    EXPECT_EQ(5, pmtVersion);
+    EXPECT_TRUE(info->isSameProgram(*scrambled));
+    EXPECT_EQ(3, info->privateDataLength);
+    EXPECT_EQ(0, memcmp(info->privateData, scrambled->privateData, 3));
+    ASSERT_EQ(1u, info->subtitleStreams.size());
+    EXPECT_EQ(2, info->subtitleStreams[0].ancillaryPageId);
+    EXPECT_TRUE(info->isComplete());
+
+    info = cache.lookup(ProgramInfoCache::makeKey(2, 1), &pmtVersion);
+    ASSERT_NE(nullptr, info.get());
+    EXPECT_EQ(0, pmtVersion);
+    EXPECT_EQ(0x100, info->videoPid);
+
+    cache.clear();
+    unlink(path.c_str());
+}
+
+TEST(ProgramInfoCacheTest, SaveIsDeferred)
+{
+    ProgramInfoCache& cache = ProgramInfoCache::instance();
+    cache.clear();
+    std::string path = testing::TempDir() + "ProgramInfoCacheTest.zap";
+    unlink(path.c_str());
+    ASSERT_EQ(-1, cache.setPersistentPath(path));
+
+    // the changes within kSaveDelayMs go in one save, written by another thread
+    sptr<ProgramInfo> info = new ProgramInfo;
+    for (int i = 0; i < 3; ++i) {
+        info->videoPid = 0x100 + i;
+        cache.update(ProgramInfoCache::makeKey(1, i), info, 0);
+    }
+    struct stat st;
+    EXPECT_NE(0, stat(path.c_str(), &st));
+    ASSERT_TRUE(waitFor([&] { return stat(path.c_str(), &st) == 0; }, 5000));
+
+    cache.clear();
+    ASSERT_EQ(0, cache.load(path));
+    for (int i = 0; i < 3; ++i) {
+        sptr<ProgramInfo> loaded = cache.lookup(ProgramInfoCache::makeKey(1, i));
+        ASSERT_NE(nullptr, loaded.get());
+        EXPECT_EQ(0x100 + i, loaded->videoPid);
+    }
+
+    // flush() doesn't wait for the delay
+    cache.erase(ProgramInfoCache::makeKey(1, 0));
+    cache.flush();
+    cache.clear();
+    ASSERT_EQ(0, cache.load(path));
+    EXPECT_EQ(nullptr, cache.lookup(ProgramInfoCache::makeKey(1, 0)).get());
+    EXPECT_NE(nullptr, cache.lookup(ProgramInfoCache::makeKey(1, 1)).get());
+
+    cache.setPersistentPath("");
+    cache.clear();
+    unlink(path.c_str());
+}
+
+TEST(ProgramInfoCacheTest, IgnoresCorruptFile)
+{
+    ProgramInfoCache& cache = ProgramInfoCache::instance();
+    cache.clear();
+    std::string path = testing::TempDir() + "ProgramInfoCacheTest.zap";
+
+    cache.update(ProgramInfoCache::makeKey(1, 7), makeScrambledProgram(), 5);
+    ASSERT_EQ(0, cache.save(path));
+    cache.clear();
+
+    FILE* fp = fopen(path.c_str(), "r+b");
+    ASSERT_NE(nullptr, fp);
+    fseek(fp, 40, SEEK_SET);
+    int c = fgetc(fp);
+    fseek(fp, 40, SEEK_SET);
+    fputc(c ^ 0x01, fp);
+    fclose(fp);
+    EXPECT_EQ(-1, cache.load(path));
+    EXPECT_EQ(nullptr, cache.lookup(ProgramInfoCache::makeKey(1, 7)).get());
+
+    ASSERT_EQ(0, truncate(path.c_str(), 10));
+    EXPECT_EQ(-1, cache.load(path));
+
+    unlink(path.c_str());
+    EXPECT_EQ(-1, cache.load(path));
+    cache.clear();
+}
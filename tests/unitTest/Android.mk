@@ -8,6 +8,7 @@ LOCAL_NOTICE_FILE := $(LOCAL_PATH)/../../LICENSE
 LOCAL_MODULE_TAGS := optional
 LOCAL_SRC_FILES := \
     TestUrlList.cpp \
+    TsTestUtils.cpp \
     AmlMpTest.cpp \
     AmlMpPlayerVideoTest.cpp \
     AmlMpPlayerAudioTest.cpp \
@@ -20,6 +21,14 @@ LOCAL_SRC_FILES := \
     AmlMpDvrPlayerVideoTest.cpp \
     AmlMpDvrPlayerAudioTest.cpp \
     AmlMpMultiThreadTest.cpp \
+    AmlMpTsScannerTest.cpp \
+    AmlMpCrc32Test.cpp \
+    AmlMpSpscQueueTest.cpp \
+    AmlSwDemuxTest.cpp \
+    AmlESQueueTest.cpp \
+    AmlDvrInjectorTest.cpp \
+    AmlHwDemuxEmulatorTest.cpp \
+    AmlTsParserCacheTest.cpp \
 
 LOCAL_CFLAGS := -DANDROID_PLATFORM_SDK_VERSION=$(PLATFORM_SDK_VERSION) \
 	-Werror -Wsign-compare
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#include "TsTestUtils.h"
+#include <utils/AmlMpCrc32.h>
+#include <string.h>
+#include <algorithm>
+
+namespace aml_mp {
+uint8_t* TsPacketWriter::append(std::vector<uint8_t>& out, unsigned continuity_counter) const
+{
+    size_t offset = out.size();
+    out.resize(offset + kTsPacketSize, 0xFF);
+    uint8_t* p = &out[offset];
+    p[0] = 0x47;
+    p[1] = (mPid >> 8) & 0x1F;
+    p[2] = mPid & 0xFF;
+    p[3] = 0x10 | (continuity_counter & 0x0F);
+    return p;
+}
+
+uint8_t* TsPacketWriter::appendPcr(std::vector<uint8_t>& out, unsigned continuity_counter) const
+{
+    uint8_t* p = append(out, continuity_counter);
+    p[3] |= 0x20;
+    p[4] = 7;
+    p[5] = 0x10;
+    memset(p + 6, 0, 6);
+    return p;
+}
+
+void TsPacketWriter::appendSection(std::vector<uint8_t>& out, unsigned continuity_counter, uint8_t tableId,
+        uint16_t tableIdExtension, uint8_t version, const std::vector<uint8_t>& body) const
+{
+    uint8_t* p = append(out, continuity_counter);
+    p[1] |= 0x40;
+    p[4] = 0;                           // pointer_field
+
+    uint8_t* section = p + 5;
+    const unsigned sectionLength = 5 + body.size() + 4;
+    section[0] = tableId;
+    section[1] = 0xB0 | (sectionLength >> 8 & 0x0F);
+    section[2] = sectionLength & 0xFF;
+    section[3] = tableIdExtension >> 8;
+    section[4] = tableIdExtension & 0xFF;
+    section[5] = 0xC1 | (version & 0x1F) << 1;
+    section[6] = 0;
+    section[7] = 0;
+    memcpy(section + 8, body.data(), body.size());
+    uint32_t crc = crc32_mpeg2(section, 3 + sectionLength - 4);
+    section[3 + sectionLength - 4] = crc >> 24;
+    section[3 + sectionLength - 3] = crc >> 16;
+    section[3 + sectionLength - 2] = crc >> 8;
+    section[3 + sectionLength - 1] = crc;
+}
+
+void TsPacketWriter::appendPes(std::vector<uint8_t>& out, unsigned& continuity_counter, const std::vector<uint8_t>& pes) const
+{
+    for (size_t offset = 0; offset < pes.size();) {
+        uint8_t* p = append(out, continuity_counter++);
+        if (offset == 0) {
+            p[1] |= 0x40;
+        }
+
+        size_t size = std::min(pes.size() - offset, kTsPacketSize - 4);
+        size_t stuffing = kTsPacketSize - 4 - size;
+        if (stuffing > 0) {
+            p[3] |= 0x20;
+            p[4] = stuffing - 1;
+            if (stuffing > 1) {
+                p[5] = 0;
+            }
+        }
+        memcpy(p + 4 + stuffing, &pes[offset], size);
+        offset += size;
+    }
+}
+
+void TsPacketWriter::appendPes(std::vector<uint8_t>& out, unsigned& continuity_counter, uint8_t streamId, int64_t pts,
+        const std::vector<uint8_t>& payload) const
+{
+    appendPes(out, continuity_counter, makePes(streamId, pts, payload));
+}
+
+std::vector<uint8_t> makePes(uint8_t streamId, int64_t pts, const std::vector<uint8_t>& payload)
+{
+    std::vector<uint8_t> pes = {0x00, 0x00, 0x01, streamId, 0, 0, 0x80, 0x00, 0};
+    if (pts >= 0) {
+        pes = {0x00, 0x00, 0x01, streamId, 0, 0, 0x80, 0x80, 5,
+                (uint8_t)(0x21 | (pts >> 29 & 0x0E)), (uint8_t)(pts >> 22),
+                (uint8_t)(0x01 | (pts >> 14 & 0xFE)), (uint8_t)(pts >> 7), (uint8_t)(0x01 | (pts << 1 & 0xFE))};
+    }
+    pes.insert(pes.end(), payload.begin(), payload.end());
+
+    size_t length = pes.size() - 6;
+    if (length <= 0xFFFF) {
+        pes[4] = length >> 8;
+        pes[5] = length & 0xFF;
+    }
+    return pes;
+}
+
+std::vector<uint8_t> makePes(size_t payloadSize, uint8_t fill)
+{
+    return makePes(0xE0, -1, std::vector<uint8_t>(payloadSize, fill));
+}
+
+}
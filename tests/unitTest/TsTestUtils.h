@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#ifndef _AML_MP_TS_TEST_UTILS_H_
+#define _AML_MP_TS_TEST_UTILS_H_
+
+#include <utils/AmlMpTsScanner.h>
+#include <stdint.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace aml_mp {
+// Builds the packets of one pid for the demux tests.
+class TsPacketWriter
+{
+public:
+    explicit TsPacketWriter(int pid)
+    : mPid(pid)
+    {
+    }
+
+    // appends a payload only packet and returns it for further edits
+    uint8_t* append(std::vector<uint8_t>& out, unsigned continuity_counter) const;
+    // with an adaptation field holding a zero PCR
+    uint8_t* appendPcr(std::vector<uint8_t>& out, unsigned continuity_counter) const;
+    // one long form section in a single packet, body follows
+    // last_section_number and a valid CRC_32 follows body
+    void appendSection(std::vector<uint8_t>& out, unsigned continuity_counter, uint8_t tableId,
+            uint16_t tableIdExtension, uint8_t version,
+            const std::vector<uint8_t>& body = std::vector<uint8_t>(8, 0x5A)) const;
+    // pes split into packets, the last one stuffed with an adaptation field
+    void appendPes(std::vector<uint8_t>& out, unsigned& continuity_counter, const std::vector<uint8_t>& pes) const;
+    void appendPes(std::vector<uint8_t>& out, unsigned& continuity_counter, uint8_t streamId, int64_t pts,
+            const std::vector<uint8_t>& payload) const;
+
+private:
+    int mPid;
+};
+
+// a PES packet with a PTS if pts >= 0, PES_packet_length is 0 if the
+// payload doesn't fit in it
+std::vector<uint8_t> makePes(uint8_t streamId, int64_t pts, const std::vector<uint8_t>& payload);
+
+// a video PES without PTS, payloadSize bytes of fill
+std::vector<uint8_t> makePes(size_t payloadSize, uint8_t fill);
+
+// polls state that nothing signals a change of
+template <typename Predicate>
+bool waitFor(Predicate predicate, int timeoutMs = 1000)
+{
+    for (int i = 0; i < timeoutMs / 2; ++i) {
+        if (predicate()) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+
+    return predicate();
+}
+
+}
+
+#endif
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#define LOG_TAG "AmlMpBufferPool"
+#include <utils/AmlMpLog.h>
+#include "AmlMpBufferPool.h"
+#include "AmlMpBuffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <algorithm>
+
+namespace aml_mp {
+
+struct AmlMpBufferPool::PooledBuffer : public AmlMpBuffer {
+    PooledBuffer(const sptr<AmlMpBufferPool>& pool, void* data, size_t capacity, int sizeClass)
+    : AmlMpBuffer(data, capacity)
+    , mPool(pool)
+    , mSizeClass(sizeClass)
+    {
+    }
+
+protected:
+    ~PooledBuffer() override {
+        mPool->recycle(base(), mSizeClass);
+    }
+
+private:
+    sptr<AmlMpBufferPool> mPool;
+    int mSizeClass;
+};
+
+AmlMpBufferPool::AmlMpBufferPool(const char* name, size_t maxCachedBytes)
+: mMaxCachedBytes(maxCachedBytes)
+{
+    snprintf(mName, sizeof(mName), "%s_%s", LOG_TAG, name);
+}
+
+AmlMpBufferPool::~AmlMpBufferPool()
+{
+    trim();
+
+    MLOGI("hits:%" PRIu64 ", misses:%" PRIu64 ", high water:%zu bytes",
+            mStats.hits, mStats.misses, mStats.highWaterBytes);
+}
+
+int AmlMpBufferPool::sizeClassOf(size_t size)
+{
+    int shift = kMinClassShift;
+    while (shift <= kMaxClassShift && ((size_t)1 << shift) < size) {
+        ++shift;
+    }
+
+    return shift <= kMaxClassShift ? shift - kMinClassShift : -1;
+}
+
+sptr<AmlMpBuffer> AmlMpBufferPool::acquire(size_t size)
+{
+    int index = sizeClassOf(size);
+    if (index < 0) {
+        // too large to keep around
+        std::lock_guard<std::mutex> _l(mLock);
+        ++mStats.misses;
+        return new AmlMpBuffer(size);
+    }
+
+    size_t blockSize = (size_t)1 << (index + kMinClassShift);
+    void* data = nullptr;
+    {
+        std::lock_guard<std::mutex> _l(mLock);
+        SizeClass& sizeClass = mClasses[index];
+        if (!sizeClass.freeBlocks.empty()) {
+            data = sizeClass.freeBlocks.back();
+            sizeClass.freeBlocks.pop_back();
+            mStats.cachedBytes -= blockSize;
+            ++mStats.hits;
+        } else {
+            ++mStats.misses;
+        }
+
+        ++sizeClass.inUse;
+        sizeClass.peakInUse = std::max(sizeClass.peakInUse, sizeClass.inUse);
+        mStats.inUseBytes += blockSize;
+        mStats.highWaterBytes = std::max(mStats.highWaterBytes, mStats.inUseBytes);
+
+        if (++mAcquiresSinceTrim >= kTrimInterval) {
+            trimToHighWater_l();
+        }
+    }
+
+    if (data == nullptr) {
+        data = malloc(blockSize);
+        if (data == nullptr) {
+            MLOGE("failed to allocate %zu bytes", blockSize);
+            recycle(nullptr, index);
+            return nullptr;
+        }
+    }
+
+    sptr<AmlMpBuffer> buffer = new PooledBuffer(this, data, blockSize, index);
+    buffer->setRange(0, size);
+    return buffer;
+}
+
+void AmlMpBufferPool::recycle(void* data, int index)
+{
+    size_t blockSize = (size_t)1 << (index + kMinClassShift);
+
+    std::lock_guard<std::mutex> _l(mLock);
+    SizeClass& sizeClass = mClasses[index];
+    --sizeClass.inUse;
+    mStats.inUseBytes -= blockSize;
+
+    if (data == nullptr) {
+        return;
+    }
+
+    if (mStats.cachedBytes + blockSize > mMaxCachedBytes) {
+        free(data);
+        mStats.trimmedBytes += blockSize;
+        return;
+    }
+
+    sizeClass.freeBlocks.push_back(data);
+    mStats.cachedBytes += blockSize;
+}
+
+void AmlMpBufferPool::trim()
+{
+    std::lock_guard<std::mutex> _l(mLock);
+    for (int i = 0; i < kNumClasses; ++i) {
+        freeBlocks_l(mClasses[i], 0, (size_t)1 << (i + kMinClassShift));
+    }
+}
+
+void AmlMpBufferPool::trimToHighWater_l()
+{
+    for (int i = 0; i < kNumClasses; ++i) {
+        SizeClass& sizeClass = mClasses[i];
+        freeBlocks_l(sizeClass, sizeClass.peakInUse - sizeClass.inUse, (size_t)1 << (i + kMinClassShift));
+        sizeClass.peakInUse = sizeClass.inUse;
+    }
+
+    mAcquiresSinceTrim = 0;
+}
+
+void AmlMpBufferPool::freeBlocks_l(SizeClass& sizeClass, size_t keep, size_t blockSize)
+{
+    while (sizeClass.freeBlocks.size() > keep) {
+        free(sizeClass.freeBlocks.back());
+        sizeClass.freeBlocks.pop_back();
+        mStats.cachedBytes -= blockSize;
+        mStats.trimmedBytes += blockSize;
+    }
+}
+
+void AmlMpBufferPool::getStats(Stats* stats) const
+{
+    std::lock_guard<std::mutex> _l(mLock);
+    *stats = mStats;
+}
+
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#ifndef AML_MP_BUFFER_POOL_H_
+#define AML_MP_BUFFER_POOL_H_
+
+#include <mutex>
+#include <vector>
+#include "AmlMpRefBase.h"
+
+namespace aml_mp {
+struct AmlMpBuffer;
+
+// Recycles the memory of AmlMpBuffers in power of two size classes.
+// A buffer from acquire() gives its memory back to the pool when its last
+// sptr goes away, on whatever thread that is; the pool lives until then.
+//
+// Every kTrimInterval acquires, each class keeps only as many free blocks
+// as it needed at its high water mark since the previous trim, so a burst
+// doesn't pin memory for the rest of the playback.
+class AmlMpBufferPool : public AmlMpRefBase
+{
+public:
+    struct Stats {
+        uint64_t hits;                  // acquires served from the pool
+        uint64_t misses;                // acquires that had to allocate
+        uint64_t trimmedBytes;          // freed by trimming and the cache limit
+        size_t cachedBytes;             // free, kept for reuse
+        size_t inUseBytes;              // held by buffers not released yet
+        size_t highWaterBytes;          // most bytes in use at once
+    };
+
+    explicit AmlMpBufferPool(const char* name, size_t maxCachedBytes = kDefaultMaxCachedBytes);
+
+    // capacity is rounded up to the size class, the range is (0, size)
+    sptr<AmlMpBuffer> acquire(size_t size);
+
+    // frees all cached blocks
+    void trim();
+
+    void getStats(Stats* stats) const;
+
+    static const size_t kDefaultMaxCachedBytes = 16 * 1024 * 1024;
+
+protected:
+    ~AmlMpBufferPool();
+
+private:
+    struct PooledBuffer;
+
+    static const int kMinClassShift = 10;
+    static const int kMaxClassShift = 24;
+    static const int kNumClasses = kMaxClassShift - kMinClassShift + 1;
+    static const uint32_t kTrimInterval = 512;
+
+    struct SizeClass {
+        std::vector<void*> freeBlocks;
+        size_t inUse = 0;
+        size_t peakInUse = 0;
+    };
+
+    static int sizeClassOf(size_t size);
+    void recycle(void* data, int sizeClass);
+    void trimToHighWater_l();
+    void freeBlocks_l(SizeClass& sizeClass, size_t keep, size_t blockSize);
+
+    char mName[64];
+    const size_t mMaxCachedBytes;
+
+    mutable std::mutex mLock;
+    SizeClass mClasses[kNumClasses];
+    uint32_t mAcquiresSinceTrim = 0;
+    Stats mStats{};
+
+    AmlMpBufferPool(const AmlMpBufferPool&) = delete;
+    AmlMpBufferPool& operator= (const AmlMpBufferPool&) = delete;
+};
+
+}
+
+#endif
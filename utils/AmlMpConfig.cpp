@@ -66,6 +66,10 @@ void AmlMpConfig::reset()
     mCasType = "none";
 
     mDisableSubtitle = 0;
+    mSwDemuxWorkers = 0; // 0 or 1 parses all PIDs on the swDemux looper
+    mHwDemuxCallbackWorkers = 0; // 0 calls back all filters on the hwDemux poll thread
+    mHwDemuxEmulator = 0; // 1 runs the hwDemux on AmlDmxEmulator instead of /dev/dvb0
+    mZapCachePath = ""; // file ProgramInfoCache is kept in across reboots, empty keeps it in memory
 }
 
 void AmlMpConfig::init()
@@ -87,6 +91,10 @@ void AmlMpConfig::init()
     initProperty("vendor.cas.support.fcc.function", mCasFCCSupport);
     initProperty("vendor.secmem.size", mSecMemSize);
     initProperty("vendor.cas.type", mCasType);
+    initProperty("vendor.amlmp.swdemux-workers", mSwDemuxWorkers);
+    initProperty("vendor.amlmp.hwdemux-callback-workers", mHwDemuxCallbackWorkers);
+    initProperty("vendor.amlmp.hwdemux-emulator", mHwDemuxEmulator);
+    initProperty("vendor.amlmp.zap-cache-path", mZapCachePath);
 }
 
 void AmlMpConfig::initLinux()
@@ -111,6 +119,10 @@ void AmlMpConfig::initLinux()
     initProperty("vendor_secmem_size", mSecMemSize);
     initProperty("vendor_cas_type", mCasType);
     initProperty("vendor_amlmp_disable_subtitle", mDisableSubtitle);
+    initProperty("vendor_amlmp_swdemux_workers", mSwDemuxWorkers);
+    initProperty("vendor_amlmp_hwdemux_callback_workers", mHwDemuxCallbackWorkers);
+    initProperty("vendor_amlmp_hwdemux_emulator", mHwDemuxEmulator);
+    initProperty("vendor_amlmp_zap_cache_path", mZapCachePath);
 }
 
 AmlMpConfig::AmlMpConfig()
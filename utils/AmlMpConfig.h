@@ -45,6 +45,10 @@ public:
     int mSecMemSize;
     std::string mCasType;
     int mDisableSubtitle;
+    int mSwDemuxWorkers;
+    int mHwDemuxCallbackWorkers;
+    int mHwDemuxEmulator;
+    std::string mZapCachePath;
 private:
     void reset();
 
@@ -0,0 +1,316 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#define LOG_TAG "AmlMpCrc32"
+#include <utils/AmlMpLog.h>
+#include "AmlMpCrc32.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AML_MP_CRC32_PCLMUL 1
+#define AML_MP_CRC32_CLMUL_NAME "pclmul"
+#define AML_MP_CRC32_TARGET __attribute__((target("pclmul,ssse3")))
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_PMULL
+#define HWCAP_PMULL (1 << 4)
+#endif
+#define AML_MP_CRC32_PMULL 1
+#define AML_MP_CRC32_CLMUL_NAME "pmull"
+#if defined(__clang__)
+#define AML_MP_CRC32_TARGET __attribute__((target("aes")))
+#else
+#define AML_MP_CRC32_TARGET __attribute__((target("+crypto")))
+#endif
+#else
+#define AML_MP_CRC32_CLMUL_NAME "slice8"
+#endif
+
+static const char* mName = LOG_TAG;
+
+namespace aml_mp {
+
+static const uint64_t kCrc32Mpeg2Poly = 0x104C11DB7ULL;
+
+// below this size the fold setup costs more than it saves
+static const size_t kClmulMinSize = 64;
+
+struct Crc32Tables {
+    Crc32Tables() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i << 24;
+            for (int j = 0; j < 8; ++j) {
+                crc = (crc << 1) ^ ((crc & 0x80000000) ? (uint32_t)kCrc32Mpeg2Poly : 0);
+            }
+            table[0][i] = crc;
+        }
+
+        for (int k = 1; k < 8; ++k) {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t prev = table[k - 1][i];
+                table[k][i] = (prev << 8) ^ table[0][prev >> 24];
+            }
+        }
+
+        x128 = xnModP(128);
+        x192 = xnModP(192);
+        x512 = xnModP(512);
+        x576 = xnModP(576);
+    }
+
+    static uint32_t xnModP(unsigned n) {
+        uint64_t r = 1;
+        for (unsigned i = 0; i < n; ++i) {
+            r <<= 1;
+            if (r & 0x100000000ULL) {
+                r ^= kCrc32Mpeg2Poly;
+            }
+        }
+        return (uint32_t)r;
+    }
+
+    // table[k][b] is b * x^(32 + 8k) mod P
+    uint32_t table[8][256];
+
+    // x^n mod P, to fold 128 bits over 128 or 512 bits
+    uint64_t x128;
+    uint64_t x192;
+    uint64_t x512;
+    uint64_t x576;
+};
+
+static const Crc32Tables& crc32Tables()
+{
+    static const Crc32Tables tables;
+    return tables;
+}
+
+uint32_t crc32_mpeg2_bytewise(const uint8_t* data, size_t size, uint32_t crc)
+{
+    const uint32_t* table = crc32Tables().table[0];
+
+    while (size--) {
+        crc = (crc << 8) ^ table[(crc >> 24) ^ *data++];
+    }
+
+    return crc;
+}
+
+uint32_t crc32_mpeg2_slice8(const uint8_t* data, size_t size, uint32_t crc)
+{
+    const Crc32Tables& t = crc32Tables();
+
+    while (size >= 8) {
+        uint32_t hi = crc ^ ((uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | data[3]);
+        crc = t.table[7][hi >> 24] ^ t.table[6][(hi >> 16) & 0xFF] ^
+              t.table[5][(hi >> 8) & 0xFF] ^ t.table[4][hi & 0xFF] ^
+              t.table[3][data[4]] ^ t.table[2][data[5]] ^
+              t.table[1][data[6]] ^ t.table[0][data[7]];
+        data += 8;
+        size -= 8;
+    }
+
+    while (size--) {
+        crc = (crc << 8) ^ t.table[0][(crc >> 24) ^ *data++];
+    }
+
+    return crc;
+}
+
+// The carry-less multiply variants keep a 128 bits remainder A of the data
+// seen so far, with the first byte in the most significant bits. Each step
+// replaces A * x^n by A_hi * (x^(n+64) mod P) + A_lo * (x^n mod P), which is
+// congruent modulo P. The final 16 bytes are reduced by slice8.
+#if AML_MP_CRC32_PCLMUL
+AML_MP_CRC32_TARGET
+static inline __m128i loadReversed(const uint8_t* data)
+{
+    const __m128i swap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)data), swap);
+}
+
+AML_MP_CRC32_TARGET
+static inline __m128i fold(__m128i a, __m128i k, __m128i next)
+{
+    __m128i lo = _mm_clmulepi64_si128(a, k, 0x00);
+    __m128i hi = _mm_clmulepi64_si128(a, k, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(lo, hi), next);
+}
+
+AML_MP_CRC32_TARGET
+static uint32_t crc32Clmul(const uint8_t* data, size_t size, uint32_t crc)
+{
+    const Crc32Tables& t = crc32Tables();
+    const __m128i k128 = _mm_set_epi64x(t.x192, t.x128);
+    const __m128i k512 = _mm_set_epi64x(t.x576, t.x512);
+
+    __m128i a0 = _mm_xor_si128(loadReversed(data), _mm_set_epi32((int)crc, 0, 0, 0));
+
+    if (size >= 128) {
+        __m128i a1 = loadReversed(data + 16);
+        __m128i a2 = loadReversed(data + 32);
+        __m128i a3 = loadReversed(data + 48);
+        data += 64;
+        size -= 64;
+
+        while (size >= 64) {
+            a0 = fold(a0, k512, loadReversed(data));
+            a1 = fold(a1, k512, loadReversed(data + 16));
+            a2 = fold(a2, k512, loadReversed(data + 32));
+            a3 = fold(a3, k512, loadReversed(data + 48));
+            data += 64;
+            size -= 64;
+        }
+
+        a0 = fold(a0, k128, a1);
+        a0 = fold(a0, k128, a2);
+        a0 = fold(a0, k128, a3);
+    } else {
+        data += 16;
+        size -= 16;
+    }
+
+    while (size >= 16) {
+        a0 = fold(a0, k128, loadReversed(data));
+        data += 16;
+        size -= 16;
+    }
+
+    uint8_t folded[16];
+    const __m128i swap = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    _mm_storeu_si128((__m128i*)folded, _mm_shuffle_epi8(a0, swap));
+
+    crc = crc32_mpeg2_slice8(folded, sizeof(folded), 0);
+    return crc32_mpeg2_slice8(data, size, crc);
+}
+
+static bool detectClmul()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+}
+#elif AML_MP_CRC32_PMULL
+static inline uint64x2_t reverseBytes(uint8x16_t v)
+{
+    v = vrev64q_u8(v);
+    return vreinterpretq_u64_u8(vextq_u8(v, v, 8));
+}
+
+AML_MP_CRC32_TARGET
+static inline uint64x2_t fold(uint64x2_t a, uint64x2_t k, uint64x2_t next)
+{
+    uint64x2_t lo = vreinterpretq_u64_p128(vmull_p64((poly64_t)vgetq_lane_u64(a, 0), (poly64_t)vgetq_lane_u64(k, 0)));
+    uint64x2_t hi = vreinterpretq_u64_p128(vmull_p64((poly64_t)vgetq_lane_u64(a, 1), (poly64_t)vgetq_lane_u64(k, 1)));
+    return veorq_u64(veorq_u64(lo, hi), next);
+}
+
+AML_MP_CRC32_TARGET
+static uint32_t crc32Clmul(const uint8_t* data, size_t size, uint32_t crc)
+{
+    const Crc32Tables& t = crc32Tables();
+    const uint64x2_t k128 = vcombine_u64(vcreate_u64(t.x128), vcreate_u64(t.x192));
+    const uint64x2_t k512 = vcombine_u64(vcreate_u64(t.x512), vcreate_u64(t.x576));
+
+    uint64x2_t a0 = veorq_u64(reverseBytes(vld1q_u8(data)),
+            vreinterpretq_u64_u32(vsetq_lane_u32(crc, vdupq_n_u32(0), 3)));
+
+    if (size >= 128) {
+        uint64x2_t a1 = reverseBytes(vld1q_u8(data + 16));
+        uint64x2_t a2 = reverseBytes(vld1q_u8(data + 32));
+        uint64x2_t a3 = reverseBytes(vld1q_u8(data + 48));
+        data += 64;
+        size -= 64;
+
+        while (size >= 64) {
+            a0 = fold(a0, k512, reverseBytes(vld1q_u8(data)));
+            a1 = fold(a1, k512, reverseBytes(vld1q_u8(data + 16)));
+            a2 = fold(a2, k512, reverseBytes(vld1q_u8(data + 32)));
+            a3 = fold(a3, k512, reverseBytes(vld1q_u8(data + 48)));
+            data += 64;
+            size -= 64;
+        }
+
+        a0 = fold(a0, k128, a1);
+        a0 = fold(a0, k128, a2);
+        a0 = fold(a0, k128, a3);
+    } else {
+        data += 16;
+        size -= 16;
+    }
+
+    while (size >= 16) {
+        a0 = fold(a0, k128, reverseBytes(vld1q_u8(data)));
+        data += 16;
+        size -= 16;
+    }
+
+    uint8_t folded[16];
+    vst1q_u8(folded, vreinterpretq_u8_u64(reverseBytes(vreinterpretq_u8_u64(a0))));
+
+    crc = crc32_mpeg2_slice8(folded, sizeof(folded), 0);
+    return crc32_mpeg2_slice8(data, size, crc);
+}
+
+static bool detectClmul()
+{
+    return getauxval(AT_HWCAP) & HWCAP_PMULL;
+}
+#else
+static uint32_t crc32Clmul(const uint8_t* data, size_t size, uint32_t crc)
+{
+    return crc32_mpeg2_slice8(data, size, crc);
+}
+
+static bool detectClmul()
+{
+    return false;
+}
+#endif
+
+static bool hasClmul()
+{
+    static const bool supported = [] {
+        bool ret = detectClmul();
+        MLOGI("crc32_mpeg2 uses %s", ret ? (AML_MP_CRC32_CLMUL_NAME) : "slice8");
+        return ret;
+    }();
+
+    return supported;
+}
+
+bool crc32_mpeg2_has_clmul()
+{
+    return hasClmul();
+}
+
+uint32_t crc32_mpeg2_clmul(const uint8_t* data, size_t size, uint32_t crc)
+{
+    if (size < 16) {
+        return crc32_mpeg2_slice8(data, size, crc);
+    }
+
+    return crc32Clmul(data, size, crc);
+}
+
+const char* crc32_mpeg2_impl()
+{
+    return hasClmul() ? AML_MP_CRC32_CLMUL_NAME : "slice8";
+}
+
+uint32_t crc32_mpeg2(const uint8_t* data, size_t size, uint32_t crc)
+{
+    if (size >= kClmulMinSize && hasClmul()) {
+        return crc32Clmul(data, size, crc);
+    }
+
+    return crc32_mpeg2_slice8(data, size, crc);
+}
+
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#ifndef AML_MP_CRC32_H_
+#define AML_MP_CRC32_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace aml_mp {
+
+// CRC32/MPEG-2: polynomial 0x04C11DB7, MSB first, no final xor.
+// A PSI section including its CRC_32 field yields 0.
+// Pass the previous result as crc to continue over split buffers.
+uint32_t crc32_mpeg2(const uint8_t* data, size_t size, uint32_t crc = 0xFFFFFFFF);
+
+// Name of the implementation selected at runtime: "pclmul", "pmull" or "slice8".
+const char* crc32_mpeg2_impl();
+
+// The individual implementations, crc32_mpeg2() picks the fastest one.
+uint32_t crc32_mpeg2_bytewise(const uint8_t* data, size_t size, uint32_t crc = 0xFFFFFFFF);
+uint32_t crc32_mpeg2_slice8(const uint8_t* data, size_t size, uint32_t crc = 0xFFFFFFFF);
+// Only valid if crc32_mpeg2_has_clmul() returns true.
+uint32_t crc32_mpeg2_clmul(const uint8_t* data, size_t size, uint32_t crc = 0xFFFFFFFF);
+bool crc32_mpeg2_has_clmul();
+
+}
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#define LOG_TAG "AmlMpSectionCache"
+#include <utils/AmlMpLog.h>
+#include "AmlMpSectionCache.h"
+#include "AmlMpCrc32.h"
+
+static const char* mName = LOG_TAG;
+
+namespace aml_mp {
+
+bool AmlMpSectionCache::makeEntry(const uint8_t* section, size_t size, uint32_t* key, Entry* entry)
+{
+    if (size < 3) {
+        return false;
+    }
+
+    size_t sectionSize = ((section[1] & 0x0F) << 8 | section[2]) + 3;
+    if (sectionSize > size) {
+        return false;
+    }
+
+    bool longForm = section[1] & 0x80;
+    if (longForm && sectionSize >= 12) {
+        *key = (uint32_t)section[0] << 24 | (uint32_t)section[3] << 16 | (uint32_t)section[4] << 8 | section[6];
+        entry->version = (section[5] >> 1) & 0x1F;
+        const uint8_t* crc = section + sectionSize - 4;
+        entry->crc = (uint32_t)crc[0] << 24 | (uint32_t)crc[1] << 16 | (uint32_t)crc[2] << 8 | crc[3];
+    } else {
+        *key = (uint32_t)section[0] << 24;
+        entry->version = -1;
+        entry->crc = crc32_mpeg2(section, sectionSize);
+    }
+
+    return true;
+}
+
+bool AmlMpSectionCache::isRepeated(const uint8_t* section, size_t size)
+{
+    uint32_t key;
+    Entry entry;
+    if (!makeEntry(section, size, &key, &entry)) {
+        return false;
+    }
+
+    auto it = mEntries.find(key);
+    if (it != mEntries.end() && it->second.version == entry.version && it->second.crc == entry.crc) {
+        ++mHits;
+        return true;
+    }
+
+    ++mMisses;
+    return false;
+}
+
+void AmlMpSectionCache::update(const uint8_t* section, size_t size)
+{
+    uint32_t key;
+    Entry entry;
+    if (!makeEntry(section, size, &key, &entry)) {
+        return;
+    }
+
+    if (mEntries.size() >= kMaxEntries && mEntries.find(key) == mEntries.end()) {
+        MLOGW("too many sections cached, clear");
+        mEntries.clear();
+    }
+
+    mEntries[key] = entry;
+}
+
+void AmlMpSectionCache::clear()
+{
+    mEntries.clear();
+}
+
+}
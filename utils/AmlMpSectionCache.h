@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#ifndef AML_MP_SECTION_CACHE_H_
+#define AML_MP_SECTION_CACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+
+namespace aml_mp {
+
+// Remembers the sections already delivered on one PID, per table_id,
+// table_id_extension and section_number, to tell an identical repetition
+// from an update. Long form sections are compared by version_number and
+// their CRC_32 field, so a repetition is found without computing any CRC.
+// Short form sections have neither, the CRC of their bytes is used instead.
+class AmlMpSectionCache
+{
+public:
+    AmlMpSectionCache() = default;
+
+    // section is complete, from table_id to the end of the section.
+    // Counts a hit if it's the same as the cached one.
+    bool isRepeated(const uint8_t* section, size_t size);
+
+    // call once the section has been checked and delivered
+    void update(const uint8_t* section, size_t size);
+
+    void clear();
+
+    uint64_t hits() const {
+        return mHits;
+    }
+
+    uint64_t misses() const {
+        return mMisses;
+    }
+
+private:
+    struct Entry {
+        uint32_t crc;
+        int version;
+    };
+
+    static bool makeEntry(const uint8_t* section, size_t size, uint32_t* key, Entry* entry);
+
+    // more than this is not repetitive PSI, start over
+    static const size_t kMaxEntries = 1024;
+
+    std::map<uint32_t, Entry> mEntries;
+    uint64_t mHits = 0;
+    uint64_t mMisses = 0;
+
+private:
+    AmlMpSectionCache(const AmlMpSectionCache&) = delete;
+    AmlMpSectionCache& operator= (const AmlMpSectionCache&) = delete;
+};
+
+}
+
+#endif
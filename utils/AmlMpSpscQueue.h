@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#ifndef AML_MP_SPSC_QUEUE_H_
+#define AML_MP_SPSC_QUEUE_H_
+
+#include <atomic>
+#include <vector>
+#include "AmlMpFifo.h"
+
+namespace aml_mp {
+
+// Bounded lock free queue, for exactly one producer thread and one consumer
+// thread. It doesn't block, callers wait on their own condition when
+// tryPush() or tryPop() fails.
+template <typename T>
+class AmlMpSpscQueue
+{
+public:
+    explicit AmlMpSpscQueue(size_t capacity)
+    : mSlots(roundUpPowerOfTwo(capacity))
+    , mMask(mSlots.size() - 1)
+    {
+    }
+
+    // producer side
+    bool tryPush(T&& item) {
+        size_t tail = mTail.value.load(std::memory_order_relaxed);
+        if (tail - mHead.value.load(std::memory_order_acquire) == mSlots.size()) {
+            return false;
+        }
+
+        mSlots[tail & mMask] = std::move(item);
+        mTail.value.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer side
+    bool tryPop(T* item) {
+        size_t head = mHead.value.load(std::memory_order_relaxed);
+        if (head == mTail.value.load(std::memory_order_acquire)) {
+            return false;
+        }
+
+        *item = std::move(mSlots[head & mMask]);
+        mSlots[head & mMask] = T();
+        mHead.value.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        return mTail.value.load(std::memory_order_acquire) - mHead.value.load(std::memory_order_acquire);
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    size_t capacity() const {
+        return mSlots.size();
+    }
+
+private:
+    std::vector<T> mSlots;
+    const size_t mMask;
+
+    // written by the consumer and the producer respectively, padded so
+    // they don't share a cache line.
+    struct PaddedIndex {
+        std::atomic<size_t> value{0};
+        char padding[64 - sizeof(std::atomic<size_t>)];
+    };
+    PaddedIndex mHead;
+    PaddedIndex mTail;
+
+    AmlMpSpscQueue(const AmlMpSpscQueue&) = delete;
+    AmlMpSpscQueue& operator= (const AmlMpSpscQueue&) = delete;
+};
+
+}
+
+#endif
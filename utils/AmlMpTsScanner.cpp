@@ -0,0 +1,511 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#define LOG_TAG "AmlMpTsScanner"
+#include <utils/AmlMpLog.h>
+#include "AmlMpTsScanner.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AML_MP_TS_SCANNER_X86 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__aarch64__)
+#include <arm_neon.h>
+#define AML_MP_TS_SCANNER_NEON 1
+#endif
+
+static const char* mName = LOG_TAG;
+
+namespace aml_mp {
+
+static const uint8_t kSyncByte = 0x47;
+
+// number of packets which must be locked before a stride is accepted
+static const int kDetectPackets = 4;
+
+// The kernels of each instruction set, see AmlMpTsScannerKernels.
+static size_t findSyncC(const uint8_t* p, size_t limit, size_t stride)
+{
+    for (size_t i = 0; i < limit; ++i) {
+        if (p[i] == kSyncByte && p[i + stride] == kSyncByte) {
+            return i;
+        }
+    }
+
+    return limit;
+}
+
+static size_t findStartCodeC(const uint8_t* data, size_t size)
+{
+    size_t i = 0;
+    while (i + 2 < size) {
+        // data[i + 2] decides how far we can skip: above 1 it can't be part
+        // of any prefix starting at i, i + 1 or i + 2.
+        uint8_t c = data[i + 2];
+        if (c > 1) {
+            i += 3;
+        } else if (c == 0) {
+            ++i;
+        } else if (data[i] == 0 && data[i + 1] == 0) {
+            return i;
+        } else {
+            i += 3;
+        }
+    }
+
+    return size;
+}
+
+static size_t findSyncWordC(const uint8_t* data, size_t size, uint8_t first, uint8_t second, uint8_t mask)
+{
+    if (size < 2) {
+        return size;
+    }
+
+    const uint8_t* p = data;
+    const uint8_t* end = data + size - 1;
+    while (p < end) {
+        p = (const uint8_t*)memchr(p, first, end - p);
+        if (p == nullptr) {
+            break;
+        }
+
+        if ((p[1] & mask) == second) {
+            return p - data;
+        }
+        ++p;
+    }
+
+    return size;
+}
+
+// the scalar tail of the matchPids kernels, from packet k on
+static size_t matchPidsFrom(const uint8_t* p, size_t size, size_t stride, const AmlMpTsPidSet& pids,
+        size_t k, uint64_t* matched)
+{
+    for (; k < 64 && (k + 1) * stride <= size; ++k) {
+        const uint8_t* packet = p + k * stride;
+        if (packet[0] != kSyncByte || ((k + 1) * stride < size && packet[stride] != kSyncByte)) {
+            break;
+        }
+
+        if (pids.contains((packet[1] & 0x1F) << 8 | packet[2])) {
+            *matched |= 1ULL << k;
+        }
+    }
+
+    return k;
+}
+
+static size_t matchPidsC(const uint8_t* p, size_t size, size_t stride, const AmlMpTsPidSet& pids, uint64_t* matched)
+{
+    *matched = 0;
+    return matchPidsFrom(p, size, stride, pids, 0, matched);
+}
+
+#if AML_MP_TS_SCANNER_X86
+static size_t findSyncSse2(const uint8_t* p, size_t limit, size_t stride)
+{
+    const __m128i sync = _mm_set1_epi8(kSyncByte);
+    size_t i = 0;
+
+    for (; i + 16 <= limit; i += 16) {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), sync);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i + stride)), sync);
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(a, b));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + findSyncC(p + i, limit - i, stride);
+}
+
+static size_t findStartCodeSse2(const uint8_t* data, size_t size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    size_t i = 0;
+
+    for (; i + 18 <= size; i += 16) {
+        __m128i v0 = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i v1 = _mm_loadu_si128((const __m128i*)(data + i + 1));
+        __m128i v2 = _mm_loadu_si128((const __m128i*)(data + i + 2));
+        __m128i m = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(v0, zero), _mm_cmpeq_epi8(v1, zero)),
+                _mm_cmpeq_epi8(v2, one));
+        unsigned mask = _mm_movemask_epi8(m);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + findStartCodeC(data + i, size - i);
+}
+
+static size_t findSyncWordSse2(const uint8_t* data, size_t size, uint8_t first, uint8_t second, uint8_t mask)
+{
+    const __m128i vfirst = _mm_set1_epi8(first);
+    const __m128i vsecond = _mm_set1_epi8(second);
+    const __m128i vmask = _mm_set1_epi8(mask);
+    size_t i = 0;
+
+    for (; i + 17 <= size; i += 16) {
+        __m128i v0 = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i v1 = _mm_loadu_si128((const __m128i*)(data + i + 1));
+        __m128i m = _mm_and_si128(_mm_cmpeq_epi8(v0, vfirst),
+                _mm_cmpeq_epi8(_mm_and_si128(v1, vmask), vsecond));
+        unsigned bits = _mm_movemask_epi8(m);
+        if (bits) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+
+    return i + findSyncWordC(data + i, size - i, first, second, mask);
+}
+
+__attribute__((target("avx2")))
+static size_t findSyncAvx2(const uint8_t* p, size_t limit, size_t stride)
+{
+    const __m256i sync = _mm256_set1_epi8(kSyncByte);
+    size_t i = 0;
+
+    for (; i + 32 <= limit; i += 32) {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i)), sync);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i + stride)), sync);
+        unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(a, b));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + findSyncSse2(p + i, limit - i, stride);
+}
+
+__attribute__((target("avx2")))
+static size_t findStartCodeAvx2(const uint8_t* data, size_t size)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    size_t i = 0;
+
+    for (; i + 34 <= size; i += 32) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i v1 = _mm256_loadu_si256((const __m256i*)(data + i + 1));
+        __m256i v2 = _mm256_loadu_si256((const __m256i*)(data + i + 2));
+        __m256i m = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(v0, zero), _mm256_cmpeq_epi8(v1, zero)),
+                _mm256_cmpeq_epi8(v2, one));
+        unsigned mask = _mm256_movemask_epi8(m);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+
+    return i + findStartCodeSse2(data + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t findSyncWordAvx2(const uint8_t* data, size_t size, uint8_t first, uint8_t second, uint8_t mask)
+{
+    const __m256i vfirst = _mm256_set1_epi8(first);
+    const __m256i vsecond = _mm256_set1_epi8(second);
+    const __m256i vmask = _mm256_set1_epi8(mask);
+    size_t i = 0;
+
+    for (; i + 33 <= size; i += 32) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i v1 = _mm256_loadu_si256((const __m256i*)(data + i + 1));
+        __m256i m = _mm256_and_si256(_mm256_cmpeq_epi8(v0, vfirst),
+                _mm256_cmpeq_epi8(_mm256_and_si256(v1, vmask), vsecond));
+        unsigned bits = _mm256_movemask_epi8(m);
+        if (bits) {
+            return i + __builtin_ctz(bits);
+        }
+    }
+
+    return i + findSyncWordSse2(data + i, size - i, first, second, mask);
+}
+
+// Gathers the headers of 8 packets at once and looks their pids up in the
+// pid set, the bit of a pid is bit pid & 31 of the 32 bits word pid >> 5.
+__attribute__((target("avx2")))
+static size_t matchPidsAvx2(const uint8_t* p, size_t size, size_t stride, const AmlMpTsPidSet& pids, uint64_t* matched)
+{
+    const __m256i index = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+    const __m256i byteMask = _mm256_set1_epi32(0xFF);
+    const __m256i sync = _mm256_set1_epi32(kSyncByte);
+    const int* pidWords = (const int*)pids.bits();
+    size_t k = 0;
+
+    *matched = 0;
+    for (; k + 8 <= 64 && (k + 8) * stride < size; k += 8) {
+        const uint8_t* base = p + k * stride;
+        if (base[8 * stride] != kSyncByte) {
+            break;
+        }
+
+        __m256i header = _mm256_i32gather_epi32((const int*)base, index, 1);
+        __m256i locked = _mm256_cmpeq_epi32(_mm256_and_si256(header, byteMask), sync);
+        if (_mm256_movemask_ps(_mm256_castsi256_ps(locked)) != 0xFF) {
+            break;
+        }
+
+        // the header bytes are little endian in each lane
+        __m256i pid = _mm256_or_si256(_mm256_and_si256(header, _mm256_set1_epi32(0x1F00)),
+                _mm256_and_si256(_mm256_srli_epi32(header, 16), byteMask));
+        __m256i words = _mm256_i32gather_epi32(pidWords, _mm256_srli_epi32(pid, 5), 4);
+        __m256i bit = _mm256_srlv_epi32(words, _mm256_and_si256(pid, _mm256_set1_epi32(31)));
+        unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(bit, 31)));
+        *matched |= (uint64_t)mask << k;
+    }
+
+    return matchPidsFrom(p, size, stride, pids, k, matched);
+}
+#endif
+
+#if AML_MP_TS_SCANNER_NEON
+// narrows each byte of a comparison to a nibble, there is no movemask on NEON
+static inline uint64_t neonMask(uint8x16_t eq)
+{
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+
+static size_t findSyncNeon(const uint8_t* p, size_t limit, size_t stride)
+{
+    const uint8x16_t sync = vdupq_n_u8(kSyncByte);
+    size_t i = 0;
+
+    for (; i + 16 <= limit; i += 16) {
+        uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(p + i), sync), vceqq_u8(vld1q_u8(p + i + stride), sync));
+        uint64_t mask = neonMask(eq);
+        if (mask) {
+            return i + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+
+    return i + findSyncC(p + i, limit - i, stride);
+}
+
+static size_t findStartCodeNeon(const uint8_t* data, size_t size)
+{
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+    size_t i = 0;
+
+    for (; i + 18 <= size; i += 16) {
+        uint8x16_t eq = vandq_u8(vandq_u8(vceqq_u8(vld1q_u8(data + i), zero), vceqq_u8(vld1q_u8(data + i + 1), zero)),
+                vceqq_u8(vld1q_u8(data + i + 2), one));
+        uint64_t mask = neonMask(eq);
+        if (mask) {
+            return i + (__builtin_ctzll(mask) >> 2);
+        }
+    }
+
+    return i + findStartCodeC(data + i, size - i);
+}
+
+static size_t findSyncWordNeon(const uint8_t* data, size_t size, uint8_t first, uint8_t second, uint8_t mask)
+{
+    const uint8x16_t vfirst = vdupq_n_u8(first);
+    const uint8x16_t vsecond = vdupq_n_u8(second);
+    const uint8x16_t vmask = vdupq_n_u8(mask);
+    size_t i = 0;
+
+    for (; i + 17 <= size; i += 16) {
+        uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(data + i), vfirst),
+                vceqq_u8(vandq_u8(vld1q_u8(data + i + 1), vmask), vsecond));
+        uint64_t bits = neonMask(eq);
+        if (bits) {
+            return i + (__builtin_ctzll(bits) >> 2);
+        }
+    }
+
+    return i + findSyncWordC(data + i, size - i, first, second, mask);
+}
+#endif
+
+static const AmlMpTsScannerKernels kKernelsC = {"c", findSyncC, findStartCodeC, findSyncWordC, matchPidsC};
+#if AML_MP_TS_SCANNER_X86
+static const AmlMpTsScannerKernels kKernelsSse2 = {"sse2", findSyncSse2, findStartCodeSse2, findSyncWordSse2, matchPidsC};
+static const AmlMpTsScannerKernels kKernelsAvx2 = {"avx2", findSyncAvx2, findStartCodeAvx2, findSyncWordAvx2, matchPidsAvx2};
+#elif AML_MP_TS_SCANNER_NEON
+static const AmlMpTsScannerKernels kKernelsNeon = {"neon", findSyncNeon, findStartCodeNeon, findSyncWordNeon, matchPidsC};
+#endif
+
+struct KernelTable {
+    const AmlMpTsScannerKernels* kernels[4];
+    size_t count;
+};
+
+// the best kernels first, the C ones always last
+static KernelTable selectKernels()
+{
+    KernelTable table{};
+
+#if AML_MP_TS_SCANNER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        table.kernels[table.count++] = &kKernelsAvx2;
+    }
+    table.kernels[table.count++] = &kKernelsSse2;
+#elif AML_MP_TS_SCANNER_NEON
+    table.kernels[table.count++] = &kKernelsNeon;
+#endif
+    table.kernels[table.count++] = &kKernelsC;
+
+    MLOGI("ts scanner uses %s kernel", table.kernels[0]->name);
+    return table;
+}
+
+static const KernelTable& kernelTable()
+{
+    static const KernelTable table = selectKernels();
+    return table;
+}
+
+static const AmlMpTsScannerKernels& kernelInfo()
+{
+    return *kernelTable().kernels[0];
+}
+
+const AmlMpTsScannerKernels* tsScannerKernels(size_t index)
+{
+    const KernelTable& table = kernelTable();
+    return index < table.count ? table.kernels[index] : nullptr;
+}
+
+const char* tsScannerImpl()
+{
+    return kernelInfo().name;
+}
+
+size_t tsFindSyncByte(const uint8_t* data, size_t size)
+{
+    if (data == nullptr) {
+        return size;
+    }
+
+    return kernelInfo().findSync(data, size, 0);
+}
+
+size_t tsFindSyncLock(const uint8_t* data, size_t size, size_t packetSize)
+{
+    if (data == nullptr) {
+        return size;
+    }
+
+    size_t offset = size;
+    if (size > packetSize) {
+        size_t limit = size - packetSize;
+        offset = kernelInfo().findSync(data, limit, packetSize);
+        if (offset < limit) {
+            return offset;
+        }
+        offset = limit;
+    } else {
+        offset = 0;
+    }
+
+    // the next packet of the remaining candidates is beyond the buffer
+    return offset + kernelInfo().findSync(data + offset, size - offset, 0);
+}
+
+size_t esFindStartCode(const uint8_t* data, size_t size)
+{
+    if (data == nullptr) {
+        return size;
+    }
+
+    return kernelInfo().findStartCode(data, size);
+}
+
+size_t esFindSyncWord(const uint8_t* data, size_t size, uint8_t first, uint8_t second, uint8_t mask)
+{
+    if (data == nullptr) {
+        return size;
+    }
+
+    return kernelInfo().findSyncWord(data, size, first, second, mask);
+}
+
+size_t tsDetectPacketSize(const uint8_t* data, size_t size, size_t* syncOffset)
+{
+    static const size_t kPacketSizes[] = {kTsPacketSize, kM2tsPacketSize, kTsFecPacketSize};
+
+    for (size_t packetSize : kPacketSizes) {
+        size_t span = packetSize * kDetectPackets;
+        if (data == nullptr || size <= span) {
+            continue;
+        }
+
+        size_t limit = size - span;
+        size_t offset = 0;
+        while (offset < limit) {
+            offset += kernelInfo().findSync(data + offset, limit - offset, packetSize);
+            if (offset >= limit) {
+                break;
+            }
+
+            int k = 2;
+            while (k <= kDetectPackets && data[offset + k * packetSize] == kSyncByte) {
+                ++k;
+            }
+
+            if (k > kDetectPackets) {
+                if (syncOffset) {
+                    *syncOffset = offset;
+                }
+                return packetSize;
+            }
+
+            ++offset;
+        }
+    }
+
+    return 0;
+}
+
+size_t tsScanPidPackets(const uint8_t* data, size_t size, const AmlMpTsPidSet& pids,
+        size_t* offsets, size_t maxCount, size_t packetSize)
+{
+    size_t count = 0;
+
+    if (data == nullptr || size < packetSize) {
+        return 0;
+    }
+
+    size_t offset = tsFindSyncLock(data, size, packetSize);
+    while (count < maxCount && offset + packetSize <= size) {
+        uint64_t matched = 0;
+        size_t packets = kernelInfo().matchPids(data + offset, size - offset, packetSize, pids, &matched);
+        for (; matched != 0 && count < maxCount; matched &= matched - 1) {
+            offsets[count++] = offset + __builtin_ctzll(matched) * packetSize;
+        }
+
+        offset += packets * packetSize;
+        if (packets < 64 && offset + packetSize <= size) {
+            // the lock is lost at offset
+            ++offset;
+            offset += tsFindSyncLock(data + offset, size - offset, packetSize);
+        }
+    }
+
+    return count;
+}
+
+size_t tsFindPidPacket(const uint8_t* data, size_t size, const AmlMpTsPidSet& pids, size_t packetSize)
+{
+    size_t offset;
+
+    if (tsScanPidPackets(data, size, pids, &offset, 1, packetSize) == 0) {
+        return size;
+    }
+
+    return offset;
+}
+
+}
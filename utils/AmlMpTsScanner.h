@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2020 Amlogic, Inc. All rights reserved.
+ *
+ * This source code is subject to the terms and conditions defined in the
+ * file 'LICENSE' which is part of this source code package.
+ *
+ * Description:
+ */
+
+#ifndef AML_MP_TS_SCANNER_H_
+#define AML_MP_TS_SCANNER_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+namespace aml_mp {
+
+static const size_t kTsPacketSize = 188;
+static const size_t kM2tsPacketSize = 192;
+static const size_t kTsFecPacketSize = 204;
+
+struct AmlMpTsPidSet {
+    AmlMpTsPidSet() {
+        clear();
+    }
+
+    void add(int pid) {
+        if (pid >= 0 && pid < 0x2000) {
+            mBits[pid >> 6] |= 1ULL << (pid & 63);
+        }
+    }
+
+    void remove(int pid) {
+        if (pid >= 0 && pid < 0x2000) {
+            mBits[pid >> 6] &= ~(1ULL << (pid & 63));
+        }
+    }
+
+    bool contains(int pid) const {
+        return (mBits[pid >> 6] >> (pid & 63)) & 1;
+    }
+
+    void clear() {
+        memset(mBits, 0, sizeof(mBits));
+    }
+
+    // one bit per pid, pid 0 is bit 0 of the first word
+    const uint64_t* bits() const {
+        return mBits;
+    }
+
+private:
+    uint64_t mBits[0x2000 / 64];
+};
+
+// The fixed 4 bytes TS packet header, loaded as one big endian word.
+struct AmlMpTsHeader {
+    explicit AmlMpTsHeader(const uint8_t* packet) {
+        uint32_t word;
+        memcpy(&word, packet, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        word = __builtin_bswap32(word);
+#endif
+        mWord = word;
+    }
+
+    unsigned syncByte() const { return mWord >> 24; }
+    unsigned transportErrorIndicator() const { return (mWord >> 23) & 0x1; }
+    unsigned payloadUnitStartIndicator() const { return (mWord >> 22) & 0x1; }
+    unsigned transportPriority() const { return (mWord >> 21) & 0x1; }
+    unsigned pid() const { return (mWord >> 8) & 0x1FFF; }
+    unsigned scramblingControl() const { return (mWord >> 6) & 0x3; }
+    unsigned adaptationFieldControl() const { return (mWord >> 4) & 0x3; }
+    unsigned continuityCounter() const { return mWord & 0xF; }
+    bool hasAdaptationField() const { return mWord & 0x20; }
+    bool hasPayload() const { return mWord & 0x10; }
+
+private:
+    uint32_t mWord;
+};
+
+struct AmlMpTsAdaptationField {
+    unsigned length = 0;
+    bool discontinuity = false;
+    bool randomAccess = false;
+    bool hasPcr = false;
+    uint64_t pcrBase = 0;
+    unsigned pcrExtension = 0;
+
+    // packet points to the TS header, returns false if the field overflows the packet.
+    bool parse(const uint8_t* packet) {
+        const uint8_t* p = packet + 4;
+        length = p[0];
+        if (length > kTsPacketSize - 5) {
+            return false;
+        }
+
+        if (length == 0) {
+            discontinuity = randomAccess = hasPcr = false;
+            return true;
+        }
+
+        unsigned flags = p[1];
+        discontinuity = flags & 0x80;
+        randomAccess = flags & 0x40;
+        hasPcr = (flags & 0x10) && length >= 7;
+        if (hasPcr) {
+            pcrBase = (uint64_t)p[2] << 25 | (uint32_t)p[3] << 17 | (uint32_t)p[4] << 9 | (uint32_t)p[5] << 1 | p[6] >> 7;
+            pcrExtension = (p[6] & 0x1) << 8 | p[7];
+        }
+
+        return true;
+    }
+
+    // offset of the payload from the start of the packet
+    size_t payloadOffset() const { return 5 + length; }
+};
+
+// Returns the offset of the first 0x47, or size if there is none.
+size_t tsFindSyncByte(const uint8_t* data, size_t size);
+
+// Returns the offset of the first 0x47 which is followed by another 0x47
+// packetSize bytes later. A candidate whose next packet starts beyond the
+// buffer is accepted on its own sync byte. Returns size if there is none.
+size_t tsFindSyncLock(const uint8_t* data, size_t size, size_t packetSize = kTsPacketSize);
+
+// Detects 188, 192 (M2TS) or 204 bytes packets, and the offset of the first
+// locked sync byte. Returns 0 if no stride locks over the buffer.
+size_t tsDetectPacketSize(const uint8_t* data, size_t size, size_t* syncOffset);
+
+// Returns the offset of the first complete packet whose PID is in pids,
+// resyncing whenever the lock is lost. Returns size if there is none.
+size_t tsFindPidPacket(const uint8_t* data, size_t size, const AmlMpTsPidSet& pids, size_t packetSize = kTsPacketSize);
+
+// Stores the offsets of up to maxCount matching packets, returns the count.
+size_t tsScanPidPackets(const uint8_t* data, size_t size, const AmlMpTsPidSet& pids,
+        size_t* offsets, size_t maxCount, size_t packetSize = kTsPacketSize);
+
+// Returns the offset of the first 00 00 01 start code prefix of an H.26x
+// elementary stream, or size if there is none. A prefix is only found if all
+// its 3 bytes are in data.
+size_t esFindStartCode(const uint8_t* data, size_t size);
+
+// Returns the offset of the first i with data[i] == first and
+// (data[i + 1] & mask) == second, or size if there is none. It only finds a
+// candidate, the caller still checks the header behind it:
+//   ADTS       0xFF, 0xF0, mask 0xF0
+//   MPEG audio 0xFF, 0xE0, mask 0xE0
+//   (E-)AC-3   0x0B, 0x77
+size_t esFindSyncWord(const uint8_t* data, size_t size, uint8_t first, uint8_t second, uint8_t mask = 0xFF);
+
+// Name of the kernels selected at runtime: "avx2", "sse2", "neon" or "c".
+const char* tsScannerImpl();
+
+// The kernels of one instruction set, the functions above use the selected ones.
+struct AmlMpTsScannerKernels {
+    const char* name;
+    // first i < limit with p[i] == 0x47 && p[i + stride] == 0x47, or limit.
+    // stride 0 checks the sync byte alone, p must be readable up to limit + stride.
+    size_t (*findSync)(const uint8_t* p, size_t limit, size_t stride);
+    // the same as esFindStartCode() and esFindSyncWord()
+    size_t (*findStartCode)(const uint8_t* data, size_t size);
+    size_t (*findSyncWord)(const uint8_t* data, size_t size, uint8_t first, uint8_t second, uint8_t mask);
+    // Walks up to 64 complete packets of stride bytes from p, a packet is
+    // locked if its next packet boundary holds a sync byte too or lies at or
+    // beyond size. Returns the number of locked packets before the first
+    // unlocked one, and sets bit k of matched for each locked packet k whose
+    // pid is in pids.
+    size_t (*matchPids)(const uint8_t* p, size_t size, size_t stride, const AmlMpTsPidSet& pids, uint64_t* matched);
+};
+
+// Returns the kernels this cpu can run, index 0 is the selected one and the
+// last is plain C. Returns nullptr past the end.
+const AmlMpTsScannerKernels* tsScannerKernels(size_t index);
+
+}
+
+#endif
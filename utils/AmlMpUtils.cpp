@@ -164,6 +164,7 @@ const char* mpPlayerParameterKey2Str(Aml_MP_PlayerParameterKey playerParamKey) {
         ENUM_TO_STR(AML_MP_PLAYER_PARAMETER_VIDEO_CROP);
         ENUM_TO_STR(AML_MP_PLAYER_PARAMETER_VIDEO_ERROR_RECOVERY_MODE);
         ENUM_TO_STR(AML_MP_PLAYER_PARAMETER_VIDEO_AFD_ASPECT_MODE);
+        ENUM_TO_STR(AML_MP_PLAYER_PARAMETER_PROGRAM_CACHE_KEY);
         //get only
         ENUM_TO_STR(AML_MP_PLAYER_PARAMETER_GET_BASE);
         ENUM_TO_STR(AML_MP_PLAYER_PARAMETER_VIDEO_INFO);
@@ -179,6 +180,7 @@ const char* mpPlayerParameterKey2Str(Aml_MP_PlayerParameterKey playerParamKey) {
         ENUM_TO_STR(AML_MP_PLAYER_PARAMETER_VIDEO_SHOW_STATE);
         ENUM_TO_STR(AML_MP_PLAYER_PARAMETER_AV_INFO_JSON);
         ENUM_TO_STR(AML_MP_PLAYER_PARAMETER_TSPLAYER_HANDLE);
+        ENUM_TO_STR(AML_MP_PLAYER_PARAMETER_DEMUX_PID_STAT);
         default:
             return "unknown player parameter key";
     }